@@ -31,19 +31,35 @@
 #include <errno.h>
 #include <stdint.h>
 #include <limits.h>
+#include <unistd.h>
 
 #include <netinet/ip6.h>
 #include "event-parse.h"
 #include "event-utils.h"
 
-static const char *input_buf;
-static unsigned long long input_buf_ptr;
-static unsigned long long input_buf_siz;
+/*
+ * The state of the tokenizer and parser. Each parse carries its own,
+ * so that several formats can be parsed at the same time.
+ */
+struct parse_ctx {
+	const char		*input_buf;
+	unsigned long long	input_buf_ptr;
+	unsigned long long	input_buf_siz;
+	int			is_flag_field;
+	int			is_symbolic_field;
+};
+
+/* Used by the pevent_read_token() interface for other parsers */
+static __thread struct parse_ctx token_ctx;
 
-static int is_flag_field;
-static int is_symbolic_field;
+/* Turned off while parsing the print format of an overridden event */
+static __thread int show_warning = 1;
 
-static int show_warning = 1;
+/*
+ * Set when printing the data of an event fails. The caller marks the
+ * event as failed, see pevent_try_print_event_data().
+ */
+static __thread int print_failed;
 
 #define do_warning(fmt, ...)				\
 	do {						\
@@ -63,21 +79,23 @@ static int show_warning = 1;
 			warning(fmt, ##__VA_ARGS__);		\
 	} while (0)
 
-static void init_input_buf(const char *buf, unsigned long long size)
+static void init_input_buf(struct parse_ctx *ctx, const char *buf,
+			   unsigned long long size)
 {
-	input_buf = buf;
-	input_buf_siz = size;
-	input_buf_ptr = 0;
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->input_buf = buf;
+	ctx->input_buf_siz = size;
+	ctx->input_buf_ptr = 0;
 }
 
 const char *pevent_get_input_buf(void)
 {
-	return input_buf;
+	return token_ctx.input_buf;
 }
 
 unsigned long long pevent_get_input_buf_ptr(void)
 {
-	return input_buf_ptr;
+	return token_ctx.input_buf_ptr;
 }
 
 struct event_handler {
@@ -119,7 +137,7 @@ static void free_func_handle(struct pevent_function_handler *func);
  */
 void pevent_buffer_init(const char *buf, unsigned long long size)
 {
-	init_input_buf(buf, size);
+	init_input_buf(&token_ctx, buf, size);
 }
 
 void breakpoint(void)
@@ -133,78 +151,195 @@ struct print_arg *alloc_arg(void)
 	return calloc(1, sizeof(struct print_arg));
 }
 
+/*
+ * The comms are kept in an open addressed hash table keyed by pid.
+ * The comm strings themselves are interned, as many tasks share
+ * the same name. A task that changes its name (exec) can have
+ * the new name registered with the time it took effect, so that
+ * the records before and after it get the right comm.
+ */
+struct cmdline_rename {
+	struct cmdline_rename	*next;
+	unsigned long long	ts;
+	char			*comm;
+};
+
 struct cmdline {
-	char *comm;
-	int pid;
+	char			*comm;
+	int			pid;
+	struct cmdline_rename	*renames;
 };
 
-static int cmdline_cmp(const void *a, const void *b)
+#define CMDLINE_MIN_SIZE	256
+
+static unsigned int cmdline_hash(int pid, int size)
 {
-	const struct cmdline *ca = a;
-	const struct cmdline *cb = b;
+	return ((unsigned int)pid * 2654435761U) & (size - 1);
+}
 
-	if (ca->pid < cb->pid)
+static unsigned int comm_hash(const char *comm, int size)
+{
+	unsigned int hash = 0;
+
+	while (*comm)
+		hash = hash * 31 + *comm++;
+
+	return (hash ^ (hash >> 16)) & (size - 1);
+}
+
+static char **find_comm_slot(struct pevent *pevent, const char *comm)
+{
+	unsigned int i;
+
+	i = comm_hash(comm, pevent->comm_size);
+	while (pevent->comms[i] && strcmp(pevent->comms[i], comm) != 0)
+		i = (i + 1) & (pevent->comm_size - 1);
+
+	return &pevent->comms[i];
+}
+
+static int grow_comms(struct pevent *pevent)
+{
+	char **comms = pevent->comms;
+	int size = pevent->comm_size;
+	int i;
+
+	pevent->comm_size = size ? size * 2 : CMDLINE_MIN_SIZE;
+	pevent->comms = calloc(pevent->comm_size, sizeof(*pevent->comms));
+	if (!pevent->comms) {
+		pevent->comms = comms;
+		pevent->comm_size = size;
 		return -1;
-	if (ca->pid > cb->pid)
-		return 1;
+	}
+
+	for (i = 0; i < size; i++) {
+		if (comms[i])
+			*find_comm_slot(pevent, comms[i]) = comms[i];
+	}
+	free(comms);
 
 	return 0;
 }
 
-struct cmdline_list {
-	struct cmdline_list	*next;
-	char			*comm;
-	int			pid;
-};
+/* Returns the interned copy of @comm, adding it if need be */
+static char *intern_comm(struct pevent *pevent, const char *comm)
+{
+	char **slot;
+
+	if ((pevent->comm_count + 1) * 2 > pevent->comm_size &&
+	    grow_comms(pevent))
+		return NULL;
+
+	slot = find_comm_slot(pevent, comm);
+	if (!*slot) {
+		*slot = strdup(comm);
+		if (!*slot)
+			return NULL;
+		pevent->comm_count++;
+	}
 
-static int cmdline_init(struct pevent *pevent)
+	return *slot;
+}
+
+static struct cmdline *find_cmdline_slot(struct pevent *pevent, int pid)
 {
-	struct cmdline_list *cmdlist = pevent->cmdlist;
-	struct cmdline_list *item;
-	struct cmdline *cmdlines;
+	unsigned int i;
+
+	i = cmdline_hash(pid, pevent->cmdline_size);
+	while (pevent->cmdlines[i].comm && pevent->cmdlines[i].pid != pid)
+		i = (i + 1) & (pevent->cmdline_size - 1);
+
+	return &pevent->cmdlines[i];
+}
+
+static int grow_cmdlines(struct pevent *pevent)
+{
+	struct cmdline *cmdlines = pevent->cmdlines;
+	int size = pevent->cmdline_size;
 	int i;
 
-	cmdlines = malloc(sizeof(*cmdlines) * pevent->cmdline_count);
-	if (!cmdlines)
+	pevent->cmdline_size = size ? size * 2 : CMDLINE_MIN_SIZE;
+	pevent->cmdlines = calloc(pevent->cmdline_size,
+				  sizeof(*pevent->cmdlines));
+	if (!pevent->cmdlines) {
+		pevent->cmdlines = cmdlines;
+		pevent->cmdline_size = size;
 		return -1;
+	}
 
-	i = 0;
-	while (cmdlist) {
-		cmdlines[i].pid = cmdlist->pid;
-		cmdlines[i].comm = cmdlist->comm;
-		i++;
-		item = cmdlist;
-		cmdlist = cmdlist->next;
-		free(item);
+	for (i = 0; i < size; i++) {
+		if (cmdlines[i].comm)
+			*find_cmdline_slot(pevent, cmdlines[i].pid) = cmdlines[i];
 	}
+	free(cmdlines);
 
-	qsort(cmdlines, pevent->cmdline_count, sizeof(*cmdlines), cmdline_cmp);
+	return 0;
+}
 
-	pevent->cmdlines = cmdlines;
-	pevent->cmdlist = NULL;
+static struct cmdline *lookup_cmdline(struct pevent *pevent, int pid)
+{
+	struct cmdline *cmdline;
 
-	return 0;
+	if (!pevent->cmdline_count)
+		return NULL;
+
+	cmdline = find_cmdline_slot(pevent, pid);
+	if (!cmdline->comm)
+		return NULL;
+
+	return cmdline;
 }
 
+/*
+ * The table is read under cmdline_lock. The interned comms are only
+ * freed with the pevent, so they can be used after it is dropped.
+ */
 static const char *find_cmdline(struct pevent *pevent, int pid)
 {
 	const struct cmdline *comm;
-	struct cmdline key;
+	const char *name = "<...>";
 
 	if (!pid)
 		return "<idle>";
 
-	if (!pevent->cmdlines && cmdline_init(pevent))
-		return "<not enough memory for cmdlines!>";
+	pthread_rwlock_rdlock(&pevent->cmdline_lock);
+	comm = lookup_cmdline(pevent, pid);
+	if (comm)
+		name = comm->comm;
+	pthread_rwlock_unlock(&pevent->cmdline_lock);
+
+	return name;
+}
+
+static const char *cmdline_comm_at(const struct cmdline *comm,
+				   unsigned long long ts)
+{
+	const struct cmdline_rename *rename;
 
-	key.pid = pid;
+	/* The renames are sorted newest first */
+	for (rename = comm->renames; rename; rename = rename->next) {
+		if (rename->ts <= ts)
+			return rename->comm;
+	}
+	return comm->comm;
+}
 
-	comm = bsearch(&key, pevent->cmdlines, pevent->cmdline_count,
-		       sizeof(*pevent->cmdlines), cmdline_cmp);
+static const char *find_cmdline_ts(struct pevent *pevent, int pid,
+				   unsigned long long ts)
+{
+	const struct cmdline *comm;
+	const char *name = "<...>";
 
+	if (!pid)
+		return "<idle>";
+
+	pthread_rwlock_rdlock(&pevent->cmdline_lock);
+	comm = lookup_cmdline(pevent, pid);
 	if (comm)
-		return comm->comm;
-	return "<...>";
+		name = cmdline_comm_at(comm, ts);
+	pthread_rwlock_unlock(&pevent->cmdline_lock);
+
+	return name;
 }
 
 /**
@@ -217,71 +352,50 @@ static const char *find_cmdline(struct pevent *pevent, int pid)
  */
 int pevent_pid_is_registered(struct pevent *pevent, int pid)
 {
-	const struct cmdline *comm;
-	struct cmdline key;
+	int ret;
 
 	if (!pid)
 		return 1;
 
-	if (!pevent->cmdlines && cmdline_init(pevent))
-		return 0;
-
-	key.pid = pid;
+	pthread_rwlock_rdlock(&pevent->cmdline_lock);
+	ret = lookup_cmdline(pevent, pid) ? 1 : 0;
+	pthread_rwlock_unlock(&pevent->cmdline_lock);
 
-	comm = bsearch(&key, pevent->cmdlines, pevent->cmdline_count,
-		       sizeof(*pevent->cmdlines), cmdline_cmp);
-
-	if (comm)
-		return 1;
-	return 0;
+	return ret;
 }
 
-/*
- * If the command lines have been converted to an array, then
- * we must add this pid. This is much slower than when cmdlines
- * are added before the array is initialized.
- */
-static int add_new_comm(struct pevent *pevent, const char *comm, int pid)
+static struct cmdline *add_new_comm(struct pevent *pevent,
+				    const char *comm, int pid)
 {
-	struct cmdline *cmdlines = pevent->cmdlines;
-	const struct cmdline *cmdline;
-	struct cmdline key;
+	struct cmdline *cmdline;
+	char *name;
 
-	if (!pid)
-		return 0;
+	if ((pevent->cmdline_count + 1) * 2 > pevent->cmdline_size &&
+	    grow_cmdlines(pevent)) {
+		errno = ENOMEM;
+		return NULL;
+	}
 
-	/* avoid duplicates */
-	key.pid = pid;
+	cmdline = find_cmdline_slot(pevent, pid);
 
-	cmdline = bsearch(&key, pevent->cmdlines, pevent->cmdline_count,
-		       sizeof(*pevent->cmdlines), cmdline_cmp);
-	if (cmdline) {
+	/* avoid duplicates */
+	if (cmdline->comm) {
 		errno = EEXIST;
-		return -1;
-	}
-
-	cmdlines = realloc(cmdlines, sizeof(*cmdlines) * (pevent->cmdline_count + 1));
-	if (!cmdlines) {
-		errno = ENOMEM;
-		return -1;
+		return NULL;
 	}
 
-	cmdlines[pevent->cmdline_count].comm = strdup(comm);
-	if (!cmdlines[pevent->cmdline_count].comm) {
-		free(cmdlines);
+	name = intern_comm(pevent, comm ? comm : "<...>");
+	if (!name) {
 		errno = ENOMEM;
-		return -1;
+		return NULL;
 	}
 
-	cmdlines[pevent->cmdline_count].pid = pid;
-		
-	if (cmdlines[pevent->cmdline_count].comm)
-		pevent->cmdline_count++;
-
-	qsort(cmdlines, pevent->cmdline_count, sizeof(*cmdlines), cmdline_cmp);
-	pevent->cmdlines = cmdlines;
+	cmdline->comm = name;
+	cmdline->pid = pid;
+	cmdline->renames = NULL;
+	pevent->cmdline_count++;
 
-	return 0;
+	return cmdline;
 }
 
 /**
@@ -291,34 +405,94 @@ static int add_new_comm(struct pevent *pevent, const char *comm, int pid)
  * @pid: the pid to map the command line to
  *
  * This adds a mapping to search for command line names with
- * a given pid. The comm is duplicated.
+ * a given pid. The comm is duplicated. If @pid already has
+ * a comm, it is left as is and -1 is returned with errno
+ * set to EEXIST.
  */
 int pevent_register_comm(struct pevent *pevent, const char *comm, int pid)
 {
-	struct cmdline_list *item;
+	struct cmdline *cmdline;
 
-	if (pevent->cmdlines)
-		return add_new_comm(pevent, comm, pid);
+	pthread_rwlock_wrlock(&pevent->cmdline_lock);
+	cmdline = add_new_comm(pevent, comm, pid);
+	pthread_rwlock_unlock(&pevent->cmdline_lock);
 
-	item = malloc(sizeof(*item));
-	if (!item)
-		return -1;
+	return cmdline ? 0 : -1;
+}
 
-	if (comm)
-		item->comm = strdup(comm);
-	else
-		item->comm = strdup("<...>");
-	if (!item->comm) {
-		free(item);
-		return -1;
+/**
+ * pevent_register_comm_ts - register the comm a pid has from a time on
+ * @pevent: handle for the pevent
+ * @comm: the command line to register
+ * @pid: the pid to map the command line to
+ * @ts: the time stamp @pid started to use @comm
+ *
+ * Like pevent_register_comm(), but if @pid already has a different
+ * comm at @ts, @comm is recorded as a rename that takes effect
+ * at @ts. pevent_data_comm_from_pid_ts() returns the comm that is
+ * in effect for a given time, pevent_data_comm_from_pid() keeps
+ * returning the comm that was registered first.
+ */
+int pevent_register_comm_ts(struct pevent *pevent, const char *comm, int pid,
+			    unsigned long long ts)
+{
+	struct cmdline_rename **next;
+	struct cmdline_rename *rename;
+	struct cmdline *cmdline;
+	char *name;
+	int ret = -1;
+
+	if (!pid)
+		return 0;
+
+	if (!comm)
+		comm = "<...>";
+
+	/* The common case is a comm that is already known */
+	pthread_rwlock_rdlock(&pevent->cmdline_lock);
+	cmdline = lookup_cmdline(pevent, pid);
+	if (cmdline && strcmp(cmdline_comm_at(cmdline, ts), comm) == 0)
+		ret = 0;
+	pthread_rwlock_unlock(&pevent->cmdline_lock);
+	if (!ret)
+		return 0;
+
+	pthread_rwlock_wrlock(&pevent->cmdline_lock);
+
+	cmdline = lookup_cmdline(pevent, pid);
+	if (!cmdline) {
+		if (add_new_comm(pevent, comm, pid))
+			ret = 0;
+		goto out;
 	}
-	item->pid = pid;
-	item->next = pevent->cmdlist;
 
-	pevent->cmdlist = item;
-	pevent->cmdline_count++;
+	name = intern_comm(pevent, comm);
+	if (!name)
+		goto out;
 
-	return 0;
+	for (next = &cmdline->renames; *next; next = &(*next)->next) {
+		if ((*next)->ts <= ts)
+			break;
+	}
+
+	/* Interned strings can be compared by address */
+	if ((*next ? (*next)->comm : cmdline->comm) == name) {
+		ret = 0;
+		goto out;
+	}
+
+	rename = malloc(sizeof(*rename));
+	if (!rename)
+		goto out;
+
+	rename->ts = ts;
+	rename->comm = name;
+	rename->next = *next;
+	*next = rename;
+	ret = 0;
+ out:
+	pthread_rwlock_unlock(&pevent->cmdline_lock);
+	return ret;
 }
 
 int pevent_register_trace_clock(struct pevent *pevent, const char *trace_clock)
@@ -331,12 +505,6 @@ int pevent_register_trace_clock(struct pevent *pevent, const char *trace_clock)
 	return 0;
 }
 
-struct func_map {
-	unsigned long long		addr;
-	char				*func;
-	char				*mod;
-};
-
 struct func_list {
 	struct func_list	*next;
 	unsigned long long	addr;
@@ -344,102 +512,372 @@ struct func_list {
 	char			*mod;
 };
 
+/* A func_map entry with the order it was registered in */
+struct func_sort {
+	struct func_map		map;
+	unsigned int		order;
+};
+
+/*
+ * qsort() is not stable, so functions that share an address are kept
+ * in the order they were registered. The last one registered is the
+ * last one in the map, which is the one the lookups return.
+ */
 static int func_cmp(const void *a, const void *b)
 {
-	const struct func_map *fa = a;
-	const struct func_map *fb = b;
+	const struct func_sort *fa = a;
+	const struct func_sort *fb = b;
 
-	if (fa->addr < fb->addr)
+	if (fa->map.addr < fb->map.addr)
 		return -1;
-	if (fa->addr > fb->addr)
+	if (fa->map.addr > fb->map.addr)
+		return 1;
+
+	if (fa->order < fb->order)
+		return -1;
+	if (fa->order > fb->order)
 		return 1;
 
 	return 0;
 }
 
+#define FUNC_CACHE_BITS		10
+#define FUNC_CACHE_SIZE		(1 << FUNC_CACHE_BITS)
+
 /*
- * We are searching for a record in between, not an exact
- * match.
+ * The sorted func_map is searched through a copy of its addresses
+ * laid out in Eytzinger (breadth first) order. The top levels of the
+ * implicit tree share a few cache lines, and the eight descendants of
+ * a node three levels down share one, so they can be prefetched.
+ *
+ * In front of that sits a direct mapped cache of the map index that
+ * last resolved an address hashing to the slot, tagged with the low
+ * bits of that address. A slot is a single word that is checked
+ * against the map itself, so it can be overwritten by another thread
+ * at any time without locking.
  */
-static int func_bcmp(const void *a, const void *b)
+struct func_search {
+	unsigned long long	*keys;		/* 1 based */
+	unsigned int		*index;		/* func_map index of the key */
+	unsigned long long	lookups;
+	unsigned long long	hits;
+	unsigned long long	cache[FUNC_CACHE_SIZE];	/* index + 1, tag */
+};
+
+static unsigned int
+func_search_fill(struct func_search *search, struct func_map *func_map,
+		 unsigned int i, unsigned int k, unsigned int count)
+{
+	if (k > count)
+		return i;
+
+	i = func_search_fill(search, func_map, i, 2 * k, count);
+	search->keys[k] = func_map[i].addr;
+	search->index[k] = i++;
+
+	return func_search_fill(search, func_map, i, 2 * k + 1, count);
+}
+
+static void free_func_search(struct func_search *search)
 {
-	const struct func_map *fa = a;
-	const struct func_map *fb = b;
+	if (!search)
+		return;
+	free(search->keys);
+	free(search->index);
+	free(search);
+}
 
-	if ((fa->addr == fb->addr) ||
+static struct func_search *alloc_func_search(unsigned int count)
+{
+	struct func_search *search;
 
-	    (fa->addr > fb->addr &&
-	     fa->addr < (fb+1)->addr))
+	search = calloc(1, sizeof(*search));
+	if (!search)
+		return NULL;
+
+	/* A node's descendants three levels down fill one cache line */
+	if (posix_memalign((void **)&search->keys, 64,
+			   sizeof(*search->keys) * (count + 1)))
+		search->keys = NULL;
+	search->index = malloc(sizeof(*search->index) * (count + 1));
+	if (!search->keys || !search->index) {
+		free_func_search(search);
+		return NULL;
+	}
+
+	return search;
+}
+
+/*
+ * We are searching for a record in between, not an exact match.
+ * Where several functions share an address, the last one in the
+ * map, the last registered, is used.
+ */
+static int func_covers(struct func_map *func_map, unsigned int count,
+		       unsigned int i, unsigned long long addr)
+{
+	if (func_map[i].addr > addr)
 		return 0;
 
-	if (fa->addr < fb->addr)
-		return -1;
+	/* Past the last function only an exact match counts */
+	if (i + 1 == count)
+		return func_map[i].addr == addr;
 
-	return 1;
+	return func_map[i + 1].addr > addr;
+}
+
+static struct func_map *
+func_search_find(struct pevent *pevent, unsigned long long addr)
+{
+	struct func_search *search = pevent->func_search;
+	unsigned long long *keys = search->keys;
+	unsigned int count = pevent->func_count;
+	unsigned int k = 1;
+	unsigned int i;
+
+	/* Find the first function above the address */
+	while (k <= count) {
+		__builtin_prefetch(keys + 8 * k);
+		k = 2 * k + (keys[k] <= addr);
+	}
+	k >>= __builtin_ffs(~k);
+
+	/* The function before it, if any, is the one that holds addr */
+	i = k ? search->index[k] : count;
+	if (!i)
+		return NULL;
+	i--;
+
+	/* Past the last function only an exact match counts */
+	if (i + 1 == count && pevent->func_map[i].addr != addr)
+		return NULL;
+
+	return &pevent->func_map[i];
 }
 
 static int func_map_init(struct pevent *pevent)
 {
+	struct func_search *search;
 	struct func_list *funclist;
 	struct func_list *item;
 	struct func_map *func_map;
-	int i;
+	struct func_sort *sort;
+	unsigned int count = pevent->func_count;
+	unsigned int i;
 
-	func_map = malloc(sizeof(*func_map) * (pevent->func_count + 1));
-	if (!func_map)
+	func_map = malloc(sizeof(*func_map) * (count + 1));
+	sort = malloc(sizeof(*sort) * count);
+	search = alloc_func_search(count);
+	if (!func_map || (count && !sort) || !search) {
+		free(func_map);
+		free(sort);
+		free_func_search(search);
 		return -1;
+	}
 
 	funclist = pevent->funclist;
 
-	i = 0;
+	/* The list has the last registered function first */
+	i = count;
 	while (funclist) {
-		func_map[i].func = funclist->func;
-		func_map[i].addr = funclist->addr;
-		func_map[i].mod = funclist->mod;
-		i++;
+		i--;
+		sort[i].map.func = funclist->func;
+		sort[i].map.addr = funclist->addr;
+		sort[i].map.mod = funclist->mod;
+		sort[i].order = i;
 		item = funclist;
 		funclist = funclist->next;
 		free(item);
 	}
 
-	qsort(func_map, pevent->func_count, sizeof(*func_map), func_cmp);
+	qsort(sort, count, sizeof(*sort), func_cmp);
+
+	for (i = 0; i < count; i++)
+		func_map[i] = sort[i].map;
+	free(sort);
 
 	/*
 	 * Add a special record at the end.
 	 */
-	func_map[pevent->func_count].func = NULL;
-	func_map[pevent->func_count].addr = 0;
-	func_map[pevent->func_count].mod = NULL;
+	func_map[count].func = NULL;
+	func_map[count].addr = 0;
+	func_map[count].mod = NULL;
+
+	func_search_fill(search, func_map, 0, 1, count);
+	pevent->func_search = search;
 
-	pevent->func_map = func_map;
 	pevent->funclist = NULL;
+	__atomic_store_n(&pevent->func_map, func_map, __ATOMIC_RELEASE);
 
 	return 0;
 }
 
+/*
+ * The function and printk maps are built from the registered lists
+ * the first time they are used, which may be by several readers at
+ * the same time.
+ */
+static int func_map_setup(struct pevent *pevent)
+{
+	int ret = 0;
+
+	if (__atomic_load_n(&pevent->func_map, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pthread_mutex_lock(&pevent->lock);
+	if (!pevent->func_map)
+		ret = func_map_init(pevent);
+	pthread_mutex_unlock(&pevent->lock);
+
+	return ret;
+}
+
+static inline void stat_inc(unsigned long long *stat)
+{
+	__atomic_store_n(stat, __atomic_load_n(stat, __ATOMIC_RELAXED) + 1,
+			 __ATOMIC_RELAXED);
+}
+
+static inline unsigned int func_cache_slot(unsigned long long addr)
+{
+	return ((addr >> 2) * 0x9e3779b97f4a7c15ULL) >> (64 - FUNC_CACHE_BITS);
+}
+
 static struct func_map *
 __find_func(struct pevent *pevent, unsigned long long addr)
 {
+	struct func_search *search;
+	unsigned long long entry;
 	struct func_map *func;
-	struct func_map key;
+	unsigned int slot;
+	unsigned int i;
 
-	if (!pevent->func_map)
-		func_map_init(pevent);
+	if (func_map_setup(pevent))
+		return NULL;
 
-	key.addr = addr;
+	search = pevent->func_search;
+	slot = func_cache_slot(addr);
 
-	func = bsearch(&key, pevent->func_map, pevent->func_count,
-		       sizeof(*pevent->func_map), func_bcmp);
+	/*
+	 * The counters are only statistics, they are not worth a locked
+	 * instruction per lookup. Concurrent readers may lose a few counts.
+	 */
+	stat_inc(&search->lookups);
+
+	entry = __atomic_load_n(&search->cache[slot], __ATOMIC_RELAXED);
+	i = entry >> 32;
+	if (i && (unsigned int)entry == (unsigned int)addr &&
+	    func_covers(pevent->func_map, pevent->func_count, i - 1, addr)) {
+		stat_inc(&search->hits);
+		return &pevent->func_map[i - 1];
+	}
+
+	func = func_search_find(pevent, addr);
+	if (func) {
+		entry = (unsigned long long)(func - pevent->func_map + 1) << 32;
+		entry |= (unsigned int)addr;
+		__atomic_store_n(&search->cache[slot], entry, __ATOMIC_RELAXED);
+	}
 
 	return func;
 }
 
+/**
+ * pevent_get_func_map - get the sorted function map
+ * @pevent: handle for the pevent
+ * @map: returns the map
+ *
+ * Builds the map from the registered functions if that was not done
+ * yet. The map is sorted by address and belongs to @pevent.
+ *
+ * Returns the number of entries in @map, or -1 on error.
+ */
+int pevent_get_func_map(struct pevent *pevent, struct func_map **map)
+{
+	if (func_map_setup(pevent))
+		return -1;
+
+	*map = pevent->func_map;
+	return pevent->func_count;
+}
+
+/**
+ * pevent_set_func_map - use a prebuilt function map
+ * @pevent: handle for the pevent
+ * @map: the functions, sorted by address
+ * @count: the number of entries in @map
+ * @free_map: called with @data when @pevent is freed
+ * @data: passed to @free_map
+ *
+ * This lets a map that was saved by a previous pevent_get_func_map()
+ * be used instead of registering every function again. The map and
+ * the strings it points to stay with the caller, and must be valid
+ * until @free_map is called.
+ *
+ * Returns 0 on success, or -1 if functions were already registered
+ * or on allocation failure.
+ */
+int pevent_set_func_map(struct pevent *pevent, struct func_map *map,
+			unsigned int count, pevent_func_map_free_func free_map,
+			void *data)
+{
+	struct func_search *search;
+	int ret = -1;
+
+	pthread_mutex_lock(&pevent->lock);
+	if (pevent->func_map || pevent->funclist)
+		goto out;
+
+	search = alloc_func_search(count);
+	if (!search)
+		goto out;
+	func_search_fill(search, map, 0, 1, count);
+
+	pevent->func_search = search;
+	pevent->func_count = count;
+	pevent->func_map_free = free_map;
+	pevent->func_map_data = data;
+	__atomic_store_n(&pevent->func_map, map, __ATOMIC_RELEASE);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&pevent->lock);
+	return ret;
+}
+
+/**
+ * pevent_func_cache_stats - get the hit rate of the function cache
+ * @pevent: handle for the pevent
+ * @lookups: returns the number of addresses looked up
+ * @hits: returns how many of them were resolved by the cache
+ *
+ * The addresses resolved by pevent_find_function() and the %pF style
+ * prints go through a small cache in front of the function map.
+ */
+void pevent_func_cache_stats(struct pevent *pevent,
+			     unsigned long long *lookups,
+			     unsigned long long *hits)
+{
+	struct func_search *search;
+
+	search = __atomic_load_n(&pevent->func_search, __ATOMIC_ACQUIRE);
+	if (!search) {
+		*lookups = 0;
+		*hits = 0;
+		return;
+	}
+
+	*lookups = __atomic_load_n(&search->lookups, __ATOMIC_RELAXED);
+	*hits = __atomic_load_n(&search->hits, __ATOMIC_RELAXED);
+}
+
 struct func_resolver {
 	pevent_func_resolver_t *func;
 	void		       *priv;
-	struct func_map	       map;
 };
 
+/* The resolver results are handed back in a per thread map */
+static __thread struct func_map resolver_map;
+
 /**
  * pevent_set_function_resolver - set an alternative function resolver
  * @pevent: handle for the pevent
@@ -488,7 +926,7 @@ find_func(struct pevent *pevent, unsigned long long addr)
 	if (!pevent->func_resolver)
 		return __find_func(pevent, addr);
 
-	map = &pevent->func_resolver->map;
+	map = &resolver_map;
 	map->mod  = NULL;
 	map->addr = addr;
 	map->func = pevent->func_resolver->func(pevent->func_resolver->priv,
@@ -540,6 +978,76 @@ pevent_find_function_address(struct pevent *pevent, unsigned long long addr)
 	return map->addr;
 }
 
+static void free_func_list(struct func_list *funclist, int strings)
+{
+	struct func_list *item;
+
+	while (funclist) {
+		item = funclist;
+		funclist = item->next;
+		if (strings) {
+			free(item->func);
+			free(item->mod);
+		}
+		free(item);
+	}
+}
+
+/*
+ * A function registered after the map was built puts the map back
+ * into the list, and the map is built again on the next lookup.
+ */
+static int func_map_release(struct pevent *pevent)
+{
+	struct func_map *func_map = pevent->func_map;
+	struct func_list *funclist = NULL;
+	struct func_list *item;
+	int copy = pevent->func_map_free != NULL;
+	unsigned int i;
+
+	for (i = 0; i < pevent->func_count; i++) {
+		item = malloc(sizeof(*item));
+		if (!item)
+			goto fail;
+		item->addr = func_map[i].addr;
+		item->func = func_map[i].func;
+		item->mod = func_map[i].mod;
+		/* A map that is not ours keeps its strings */
+		if (copy) {
+			item->func = strdup(item->func);
+			if (item->mod)
+				item->mod = strdup(item->mod);
+			if (!item->func || (func_map[i].mod && !item->mod)) {
+				free(item->func);
+				free(item->mod);
+				free(item);
+				goto fail;
+			}
+		}
+		item->next = funclist;
+		funclist = item;
+	}
+
+	if (copy)
+		pevent->func_map_free(pevent->func_map_data);
+	else
+		free(func_map);
+	free_func_search(pevent->func_search);
+
+	pevent->func_map_free = NULL;
+	pevent->func_map_data = NULL;
+	pevent->func_search = NULL;
+	pevent->func_map = NULL;
+	pevent->funclist = funclist;
+
+	return 0;
+
+ fail:
+	free_func_list(funclist, copy);
+	errno = ENOMEM;
+	return -1;
+}
+
 /**
  * pevent_register_function - register a function with a given address
  * @pevent: handle for the pevent
@@ -553,8 +1061,12 @@ pevent_find_function_address(struct pevent *pevent, unsigned long long addr)
 int pevent_register_function(struct pevent *pevent, char *func,
 			     unsigned long long addr, char *mod)
 {
-	struct func_list *item = malloc(sizeof(*item));
+	struct func_list *item;
 
+	if (pevent->func_map && func_map_release(pevent))
+		return -1;
+
+	item = malloc(sizeof(*item));
 	if (!item)
 		return -1;
 
@@ -595,8 +1107,8 @@ void pevent_print_funcs(struct pevent *pevent)
 {
 	int i;
 
-	if (!pevent->func_map)
-		func_map_init(pevent);
+	if (func_map_setup(pevent))
+		return;
 
 	for (i = 0; i < (int)pevent->func_count; i++) {
 		printf("%016llx %s",
@@ -658,19 +1170,34 @@ static int printk_map_init(struct pevent *pevent)
 
 	qsort(printk_map, pevent->printk_count, sizeof(*printk_map), printk_cmp);
 
-	pevent->printk_map = printk_map;
 	pevent->printklist = NULL;
+	__atomic_store_n(&pevent->printk_map, printk_map, __ATOMIC_RELEASE);
 
 	return 0;
 }
 
+static int printk_map_setup(struct pevent *pevent)
+{
+	int ret = 0;
+
+	if (__atomic_load_n(&pevent->printk_map, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pthread_mutex_lock(&pevent->lock);
+	if (!pevent->printk_map)
+		ret = printk_map_init(pevent);
+	pthread_mutex_unlock(&pevent->lock);
+
+	return ret;
+}
+
 static struct printk_map *
 find_printk(struct pevent *pevent, unsigned long long addr)
 {
 	struct printk_map *printk;
 	struct printk_map key;
 
-	if (!pevent->printk_map && printk_map_init(pevent))
+	if (printk_map_setup(pevent))
 		return NULL;
 
 	key.addr = addr;
@@ -738,8 +1265,8 @@ void pevent_print_printk(struct pevent *pevent)
 {
 	int i;
 
-	if (!pevent->printk_map)
-		printk_map_init(pevent);
+	if (printk_map_setup(pevent))
+		return;
 
 	for (i = 0; i < (int)pevent->printk_count; i++) {
 		printf("%016llx %s\n",
@@ -753,6 +1280,104 @@ static struct event_format *alloc_event(void)
 	return calloc(1, sizeof(struct event_format));
 }
 
+static int add_event_id(struct pevent *pevent, struct event_format *event)
+{
+	struct event_format **ids;
+	int nr;
+
+	if (event->id < 0 || event->id >= PEVENT_MAX_DENSE_ID)
+		return 0;
+
+	if (event->id >= pevent->nr_event_ids) {
+		nr = pevent->nr_event_ids * 2;
+		if (nr <= event->id)
+			nr = event->id + 1;
+		if (nr > PEVENT_MAX_DENSE_ID)
+			nr = PEVENT_MAX_DENSE_ID;
+		ids = realloc(pevent->event_ids, sizeof(*ids) * nr);
+		if (!ids)
+			return -1;
+		memset(ids + pevent->nr_event_ids, 0,
+		       sizeof(*ids) * (nr - pevent->nr_event_ids));
+		pevent->event_ids = ids;
+		pevent->nr_event_ids = nr;
+	}
+
+	/* Keep the first event that was registered with this id */
+	if (!pevent->event_ids[event->id])
+		pevent->event_ids[event->id] = event;
+
+	return 0;
+}
+
+#define EVENT_NAME_HASH_BITS	10
+#define EVENT_NAME_HASH_SIZE	(1 << EVENT_NAME_HASH_BITS)
+
+/*
+ * The events hashed by name. Each bucket is kept sorted like the
+ * events array, so the first match is the one a scan would find.
+ */
+struct event_name_item {
+	struct event_name_item	*next;
+	struct event_format	*event;
+};
+
+static unsigned int event_name_hash(const char *name)
+{
+	unsigned int hash = 0;
+
+	while (*name)
+		hash = hash * 31 + *name++;
+
+	return (hash ^ (hash >> EVENT_NAME_HASH_BITS)) &
+		(EVENT_NAME_HASH_SIZE - 1);
+}
+
+static int add_event_name(struct pevent *pevent, struct event_format *event)
+{
+	struct event_name_item **next;
+	struct event_name_item *item;
+
+	if (!pevent->event_names) {
+		pevent->event_names = calloc(EVENT_NAME_HASH_SIZE,
+					     sizeof(*pevent->event_names));
+		if (!pevent->event_names)
+			return -1;
+	}
+
+	item = malloc(sizeof(*item));
+	if (!item)
+		return -1;
+
+	item->event = event;
+
+	next = &pevent->event_names[event_name_hash(event->name)];
+	while (*next && (*next)->event->id <= event->id)
+		next = &(*next)->next;
+
+	item->next = *next;
+	*next = item;
+
+	return 0;
+}
+
+static void free_event_names(struct pevent *pevent)
+{
+	struct event_name_item *item;
+	int i;
+
+	if (!pevent->event_names)
+		return;
+
+	for (i = 0; i < EVENT_NAME_HASH_SIZE; i++) {
+		while ((item = pevent->event_names[i])) {
+			pevent->event_names[i] = item->next;
+			free(item);
+		}
+	}
+	free(pevent->event_names);
+}
+
 static int add_event(struct pevent *pevent, struct event_format *event)
 {
 	int i;
@@ -763,6 +1388,16 @@ static int add_event(struct pevent *pevent, struct event_format *event)
 
 	pevent->events = events;
 
+	if (add_event_id(pevent, event))
+		return -1;
+
+	if (add_event_name(pevent, event)) {
+		if (event->id >= 0 && event->id < pevent->nr_event_ids &&
+		    pevent->event_ids[event->id] == event)
+			pevent->event_ids[event->id] = NULL;
+		return -1;
+	}
+
 	for (i = 0; i < pevent->nr_events; i++) {
 		if (pevent->events[i]->id > event->id)
 			break;
@@ -892,20 +1527,20 @@ static enum event_type get_type(int ch)
 	return EVENT_OP;
 }
 
-static int __read_char(void)
+static int __read_char(struct parse_ctx *ctx)
 {
-	if (input_buf_ptr >= input_buf_siz)
+	if (ctx->input_buf_ptr >= ctx->input_buf_siz)
 		return -1;
 
-	return input_buf[input_buf_ptr++];
+	return ctx->input_buf[ctx->input_buf_ptr++];
 }
 
-static int __peek_char(void)
+static int __peek_char(struct parse_ctx *ctx)
 {
-	if (input_buf_ptr >= input_buf_siz)
+	if (ctx->input_buf_ptr >= ctx->input_buf_siz)
 		return -1;
 
-	return input_buf[input_buf_ptr];
+	return ctx->input_buf[ctx->input_buf_ptr];
 }
 
 /**
@@ -915,7 +1550,7 @@ static int __peek_char(void)
  */
 int pevent_peek_char(void)
 {
-	return __peek_char();
+	return __peek_char(&token_ctx);
 }
 
 static int extend_token(char **tok, char *buf, int size)
@@ -939,7 +1574,7 @@ static int extend_token(char **tok, char *buf, int size)
 
 static enum event_type force_token(const char *str, char **tok);
 
-static enum event_type __read_token(char **tok)
+static enum event_type __read_token(struct parse_ctx *ctx, char **tok)
 {
 	char buf[BUFSIZ];
 	int ch, last_ch, quote_ch, next_ch;
@@ -950,7 +1585,7 @@ static enum event_type __read_token(char **tok)
 	*tok = NULL;
 
 
-	ch = __read_char();
+	ch = __read_char(ctx);
 	if (ch < 0)
 		return EVENT_NONE;
 
@@ -971,9 +1606,9 @@ static enum event_type __read_token(char **tok)
 	case EVENT_OP:
 		switch (ch) {
 		case '-':
-			next_ch = __peek_char();
+			next_ch = __peek_char(ctx);
 			if (next_ch == '>') {
-				buf[i++] = __read_char();
+				buf[i++] = __read_char(ctx);
 				break;
 			}
 			/* fall through */
@@ -983,10 +1618,10 @@ static enum event_type __read_token(char **tok)
 		case '>':
 		case '<':
 			last_ch = ch;
-			ch = __peek_char();
+			ch = __peek_char(ctx);
 			if (ch != last_ch)
 				goto test_equal;
-			buf[i++] = __read_char();
+			buf[i++] = __read_char(ctx);
 			switch (last_ch) {
 			case '>':
 			case '<':
@@ -1006,9 +1641,9 @@ static enum event_type __read_token(char **tok)
 		return type;
 
  test_equal:
-		ch = __peek_char();
+		ch = __peek_char(ctx);
 		if (ch == '=')
-			buf[i++] = __read_char();
+			buf[i++] = __read_char(ctx);
 		goto out;
 
 	case EVENT_DQUOTE:
@@ -1028,7 +1663,7 @@ static enum event_type __read_token(char **tok)
 				i = 0;
 			}
 			last_ch = ch;
-			ch = __read_char();
+			ch = __read_char(ctx);
 			buf[i++] = ch;
 			/* the '\' '\' will cancel itself */
 			if (ch == '\\' && last_ch == '\\')
@@ -1042,14 +1677,14 @@ static enum event_type __read_token(char **tok)
 		 * If it is another string, concatinate the two.
 		 */
 		if (type == EVENT_DQUOTE) {
-			unsigned long long save_input_buf_ptr = input_buf_ptr;
+			unsigned long long save_ptr = ctx->input_buf_ptr;
 
 			do {
-				ch = __read_char();
+				ch = __read_char(ctx);
 			} while (isspace(ch));
 			if (ch == '"')
 				goto concat;
-			input_buf_ptr = save_input_buf_ptr;
+			ctx->input_buf_ptr = save_ptr;
 		}
 
 		goto out;
@@ -1060,7 +1695,7 @@ static enum event_type __read_token(char **tok)
 		break;
 	}
 
-	while (get_type(__peek_char()) == type) {
+	while (get_type(__peek_char(ctx)) == type) {
 		if (i == (BUFSIZ - 1)) {
 			buf[i] = 0;
 			tok_size += BUFSIZ;
@@ -1069,7 +1704,7 @@ static enum event_type __read_token(char **tok)
 				return EVENT_NONE;
 			i = 0;
 		}
-		ch = __read_char();
+		ch = __read_char(ctx);
 		buf[i++] = ch;
 	}
 
@@ -1107,26 +1742,12 @@ static enum event_type __read_token(char **tok)
 
 static enum event_type force_token(const char *str, char **tok)
 {
-	const char *save_input_buf;
-	unsigned long long save_input_buf_ptr;
-	unsigned long long save_input_buf_siz;
-	enum event_type type;
-	
-	/* save off the current input pointers */
-	save_input_buf = input_buf;
-	save_input_buf_ptr = input_buf_ptr;
-	save_input_buf_siz = input_buf_siz;
+	struct parse_ctx str_ctx;
 
-	init_input_buf(str, strlen(str));
+	/* parse @str on the side, leaving the current input alone */
+	init_input_buf(&str_ctx, str, strlen(str));
 
-	type = __read_token(tok);
-
-	/* reset back to original token */
-	input_buf = save_input_buf;
-	input_buf_ptr = save_input_buf_ptr;
-	input_buf_siz = save_input_buf_siz;
-
-	return type;
+	return __read_token(&str_ctx, tok);
 }
 
 static void free_token(char *tok)
@@ -1135,12 +1756,12 @@ static void free_token(char *tok)
 		free(tok);
 }
 
-static enum event_type read_token(char **tok)
+static enum event_type read_token(struct parse_ctx *ctx, char **tok)
 {
 	enum event_type type;
 
 	for (;;) {
-		type = __read_token(tok);
+		type = __read_token(ctx, tok);
 		if (type != EVENT_SPACE)
 			return type;
 
@@ -1163,7 +1784,7 @@ static enum event_type read_token(char **tok)
  */
 enum event_type pevent_read_token(char **tok)
 {
-	return read_token(tok);
+	return read_token(&token_ctx, tok);
 }
 
 /**
@@ -1176,12 +1797,12 @@ void pevent_free_token(char *token)
 }
 
 /* no newline */
-static enum event_type read_token_item(char **tok)
+static enum event_type read_token_item(struct parse_ctx *ctx, char **tok)
 {
 	enum event_type type;
 
 	for (;;) {
-		type = __read_token(tok);
+		type = __read_token(ctx, tok);
 		if (type != EVENT_SPACE && type != EVENT_NEWLINE)
 			return type;
 		free_token(*tok);
@@ -1220,33 +1841,35 @@ static int test_type_token(enum event_type type, const char *token,
 	return 0;
 }
 
-static int __read_expect_type(enum event_type expect, char **tok, int newline_ok)
+static int __read_expect_type(struct parse_ctx *ctx, enum event_type expect,
+			      char **tok, int newline_ok)
 {
 	enum event_type type;
 
 	if (newline_ok)
-		type = read_token(tok);
+		type = read_token(ctx, tok);
 	else
-		type = read_token_item(tok);
+		type = read_token_item(ctx, tok);
 	return test_type(type, expect);
 }
 
-static int read_expect_type(enum event_type expect, char **tok)
+static int read_expect_type(struct parse_ctx *ctx, enum event_type expect,
+			    char **tok)
 {
-	return __read_expect_type(expect, tok, 1);
+	return __read_expect_type(ctx, expect, tok, 1);
 }
 
-static int __read_expected(enum event_type expect, const char *str,
-			   int newline_ok)
+static int __read_expected(struct parse_ctx *ctx, enum event_type expect,
+			   const char *str, int newline_ok)
 {
 	enum event_type type;
 	char *token;
 	int ret;
 
 	if (newline_ok)
-		type = read_token(&token);
+		type = read_token(ctx, &token);
 	else
-		type = read_token_item(&token);
+		type = read_token_item(ctx, &token);
 
 	ret = test_type_token(type, token, expect, str);
 
@@ -1255,27 +1878,29 @@ static int __read_expected(enum event_type expect, const char *str,
 	return ret;
 }
 
-static int read_expected(enum event_type expect, const char *str)
+static int read_expected(struct parse_ctx *ctx, enum event_type expect,
+			 const char *str)
 {
-	return __read_expected(expect, str, 1);
+	return __read_expected(ctx, expect, str, 1);
 }
 
-static int read_expected_item(enum event_type expect, const char *str)
+static int read_expected_item(struct parse_ctx *ctx, enum event_type expect,
+			      const char *str)
 {
-	return __read_expected(expect, str, 0);
+	return __read_expected(ctx, expect, str, 0);
 }
 
-static char *event_read_name(void)
+static char *event_read_name(struct parse_ctx *ctx)
 {
 	char *token;
 
-	if (read_expected(EVENT_ITEM, "name") < 0)
+	if (read_expected(ctx, EVENT_ITEM, "name") < 0)
 		return NULL;
 
-	if (read_expected(EVENT_OP, ":") < 0)
+	if (read_expected(ctx, EVENT_OP, ":") < 0)
 		return NULL;
 
-	if (read_expect_type(EVENT_ITEM, &token) < 0)
+	if (read_expect_type(ctx, EVENT_ITEM, &token) < 0)
 		goto fail;
 
 	return token;
@@ -1285,18 +1910,18 @@ static char *event_read_name(void)
 	return NULL;
 }
 
-static int event_read_id(void)
+static int event_read_id(struct parse_ctx *ctx)
 {
 	char *token;
 	int id;
 
-	if (read_expected_item(EVENT_ITEM, "ID") < 0)
+	if (read_expected_item(ctx, EVENT_ITEM, "ID") < 0)
 		return -1;
 
-	if (read_expected(EVENT_OP, ":") < 0)
+	if (read_expected(ctx, EVENT_OP, ":") < 0)
 		return -1;
 
-	if (read_expect_type(EVENT_ITEM, &token) < 0)
+	if (read_expect_type(ctx, EVENT_ITEM, &token) < 0)
 		goto fail;
 
 	id = strtoul(token, NULL, 0);
@@ -1363,7 +1988,8 @@ static unsigned int type_size(const char *name)
 	return 0;
 }
 
-static int event_read_fields(struct event_format *event, struct format_field **fields)
+static int event_read_fields(struct parse_ctx *ctx, struct event_format *event,
+			     struct format_field **fields)
 {
 	struct format_field *field = NULL;
 	enum event_type type;
@@ -1374,7 +2000,7 @@ static int event_read_fields(struct event_format *event, struct format_field **f
 	do {
 		unsigned int size_dynamic = 0;
 
-		type = read_token(&token);
+		type = read_token(ctx, &token);
 		if (type == EVENT_NEWLINE) {
 			free_token(token);
 			return count;
@@ -1386,7 +2012,7 @@ static int event_read_fields(struct event_format *event, struct format_field **f
 			goto fail;
 		free_token(token);
 
-		type = read_token(&token);
+		type = read_token(ctx, &token);
 		/*
 		 * The ftrace fields may still use the "special" name.
 		 * Just ignore it.
@@ -1394,14 +2020,14 @@ static int event_read_fields(struct event_format *event, struct format_field **f
 		if (event->flags & EVENT_FL_ISFTRACE &&
 		    type == EVENT_ITEM && strcmp(token, "special") == 0) {
 			free_token(token);
-			type = read_token(&token);
+			type = read_token(ctx, &token);
 		}
 
 		if (test_type_token(type, token, EVENT_OP, ":") < 0)
 			goto fail;
 
 		free_token(token);
-		if (read_expect_type(EVENT_ITEM, &token) < 0)
+		if (read_expect_type(ctx, EVENT_ITEM, &token) < 0)
 			goto fail;
 
 		last_token = token;
@@ -1414,7 +2040,7 @@ static int event_read_fields(struct event_format *event, struct format_field **f
 
 		/* read the rest of the type */
 		for (;;) {
-			type = read_token(&token);
+			type = read_token(ctx, &token);
 			if (type == EVENT_ITEM ||
 			    (type == EVENT_OP && strcmp(token, "*") == 0) ||
 			    /*
@@ -1466,7 +2092,7 @@ static int event_read_fields(struct event_format *event, struct format_field **f
 
 			field->flags |= FIELD_IS_ARRAY;
 
-			type = read_token(&token);
+			type = read_token(ctx, &token);
 
 			if (type == EVENT_ITEM)
 				field->arraylen = strtoul(token, NULL, 0);
@@ -1495,7 +2121,7 @@ static int event_read_fields(struct event_format *event, struct format_field **f
 				/* We only care about the last token */
 				field->arraylen = strtoul(token, NULL, 0);
 				free_token(token);
-				type = read_token(&token);
+				type = read_token(ctx, &token);
 				if (type == EVENT_NONE) {
 					do_warning_event(event, "failed to find token");
 					goto fail;
@@ -1514,7 +2140,7 @@ static int event_read_fields(struct event_format *event, struct format_field **f
 
 			/* add brackets to type */
 
-			type = read_token(&token);
+			type = read_token(ctx, &token);
 			/*
 			 * If the next token is not an OP, then it is of
 			 * the format: type [] item;
@@ -1536,7 +2162,7 @@ static int event_read_fields(struct event_format *event, struct format_field **f
 				free_token(field->name);
 				strcat(field->type, brackets);
 				field->name = field->alias = token;
-				type = read_token(&token);
+				type = read_token(ctx, &token);
 			} else {
 				char *new_type;
 				new_type = realloc(field->type,
@@ -1563,35 +2189,35 @@ static int event_read_fields(struct event_format *event, struct format_field **f
 			goto fail;
 		free_token(token);
 
-		if (read_expected(EVENT_ITEM, "offset") < 0)
+		if (read_expected(ctx, EVENT_ITEM, "offset") < 0)
 			goto fail_expect;
 
-		if (read_expected(EVENT_OP, ":") < 0)
+		if (read_expected(ctx, EVENT_OP, ":") < 0)
 			goto fail_expect;
 
-		if (read_expect_type(EVENT_ITEM, &token))
+		if (read_expect_type(ctx, EVENT_ITEM, &token))
 			goto fail;
 		field->offset = strtoul(token, NULL, 0);
 		free_token(token);
 
-		if (read_expected(EVENT_OP, ";") < 0)
+		if (read_expected(ctx, EVENT_OP, ";") < 0)
 			goto fail_expect;
 
-		if (read_expected(EVENT_ITEM, "size") < 0)
+		if (read_expected(ctx, EVENT_ITEM, "size") < 0)
 			goto fail_expect;
 
-		if (read_expected(EVENT_OP, ":") < 0)
+		if (read_expected(ctx, EVENT_OP, ":") < 0)
 			goto fail_expect;
 
-		if (read_expect_type(EVENT_ITEM, &token))
+		if (read_expect_type(ctx, EVENT_ITEM, &token))
 			goto fail;
 		field->size = strtoul(token, NULL, 0);
 		free_token(token);
 
-		if (read_expected(EVENT_OP, ";") < 0)
+		if (read_expected(ctx, EVENT_OP, ";") < 0)
 			goto fail_expect;
 
-		type = read_token(&token);
+		type = read_token(ctx, &token);
 		if (type != EVENT_NEWLINE) {
 			/* newer versions of the kernel have a "signed" type */
 			if (test_type_token(type, token, EVENT_ITEM, "signed"))
@@ -1599,20 +2225,20 @@ static int event_read_fields(struct event_format *event, struct format_field **f
 
 			free_token(token);
 
-			if (read_expected(EVENT_OP, ":") < 0)
+			if (read_expected(ctx, EVENT_OP, ":") < 0)
 				goto fail_expect;
 
-			if (read_expect_type(EVENT_ITEM, &token))
+			if (read_expect_type(ctx, EVENT_ITEM, &token))
 				goto fail;
 
 			if (strtoul(token, NULL, 0))
 				field->flags |= FIELD_IS_SIGNED;
 
 			free_token(token);
-			if (read_expected(EVENT_OP, ";") < 0)
+			if (read_expected(ctx, EVENT_OP, ";") < 0)
 				goto fail_expect;
 
-			if (read_expect_type(EVENT_NEWLINE, &token))
+			if (read_expect_type(ctx, EVENT_NEWLINE, &token))
 				goto fail;
 		}
 
@@ -1634,6 +2260,8 @@ static int event_read_fields(struct event_format *event, struct format_field **f
 
 		*fields = field;
 		fields = &field->next;
+		/* it is on the list now, do not free it on failure */
+		field = NULL;
 
 	} while (1);
 
@@ -1650,27 +2278,27 @@ fail_expect:
 	return -1;
 }
 
-static int event_read_format(struct event_format *event)
+static int event_read_format(struct parse_ctx *ctx, struct event_format *event)
 {
 	char *token;
 	int ret;
 
-	if (read_expected_item(EVENT_ITEM, "format") < 0)
+	if (read_expected_item(ctx, EVENT_ITEM, "format") < 0)
 		return -1;
 
-	if (read_expected(EVENT_OP, ":") < 0)
+	if (read_expected(ctx, EVENT_OP, ":") < 0)
 		return -1;
 
-	if (read_expect_type(EVENT_NEWLINE, &token))
+	if (read_expect_type(ctx, EVENT_NEWLINE, &token))
 		goto fail;
 	free_token(token);
 
-	ret = event_read_fields(event, &event->format.common_fields);
+	ret = event_read_fields(ctx, event, &event->format.common_fields);
 	if (ret < 0)
 		return ret;
 	event->format.nr_common = ret;
 
-	ret = event_read_fields(event, &event->format.fields);
+	ret = event_read_fields(ctx, event, &event->format.fields);
 	if (ret < 0)
 		return ret;
 	event->format.nr_fields = ret;
@@ -1683,44 +2311,48 @@ static int event_read_format(struct event_format *event)
 }
 
 static enum event_type
-process_arg_token(struct event_format *event, struct print_arg *arg,
-		  char **tok, enum event_type type);
+process_arg_token(struct parse_ctx *ctx, struct event_format *event,
+		  struct print_arg *arg, char **tok, enum event_type type);
 
 static enum event_type
-process_arg(struct event_format *event, struct print_arg *arg, char **tok)
+process_arg(struct parse_ctx *ctx, struct event_format *event,
+	    struct print_arg *arg, char **tok)
 {
 	enum event_type type;
 	char *token;
 
-	type = read_token(&token);
+	type = read_token(ctx, &token);
 	*tok = token;
 
-	return process_arg_token(event, arg, tok, type);
+	return process_arg_token(ctx, event, arg, tok, type);
 }
 
 static enum event_type
-process_op(struct event_format *event, struct print_arg *arg, char **tok);
+process_op(struct parse_ctx *ctx, struct event_format *event,
+	   struct print_arg *arg, char **tok);
 
 /*
  * For __print_symbolic() and __print_flags, we need to completely
  * evaluate the first argument, which defines what to print next.
  */
 static enum event_type
-process_field_arg(struct event_format *event, struct print_arg *arg, char **tok)
+process_field_arg(struct parse_ctx *ctx, struct event_format *event,
+		  struct print_arg *arg, char **tok)
 {
 	enum event_type type;
 
-	type = process_arg(event, arg, tok);
+	type = process_arg(ctx, event, arg, tok);
 
 	while (type == EVENT_OP) {
-		type = process_op(event, arg, tok);
+		type = process_op(ctx, event, arg, tok);
 	}
 
 	return type;
 }
 
 static enum event_type
-process_cond(struct event_format *event, struct print_arg *top, char **tok)
+process_cond(struct parse_ctx *ctx, struct event_format *event,
+	     struct print_arg *top, char **tok)
 {
 	struct print_arg *arg, *left, *right;
 	enum event_type type;
@@ -1743,7 +2375,7 @@ process_cond(struct event_format *event, struct print_arg *top, char **tok)
 	arg->op.right = right;
 
 	*tok = NULL;
-	type = process_arg(event, left, &token);
+	type = process_arg(ctx, event, left, &token);
 
  again:
 	if (type == EVENT_ERROR)
@@ -1751,7 +2383,7 @@ process_cond(struct event_format *event, struct print_arg *top, char **tok)
 
 	/* Handle other operations in the arguments */
 	if (type == EVENT_OP && strcmp(token, ":") != 0) {
-		type = process_op(event, left, &token);
+		type = process_op(ctx, event, left, &token);
 		goto again;
 	}
 
@@ -1760,7 +2392,7 @@ process_cond(struct event_format *event, struct print_arg *top, char **tok)
 
 	arg->op.op = token;
 
-	type = process_arg(event, right, &token);
+	type = process_arg(ctx, event, right, &token);
 
 	top->op.right = arg;
 
@@ -1776,7 +2408,8 @@ out_free:
 }
 
 static enum event_type
-process_array(struct event_format *event, struct print_arg *top, char **tok)
+process_array(struct parse_ctx *ctx, struct event_format *event,
+	      struct print_arg *top, char **tok)
 {
 	struct print_arg *arg;
 	enum event_type type;
@@ -1791,14 +2424,14 @@ process_array(struct event_format *event, struct print_arg *top, char **tok)
 	}
 
 	*tok = NULL;
-	type = process_arg(event, arg, &token);
+	type = process_arg(ctx, event, arg, &token);
 	if (test_type_token(type, token, EVENT_OP, "]"))
 		goto out_free;
 
 	top->op.right = arg;
 
 	free_token(token);
-	type = read_token_item(&token);
+	type = read_token_item(ctx, &token);
 	*tok = token;
 
 	return type;
@@ -1878,7 +2511,8 @@ static int set_op_prio(struct print_arg *arg)
 
 /* Note, *tok does not get freed, but will most likely be saved */
 static enum event_type
-process_op(struct event_format *event, struct print_arg *arg, char **tok)
+process_op(struct parse_ctx *ctx, struct event_format *event,
+	   struct print_arg *arg, char **tok)
 {
 	struct print_arg *left, *right = NULL;
 	enum event_type type;
@@ -1921,7 +2555,7 @@ process_op(struct event_format *event, struct print_arg *arg, char **tok)
 
 		/* do not free the token, it belongs to an op */
 		*tok = NULL;
-		type = process_arg(event, right, tok);
+		type = process_arg(ctx, event, right, tok);
 
 	} else if (strcmp(token, "?") == 0) {
 
@@ -1938,7 +2572,7 @@ process_op(struct event_format *event, struct print_arg *arg, char **tok)
 		arg->op.prio = 0;
 
 		/* it will set arg->op.right */
-		type = process_cond(event, arg, tok);
+		type = process_cond(ctx, event, arg, tok);
 
 	} else if (strcmp(token, ">>") == 0 ||
 		   strcmp(token, "<<") == 0 ||
@@ -1978,7 +2612,7 @@ process_op(struct event_format *event, struct print_arg *arg, char **tok)
 			goto out_free;
 		}
 
-		type = read_token_item(&token);
+		type = read_token_item(ctx, &token);
 		*tok = token;
 
 		/* could just be a type pointer */
@@ -2008,10 +2642,10 @@ process_op(struct event_format *event, struct print_arg *arg, char **tok)
 		if (!right)
 			goto out_warn_free;
 
-		type = process_arg_token(event, right, tok, type);
+		type = process_arg_token(ctx, event, right, tok, type);
 		if (type == EVENT_ERROR) {
 			free_arg(right);
-			/* token was freed in process_arg_token() via *tok */
+			/* token was freed in process_arg_token(ctx) via *tok */
 			token = NULL;
 			goto out_free;
 		}
@@ -2047,7 +2681,7 @@ process_op(struct event_format *event, struct print_arg *arg, char **tok)
 		arg->op.prio = 0;
 
 		/* it will set arg->op.right */
-		type = process_array(event, arg, tok);
+		type = process_array(ctx, event, arg, tok);
 
 	} else {
 		do_warning_event(event, "unknown op '%s'", token);
@@ -2063,9 +2697,9 @@ process_op(struct event_format *event, struct print_arg *arg, char **tok)
 		prio = get_op_prio(*tok);
 
 		if (prio > arg->op.prio)
-			return process_op(event, arg, tok);
+			return process_op(ctx, event, arg, tok);
 
-		return process_op(event, right, tok);
+		return process_op(ctx, event, right, tok);
 	}
 
 	return type;
@@ -2079,34 +2713,34 @@ out_free:
 }
 
 static enum event_type
-process_entry(struct event_format *event __maybe_unused, struct print_arg *arg,
-	      char **tok)
+process_entry(struct parse_ctx *ctx, struct event_format *event __maybe_unused,
+	      struct print_arg *arg, char **tok)
 {
 	enum event_type type;
 	char *field;
 	char *token;
 
-	if (read_expected(EVENT_OP, "->") < 0)
+	if (read_expected(ctx, EVENT_OP, "->") < 0)
 		goto out_err;
 
-	if (read_expect_type(EVENT_ITEM, &token) < 0)
+	if (read_expect_type(ctx, EVENT_ITEM, &token) < 0)
 		goto out_free;
 	field = token;
 
 	arg->type = PRINT_FIELD;
 	arg->field.name = field;
 
-	if (is_flag_field) {
+	if (ctx->is_flag_field) {
 		arg->field.field = pevent_find_any_field(event, arg->field.name);
 		arg->field.field->flags |= FIELD_IS_FLAG;
-		is_flag_field = 0;
-	} else if (is_symbolic_field) {
+		ctx->is_flag_field = 0;
+	} else if (ctx->is_symbolic_field) {
 		arg->field.field = pevent_find_any_field(event, arg->field.name);
 		arg->field.field->flags |= FIELD_IS_SYMBOLIC;
-		is_symbolic_field = 0;
+		ctx->is_symbolic_field = 0;
 	}
 
-	type = read_token(&token);
+	type = read_token(ctx, &token);
 	*tok = token;
 
 	return type;
@@ -2118,7 +2752,8 @@ process_entry(struct event_format *event __maybe_unused, struct print_arg *arg,
 	return EVENT_ERROR;
 }
 
-static int alloc_and_process_delim(struct event_format *event, char *next_token,
+static int alloc_and_process_delim(struct parse_ctx *ctx,
+				   struct event_format *event, char *next_token,
 				   struct print_arg **print_arg)
 {
 	struct print_arg *field;
@@ -2133,7 +2768,7 @@ static int alloc_and_process_delim(struct event_format *event, char *next_token,
 		return -1;
 	}
 
-	type = process_arg(event, field, &token);
+	type = process_arg(ctx, event, field, &token);
 
 	if (test_type_token(type, token, EVENT_DELIM, next_token)) {
 		errno = EINVAL;
@@ -2426,7 +3061,7 @@ static int arg_num_eval(struct print_arg *arg, long long *val)
 static char *arg_eval (struct print_arg *arg)
 {
 	long long val;
-	static char buf[20];
+	static __thread char buf[20];
 
 	switch (arg->type) {
 	case PRINT_ATOM:
@@ -2453,7 +3088,8 @@ static char *arg_eval (struct print_arg *arg)
 }
 
 static enum event_type
-process_fields(struct event_format *event, struct print_flag_sym **list, char **tok)
+process_fields(struct parse_ctx *ctx, struct event_format *event,
+	       struct print_flag_sym **list, char **tok)
 {
 	enum event_type type;
 	struct print_arg *arg = NULL;
@@ -2463,7 +3099,7 @@ process_fields(struct event_format *event, struct print_flag_sym **list, char **
 
 	do {
 		free_token(token);
-		type = read_token_item(&token);
+		type = read_token_item(ctx, &token);
 		if (test_type_token(type, token, EVENT_OP, "{"))
 			break;
 
@@ -2472,10 +3108,10 @@ process_fields(struct event_format *event, struct print_flag_sym **list, char **
 			goto out_free;
 
 		free_token(token);
-		type = process_arg(event, arg, &token);
+		type = process_arg(ctx, event, arg, &token);
 
 		if (type == EVENT_OP)
-			type = process_op(event, arg, &token);
+			type = process_op(ctx, event, arg, &token);
 
 		if (type == EVENT_ERROR)
 			goto out_free;
@@ -2500,7 +3136,7 @@ process_fields(struct event_format *event, struct print_flag_sym **list, char **
 			goto out_free;
 
 		free_token(token);
-		type = process_arg(event, arg, &token);
+		type = process_arg(ctx, event, arg, &token);
 		if (test_type_token(type, token, EVENT_OP, "}"))
 			goto out_free_field;
 
@@ -2517,7 +3153,7 @@ process_fields(struct event_format *event, struct print_flag_sym **list, char **
 		list = &field->next;
 
 		free_token(token);
-		type = read_token_item(&token);
+		type = read_token_item(ctx, &token);
 	} while (type == EVENT_DELIM && strcmp(token, ",") == 0);
 
 	*tok = token;
@@ -2534,7 +3170,8 @@ out_free:
 }
 
 static enum event_type
-process_flags(struct event_format *event, struct print_arg *arg, char **tok)
+process_flags(struct parse_ctx *ctx, struct event_format *event,
+	      struct print_arg *arg, char **tok)
 {
 	struct print_arg *field;
 	enum event_type type;
@@ -2549,11 +3186,11 @@ process_flags(struct event_format *event, struct print_arg *arg, char **tok)
 		goto out_free;
 	}
 
-	type = process_field_arg(event, field, &token);
+	type = process_field_arg(ctx, event, field, &token);
 
 	/* Handle operations in the first argument */
 	while (type == EVENT_OP)
-		type = process_op(event, field, &token);
+		type = process_op(ctx, event, field, &token);
 
 	if (test_type_token(type, token, EVENT_DELIM, ","))
 		goto out_free_field;
@@ -2561,21 +3198,21 @@ process_flags(struct event_format *event, struct print_arg *arg, char **tok)
 
 	arg->flags.field = field;
 
-	type = read_token_item(&token);
+	type = read_token_item(ctx, &token);
 	if (event_item_type(type)) {
 		arg->flags.delim = token;
-		type = read_token_item(&token);
+		type = read_token_item(ctx, &token);
 	}
 
 	if (test_type_token(type, token, EVENT_DELIM, ","))
 		goto out_free;
 
-	type = process_fields(event, &arg->flags.flags, &token);
+	type = process_fields(ctx, event, &arg->flags.flags, &token);
 	if (test_type_token(type, token, EVENT_DELIM, ")"))
 		goto out_free;
 
 	free_token(token);
-	type = read_token_item(tok);
+	type = read_token_item(ctx, tok);
 	return type;
 
 out_free_field:
@@ -2587,7 +3224,8 @@ out_free:
 }
 
 static enum event_type
-process_symbols(struct event_format *event, struct print_arg *arg, char **tok)
+process_symbols(struct parse_ctx *ctx, struct event_format *event,
+		struct print_arg *arg, char **tok)
 {
 	struct print_arg *field;
 	enum event_type type;
@@ -2602,19 +3240,19 @@ process_symbols(struct event_format *event, struct print_arg *arg, char **tok)
 		goto out_free;
 	}
 
-	type = process_field_arg(event, field, &token);
+	type = process_field_arg(ctx, event, field, &token);
 
 	if (test_type_token(type, token, EVENT_DELIM, ","))
 		goto out_free_field;
 
 	arg->symbol.field = field;
 
-	type = process_fields(event, &arg->symbol.symbols, &token);
+	type = process_fields(ctx, event, &arg->symbol.symbols, &token);
 	if (test_type_token(type, token, EVENT_DELIM, ")"))
 		goto out_free;
 
 	free_token(token);
-	type = read_token_item(tok);
+	type = read_token_item(ctx, tok);
 	return type;
 
 out_free_field:
@@ -2626,18 +3264,19 @@ out_free:
 }
 
 static enum event_type
-process_hex(struct event_format *event, struct print_arg *arg, char **tok)
+process_hex(struct parse_ctx *ctx, struct event_format *event,
+	    struct print_arg *arg, char **tok)
 {
 	memset(arg, 0, sizeof(*arg));
 	arg->type = PRINT_HEX;
 
-	if (alloc_and_process_delim(event, ",", &arg->hex.field))
+	if (alloc_and_process_delim(ctx, event, ",", &arg->hex.field))
 		goto out;
 
-	if (alloc_and_process_delim(event, ")", &arg->hex.size))
+	if (alloc_and_process_delim(ctx, event, ")", &arg->hex.size))
 		goto free_field;
 
-	return read_token_item(tok);
+	return read_token_item(ctx, tok);
 
 free_field:
 	free_arg(arg->hex.field);
@@ -2648,21 +3287,22 @@ out:
 }
 
 static enum event_type
-process_int_array(struct event_format *event, struct print_arg *arg, char **tok)
+process_int_array(struct parse_ctx *ctx, struct event_format *event,
+		  struct print_arg *arg, char **tok)
 {
 	memset(arg, 0, sizeof(*arg));
 	arg->type = PRINT_INT_ARRAY;
 
-	if (alloc_and_process_delim(event, ",", &arg->int_array.field))
+	if (alloc_and_process_delim(ctx, event, ",", &arg->int_array.field))
 		goto out;
 
-	if (alloc_and_process_delim(event, ",", &arg->int_array.count))
+	if (alloc_and_process_delim(ctx, event, ",", &arg->int_array.count))
 		goto free_field;
 
-	if (alloc_and_process_delim(event, ")", &arg->int_array.el_size))
+	if (alloc_and_process_delim(ctx, event, ")", &arg->int_array.el_size))
 		goto free_size;
 
-	return read_token_item(tok);
+	return read_token_item(ctx, tok);
 
 free_size:
 	free_arg(arg->int_array.count);
@@ -2676,7 +3316,8 @@ out:
 }
 
 static enum event_type
-process_dynamic_array(struct event_format *event, struct print_arg *arg, char **tok)
+process_dynamic_array(struct parse_ctx *ctx, struct event_format *event,
+		      struct print_arg *arg, char **tok)
 {
 	struct format_field *field;
 	enum event_type type;
@@ -2689,7 +3330,7 @@ process_dynamic_array(struct event_format *event, struct print_arg *arg, char **
 	 * The item within the parenthesis is another field that holds
 	 * the index into where the array starts.
 	 */
-	type = read_token(&token);
+	type = read_token(ctx, &token);
 	*tok = token;
 	if (type != EVENT_ITEM)
 		goto out_free;
@@ -2703,11 +3344,11 @@ process_dynamic_array(struct event_format *event, struct print_arg *arg, char **
 	arg->dynarray.field = field;
 	arg->dynarray.index = 0;
 
-	if (read_expected(EVENT_DELIM, ")") < 0)
+	if (read_expected(ctx, EVENT_DELIM, ")") < 0)
 		goto out_free;
 
 	free_token(token);
-	type = read_token_item(&token);
+	type = read_token_item(ctx, &token);
 	*tok = token;
 	if (type != EVENT_OP || strcmp(token, "[") != 0)
 		return type;
@@ -2720,7 +3361,7 @@ process_dynamic_array(struct event_format *event, struct print_arg *arg, char **
 		return EVENT_ERROR;
 	}
 
-	type = process_arg(event, arg, &token);
+	type = process_arg(ctx, event, arg, &token);
 	if (type == EVENT_ERROR)
 		goto out_free_arg;
 
@@ -2728,7 +3369,7 @@ process_dynamic_array(struct event_format *event, struct print_arg *arg, char **
 		goto out_free_arg;
 
 	free_token(token);
-	type = read_token_item(tok);
+	type = read_token_item(ctx, tok);
 	return type;
 
  out_free_arg:
@@ -2740,14 +3381,14 @@ process_dynamic_array(struct event_format *event, struct print_arg *arg, char **
 }
 
 static enum event_type
-process_dynamic_array_len(struct event_format *event, struct print_arg *arg,
-			  char **tok)
+process_dynamic_array_len(struct parse_ctx *ctx, struct event_format *event,
+			  struct print_arg *arg, char **tok)
 {
 	struct format_field *field;
 	enum event_type type;
 	char *token;
 
-	if (read_expect_type(EVENT_ITEM, &token) < 0)
+	if (read_expect_type(ctx, EVENT_ITEM, &token) < 0)
 		goto out_free;
 
 	arg->type = PRINT_DYNAMIC_ARRAY_LEN;
@@ -2760,10 +3401,10 @@ process_dynamic_array_len(struct event_format *event, struct print_arg *arg,
 	arg->dynarray.field = field;
 	arg->dynarray.index = 0;
 
-	if (read_expected(EVENT_DELIM, ")") < 0)
+	if (read_expected(ctx, EVENT_DELIM, ")") < 0)
 		goto out_err;
 
-	type = read_token(&token);
+	type = read_token(ctx, &token);
 	*tok = token;
 
 	return type;
@@ -2776,19 +3417,20 @@ process_dynamic_array_len(struct event_format *event, struct print_arg *arg,
 }
 
 static enum event_type
-process_paren(struct event_format *event, struct print_arg *arg, char **tok)
+process_paren(struct parse_ctx *ctx, struct event_format *event,
+	      struct print_arg *arg, char **tok)
 {
 	struct print_arg *item_arg;
 	enum event_type type;
 	char *token;
 
-	type = process_arg(event, arg, &token);
+	type = process_arg(ctx, event, arg, &token);
 
 	if (type == EVENT_ERROR)
 		goto out_free;
 
 	if (type == EVENT_OP)
-		type = process_op(event, arg, &token);
+		type = process_op(ctx, event, arg, &token);
 
 	if (type == EVENT_ERROR)
 		goto out_free;
@@ -2797,7 +3439,7 @@ process_paren(struct event_format *event, struct print_arg *arg, char **tok)
 		goto out_free;
 
 	free_token(token);
-	type = read_token_item(&token);
+	type = read_token_item(ctx, &token);
 
 	/*
 	 * If the next token is an item or another open paren, then
@@ -2824,7 +3466,7 @@ process_paren(struct event_format *event, struct print_arg *arg, char **tok)
 		arg->type = PRINT_TYPE;
 		arg->typecast.type = arg->atom.atom;
 		arg->typecast.item = item_arg;
-		type = process_arg_token(event, item_arg, &token, type);
+		type = process_arg_token(ctx, event, item_arg, &token, type);
 
 	}
 
@@ -2839,23 +3481,23 @@ process_paren(struct event_format *event, struct print_arg *arg, char **tok)
 
 
 static enum event_type
-process_str(struct event_format *event __maybe_unused, struct print_arg *arg,
-	    char **tok)
+process_str(struct parse_ctx *ctx, struct event_format *event __maybe_unused,
+	    struct print_arg *arg, char **tok)
 {
 	enum event_type type;
 	char *token;
 
-	if (read_expect_type(EVENT_ITEM, &token) < 0)
+	if (read_expect_type(ctx, EVENT_ITEM, &token) < 0)
 		goto out_free;
 
 	arg->type = PRINT_STRING;
 	arg->string.string = token;
 	arg->string.offset = -1;
 
-	if (read_expected(EVENT_DELIM, ")") < 0)
+	if (read_expected(ctx, EVENT_DELIM, ")") < 0)
 		goto out_err;
 
-	type = read_token(&token);
+	type = read_token(ctx, &token);
 	*tok = token;
 
 	return type;
@@ -2868,23 +3510,24 @@ process_str(struct event_format *event __maybe_unused, struct print_arg *arg,
 }
 
 static enum event_type
-process_bitmask(struct event_format *event __maybe_unused, struct print_arg *arg,
-	    char **tok)
+process_bitmask(struct parse_ctx *ctx,
+		struct event_format *event __maybe_unused,
+		struct print_arg *arg, char **tok)
 {
 	enum event_type type;
 	char *token;
 
-	if (read_expect_type(EVENT_ITEM, &token) < 0)
+	if (read_expect_type(ctx, EVENT_ITEM, &token) < 0)
 		goto out_free;
 
 	arg->type = PRINT_BITMASK;
 	arg->bitmask.bitmask = token;
 	arg->bitmask.offset = -1;
 
-	if (read_expected(EVENT_DELIM, ")") < 0)
+	if (read_expected(ctx, EVENT_DELIM, ")") < 0)
 		goto out_err;
 
-	type = read_token(&token);
+	type = read_token(ctx, &token);
 	*tok = token;
 
 	return type;
@@ -2929,7 +3572,8 @@ static void remove_func_handler(struct pevent *pevent, char *func_name)
 }
 
 static enum event_type
-process_func_handler(struct event_format *event, struct pevent_function_handler *func,
+process_func_handler(struct parse_ctx *ctx, struct event_format *event,
+		     struct pevent_function_handler *func,
 		     struct print_arg *arg, char **tok)
 {
 	struct print_arg **next_arg;
@@ -2952,7 +3596,7 @@ process_func_handler(struct event_format *event, struct pevent_function_handler
 			return EVENT_ERROR;
 		}
 
-		type = process_arg(event, farg, &token);
+		type = process_arg(ctx, event, farg, &token);
 		if (i < (func->nr_args - 1)) {
 			if (type != EVENT_DELIM || strcmp(token, ",") != 0) {
 				do_warning_event(event,
@@ -2975,7 +3619,7 @@ process_func_handler(struct event_format *event, struct pevent_function_handler
 		free_token(token);
 	}
 
-	type = read_token(&token);
+	type = read_token(ctx, &token);
 	*tok = token;
 
 	return type;
@@ -2987,50 +3631,50 @@ err:
 }
 
 static enum event_type
-process_function(struct event_format *event, struct print_arg *arg,
-		 char *token, char **tok)
+process_function(struct parse_ctx *ctx, struct event_format *event,
+		 struct print_arg *arg, char *token, char **tok)
 {
 	struct pevent_function_handler *func;
 
 	if (strcmp(token, "__print_flags") == 0) {
 		free_token(token);
-		is_flag_field = 1;
-		return process_flags(event, arg, tok);
+		ctx->is_flag_field = 1;
+		return process_flags(ctx, event, arg, tok);
 	}
 	if (strcmp(token, "__print_symbolic") == 0) {
 		free_token(token);
-		is_symbolic_field = 1;
-		return process_symbols(event, arg, tok);
+		ctx->is_symbolic_field = 1;
+		return process_symbols(ctx, event, arg, tok);
 	}
 	if (strcmp(token, "__print_hex") == 0) {
 		free_token(token);
-		return process_hex(event, arg, tok);
+		return process_hex(ctx, event, arg, tok);
 	}
 	if (strcmp(token, "__print_array") == 0) {
 		free_token(token);
-		return process_int_array(event, arg, tok);
+		return process_int_array(ctx, event, arg, tok);
 	}
 	if (strcmp(token, "__get_str") == 0) {
 		free_token(token);
-		return process_str(event, arg, tok);
+		return process_str(ctx, event, arg, tok);
 	}
 	if (strcmp(token, "__get_bitmask") == 0) {
 		free_token(token);
-		return process_bitmask(event, arg, tok);
+		return process_bitmask(ctx, event, arg, tok);
 	}
 	if (strcmp(token, "__get_dynamic_array") == 0) {
 		free_token(token);
-		return process_dynamic_array(event, arg, tok);
+		return process_dynamic_array(ctx, event, arg, tok);
 	}
 	if (strcmp(token, "__get_dynamic_array_len") == 0) {
 		free_token(token);
-		return process_dynamic_array_len(event, arg, tok);
+		return process_dynamic_array_len(ctx, event, arg, tok);
 	}
 
 	func = find_func_handler(event->pevent, token);
 	if (func) {
 		free_token(token);
-		return process_func_handler(event, func, arg, tok);
+		return process_func_handler(ctx, event, func, arg, tok);
 	}
 
 	do_warning_event(event, "function %s not defined", token);
@@ -3039,8 +3683,8 @@ process_function(struct event_format *event, struct print_arg *arg,
 }
 
 static enum event_type
-process_arg_token(struct event_format *event, struct print_arg *arg,
-		  char **tok, enum event_type type)
+process_arg_token(struct parse_ctx *ctx, struct event_format *event,
+		  struct print_arg *arg, char **tok, enum event_type type)
 {
 	char *token;
 	char *atom;
@@ -3051,12 +3695,12 @@ process_arg_token(struct event_format *event, struct print_arg *arg,
 	case EVENT_ITEM:
 		if (strcmp(token, "REC") == 0) {
 			free_token(token);
-			type = process_entry(event, arg, &token);
+			type = process_entry(ctx, event, arg, &token);
 			break;
 		}
 		atom = token;
 		/* test the next token */
-		type = read_token_item(&token);
+		type = read_token_item(ctx, &token);
 
 		/*
 		 * If the next token is a parenthesis, then this
@@ -3066,7 +3710,7 @@ process_arg_token(struct event_format *event, struct print_arg *arg,
 			free_token(token);
 			token = NULL;
 			/* this will free atom. */
-			type = process_function(event, arg, atom, &token);
+			type = process_function(ctx, event, arg, atom, &token);
 			break;
 		}
 		/* atoms can be more than one token long */
@@ -3084,7 +3728,7 @@ process_arg_token(struct event_format *event, struct print_arg *arg,
 			strcat(atom, " ");
 			strcat(atom, token);
 			free_token(token);
-			type = read_token_item(&token);
+			type = read_token_item(ctx, &token);
 		}
 
 		arg->type = PRINT_ATOM;
@@ -3095,12 +3739,12 @@ process_arg_token(struct event_format *event, struct print_arg *arg,
 	case EVENT_SQUOTE:
 		arg->type = PRINT_ATOM;
 		arg->atom.atom = token;
-		type = read_token_item(&token);
+		type = read_token_item(ctx, &token);
 		break;
 	case EVENT_DELIM:
 		if (strcmp(token, "(") == 0) {
 			free_token(token);
-			type = process_paren(event, arg, &token);
+			type = process_paren(ctx, event, arg, &token);
 			break;
 		}
 	case EVENT_OP:
@@ -3108,7 +3752,7 @@ process_arg_token(struct event_format *event, struct print_arg *arg,
 		arg->type = PRINT_OP;
 		arg->op.op = token;
 		arg->op.left = NULL;
-		type = process_op(event, arg, &token);
+		type = process_op(ctx, event, arg, &token);
 
 		/* On error, the op is freed */
 		if (type == EVENT_ERROR)
@@ -3127,7 +3771,9 @@ process_arg_token(struct event_format *event, struct print_arg *arg,
 	return type;
 }
 
-static int event_read_print_args(struct event_format *event, struct print_arg **list)
+static int event_read_print_args(struct parse_ctx *ctx,
+				 struct event_format *event,
+				 struct print_arg **list)
 {
 	enum event_type type = EVENT_ERROR;
 	struct print_arg *arg;
@@ -3136,7 +3782,7 @@ static int event_read_print_args(struct event_format *event, struct print_arg **
 
 	do {
 		if (type == EVENT_NEWLINE) {
-			type = read_token_item(&token);
+			type = read_token_item(ctx, &token);
 			continue;
 		}
 
@@ -3147,7 +3793,7 @@ static int event_read_print_args(struct event_format *event, struct print_arg **
 			return -1;
 		}
 
-		type = process_arg(event, arg, &token);
+		type = process_arg(ctx, event, arg, &token);
 
 		if (type == EVENT_ERROR) {
 			free_token(token);
@@ -3159,7 +3805,7 @@ static int event_read_print_args(struct event_format *event, struct print_arg **
 		args++;
 
 		if (type == EVENT_OP) {
-			type = process_op(event, arg, &token);
+			type = process_op(ctx, event, arg, &token);
 			free_token(token);
 			if (type == EVENT_ERROR) {
 				*list = NULL;
@@ -3185,22 +3831,83 @@ static int event_read_print_args(struct event_format *event, struct print_arg **
 	return args;
 }
 
-static int event_read_print(struct event_format *event)
+/*
+ * Look up the fields the print args refer to while parsing, so that
+ * printing only reads the args and can be done from several threads.
+ */
+static void resolve_print_args(struct event_format *event,
+			       struct print_arg *arg)
+{
+	struct format_field *field;
+
+	for (; arg; arg = arg->next) {
+		switch (arg->type) {
+		case PRINT_FIELD:
+			if (!arg->field.field)
+				arg->field.field =
+					pevent_find_any_field(event, arg->field.name);
+			break;
+		case PRINT_STRING:
+			if (arg->string.offset != -1)
+				break;
+			field = pevent_find_any_field(event, arg->string.string);
+			if (field)
+				arg->string.offset = field->offset;
+			break;
+		case PRINT_BITMASK:
+			if (arg->bitmask.offset != -1)
+				break;
+			field = pevent_find_any_field(event, arg->bitmask.bitmask);
+			if (field)
+				arg->bitmask.offset = field->offset;
+			break;
+		case PRINT_FLAGS:
+			resolve_print_args(event, arg->flags.field);
+			break;
+		case PRINT_SYMBOL:
+			resolve_print_args(event, arg->symbol.field);
+			break;
+		case PRINT_HEX:
+			resolve_print_args(event, arg->hex.field);
+			resolve_print_args(event, arg->hex.size);
+			break;
+		case PRINT_INT_ARRAY:
+			resolve_print_args(event, arg->int_array.field);
+			resolve_print_args(event, arg->int_array.count);
+			resolve_print_args(event, arg->int_array.el_size);
+			break;
+		case PRINT_TYPE:
+			resolve_print_args(event, arg->typecast.item);
+			break;
+		case PRINT_OP:
+			resolve_print_args(event, arg->op.left);
+			resolve_print_args(event, arg->op.right);
+			break;
+		case PRINT_FUNC:
+			resolve_print_args(event, arg->func.args);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static int event_read_print(struct parse_ctx *ctx, struct event_format *event)
 {
 	enum event_type type;
 	char *token;
 	int ret;
 
-	if (read_expected_item(EVENT_ITEM, "print") < 0)
+	if (read_expected_item(ctx, EVENT_ITEM, "print") < 0)
 		return -1;
 
-	if (read_expected(EVENT_ITEM, "fmt") < 0)
+	if (read_expected(ctx, EVENT_ITEM, "fmt") < 0)
 		return -1;
 
-	if (read_expected(EVENT_OP, ":") < 0)
+	if (read_expected(ctx, EVENT_OP, ":") < 0)
 		return -1;
 
-	if (read_expect_type(EVENT_DQUOTE, &token) < 0)
+	if (read_expect_type(ctx, EVENT_DQUOTE, &token) < 0)
 		goto fail;
 
  concat:
@@ -3208,7 +3915,7 @@ static int event_read_print(struct event_format *event)
 	event->print_fmt.args = NULL;
 
 	/* ok to have no arg */
-	type = read_token_item(&token);
+	type = read_token_item(ctx, &token);
 
 	if (type == EVENT_NONE)
 		return 0;
@@ -3231,7 +3938,7 @@ static int event_read_print(struct event_format *event)
 
 	free_token(token);
 
-	ret = event_read_print_args(event, &event->print_fmt.args);
+	ret = event_read_print_args(ctx, event, &event->print_fmt.args);
 	if (ret < 0)
 		return -1;
 
@@ -3333,6 +4040,75 @@ unsigned long long pevent_read_number(struct pevent *pevent,
 	}
 }
 
+#define FIELD_READERS(bits, utype, stype, swap)				\
+static unsigned long long read_u##bits(const void *ptr)			\
+{									\
+	utype val;							\
+									\
+	memcpy(&val, ptr, sizeof(val));					\
+	return val;							\
+}									\
+static unsigned long long read_s##bits(const void *ptr)			\
+{									\
+	stype val;							\
+									\
+	memcpy(&val, ptr, sizeof(val));					\
+	return (long long)val;						\
+}									\
+static unsigned long long read_u##bits##_swap(const void *ptr)		\
+{									\
+	utype val;							\
+									\
+	memcpy(&val, ptr, sizeof(val));					\
+	return (utype)swap(val);					\
+}									\
+static unsigned long long read_s##bits##_swap(const void *ptr)		\
+{									\
+	utype val;							\
+									\
+	memcpy(&val, ptr, sizeof(val));					\
+	return (long long)(stype)swap(val);				\
+}
+
+#define no_swap(val)	(val)
+
+FIELD_READERS(8, unsigned char, signed char, no_swap)
+FIELD_READERS(16, unsigned short, short, __builtin_bswap16)
+FIELD_READERS(32, unsigned int, int, __builtin_bswap32)
+FIELD_READERS(64, unsigned long long, long long, __builtin_bswap64)
+
+static unsigned long long read_none(const void *ptr)
+{
+	return 0;
+}
+
+/* Indexed by [size][swap][signed] */
+static const pevent_field_read_func field_readers[4][2][2] = {
+	{ { read_u8, read_s8 }, { read_u8_swap, read_s8_swap } },
+	{ { read_u16, read_s16 }, { read_u16_swap, read_s16_swap } },
+	{ { read_u32, read_s32 }, { read_u32_swap, read_s32_swap } },
+	{ { read_u64, read_s64 }, { read_u64_swap, read_s64_swap } },
+};
+
+static pevent_field_read_func
+field_reader(struct pevent *pevent, int size, int sign)
+{
+	int swap = pevent->host_bigendian != pevent->file_bigendian;
+
+	switch (size) {
+	case 1:
+		return field_readers[0][swap][sign];
+	case 2:
+		return field_readers[1][swap][sign];
+	case 4:
+		return field_readers[2][swap][sign];
+	case 8:
+		return field_readers[3][swap][sign];
+	default:
+		return NULL;
+	}
+}
+
 /**
  * pevent_read_number_field - read a number from data
  * @field: a handle to the field
@@ -3347,19 +4123,82 @@ unsigned long long pevent_read_number(struct pevent *pevent,
 int pevent_read_number_field(struct format_field *field, const void *data,
 			     unsigned long long *value)
 {
+	pevent_field_read_func read;
+
 	if (!field)
 		return -1;
-	switch (field->size) {
-	case 1:
-	case 2:
-	case 4:
-	case 8:
-		*value = pevent_read_number(field->event->pevent,
-					    data + field->offset, field->size);
-		return 0;
-	default:
+
+	read = field_reader(field->event->pevent, field->size, 0);
+	if (!read)
 		return -1;
-	}
+
+	*value = read(data + field->offset);
+	return 0;
+}
+
+/**
+ * pevent_field_accessor_init - resolve a field for reading
+ * @acc: the accessor to fill in
+ * @field: the field to read
+ * @flags: PEVENT_FIELD_SIGN_EXTEND to sign extend signed fields
+ *
+ * Sets up @acc to read @field of a record with pevent_field_read()
+ * and pevent_field_data(). The byte order of the pevent must be
+ * set before, as the reader is picked for it. Reading a field that
+ * is not 1, 2, 4 or 8 bytes gives 0, but its data may still be found.
+ *
+ * Returns 0 on success, -1 if @field is NULL.
+ */
+int pevent_field_accessor_init(struct pevent_field_accessor *acc,
+			       struct format_field *field, int flags)
+{
+	pevent_field_read_func read;
+	int sign = 0;
+
+	memset(acc, 0, sizeof(*acc));
+	acc->read = read_none;
+	if (!field)
+		return -1;
+
+	acc->field = field;
+	acc->offset = field->offset;
+	acc->size = field->size;
+	acc->flags = field->flags;
+
+	/* The __data_loc word is never signed */
+	if ((flags & PEVENT_FIELD_SIGN_EXTEND) &&
+	    (field->flags & (FIELD_IS_SIGNED | FIELD_IS_DYNAMIC)) == FIELD_IS_SIGNED)
+		sign = 1;
+
+	read = field_reader(field->event->pevent, field->size, sign);
+	if (read)
+		acc->read = read;
+
+	return 0;
+}
+
+/**
+ * pevent_field_accessor_find - resolve a field of an event by name
+ * @acc: the accessor to fill in
+ * @event: the event that the field is for
+ * @name: the name of the field, common or not
+ * @flags: PEVENT_FIELD_SIGN_EXTEND to sign extend signed fields
+ *
+ * Like pevent_field_accessor_init() for the field found with
+ * pevent_find_any_field(). If it is not found, @acc reads as 0.
+ *
+ * Returns 0 on success, -1 if the field is not found.
+ */
+int pevent_field_accessor_find(struct pevent_field_accessor *acc,
+			       struct event_format *event, const char *name,
+			       int flags)
+{
+	struct format_field *field = NULL;
+
+	if (event)
+		field = pevent_find_any_field(event, name);
+
+	return pevent_field_accessor_init(acc, field, flags);
 }
 
 static int get_common_info(struct pevent *pevent,
@@ -3391,14 +4230,23 @@ static int get_common_info(struct pevent *pevent,
 static int __parse_common(struct pevent *pevent, void *data,
 			  int *size, int *offset, const char *name)
 {
-	int ret;
+	int field_size;
+	int ret = 0;
 
-	if (!*size) {
-		ret = get_common_info(pevent, name, offset, size);
+	/* The size is set last, once it is there the offset is too */
+	field_size = __atomic_load_n(size, __ATOMIC_ACQUIRE);
+	if (!field_size) {
+		pthread_mutex_lock(&pevent->lock);
+		if (!*size)
+			ret = get_common_info(pevent, name, offset, &field_size);
+		if (!ret && !*size)
+			__atomic_store_n(size, field_size, __ATOMIC_RELEASE);
+		field_size = *size;
+		pthread_mutex_unlock(&pevent->lock);
 		if (ret < 0)
 			return ret;
 	}
-	return pevent_read_number(pevent, data + *offset, *size);
+	return pevent_read_number(pevent, data + *offset, field_size);
 }
 
 static int trace_parse_common_type(struct pevent *pevent, void *data)
@@ -3458,19 +4306,19 @@ struct event_format *pevent_find_event(struct pevent *pevent, int id)
 	struct event_format key;
 	struct event_format *pkey = &key;
 
-	/* Check cache first */
-	if (pevent->last_event && pevent->last_event->id == id)
-		return pevent->last_event;
+	if (id >= 0 && id < PEVENT_MAX_DENSE_ID) {
+		if (id < pevent->nr_event_ids)
+			return pevent->event_ids[id];
+		return NULL;
+	}
 
 	key.id = id;
 
 	eventptr = bsearch(&pkey, pevent->events, pevent->nr_events,
 			   sizeof(*pevent->events), events_id_cmp);
 
-	if (eventptr) {
-		pevent->last_event = *eventptr;
+	if (eventptr)
 		return *eventptr;
-	}
 
 	return NULL;
 }
@@ -3488,28 +4336,19 @@ struct event_format *
 pevent_find_event_by_name(struct pevent *pevent,
 			  const char *sys, const char *name)
 {
-	struct event_format *event;
-	int i;
+	struct event_name_item *item;
 
-	if (pevent->last_event &&
-	    strcmp(pevent->last_event->name, name) == 0 &&
-	    (!sys || strcmp(pevent->last_event->system, sys) == 0))
-		return pevent->last_event;
+	if (!pevent->event_names)
+		return NULL;
 
-	for (i = 0; i < pevent->nr_events; i++) {
-		event = pevent->events[i];
-		if (strcmp(event->name, name) == 0) {
-			if (!sys)
-				break;
-			if (strcmp(event->system, sys) == 0)
-				break;
-		}
+	for (item = pevent->event_names[event_name_hash(name)];
+	     item; item = item->next) {
+		if (strcmp(item->event->name, name) == 0 &&
+		    (!sys || strcmp(item->event->system, sys) == 0))
+			return item->event;
 	}
-	if (i == pevent->nr_events)
-		event = NULL;
 
-	pevent->last_event = event;
-	return event;
+	return NULL;
 }
 
 static unsigned long long
@@ -4194,6 +5033,52 @@ static void free_args(struct print_arg *args)
 	}
 }
 
+/*
+ * Look up the fields of the bprint event once. The fmt field is
+ * published last, the other two can be read once it is set.
+ */
+static int bprint_fields_setup(struct event_format *event)
+{
+	struct pevent *pevent = event->pevent;
+	struct format_field *fmt_field;
+	struct format_field *field;
+	struct format_field *ip_field;
+	int ret = -1;
+
+	if (__atomic_load_n(&pevent->bprint_fmt_field, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pthread_mutex_lock(&pevent->lock);
+	if (pevent->bprint_fmt_field) {
+		ret = 0;
+		goto out;
+	}
+
+	field = pevent_find_field(event, "buf");
+	if (!field) {
+		do_warning_event(event, "can't find buffer field for binary printk");
+		goto out;
+	}
+	ip_field = pevent_find_field(event, "ip");
+	if (!ip_field) {
+		do_warning_event(event, "can't find ip field for binary printk");
+		goto out;
+	}
+	fmt_field = pevent_find_field(event, "fmt");
+	if (!fmt_field) {
+		do_warning_event(event, "can't find format field for binary printk");
+		goto out;
+	}
+
+	pevent->bprint_buf_field = field;
+	pevent->bprint_ip_field = ip_field;
+	__atomic_store_n(&pevent->bprint_fmt_field, fmt_field, __ATOMIC_RELEASE);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&pevent->lock);
+	return ret;
+}
+
 static struct print_arg *make_bprint_args(char *fmt, void *data, int size, struct event_format *event)
 {
 	struct pevent *pevent = event->pevent;
@@ -4204,24 +5089,12 @@ static struct print_arg *make_bprint_args(char *fmt, void *data, int size, struc
 	void *bptr;
 	int vsize;
 
+	if (bprint_fields_setup(event))
+		return NULL;
+
 	field = pevent->bprint_buf_field;
 	ip_field = pevent->bprint_ip_field;
 
-	if (!field) {
-		field = pevent_find_field(event, "buf");
-		if (!field) {
-			do_warning_event(event, "can't find buffer field for binary printk");
-			return NULL;
-		}
-		ip_field = pevent_find_field(event, "ip");
-		if (!ip_field) {
-			do_warning_event(event, "can't find ip field for binary printk");
-			return NULL;
-		}
-		pevent->bprint_buf_field = field;
-		pevent->bprint_ip_field = ip_field;
-	}
-
 	ip = pevent_read_number(pevent, data + ip_field->offset, ip_field->size);
 
 	/*
@@ -4348,42 +5221,6 @@ out_free:
 	return NULL;
 }
 
-static char *
-get_bprint_format(void *data, int size __maybe_unused,
-		  struct event_format *event)
-{
-	struct pevent *pevent = event->pevent;
-	unsigned long long addr;
-	struct format_field *field;
-	struct printk_map *printk;
-	char *format;
-
-	field = pevent->bprint_fmt_field;
-
-	if (!field) {
-		field = pevent_find_field(event, "fmt");
-		if (!field) {
-			do_warning_event(event, "can't find format field for binary printk");
-			return NULL;
-		}
-		pevent->bprint_fmt_field = field;
-	}
-
-	addr = pevent_read_number(pevent, data + field->offset, field->size);
-
-	printk = find_printk(pevent, addr);
-	if (!printk) {
-		if (asprintf(&format, "%%pf: (NO FORMAT FOUND at %llx)\n", addr) < 0)
-			return NULL;
-		return format;
-	}
-
-	if (asprintf(&format, "%s: %s", "%pf", printk->printk) < 0)
-		return NULL;
-
-	return format;
-}
-
 static void print_mac_arg(struct trace_seq *s, int mac, void *data, int size,
 			  struct event_format *event, struct print_arg *arg)
 {
@@ -4826,259 +5663,647 @@ void pevent_print_fields(struct trace_seq *s, void *data,
 	}
 }
 
-static void pretty_print(struct trace_seq *s, void *data, int size, struct event_format *event)
+/*
+ * The print format of an event is compiled the first time it is used,
+ * so that printing a record does not have to scan the format string
+ * again. Text between the conversions (with the escapes already done)
+ * becomes one op, and each conversion becomes an op that knows its
+ * type, length modifier and the printf format to use. The ops take the
+ * print args in order, the same way the format string would.
+ */
+enum print_op_type {
+	PRINT_OP_TEXT,
+	PRINT_OP_NUM,		/* %d %i %u %x %X and %p, with %pF/%ps and friends */
+	PRINT_OP_MAC,		/* %pM %pm */
+	PRINT_OP_IP,		/* %pI4 %pi6 %pISpc and friends */
+	PRINT_OP_STR,		/* %s */
+};
+
+struct print_op {
+	enum print_op_type	type;
+	char			*text;		/* the text, or the printf format */
+	int			ls;		/* length modifier, -2 (hh) to 2 (ll) */
+	int			nr_len_args;	/* number of '*' in the conversion */
+	int			bad_format;	/* the conversion was too long */
+	char			show_func;	/* 'F', 'f', 'S' or 's' for %pF... */
+	char			mac;		/* 'M' or 'm' for %pM */
+};
+
+struct print_prog {
+	int			nr_ops;
+	struct print_op		ops[];
+};
+
+static void free_print_prog(struct print_prog *prog)
+{
+	int i;
+
+	if (!prog)
+		return;
+
+	for (i = 0; i < prog->nr_ops; i++)
+		free(prog->ops[i].text);
+	free(prog);
+}
+
+/* How many characters after the 'p' of "%pI4" and such print_ip_arg() uses */
+static int ip_fmt_len(const char *ptr)
+{
+	char i = ptr[0];
+	int len = 2;
+
+	if (i != 'I' && i != 'i')
+		return 0;
+
+	switch (ptr[1]) {
+	case '4':
+		break;
+	case '6':
+		if (i == 'I' && ptr[2] == 'c')
+			len++;
+		break;
+	case 'S':
+		if (i == 'I') {
+			if (ptr[len] == 'p')
+				len++;
+			if (ptr[len] == 'c')
+				len++;
+		}
+		break;
+	default:
+		return 0;
+	}
+
+	return len;
+}
+
+static struct print_op *add_print_op(struct print_prog **prog, int *size,
+				     enum print_op_type type)
+{
+	struct print_prog *p = *prog;
+	struct print_op *op;
+
+	if (p->nr_ops == *size) {
+		*size *= 2;
+		p = realloc(p, sizeof(*p) + sizeof(p->ops[0]) * *size);
+		if (!p)
+			return NULL;
+		*prog = p;
+	}
+
+	op = &p->ops[p->nr_ops++];
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+
+	return op;
+}
+
+static int add_text_op(struct print_prog **prog, int *size,
+		       char *text, int *len)
+{
+	struct print_op *op;
+
+	if (!*len)
+		return 0;
+
+	op = add_print_op(prog, size, PRINT_OP_TEXT);
+	if (!op)
+		return -1;
+
+	op->text = strndup(text, *len);
+	if (!op->text)
+		return -1;
+
+	*len = 0;
+	return 0;
+}
+
+static struct print_prog *
+compile_print_fmt(struct event_format *event, const char *fmt)
 {
 	struct pevent *pevent = event->pevent;
-	struct print_fmt *print_fmt = &event->print_fmt;
-	struct print_arg *arg = print_fmt->args;
-	struct print_arg *args = NULL;
-	const char *ptr = print_fmt->format;
-	unsigned long long val;
-	struct func_map *func;
+	struct print_prog *prog;
+	struct print_op *op;
 	const char *saveptr;
-	struct trace_seq p;
-	char *bprint_fmt = NULL;
-	char format[32];
+	const char *ptr;
+	char *text;
+	int text_len = 0;
+	int nr_len_args;
 	int show_func;
-	int len_as_arg;
-	int len_arg;
+	int size = 8;
 	int len;
 	int ls;
 
-	if (event->flags & EVENT_FL_FAILED) {
-		trace_seq_printf(s, "[FAILED TO PARSE]");
-		pevent_print_fields(s, data, size, event);
-		return;
-	}
+	prog = malloc(sizeof(*prog) + sizeof(prog->ops[0]) * size);
+	if (!prog)
+		return NULL;
+	prog->nr_ops = 0;
 
-	if (event->flags & EVENT_FL_ISBPRINT) {
-		bprint_fmt = get_bprint_format(data, size, event);
-		args = make_bprint_args(bprint_fmt, data, size, event);
-		arg = args;
-		ptr = bprint_fmt;
-	}
+	/* The text never gets longer than the format */
+	text = malloc(strlen(fmt) + 1);
+	if (!text)
+		goto out_free;
 
-	for (; *ptr; ptr++) {
-		ls = 0;
+	for (ptr = fmt; *ptr; ptr++) {
 		if (*ptr == '\\') {
 			ptr++;
 			switch (*ptr) {
 			case 'n':
-				trace_seq_putc(s, '\n');
+				text[text_len++] = '\n';
 				break;
 			case 't':
-				trace_seq_putc(s, '\t');
+				text[text_len++] = '\t';
 				break;
 			case 'r':
-				trace_seq_putc(s, '\r');
+				text[text_len++] = '\r';
 				break;
-			case '\\':
-				trace_seq_putc(s, '\\');
+			case 0:
+				ptr--;
 				break;
 			default:
-				trace_seq_putc(s, *ptr);
+				text[text_len++] = *ptr;
 				break;
 			}
+			continue;
+		}
+
+		if (*ptr != '%') {
+			text[text_len++] = *ptr;
+			continue;
+		}
 
-		} else if (*ptr == '%') {
-			saveptr = ptr;
-			show_func = 0;
-			len_as_arg = 0;
+		saveptr = ptr;
+		show_func = 0;
+		nr_len_args = 0;
+		ls = 0;
  cont_process:
-			ptr++;
-			switch (*ptr) {
-			case '%':
-				trace_seq_putc(s, '%');
-				break;
-			case '#':
-				/* FIXME: need to handle properly */
-				goto cont_process;
-			case 'h':
-				ls--;
-				goto cont_process;
-			case 'l':
-				ls++;
-				goto cont_process;
-			case 'L':
+		ptr++;
+		switch (*ptr) {
+		case '%':
+			text[text_len++] = '%';
+			continue;
+		case 'h':
+			ls--;
+			goto cont_process;
+		case 'l':
+			ls++;
+			goto cont_process;
+		case 'L':
+			ls = 2;
+			goto cont_process;
+		case '*':
+			/* The argument is the length. */
+			nr_len_args++;
+			goto cont_process;
+		case 'z':
+		case 'Z':
+			/* size_t is a long, like in make_bprint_args() */
+			ls = 1;
+			goto cont_process;
+		case '#':
+			/* FIXME: need to handle properly */
+		case '.':
+		case '0' ... '9':
+		case '-':
+			goto cont_process;
+		case 'p':
+			if (pevent->long_size == 4)
+				ls = 1;
+			else
 				ls = 2;
-				goto cont_process;
-			case '*':
-				/* The argument is the length. */
-				if (!arg) {
-					do_warning_event(event, "no argument match");
-					event->flags |= EVENT_FL_FAILED;
-					goto out_failed;
-				}
-				len_arg = eval_num_arg(data, size, event, arg);
-				len_as_arg = 1;
-				arg = arg->next;
-				goto cont_process;
-			case '.':
-			case 'z':
-			case 'Z':
-			case '0' ... '9':
-			case '-':
-				goto cont_process;
-			case 'p':
-				if (pevent->long_size == 4)
-					ls = 1;
-				else
-					ls = 2;
-
-				if (*(ptr+1) == 'F' || *(ptr+1) == 'f' ||
-				    *(ptr+1) == 'S' || *(ptr+1) == 's') {
-					ptr++;
-					show_func = *ptr;
-				} else if (*(ptr+1) == 'M' || *(ptr+1) == 'm') {
-					print_mac_arg(s, *(ptr+1), data, size, event, arg);
-					ptr++;
-					arg = arg->next;
-					break;
-				} else if (*(ptr+1) == 'I' || *(ptr+1) == 'i') {
-					int n;
-
-					n = print_ip_arg(s, ptr+1, data, size, event, arg);
-					if (n > 0) {
-						ptr += n;
-						arg = arg->next;
-						break;
-					}
+
+			if (*(ptr+1) == 'F' || *(ptr+1) == 'f' ||
+			    *(ptr+1) == 'S' || *(ptr+1) == 's') {
+				ptr++;
+				show_func = *ptr;
+			} else if (*(ptr+1) == 'M' || *(ptr+1) == 'm') {
+				if (add_text_op(&prog, &size, text, &text_len))
+					goto out_free;
+				op = add_print_op(&prog, &size, PRINT_OP_MAC);
+				if (!op)
+					goto out_free;
+				op->nr_len_args = nr_len_args;
+				ptr++;
+				op->mac = *ptr;
+				continue;
+			} else if ((len = ip_fmt_len(ptr + 1))) {
+				if (add_text_op(&prog, &size, text, &text_len))
+					goto out_free;
+				op = add_print_op(&prog, &size, PRINT_OP_IP);
+				if (!op)
+					goto out_free;
+				op->nr_len_args = nr_len_args;
+				op->text = strndup(ptr + 1, len);
+				if (!op->text)
+					goto out_free;
+				ptr += len;
+				continue;
+			}
+
+			/* fall through */
+		case 'd':
+		case 'i':
+		case 'x':
+		case 'X':
+		case 'u':
+		case 's':
+			if (add_text_op(&prog, &size, text, &text_len))
+				goto out_free;
+			op = add_print_op(&prog, &size,
+					  *ptr == 's' && !show_func ?
+					  PRINT_OP_STR : PRINT_OP_NUM);
+			if (!op)
+				goto out_free;
+			op->nr_len_args = nr_len_args;
+			op->show_func = show_func;
+
+			len = ((unsigned long)ptr + 1) -
+				(unsigned long)saveptr;
+
+			/* should never happen */
+			if (len > 31) {
+				op->bad_format = 1;
+				len = 31;
+			}
+
+			/* Leave room to turn %l into %ll */
+			op->text = malloc(len + 2);
+			if (!op->text)
+				goto out_free;
+			memcpy(op->text, saveptr, len);
+			op->text[len] = 0;
+
+			if (op->type == PRINT_OP_NUM &&
+			    pevent->long_size == 8 && ls == 1 &&
+			    sizeof(long) != 8) {
+				char *p;
+
+				/* make %l into %ll, and %z too */
+				if ((p = strchr(op->text, 'l')))
+					memmove(p+1, p, strlen(p)+1);
+				else if ((p = strchr(op->text, 'z')) ||
+					 (p = strchr(op->text, 'Z'))) {
+					memmove(p+1, p, strlen(p)+1);
+					p[0] = p[1] = 'l';
+				} else if (strcmp(op->text, "%p") == 0) {
+					free(op->text);
+					op->text = strdup("0x%llx");
+					if (!op->text)
+						goto out_free;
 				}
+				ls = 2;
+			}
+			op->ls = ls;
+			continue;
+		case 0:
+			/* A '%' at the end of the format */
+			ptr--;
+			continue;
+		default:
+			text[text_len++] = '>';
+			text[text_len++] = *ptr;
+			text[text_len++] = '<';
+			continue;
+		}
+	}
+
+	if (add_text_op(&prog, &size, text, &text_len))
+		goto out_free;
+
+	free(text);
+
+	return prog;
+
+ out_free:
+	free(text);
+	free_print_prog(prog);
+	return NULL;
+}
+
+static void print_num_op(struct trace_seq *s, struct print_op *op,
+			 struct event_format *event, unsigned long long val,
+			 int len_as_arg, int len_arg)
+{
+	struct func_map *func;
+
+	if (op->show_func) {
+		func = find_func(event->pevent, val);
+		if (func) {
+			trace_seq_puts(s, func->func);
+			if (op->show_func == 'F')
+				trace_seq_printf(s, "+0x%llx", val - func->addr);
+			return;
+		}
+	}
+
+	switch (op->ls) {
+	case -2:
+		if (len_as_arg)
+			trace_seq_printf(s, op->text, len_arg, (char)val);
+		else
+			trace_seq_printf(s, op->text, (char)val);
+		break;
+	case -1:
+		if (len_as_arg)
+			trace_seq_printf(s, op->text, len_arg, (short)val);
+		else
+			trace_seq_printf(s, op->text, (short)val);
+		break;
+	case 0:
+		if (len_as_arg)
+			trace_seq_printf(s, op->text, len_arg, (int)val);
+		else
+			trace_seq_printf(s, op->text, (int)val);
+		break;
+	case 1:
+		if (len_as_arg)
+			trace_seq_printf(s, op->text, len_arg, (long)val);
+		else
+			trace_seq_printf(s, op->text, (long)val);
+		break;
+	case 2:
+		if (len_as_arg)
+			trace_seq_printf(s, op->text, len_arg, (long long)val);
+		else
+			trace_seq_printf(s, op->text, (long long)val);
+		break;
+	default:
+		do_warning_event(event, "bad count (%d)", op->ls);
+		print_failed = 1;
+	}
+}
+
+static void run_print_prog(struct trace_seq *s, void *data, int size,
+			   struct event_format *event, struct print_prog *prog,
+			   struct print_arg *arg)
+{
+	struct print_op *op;
+	struct trace_seq p;
+	const char *no_arg;
+	int len_as_arg;
+	int len_arg = 0;
+	int i, l;
+
+	for (i = 0; i < prog->nr_ops; i++) {
+		op = &prog->ops[i];
+
+		if (op->type == PRINT_OP_TEXT) {
+			trace_seq_puts(s, op->text);
+			continue;
+		}
+
+		len_as_arg = 0;
+		for (l = 0; l < op->nr_len_args; l++) {
+			if (!arg) {
+				no_arg = "no argument match";
+				goto out_failed;
+			}
+			len_arg = eval_num_arg(data, size, event, arg);
+			len_as_arg = 1;
+			arg = arg->next;
+		}
+
+		if (!arg) {
+			if (op->type == PRINT_OP_STR)
+				no_arg = "no matching argument";
+			else
+				no_arg = "no argument match";
+			goto out_failed;
+		}
+
+		if (op->bad_format) {
+			do_warning_event(event, "bad format!");
+			print_failed = 1;
+		}
+
+		switch (op->type) {
+		case PRINT_OP_MAC:
+			print_mac_arg(s, op->mac, data, size, event, arg);
+			break;
+		case PRINT_OP_IP:
+			print_ip_arg(s, op->text, data, size, event, arg);
+			break;
+		case PRINT_OP_NUM:
+			print_num_op(s, op, event,
+				     eval_num_arg(data, size, event, arg),
+				     len_as_arg, len_arg);
+			break;
+		case PRINT_OP_STR:
+			if (!len_as_arg)
+				len_arg = -1;
+			/* Use helper trace_seq */
+			trace_seq_init(&p);
+			print_str_arg(&p, data, size, event,
+				      op->text, len_arg, arg);
+			trace_seq_terminate(&p);
+			trace_seq_puts(s, p.buffer);
+			trace_seq_destroy(&p);
+			break;
+		default:
+			break;
+		}
+		arg = arg->next;
+	}
+
+	if (print_failed)
+		trace_seq_printf(s, "[FAILED TO PARSE]");
+	return;
+
+ out_failed:
+	do_warning_event(event, "%s", no_arg);
+	print_failed = 1;
+	trace_seq_printf(s, "[FAILED TO PARSE]");
+}
+
+/*
+ * The binary printk formats are compiled as they are found, and kept
+ * in a hash indexed by the address of the format. Entries are never
+ * removed, so readers walk the buckets without taking the lock.
+ */
+#define BPRINT_CACHE_BITS	8
+#define BPRINT_CACHE_SIZE	(1 << BPRINT_CACHE_BITS)
+
+struct bprint_cache_entry {
+	struct bprint_cache_entry	*next;
+	unsigned long long		addr;
+	char				*format;
+	struct print_prog		*prog;
+};
+
+struct bprint_cache {
+	struct bprint_cache_entry	*buckets[BPRINT_CACHE_SIZE];
+};
+
+static void free_bprint_cache(struct pevent *pevent)
+{
+	struct bprint_cache *cache = pevent->bprint_cache;
+	struct bprint_cache_entry *entry;
+	int i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < BPRINT_CACHE_SIZE; i++) {
+		while ((entry = cache->buckets[i])) {
+			cache->buckets[i] = entry->next;
+			free(entry->format);
+			free_print_prog(entry->prog);
+			free(entry);
+		}
+	}
+	free(cache);
+	pevent->bprint_cache = NULL;
+}
+
+static struct bprint_cache_entry *
+find_bprint_entry(struct bprint_cache_entry **bucket, unsigned long long addr)
+{
+	struct bprint_cache_entry *entry;
+
+	for (entry = __atomic_load_n(bucket, __ATOMIC_ACQUIRE); entry;
+	     entry = entry->next) {
+		if (entry->addr == addr)
+			return entry;
+	}
+	return NULL;
+}
+
+static struct bprint_cache_entry *
+add_bprint_entry(struct event_format *event, struct bprint_cache_entry **bucket,
+		 unsigned long long addr, struct printk_map *printk)
+{
+	struct bprint_cache_entry *entry;
+	char *format;
 
-				/* fall through */
-			case 'd':
-			case 'i':
-			case 'x':
-			case 'X':
-			case 'u':
-				if (!arg) {
-					do_warning_event(event, "no argument match");
-					event->flags |= EVENT_FL_FAILED;
-					goto out_failed;
-				}
+	if (!printk) {
+		if (asprintf(&format, "%%pf: (NO FORMAT FOUND at %llx)\n", addr) < 0)
+			return NULL;
+	} else if (asprintf(&format, "%s: %s", "%pf", printk->printk) < 0)
+		return NULL;
 
-				len = ((unsigned long)ptr + 1) -
-					(unsigned long)saveptr;
+	entry = malloc(sizeof(*entry));
+	if (!entry) {
+		free(format);
+		return NULL;
+	}
 
-				/* should never happen */
-				if (len > 31) {
-					do_warning_event(event, "bad format!");
-					event->flags |= EVENT_FL_FAILED;
-					len = 31;
-				}
+	entry->addr = addr;
+	entry->format = format;
+	entry->prog = compile_print_fmt(event, format);
+	if (!entry->prog) {
+		free(format);
+		free(entry);
+		return NULL;
+	}
 
-				memcpy(format, saveptr, len);
-				format[len] = 0;
-
-				val = eval_num_arg(data, size, event, arg);
-				arg = arg->next;
-
-				if (show_func) {
-					func = find_func(pevent, val);
-					if (func) {
-						trace_seq_puts(s, func->func);
-						if (show_func == 'F')
-							trace_seq_printf(s,
-							       "+0x%llx",
-							       val - func->addr);
-						break;
-					}
-				}
-				if (pevent->long_size == 8 && ls == 1 &&
-				    sizeof(long) != 8) {
-					char *p;
-
-					/* make %l into %ll */
-					if (ls == 1 && (p = strchr(format, 'l')))
-						memmove(p+1, p, strlen(p)+1);
-					else if (strcmp(format, "%p") == 0)
-						strcpy(format, "0x%llx");
-					ls = 2;
-				}
-				switch (ls) {
-				case -2:
-					if (len_as_arg)
-						trace_seq_printf(s, format, len_arg, (char)val);
-					else
-						trace_seq_printf(s, format, (char)val);
-					break;
-				case -1:
-					if (len_as_arg)
-						trace_seq_printf(s, format, len_arg, (short)val);
-					else
-						trace_seq_printf(s, format, (short)val);
-					break;
-				case 0:
-					if (len_as_arg)
-						trace_seq_printf(s, format, len_arg, (int)val);
-					else
-						trace_seq_printf(s, format, (int)val);
-					break;
-				case 1:
-					if (len_as_arg)
-						trace_seq_printf(s, format, len_arg, (long)val);
-					else
-						trace_seq_printf(s, format, (long)val);
-					break;
-				case 2:
-					if (len_as_arg)
-						trace_seq_printf(s, format, len_arg,
-								 (long long)val);
-					else
-						trace_seq_printf(s, format, (long long)val);
-					break;
-				default:
-					do_warning_event(event, "bad count (%d)", ls);
-					event->flags |= EVENT_FL_FAILED;
-				}
-				break;
-			case 's':
-				if (!arg) {
-					do_warning_event(event, "no matching argument");
-					event->flags |= EVENT_FL_FAILED;
-					goto out_failed;
-				}
+	entry->next = *bucket;
+	__atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
 
-				len = ((unsigned long)ptr + 1) -
-					(unsigned long)saveptr;
+	return entry;
+}
 
-				/* should never happen */
-				if (len > 31) {
-					do_warning_event(event, "bad format!");
-					event->flags |= EVENT_FL_FAILED;
-					len = 31;
-				}
+static struct bprint_cache_entry *
+get_bprint_entry(void *data, int size __maybe_unused,
+		 struct event_format *event)
+{
+	struct pevent *pevent = event->pevent;
+	struct bprint_cache_entry **bucket;
+	struct bprint_cache_entry *entry;
+	struct bprint_cache *cache;
+	struct printk_map *printk;
+	unsigned long long addr;
+	struct format_field *field;
 
-				memcpy(format, saveptr, len);
-				format[len] = 0;
-				if (!len_as_arg)
-					len_arg = -1;
-				/* Use helper trace_seq */
-				trace_seq_init(&p);
-				print_str_arg(&p, data, size, event,
-					      format, len_arg, arg);
-				trace_seq_terminate(&p);
-				trace_seq_puts(s, p.buffer);
-				trace_seq_destroy(&p);
-				arg = arg->next;
-				break;
-			default:
-				trace_seq_printf(s, ">%c<", *ptr);
+	if (bprint_fields_setup(event))
+		return NULL;
 
-			}
-		} else
-			trace_seq_putc(s, *ptr);
+	field = pevent->bprint_fmt_field;
+	addr = pevent_read_number(pevent, data + field->offset, field->size);
+
+	cache = __atomic_load_n(&pevent->bprint_cache, __ATOMIC_ACQUIRE);
+	if (!cache) {
+		pthread_mutex_lock(&pevent->lock);
+		cache = pevent->bprint_cache;
+		if (!cache) {
+			cache = calloc(1, sizeof(*cache));
+			__atomic_store_n(&pevent->bprint_cache, cache,
+					 __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&pevent->lock);
+		if (!cache)
+			return NULL;
 	}
 
-	if (event->flags & EVENT_FL_FAILED) {
-out_failed:
+	/* The formats are strings, the low bits are the most random */
+	bucket = &cache->buckets[(addr ^ (addr >> BPRINT_CACHE_BITS)) &
+				 (BPRINT_CACHE_SIZE - 1)];
+
+	entry = find_bprint_entry(bucket, addr);
+	if (entry)
+		return entry;
+
+	/* This may build the printk map, which takes the lock itself */
+	printk = find_printk(pevent, addr);
+
+	pthread_mutex_lock(&pevent->lock);
+	entry = find_bprint_entry(bucket, addr);
+	if (!entry)
+		entry = add_bprint_entry(event, bucket, addr, printk);
+	pthread_mutex_unlock(&pevent->lock);
+
+	return entry;
+}
+
+static enum pevent_print_status
+pretty_print(struct trace_seq *s, void *data, int size, struct event_format *event)
+{
+	struct print_fmt *print_fmt = &event->print_fmt;
+	struct bprint_cache_entry *entry;
+	struct print_prog *prog;
+	struct print_arg *args;
+
+	/* The thread that prints in order may mark the event as failed */
+	if (__atomic_load_n(&event->flags, __ATOMIC_RELAXED) & EVENT_FL_FAILED) {
 		trace_seq_printf(s, "[FAILED TO PARSE]");
+		pevent_print_fields(s, data, size, event);
+		return PEVENT_PRINT_FIELDS;
 	}
 
-	if (args) {
+	print_failed = 0;
+
+	if (event->flags & EVENT_FL_ISBPRINT) {
+		entry = get_bprint_entry(data, size, event);
+		if (!entry) {
+			trace_seq_printf(s, "[FAILED TO PARSE]");
+			return PEVENT_PRINT_DATA;
+		}
+		args = make_bprint_args(entry->format, data, size, event);
+		run_print_prog(s, data, size, event, entry->prog, args);
 		free_args(args);
-		free(bprint_fmt);
+		goto out;
+	}
+
+	prog = __atomic_load_n(&print_fmt->prog, __ATOMIC_ACQUIRE);
+	if (!prog) {
+		struct print_prog *old = NULL;
+
+		prog = compile_print_fmt(event, print_fmt->format);
+		if (!prog) {
+			trace_seq_printf(s, "[FAILED TO PARSE]");
+			return PEVENT_PRINT_DATA;
+		}
+		/* Another reader may have compiled it at the same time */
+		if (!__atomic_compare_exchange_n(&print_fmt->prog, &old, prog,
+						 0, __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE)) {
+			free_print_prog(prog);
+			prog = old;
+		}
 	}
+
+	run_print_prog(s, data, size, event, prog, print_fmt->args);
+ out:
+	return print_failed ? PEVENT_PRINT_FAILED : PEVENT_PRINT_DATA;
 }
 
 /**
@@ -5094,10 +6319,10 @@ out_failed:
 void pevent_data_lat_fmt(struct pevent *pevent,
 			 struct trace_seq *s, struct pevent_record *record)
 {
-	static int check_lock_depth = 1;
-	static int check_migrate_disable = 1;
-	static int lock_depth_exists;
-	static int migrate_disable_exists;
+	static __thread int check_lock_depth = 1;
+	static __thread int check_migrate_disable = 1;
+	static __thread int lock_depth_exists;
+	static __thread int migrate_disable_exists;
 	unsigned int lat_flags;
 	unsigned int pc;
 	int lock_depth;
@@ -5242,20 +6467,34 @@ const char *pevent_data_comm_from_pid(struct pevent *pevent, int pid)
 	return comm;
 }
 
-static struct cmdline *
-pid_from_cmdlist(struct pevent *pevent, const char *comm, struct cmdline *next)
+/**
+ * pevent_data_comm_from_pid_ts - return the command line of PID at a time
+ * @pevent: a handle to the pevent
+ * @pid: the PID of the task to search for
+ * @ts: the time stamp to get the command line for
+ *
+ * This returns a pointer to the command line that the task with
+ * @pid had at @ts, taking the renames registered with
+ * pevent_register_comm_ts() into account.
+ */
+const char *pevent_data_comm_from_pid_ts(struct pevent *pevent, int pid,
+					 unsigned long long ts)
 {
-	struct cmdline_list *cmdlist = (struct cmdline_list *)next;
+	return find_cmdline_ts(pevent, pid, ts);
+}
 
-	if (cmdlist)
-		cmdlist = cmdlist->next;
-	else
-		cmdlist = pevent->cmdlist;
+static int cmdline_has_comm(struct cmdline *cmdline, const char *comm)
+{
+	struct cmdline_rename *rename;
 
-	while (cmdlist && strcmp(cmdlist->comm, comm) != 0)
-		cmdlist = cmdlist->next;
+	if (cmdline->comm == comm)
+		return 1;
 
-	return (struct cmdline *)cmdlist;
+	for (rename = cmdline->renames; rename; rename = rename->next) {
+		if (rename->comm == comm)
+			return 1;
+	}
+	return 0;
 }
 
 /**
@@ -5268,42 +6507,46 @@ pid_from_cmdlist(struct pevent *pevent, const char *comm, struct cmdline *next)
  * comm, or NULL if none found. As there may be more than one pid for
  * a given comm, the result of this call can be passed back into
  * a recurring call in the @next paramater, and then it will find the
- * next pid.
- * Also, it does a linear seach, so it may be slow.
+ * next pid. A pid matches if it had @comm at any time.
+ * Also, it does a linear seach, so it may be slow. Registering new
+ * comms between calls may restart the search.
  */
 struct cmdline *pevent_data_pid_from_comm(struct pevent *pevent, const char *comm,
 					  struct cmdline *next)
 {
-	struct cmdline *cmdline;
+	struct cmdline *cmdline = NULL;
+	struct cmdline *end;
+	char **slot;
 
-	/*
-	 * If the cmdlines have not been converted yet, then use
-	 * the list.
-	 */
-	if (!pevent->cmdlines)
-		return pid_from_cmdlist(pevent, comm, next);
+	pthread_rwlock_rdlock(&pevent->cmdline_lock);
 
-	if (next) {
-		/*
-		 * The next pointer could have been still from
-		 * a previous call before cmdlines were created
-		 */
-		if (next < pevent->cmdlines ||
-		    next >= pevent->cmdlines + pevent->cmdline_count)
-			next = NULL;
-		else
-			cmdline  = next++;
-	}
+	if (!pevent->comm_count)
+		goto out;
+
+	/* Only interned strings can match */
+	slot = find_comm_slot(pevent, comm);
+	if (!*slot)
+		goto out;
 
-	if (!next)
+	end = pevent->cmdlines + pevent->cmdline_size;
+
+	/*
+	 * The next pointer could be from before the table
+	 * was last grown, start over if so.
+	 */
+	if (next && next >= pevent->cmdlines && next < end)
+		cmdline = next + 1;
+	else
 		cmdline = pevent->cmdlines;
 
-	while (cmdline < pevent->cmdlines + pevent->cmdline_count) {
-		if (strcmp(cmdline->comm, comm) == 0)
-			return cmdline;
-		cmdline++;
+	for (; cmdline < end; cmdline++) {
+		if (cmdline->comm && cmdline_has_comm(cmdline, *slot))
+			goto out;
 	}
-	return NULL;
+	cmdline = NULL;
+ out:
+	pthread_rwlock_unlock(&pevent->cmdline_lock);
+	return cmdline;
 }
 
 /**
@@ -5315,50 +6558,53 @@ struct cmdline *pevent_data_pid_from_comm(struct pevent *pevent, const char *com
  */
 int pevent_cmdline_pid(struct pevent *pevent, struct cmdline *cmdline)
 {
-	struct cmdline_list *cmdlist = (struct cmdline_list *)cmdline;
-
 	if (!cmdline)
 		return -1;
 
-	/*
-	 * If cmdlines have not been created yet, or cmdline is
-	 * not part of the array, then treat it as a cmdlist instead.
-	 */
-	if (!pevent->cmdlines ||
-	    cmdline < pevent->cmdlines ||
-	    cmdline >= pevent->cmdlines + pevent->cmdline_count)
-		return cmdlist->pid;
-
 	return cmdline->pid;
 }
 
-/**
- * pevent_data_comm_from_pid - parse the data into the print format
- * @s: the trace_seq to write to
- * @event: the handle to the event
- * @record: the record to read from
- *
- * This parses the raw @data using the given @event information and
- * writes the print format into the trace_seq.
- */
-void pevent_event_info(struct trace_seq *s, struct event_format *event,
-		       struct pevent_record *record)
+static enum pevent_print_status
+event_info(struct trace_seq *s, struct event_format *event,
+	   struct pevent_record *record)
 {
+	int flags = __atomic_load_n(&event->flags, __ATOMIC_RELAXED);
+	enum pevent_print_status status = PEVENT_PRINT_DATA;
 	int print_pretty = 1;
 
-	if (event->pevent->print_raw || (event->flags & EVENT_FL_PRINTRAW))
+	if (event->pevent->print_raw || (flags & EVENT_FL_PRINTRAW))
 		pevent_print_fields(s, record->data, record->size, event);
 	else {
 
-		if (event->handler && !(event->flags & EVENT_FL_NOHANDLE))
+		if (event->handler && !(flags & EVENT_FL_NOHANDLE))
 			print_pretty = event->handler(s, record, event,
 						      event->context);
 
 		if (print_pretty)
-			pretty_print(s, record->data, record->size, event);
+			status = pretty_print(s, record->data, record->size,
+					      event);
 	}
 
 	trace_seq_terminate(s);
+	return status;
+}
+
+/**
+ * pevent_data_comm_from_pid - parse the data into the print format
+ * @s: the trace_seq to write to
+ * @event: the handle to the event
+ * @record: the record to read from
+ *
+ * This parses the raw @data using the given @event information and
+ * writes the print format into the trace_seq.
+ */
+void pevent_event_info(struct trace_seq *s, struct event_format *event,
+		       struct pevent_record *record)
+{
+	/* The records after the one that failed print their fields */
+	if (event_info(s, event, record) == PEVENT_PRINT_FAILED)
+		__atomic_fetch_or(&event->flags, EVENT_FL_FAILED,
+				  __ATOMIC_RELAXED);
 }
 
 static bool is_timestamp_in_us(char *trace_clock, bool use_trace_clock)
@@ -5415,7 +6661,7 @@ void pevent_print_event_task(struct pevent *pevent, struct trace_seq *s,
 	int pid;
 
 	pid = parse_common_pid(pevent, data);
-	comm = find_cmdline(pevent, pid);
+	comm = find_cmdline_ts(pevent, pid, record->ts);
 
 	if (pevent->latency_format) {
 		trace_seq_printf(s, "%8.8s-%-5d %3d",
@@ -5487,6 +6733,32 @@ void pevent_print_event_time(struct pevent *pevent, struct trace_seq *s,
 void pevent_print_event_data(struct pevent *pevent, struct trace_seq *s,
 			     struct event_format *event,
 			     struct pevent_record *record)
+{
+	if (pevent_try_print_event_data(pevent, s, event, record) ==
+	    PEVENT_PRINT_FAILED)
+		__atomic_fetch_or(&event->flags, EVENT_FL_FAILED,
+				  __ATOMIC_RELAXED);
+}
+
+/**
+ * pevent_try_print_event_data - Write the event data section, as is
+ * @pevent: a handle to the pevent
+ * @s: the trace_seq to write to
+ * @event: the handle to the record's event
+ * @record: The record to get the event from
+ *
+ * Like pevent_print_event_data(), but if printing the data fails,
+ * @event is not marked as failed. That is for the caller to do, with
+ * EVENT_FL_FAILED, when the records are printed by several threads and
+ * only the one that has them in order knows which failed first.
+ *
+ * Returns what was written: the data, the data up to where it failed,
+ * or the fields of an event that was marked as failed before.
+ */
+enum pevent_print_status
+pevent_try_print_event_data(struct pevent *pevent, struct trace_seq *s,
+			    struct event_format *event,
+			    struct pevent_record *record)
 {
 	static const char *spaces = "                    "; /* 20 spaces */
 	int len;
@@ -5498,7 +6770,7 @@ void pevent_print_event_data(struct pevent *pevent, struct trace_seq *s,
 	if (len < 20)
 		trace_seq_printf(s, "%.*s", 20 - len, spaces);
 
-	pevent_event_info(s, event, record);
+	return event_info(s, event, record);
 }
 
 void pevent_print_event(struct pevent *pevent, struct trace_seq *s,
@@ -5765,7 +7037,7 @@ static void print_args(struct print_arg *args)
 	}
 }
 
-static void parse_header_field(const char *field,
+static void parse_header_field(struct parse_ctx *ctx, const char *field,
 			       int *offset, int *size, int mandatory)
 {
 	unsigned long long save_input_buf_ptr;
@@ -5773,16 +7045,16 @@ static void parse_header_field(const char *field,
 	char *token;
 	int type;
 
-	save_input_buf_ptr = input_buf_ptr;
-	save_input_buf_siz = input_buf_siz;
+	save_input_buf_ptr = ctx->input_buf_ptr;
+	save_input_buf_siz = ctx->input_buf_siz;
 
-	if (read_expected(EVENT_ITEM, "field") < 0)
+	if (read_expected(ctx, EVENT_ITEM, "field") < 0)
 		return;
-	if (read_expected(EVENT_OP, ":") < 0)
+	if (read_expected(ctx, EVENT_OP, ":") < 0)
 		return;
 
 	/* type */
-	if (read_expect_type(EVENT_ITEM, &token) < 0)
+	if (read_expect_type(ctx, EVENT_ITEM, &token) < 0)
 		goto fail;
 	free_token(token);
 
@@ -5790,39 +7062,39 @@ static void parse_header_field(const char *field,
 	 * If this is not a mandatory field, then test it first.
 	 */
 	if (mandatory) {
-		if (read_expected(EVENT_ITEM, field) < 0)
+		if (read_expected(ctx, EVENT_ITEM, field) < 0)
 			return;
 	} else {
-		if (read_expect_type(EVENT_ITEM, &token) < 0)
+		if (read_expect_type(ctx, EVENT_ITEM, &token) < 0)
 			goto fail;
 		if (strcmp(token, field) != 0)
 			goto discard;
 		free_token(token);
 	}
 
-	if (read_expected(EVENT_OP, ";") < 0)
+	if (read_expected(ctx, EVENT_OP, ";") < 0)
 		return;
-	if (read_expected(EVENT_ITEM, "offset") < 0)
+	if (read_expected(ctx, EVENT_ITEM, "offset") < 0)
 		return;
-	if (read_expected(EVENT_OP, ":") < 0)
+	if (read_expected(ctx, EVENT_OP, ":") < 0)
 		return;
-	if (read_expect_type(EVENT_ITEM, &token) < 0)
+	if (read_expect_type(ctx, EVENT_ITEM, &token) < 0)
 		goto fail;
 	*offset = atoi(token);
 	free_token(token);
-	if (read_expected(EVENT_OP, ";") < 0)
+	if (read_expected(ctx, EVENT_OP, ";") < 0)
 		return;
-	if (read_expected(EVENT_ITEM, "size") < 0)
+	if (read_expected(ctx, EVENT_ITEM, "size") < 0)
 		return;
-	if (read_expected(EVENT_OP, ":") < 0)
+	if (read_expected(ctx, EVENT_OP, ":") < 0)
 		return;
-	if (read_expect_type(EVENT_ITEM, &token) < 0)
+	if (read_expect_type(ctx, EVENT_ITEM, &token) < 0)
 		goto fail;
 	*size = atoi(token);
 	free_token(token);
-	if (read_expected(EVENT_OP, ";") < 0)
+	if (read_expected(ctx, EVENT_OP, ";") < 0)
 		return;
-	type = read_token(&token);
+	type = read_token(ctx, &token);
 	if (type != EVENT_NEWLINE) {
 		/* newer versions of the kernel have a "signed" type */
 		if (type != EVENT_ITEM)
@@ -5833,17 +7105,17 @@ static void parse_header_field(const char *field,
 
 		free_token(token);
 
-		if (read_expected(EVENT_OP, ":") < 0)
+		if (read_expected(ctx, EVENT_OP, ":") < 0)
 			return;
 
-		if (read_expect_type(EVENT_ITEM, &token))
+		if (read_expect_type(ctx, EVENT_ITEM, &token))
 			goto fail;
 
 		free_token(token);
-		if (read_expected(EVENT_OP, ";") < 0)
+		if (read_expected(ctx, EVENT_OP, ";") < 0)
 			return;
 
-		if (read_expect_type(EVENT_NEWLINE, &token))
+		if (read_expect_type(ctx, EVENT_NEWLINE, &token))
 			goto fail;
 	}
  fail:
@@ -5851,8 +7123,8 @@ static void parse_header_field(const char *field,
 	return;
 
  discard:
-	input_buf_ptr = save_input_buf_ptr;
-	input_buf_siz = save_input_buf_siz;
+	ctx->input_buf_ptr = save_input_buf_ptr;
+	ctx->input_buf_siz = save_input_buf_siz;
 	*offset = 0;
 	*size = 0;
 	free_token(token);
@@ -5873,6 +7145,8 @@ static void parse_header_field(const char *field,
 int pevent_parse_header_page(struct pevent *pevent, char *buf, unsigned long size,
 			     int long_size)
 {
+	struct parse_ctx parse;
+	struct parse_ctx *ctx = &parse;
 	int ignore;
 
 	if (!size) {
@@ -5886,15 +7160,15 @@ int pevent_parse_header_page(struct pevent *pevent, char *buf, unsigned long siz
 		pevent->old_format = 1;
 		return -1;
 	}
-	init_input_buf(buf, size);
+	init_input_buf(ctx, buf, size);
 
-	parse_header_field("timestamp", &pevent->header_page_ts_offset,
+	parse_header_field(ctx, "timestamp", &pevent->header_page_ts_offset,
 			   &pevent->header_page_ts_size, 1);
-	parse_header_field("commit", &pevent->header_page_size_offset,
+	parse_header_field(ctx, "commit", &pevent->header_page_size_offset,
 			   &pevent->header_page_size_size, 1);
-	parse_header_field("overwrite", &pevent->header_page_overwrite,
+	parse_header_field(ctx, "overwrite", &pevent->header_page_overwrite,
 			   &ignore, 0);
-	parse_header_field("data", &pevent->header_page_data_offset,
+	parse_header_field(ctx, "data", &pevent->header_page_data_offset,
 			   &pevent->header_page_data_size, 1);
 
 	return 0;
@@ -5923,22 +7197,47 @@ static void free_handler(struct event_handler *handle)
 	free(handle);
 }
 
-static int find_event_handle(struct pevent *pevent, struct event_format *event)
+static struct event_handler **
+event_handle_slot(struct pevent *pevent, struct event_format *event)
 {
-	struct event_handler *handle, **next;
+	struct event_handler **next;
 
-	for (next = &pevent->handlers; *next;
-	     next = &(*next)->next) {
-		handle = *next;
-		if (event_matches(event, handle->id,
-				  handle->sys_name,
-				  handle->event_name))
+	for (next = &pevent->handlers; *next; next = &(*next)->next) {
+		if (event_matches(event, (*next)->id, (*next)->sys_name,
+				  (*next)->event_name))
 			break;
 	}
 
+	return next;
+}
+
+/*
+ * Formats may be parsed by several threads at once, but the handlers
+ * are only attached once they are all parsed. So while parsing, this
+ * only checks if a handler is waiting for the event.
+ */
+static int has_event_handle(struct pevent *pevent, struct event_format *event)
+{
+	int ret;
+
+	pthread_mutex_lock(&pevent->lock);
+	ret = *event_handle_slot(pevent, event) != NULL;
+	pthread_mutex_unlock(&pevent->lock);
+
+	return ret;
+}
+
+/* Called with pevent->lock held */
+static int find_event_handle(struct pevent *pevent, struct event_format *event)
+{
+	struct event_handler *handle, **next;
+
+	next = event_handle_slot(pevent, event);
 	if (!(*next))
 		return 0;
 
+	handle = *next;
+
 	pr_stat("overriding event (%d) %s:%s with new print handler",
 		event->id, event->system, event->name);
 
@@ -5968,16 +7267,18 @@ enum pevent_errno __pevent_parse_format(struct event_format **eventp,
 					struct pevent *pevent, const char *buf,
 					unsigned long size, const char *sys)
 {
+	struct parse_ctx parse;
+	struct parse_ctx *ctx = &parse;
 	struct event_format *event;
 	int ret;
 
-	init_input_buf(buf, size);
+	init_input_buf(ctx, buf, size);
 
 	*eventp = event = alloc_event();
 	if (!event)
 		return PEVENT_ERRNO__MEM_ALLOC_FAILED;
 
-	event->name = event_read_name();
+	event->name = event_read_name(ctx);
 	if (!event->name) {
 		/* Bad event? */
 		ret = PEVENT_ERRNO__MEM_ALLOC_FAILED;
@@ -5991,7 +7292,7 @@ enum pevent_errno __pevent_parse_format(struct event_format **eventp,
 			event->flags |= EVENT_FL_ISBPRINT;
 	}
 		
-	event->id = event_read_id();
+	event->id = event_read_id(ctx);
 	if (event->id < 0) {
 		ret = PEVENT_ERRNO__READ_ID_FAILED;
 		/*
@@ -6010,7 +7311,7 @@ enum pevent_errno __pevent_parse_format(struct event_format **eventp,
 	/* Add pevent to event so that it can be referenced */
 	event->pevent = pevent;
 
-	ret = event_read_format(event);
+	ret = event_read_format(ctx, event);
 	if (ret < 0) {
 		ret = PEVENT_ERRNO__READ_FORMAT_FAILED;
 		goto event_parse_failed;
@@ -6020,10 +7321,10 @@ enum pevent_errno __pevent_parse_format(struct event_format **eventp,
 	 * If the event has an override, don't print warnings if the event
 	 * print format fails to parse.
 	 */
-	if (pevent && find_event_handle(pevent, event))
+	if (pevent && has_event_handle(pevent, event))
 		show_warning = 0;
 
-	ret = event_read_print(event);
+	ret = event_read_print(ctx, event);
 	show_warning = 1;
 
 	if (ret < 0) {
@@ -6031,6 +7332,8 @@ enum pevent_errno __pevent_parse_format(struct event_format **eventp,
 		goto event_parse_failed;
 	}
 
+	resolve_print_args(event, event->print_fmt.args);
+
 	if (!ret && (event->flags & EVENT_FL_ISFTRACE)) {
 		struct format_field *field;
 		struct print_arg *arg, **list;
@@ -6071,6 +7374,35 @@ enum pevent_errno __pevent_parse_format(struct event_format **eventp,
 	return ret;
 }
 
+static enum pevent_errno
+register_parsed_event(struct pevent *pevent, struct event_format *event)
+{
+	int ret;
+
+	if (pevent) {
+		/*
+		 * Only the adding is serialized, the parsing runs in
+		 * parallel. The events are added in the order of their
+		 * formats, and take the handlers registered for them in
+		 * that order too.
+		 */
+		pthread_mutex_lock(&pevent->lock);
+		find_event_handle(pevent, event);
+		ret = add_event(pevent, event);
+		pthread_mutex_unlock(&pevent->lock);
+		if (ret) {
+			pevent_free_format(event);
+			return PEVENT_ERRNO__MEM_ALLOC_FAILED;
+		}
+	}
+
+#define PRINT_ARGS 0
+	if (PRINT_ARGS && event->print_fmt.args)
+		print_args(event->print_fmt.args);
+
+	return 0;
+}
+
 static enum pevent_errno
 __pevent_parse_event(struct pevent *pevent,
 		     struct event_format **eventp,
@@ -6083,20 +7415,7 @@ __pevent_parse_event(struct pevent *pevent,
 	if (event == NULL)
 		return ret;
 
-	if (pevent && add_event(pevent, event)) {
-		ret = PEVENT_ERRNO__MEM_ALLOC_FAILED;
-		goto event_add_failed;
-	}
-
-#define PRINT_ARGS 0
-	if (PRINT_ARGS && event->print_fmt.args)
-		print_args(event->print_fmt.args);
-
-	return 0;
-
-event_add_failed:
-	pevent_free_format(event);
-	return ret;
+	return register_parsed_event(pevent, event);
 }
 
 /**
@@ -6143,6 +7462,118 @@ enum pevent_errno pevent_parse_event(struct pevent *pevent, const char *buf,
 	return __pevent_parse_event(pevent, &event, buf, size, sys);
 }
 
+/* Do not bother starting a thread for less than this many formats */
+#define FORMATS_PER_THREAD	64
+
+struct parse_events_work {
+	struct pevent			*pevent;
+	struct pevent_format_buf	*formats;
+	int				nr_formats;
+	int				next;
+	pevent_format_load_func		load;
+	void				*context;
+};
+
+static void *parse_events_worker(void *data)
+{
+	struct parse_events_work *work = data;
+	struct pevent_format_buf *format;
+	int i;
+
+	for (;;) {
+		i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+		if (i >= work->nr_formats)
+			break;
+
+		format = &work->formats[i];
+		format->event = NULL;
+
+		if (work->load && work->load(format, work->context) < 0) {
+			format->ret = PEVENT_ERRNO__READ_FORMAT_FAILED;
+			continue;
+		}
+
+		format->ret = __pevent_parse_format(&format->event, work->pevent,
+						    format->buf, format->size,
+						    format->sys);
+	}
+
+	return NULL;
+}
+
+/**
+ * pevent_parse_events - parse a set of event formats in parallel
+ * @pevent: the handle to the pevent
+ * @formats: the formats to parse
+ * @nr_formats: the number of entries in @formats
+ * @nr_threads: the number of threads to parse with, 0 for one per CPU
+ * @load: if not NULL, called by the parsing thread to fill in the
+ *        buf and size of a format before it is parsed
+ * @context: passed to @load
+ *
+ * This does what calling pevent_parse_event() on each of the @formats
+ * would do, but spreads the parsing over a pool of threads. The events
+ * are only added to @pevent once all of them are parsed, and they are
+ * added in the order of @formats, so the result does not depend on
+ * how the work was scheduled.
+ *
+ * If @load returns a negative value, that format is skipped.
+ *
+ * The result of each format is stored in its ret field. Returns the
+ * number of formats that failed.
+ */
+int pevent_parse_events(struct pevent *pevent,
+			struct pevent_format_buf *formats, int nr_formats,
+			int nr_threads, pevent_format_load_func load,
+			void *context)
+{
+	struct parse_events_work work;
+	pthread_t *threads = NULL;
+	int started = 0;
+	int failed = 0;
+	int i;
+
+	if (nr_threads <= 0)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > nr_formats / FORMATS_PER_THREAD)
+		nr_threads = nr_formats / FORMATS_PER_THREAD;
+
+	work.pevent = pevent;
+	work.formats = formats;
+	work.nr_formats = nr_formats;
+	work.next = 0;
+	work.load = load;
+	work.context = context;
+
+	/* The calling thread is one of the workers */
+	if (nr_threads > 1)
+		threads = malloc(sizeof(*threads) * (nr_threads - 1));
+	if (threads) {
+		for (i = 0; i < nr_threads - 1; i++) {
+			if (pthread_create(&threads[started], NULL,
+					   parse_events_worker, &work))
+				break;
+			started++;
+		}
+	}
+
+	parse_events_worker(&work);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < nr_formats; i++) {
+		if (formats[i].event)
+			formats[i].ret = register_parsed_event(pevent,
+							       formats[i].event);
+		if (formats[i].ret)
+			failed++;
+	}
+
+	return failed;
+}
+
 #undef _PE
 #define _PE(code, str) str
 static const char * const pevent_error_str[] = {
@@ -6321,6 +7752,41 @@ int pevent_get_any_field_val(struct trace_seq *s, struct event_format *event,
 	return get_field_val(s, field, name, record, val, err);
 }
 
+/**
+ * pevent_get_accessor_val - return the value of a resolved field
+ * @s: The seq to print to on error, or NULL
+ * @acc: the field, from pevent_field_accessor_find()
+ * @name: The name of the field, for the error
+ * @record: The record with the field.
+ * @val: place to store the value of the field.
+ * @err: print default error if failed.
+ *
+ * Like pevent_get_field_val(), for a handler that finds its fields
+ * once instead of on every record.
+ *
+ * Returns 0 on success -1 on field not found.
+ */
+int pevent_get_accessor_val(struct trace_seq *s,
+			    const struct pevent_field_accessor *acc,
+			    const char *name, struct pevent_record *record,
+			    unsigned long long *val, int err)
+{
+	if (!acc->field) {
+		if (err && s)
+			trace_seq_printf(s, "<CANT FIND FIELD %s>", name);
+		return -1;
+	}
+
+	if (acc->read == read_none) {
+		if (err && s)
+			trace_seq_printf(s, " %s=INVALID", name);
+		return -1;
+	}
+
+	*val = pevent_field_read(acc, record->data);
+	return 0;
+}
+
 /**
  * pevent_print_num_field - print a field and a format
  * @s: The seq to print to
@@ -6607,9 +8073,12 @@ int pevent_register_event_handler(struct pevent *pevent, int id,
 	}
 
 	handle->func = func;
+	handle->context = context;
+
+	pthread_mutex_lock(&pevent->lock);
 	handle->next = pevent->handlers;
 	pevent->handlers = handle;
-	handle->context = context;
+	pthread_mutex_unlock(&pevent->lock);
 
 	return -1;
 }
@@ -6694,8 +8163,11 @@ struct pevent *pevent_alloc(void)
 {
 	struct pevent *pevent = calloc(1, sizeof(*pevent));
 
-	if (pevent)
+	if (pevent) {
 		pevent->ref_count = 1;
+		pthread_mutex_init(&pevent->lock, NULL);
+		pthread_rwlock_init(&pevent->cmdline_lock, NULL);
+	}
 
 	return pevent;
 }
@@ -6740,6 +8212,7 @@ void pevent_free_format(struct event_format *event)
 
 	free(event->print_fmt.format);
 	free_args(event->print_fmt.args);
+	free_print_prog(event->print_fmt.prog);
 
 	free(event);
 }
@@ -6750,7 +8223,6 @@ void pevent_free_format(struct event_format *event)
  */
 void pevent_free(struct pevent *pevent)
 {
-	struct cmdline_list *cmdlist, *cmdnext;
 	struct func_list *funclist, *funcnext;
 	struct printk_list *printklist, *printknext;
 	struct pevent_function_handler *func_handler;
@@ -6760,7 +8232,6 @@ void pevent_free(struct pevent *pevent)
 	if (!pevent)
 		return;
 
-	cmdlist = pevent->cmdlist;
 	funclist = pevent->funclist;
 	printklist = pevent->printklist;
 
@@ -6768,25 +8239,30 @@ void pevent_free(struct pevent *pevent)
 	if (pevent->ref_count)
 		return;
 
-	if (pevent->cmdlines) {
-		for (i = 0; i < pevent->cmdline_count; i++)
-			free(pevent->cmdlines[i].comm);
-		free(pevent->cmdlines);
-	}
+	for (i = 0; i < pevent->cmdline_size; i++) {
+		struct cmdline_rename *rename;
 
-	while (cmdlist) {
-		cmdnext = cmdlist->next;
-		free(cmdlist->comm);
-		free(cmdlist);
-		cmdlist = cmdnext;
+		while ((rename = pevent->cmdlines[i].renames)) {
+			pevent->cmdlines[i].renames = rename->next;
+			free(rename);
+		}
 	}
+	free(pevent->cmdlines);
+
+	for (i = 0; i < pevent->comm_size; i++)
+		free(pevent->comms[i]);
+	free(pevent->comms);
 
-	if (pevent->func_map) {
+	if (pevent->func_map_free) {
+		pevent->func_map_free(pevent->func_map_data);
+		free_func_search(pevent->func_search);
+	} else if (pevent->func_map) {
 		for (i = 0; i < (int)pevent->func_count; i++) {
 			free(pevent->func_map[i].func);
 			free(pevent->func_map[i].mod);
 		}
 		free(pevent->func_map);
+		free_func_search(pevent->func_search);
 	}
 
 	while (funclist) {
@@ -6816,6 +8292,8 @@ void pevent_free(struct pevent *pevent)
 		printklist = printknext;
 	}
 
+	free_bprint_cache(pevent);
+
 	for (i = 0; i < pevent->nr_events; i++)
 		pevent_free_format(pevent->events[i]);
 
@@ -6827,9 +8305,14 @@ void pevent_free(struct pevent *pevent)
 
 	free(pevent->trace_clock);
 	free(pevent->events);
+	free(pevent->event_ids);
+	free_event_names(pevent);
 	free(pevent->sort_events);
 	free(pevent->func_resolver);
 
+	pthread_mutex_destroy(&pevent->lock);
+	pthread_rwlock_destroy(&pevent->cmdline_lock);
+
 	free(pevent);
 }
 
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <regex.h>
 #include <string.h>
+#include <pthread.h>
 
 #ifndef __maybe_unused
 #define __maybe_unused __attribute__((unused))
@@ -89,16 +90,20 @@ extern int trace_seq_vprintf(struct trace_seq *s, const char *fmt, va_list args)
 
 extern int trace_seq_puts(struct trace_seq *s, const char *str);
 extern int trace_seq_putc(struct trace_seq *s, unsigned char c);
+extern int trace_seq_putmem(struct trace_seq *s, const void *mem,
+			    unsigned int len);
 
 extern void trace_seq_terminate(struct trace_seq *s);
 
 extern int trace_seq_do_fprintf(struct trace_seq *s, FILE *fp);
 extern int trace_seq_do_printf(struct trace_seq *s);
+extern int trace_seq_flush(struct trace_seq *s, int fd);
 
 
 /* ----------------------- pevent ----------------------- */
 
 struct pevent;
+struct event_name_item;
 struct event_format;
 
 typedef int (*pevent_event_handler_func)(struct trace_seq *s,
@@ -208,6 +213,25 @@ struct format {
 	struct format_field	*fields;
 };
 
+typedef unsigned long long (*pevent_field_read_func)(const void *ptr);
+
+enum pevent_field_access_flags {
+	PEVENT_FIELD_SIGN_EXTEND	= 1,
+};
+
+/*
+ * A field resolved for reading. The reader is picked for the size,
+ * sign and byte order of the field once, instead of on every record.
+ * For a dynamic array, it reads the __data_loc word.
+ */
+struct pevent_field_accessor {
+	struct format_field	*field;
+	pevent_field_read_func	read;
+	int			offset;
+	int			size;
+	unsigned long		flags;
+};
+
 struct print_arg_atom {
 	char			*atom;
 };
@@ -318,9 +342,12 @@ struct print_arg {
 	};
 };
 
+struct print_prog;
+
 struct print_fmt {
 	char			*format;
 	struct print_arg	*args;
+	struct print_prog	*prog;
 };
 
 struct event_format {
@@ -347,6 +374,13 @@ enum {
 	EVENT_FL_FAILED		= 0x80000000
 };
 
+/* What printing the data of a record wrote */
+enum pevent_print_status {
+	PEVENT_PRINT_DATA,	/* as the print format says */
+	PEVENT_PRINT_FAILED,	/* up to where it failed to parse */
+	PEVENT_PRINT_FIELDS,	/* the fields, the event failed before */
+};
+
 enum event_sort_type {
 	EVENT_SORT_ID,
 	EVENT_SORT_NAME,
@@ -452,8 +486,7 @@ void traceevent_print_plugins(struct trace_seq *s,
 			      const struct plugin_list *list);
 
 struct cmdline;
-struct cmdline_list;
-struct func_map;
+struct func_search;
 struct func_list;
 struct event_handler;
 struct func_resolver;
@@ -461,6 +494,20 @@ struct func_resolver;
 typedef char *(pevent_func_resolver_t)(void *priv,
 				       unsigned long long *addrp, char **modp);
 
+struct func_map {
+	unsigned long long		addr;
+	char				*func;
+	char				*mod;
+};
+
+typedef void (*pevent_func_map_free_func)(void *data);
+
+/*
+ * Event ids below this index the event tables directly, the ones
+ * above (which the kernel never hands out) are searched for.
+ */
+#define PEVENT_MAX_DENSE_ID	(1 << 16)
+
 struct pevent {
 	int ref_count;
 
@@ -484,13 +531,19 @@ struct pevent {
 	int page_size;
 
 	struct cmdline *cmdlines;
-	struct cmdline_list *cmdlist;
 	int cmdline_count;
+	int cmdline_size;
+	char **comms;
+	int comm_count;
+	int comm_size;
 
 	struct func_map *func_map;
+	struct func_search *func_search;
 	struct func_resolver *func_resolver;
 	struct func_list *funclist;
 	unsigned int func_count;
+	pevent_func_map_free_func func_map_free;
+	void *func_map_data;
 
 	struct printk_map *printk_map;
 	struct printk_list *printklist;
@@ -499,6 +552,9 @@ struct pevent {
 
 	struct event_format **events;
 	int nr_events;
+	struct event_format **event_ids;
+	int nr_event_ids;
+	struct event_name_item **event_names;
 	struct event_format **sort_events;
 	enum event_sort_type last_type;
 
@@ -526,14 +582,19 @@ struct pevent {
 	struct format_field *bprint_ip_field;
 	struct format_field *bprint_fmt_field;
 	struct format_field *bprint_buf_field;
+	struct bprint_cache *bprint_cache;
 
 	struct event_handler *handlers;
 	struct pevent_function_handler *func_handlers;
 
 	int parsing_failures;
 
-	/* cache */
-	struct event_format *last_event;
+	/*
+	 * Protects the maps and caches that are built on first use,
+	 * so that several threads can read events with one pevent.
+	 */
+	pthread_mutex_t lock;
+	pthread_rwlock_t cmdline_lock;
 
 	char *trace_clock;
 };
@@ -625,6 +686,8 @@ int pevent_set_function_resolver(struct pevent *pevent,
 				 pevent_func_resolver_t *func, void *priv);
 void pevent_reset_function_resolver(struct pevent *pevent);
 int pevent_register_comm(struct pevent *pevent, const char *comm, int pid);
+int pevent_register_comm_ts(struct pevent *pevent, const char *comm, int pid,
+			    unsigned long long ts);
 int pevent_register_trace_clock(struct pevent *pevent, const char *trace_clock);
 int pevent_register_function(struct pevent *pevent, char *name,
 			     unsigned long long addr, char *mod);
@@ -642,6 +705,10 @@ void pevent_print_event_time(struct pevent *pevent, struct trace_seq *s,
 void pevent_print_event_data(struct pevent *pevent, struct trace_seq *s,
 			     struct event_format *event,
 			     struct pevent_record *record);
+enum pevent_print_status
+pevent_try_print_event_data(struct pevent *pevent, struct trace_seq *s,
+			    struct event_format *event,
+			    struct pevent_record *record);
 void pevent_print_event(struct pevent *pevent, struct trace_seq *s,
 			struct pevent_record *record, bool use_trace_clock);
 
@@ -654,6 +721,23 @@ enum pevent_errno pevent_parse_format(struct pevent *pevent,
 				      struct event_format **eventp,
 				      const char *buf,
 				      unsigned long size, const char *sys);
+
+struct pevent_format_buf {
+	const char		*sys;
+	char			*buf;
+	unsigned long		size;
+	void			*data;
+	enum pevent_errno	ret;
+	struct event_format	*event;
+};
+
+typedef int (*pevent_format_load_func)(struct pevent_format_buf *format,
+				       void *context);
+
+int pevent_parse_events(struct pevent *pevent,
+			struct pevent_format_buf *formats, int nr_formats,
+			int nr_threads, pevent_format_load_func load,
+			void *context);
 void pevent_free_format(struct event_format *event);
 void pevent_free_format_field(struct format_field *field);
 
@@ -670,6 +754,10 @@ int pevent_get_common_field_val(struct trace_seq *s, struct event_format *event,
 int pevent_get_any_field_val(struct trace_seq *s, struct event_format *event,
 			     const char *name, struct pevent_record *record,
 			     unsigned long long *val, int err);
+int pevent_get_accessor_val(struct trace_seq *s,
+			    const struct pevent_field_accessor *acc,
+			    const char *name, struct pevent_record *record,
+			    unsigned long long *val, int err);
 
 int pevent_print_num_field(struct trace_seq *s, const char *fmt,
 			   struct event_format *event, const char *name,
@@ -699,9 +787,45 @@ struct format_field *pevent_find_any_field(struct event_format *event, const cha
 const char *pevent_find_function(struct pevent *pevent, unsigned long long addr);
 unsigned long long
 pevent_find_function_address(struct pevent *pevent, unsigned long long addr);
+void pevent_func_cache_stats(struct pevent *pevent,
+			     unsigned long long *lookups,
+			     unsigned long long *hits);
+int pevent_get_func_map(struct pevent *pevent, struct func_map **map);
+int pevent_set_func_map(struct pevent *pevent, struct func_map *map,
+			unsigned int count, pevent_func_map_free_func free_map,
+			void *data);
 unsigned long long pevent_read_number(struct pevent *pevent, const void *ptr, int size);
 int pevent_read_number_field(struct format_field *field, const void *data,
 			     unsigned long long *value);
+int pevent_field_accessor_init(struct pevent_field_accessor *acc,
+			       struct format_field *field, int flags);
+int pevent_field_accessor_find(struct pevent_field_accessor *acc,
+			       struct event_format *event, const char *name,
+			       int flags);
+
+/* Returns the number in the field of @data, 0 if it is not a number */
+static inline unsigned long long
+pevent_field_read(const struct pevent_field_accessor *acc, const void *data)
+{
+	return acc->read(data + acc->offset);
+}
+
+/* Returns where the array of the field is in @data, and its length */
+static inline void *
+pevent_field_data(const struct pevent_field_accessor *acc, void *data,
+		  int *len)
+{
+	unsigned int loc;
+
+	if (!(acc->flags & FIELD_IS_DYNAMIC)) {
+		*len = acc->size;
+		return data + acc->offset;
+	}
+
+	loc = acc->read(data + acc->offset);
+	*len = loc >> 16;
+	return data + (loc & 0xffff);
+}
 
 struct event_format *pevent_find_event(struct pevent *pevent, int id);
 
@@ -719,6 +843,8 @@ int pevent_data_pid(struct pevent *pevent, struct pevent_record *rec);
 int pevent_data_pc(struct pevent *pevent, struct pevent_record *rec);
 int pevent_data_flags(struct pevent *pevent, struct pevent_record *rec);
 const char *pevent_data_comm_from_pid(struct pevent *pevent, int pid);
+const char *pevent_data_comm_from_pid_ts(struct pevent *pevent, int pid,
+					 unsigned long long ts);
 struct cmdline;
 struct cmdline *pevent_data_pid_from_comm(struct pevent *pevent, const char *comm,
 					  struct cmdline *next);
@@ -881,6 +1007,7 @@ struct filter_arg_boolean {
 
 struct filter_arg_field {
 	struct format_field	*field;
+	struct pevent_field_accessor	access;
 };
 
 struct filter_arg_value {
@@ -909,12 +1036,16 @@ struct filter_arg_num {
 	struct filter_arg	*right;
 };
 
+struct filter_str_match;
+
 struct filter_arg_str {
 	enum filter_cmp_type	type;
 	struct format_field	*field;
+	struct pevent_field_accessor	access;
 	char			*val;
 	char			*buffer;
 	regex_t			reg;
+	struct filter_str_match	*match;
 };
 
 struct filter_arg {
@@ -930,10 +1061,13 @@ struct filter_arg {
 	};
 };
 
+struct filter_prog;
+
 struct filter_type {
 	int			event_id;
 	struct event_format	*event;
 	struct filter_arg	*filter;
+	struct filter_prog	*prog;
 };
 
 #define PEVENT_FILTER_ERROR_BUFSZ  1024
@@ -942,6 +1076,8 @@ struct event_filter {
 	struct pevent		*pevent;
 	int			filters;
 	struct filter_type	*event_filters;
+	int			nr_filter_ids;
+	int			*filter_ids;
 	char			error_buffer[PEVENT_FILTER_ERROR_BUFSZ];
 };
 
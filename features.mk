@@ -52,3 +52,16 @@ int main (void)
 	return ret;
 }
 endef
+
+define SOURCE_ZLIB
+#include <zlib.h>
+
+int main (void)
+{
+	Bytef src[1] = { 0 };
+	Bytef buf[64];
+	uLongf len = sizeof(buf);
+
+	return compress2(buf, &len, src, sizeof(src), Z_BEST_SPEED);
+}
+endef
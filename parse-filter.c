@@ -115,11 +115,62 @@ static int filter_cmp(const void *a, const void *b)
 	return 0;
 }
 
+/*
+ * filter_ids maps an event id to its index in event_filters plus one,
+ * zero meaning the event has no filter. The entries from @start on
+ * have moved, so point their ids at the new slots.
+ */
+static void update_filter_ids(struct event_filter *filter, int start)
+{
+	int id;
+	int i;
+
+	for (i = start; i < filter->filters; i++) {
+		id = filter->event_filters[i].event_id;
+		if (id >= 0 && id < filter->nr_filter_ids)
+			filter->filter_ids[id] = i + 1;
+	}
+}
+
+static int add_filter_id(struct event_filter *filter, int id)
+{
+	int *ids;
+	int nr;
+
+	if (id < 0 || id >= PEVENT_MAX_DENSE_ID || id < filter->nr_filter_ids)
+		return 0;
+
+	nr = filter->nr_filter_ids * 2;
+	if (nr <= id)
+		nr = id + 1;
+	if (nr > PEVENT_MAX_DENSE_ID)
+		nr = PEVENT_MAX_DENSE_ID;
+
+	ids = realloc(filter->filter_ids, sizeof(*ids) * nr);
+	if (!ids)
+		return -1;
+
+	memset(ids + filter->nr_filter_ids, 0,
+	       sizeof(*ids) * (nr - filter->nr_filter_ids));
+	filter->filter_ids = ids;
+	filter->nr_filter_ids = nr;
+
+	return 0;
+}
+
 static struct filter_type *
 find_filter_type(struct event_filter *filter, int id)
 {
 	struct filter_type *filter_type;
 	struct filter_type key;
+	int idx;
+
+	if (id >= 0 && id < PEVENT_MAX_DENSE_ID) {
+		if (id >= filter->nr_filter_ids)
+			return NULL;
+		idx = filter->filter_ids[id];
+		return idx ? &filter->event_filters[idx - 1] : NULL;
+	}
 
 	key.event_id = id;
 
@@ -141,6 +192,9 @@ add_filter_type(struct event_filter *filter, int id)
 	if (filter_type)
 		return filter_type;
 
+	if (add_filter_id(filter, id))
+		return NULL;
+
 	filter_type = realloc(filter->event_filters,
 			      sizeof(*filter->event_filters) *
 			      (filter->filters + 1));
@@ -164,9 +218,12 @@ add_filter_type(struct event_filter *filter, int id)
 	filter_type->event_id = id;
 	filter_type->event = pevent_find_event(filter->pevent, id);
 	filter_type->filter = NULL;
+	filter_type->prog = NULL;
 
 	filter->filters++;
 
+	update_filter_ids(filter, i);
+
 	return filter_type;
 }
 
@@ -194,6 +251,202 @@ static struct filter_arg *allocate_arg(void)
 	return calloc(1, sizeof(struct filter_arg));
 }
 
+/*
+ * Most regexes in filters are a plain string, maybe anchored at one
+ * or both ends, and those are tested with string compares. For the
+ * others, the result is remembered for the comms (which are interned,
+ * so the same comm is always the same pointer) and for the strings
+ * that were tested recently.
+ */
+enum filter_str_fast {
+	STR_FAST_NONE,
+	STR_FAST_EXACT,
+	STR_FAST_PREFIX,
+	STR_FAST_SUFFIX,
+	STR_FAST_SUBSTR,
+};
+
+#define STR_MEMO_SIZE		256
+#define STR_CACHE_SIZE		256
+#define STR_CACHE_LEN		64
+
+struct filter_str_memo {
+	const char		*comm;
+	int			match;
+};
+
+struct filter_str_cache {
+	unsigned int		hash;
+	int			match;
+	char			str[STR_CACHE_LEN];
+};
+
+struct filter_str_match {
+	enum filter_str_fast	fast;
+	int			len;
+	struct filter_str_memo	memo[STR_MEMO_SIZE];
+	struct filter_str_cache	cache[STR_CACHE_SIZE];
+	char			lit[];
+};
+
+/* Characters that may mean something in a basic regex */
+static int regex_special(char ch)
+{
+	return strchr(".[]*\\^${}+?|()", ch) != NULL;
+}
+
+static int regex_escaped(const char *re, int pos)
+{
+	int n = 0;
+
+	while (pos > 0 && re[pos - 1] == '\\') {
+		pos--;
+		n++;
+	}
+	return n & 1;
+}
+
+/*
+ * Works out if the basic regex @re of @len is a plain string, and
+ * copies it to @lit. The regex is compiled with REG_ICASE, and the
+ * compares only fold the case of ASCII the same way.
+ */
+static enum filter_str_fast regex_fast(const char *re, int len, char *lit)
+{
+	int start = 0;
+	int end = 0;
+	int n = 0;
+	int i;
+
+	if (len && re[0] == '^') {
+		start = 1;
+		re++;
+		len--;
+	}
+
+	/* ".*" at either end matches whatever an anchor would not */
+	while (len >= 2 && re[0] == '.' && re[1] == '*') {
+		start = 0;
+		re += 2;
+		len -= 2;
+	}
+
+	if (len && re[len - 1] == '$' && !regex_escaped(re, len - 1)) {
+		end = 1;
+		len--;
+	}
+
+	while (len >= 2 && re[len - 2] == '.' && re[len - 1] == '*' &&
+	       !regex_escaped(re, len - 2)) {
+		end = 0;
+		len -= 2;
+	}
+
+	/* "ab*" matches any string that "a" does, when not anchored */
+	while (!end && len >= 2 && re[len - 1] == '*' &&
+	       !regex_special(re[len - 2]) && !regex_escaped(re, len - 2))
+		len -= 2;
+
+	for (i = 0; i < len; i++) {
+		if (re[i] == '\\') {
+			if (++i == len || !strchr(".[*\\^$", re[i]))
+				return STR_FAST_NONE;
+		} else if (regex_special(re[i]))
+			return STR_FAST_NONE;
+		if ((unsigned char)re[i] >= 0x80)
+			return STR_FAST_NONE;
+		lit[n++] = re[i];
+	}
+	lit[n] = 0;
+
+	if (start && end)
+		return STR_FAST_EXACT;
+	if (start)
+		return STR_FAST_PREFIX;
+	if (end)
+		return STR_FAST_SUFFIX;
+	return STR_FAST_SUBSTR;
+}
+
+static struct filter_str_match *alloc_str_match(const char *re)
+{
+	struct filter_str_match *match;
+	int len = strlen(re);
+
+	match = calloc(1, sizeof(*match) + len + 1);
+	if (!match)
+		return NULL;
+
+	match->fast = regex_fast(re, len, match->lit);
+	match->len = strlen(match->lit);
+
+	return match;
+}
+
+static unsigned int str_hash(const char *str, int *len)
+{
+	unsigned int hash = 2166136261U;
+	int i;
+
+	for (i = 0; str[i]; i++)
+		hash = (hash ^ (unsigned char)str[i]) * 16777619U;
+	*len = i;
+
+	return hash;
+}
+
+/* Returns non-zero if @val matches the regex of @arg */
+static int test_regex(struct filter_arg *arg, const char *val, int is_comm)
+{
+	struct filter_str_match *match = arg->str.match;
+	struct filter_str_cache *cache;
+	struct filter_str_memo *memo;
+	unsigned int hash;
+	int len;
+
+	if (!match)
+		return !regexec(&arg->str.reg, val, 0, NULL, 0);
+
+	switch (match->fast) {
+	case STR_FAST_EXACT:
+		return strcasecmp(val, match->lit) == 0;
+	case STR_FAST_PREFIX:
+		return strncasecmp(val, match->lit, match->len) == 0;
+	case STR_FAST_SUFFIX:
+		len = strlen(val);
+		return len >= match->len &&
+			strcasecmp(val + len - match->len, match->lit) == 0;
+	case STR_FAST_SUBSTR:
+		return strcasestr(val, match->lit) != NULL;
+	default:
+		break;
+	}
+
+	if (is_comm) {
+		hash = (unsigned long)val >> 4 ^ (unsigned long)val >> 12;
+		memo = &match->memo[hash & (STR_MEMO_SIZE - 1)];
+		if (memo->comm != val) {
+			memo->comm = val;
+			memo->match = !regexec(&arg->str.reg, val, 0, NULL, 0);
+		}
+		return memo->match;
+	}
+
+	hash = str_hash(val, &len);
+	if (len >= STR_CACHE_LEN)
+		return !regexec(&arg->str.reg, val, 0, NULL, 0);
+
+	cache = &match->cache[hash & (STR_CACHE_SIZE - 1)];
+	if (cache->hash != hash || strcmp(cache->str, val) != 0) {
+		cache->match = !regexec(&arg->str.reg, val, 0, NULL, 0);
+		cache->hash = hash;
+		memcpy(cache->str, val, len + 1);
+	}
+	return cache->match;
+}
+
+static void free_filter_prog(struct filter_prog *prog);
+
 static void free_arg(struct filter_arg *arg)
 {
 	if (!arg)
@@ -218,6 +471,7 @@ static void free_arg(struct filter_arg *arg)
 		free(arg->str.val);
 		regfree(&arg->str.reg);
 		free(arg->str.buffer);
+		free(arg->str.match);
 		break;
 
 	case FILTER_ARG_VALUE:
@@ -393,6 +647,11 @@ create_arg_item(struct event_format *event, const char *token,
 		}
 		arg->type = FILTER_ARG_FIELD;
 		arg->field.field = field;
+		if (field == &comm)
+			arg->field.access.field = field;
+		else
+			pevent_field_accessor_init(&arg->field.access, field,
+						   PEVENT_FIELD_SIGN_EXTEND);
 		break;
 	default:
 		free_arg(arg);
@@ -455,6 +714,7 @@ add_right(struct filter_arg *op, struct filter_arg *arg, char *error_str)
 	struct filter_arg *left;
 	char *str;
 	int op_type;
+	int size;
 	int ret;
 
 	switch (op->type) {
@@ -550,6 +810,11 @@ add_right(struct filter_arg *op, struct filter_arg *arg, char *error_str)
 						   str);
 					return PEVENT_ERRNO__INVALID_REGEX;
 				}
+				op->str.match = alloc_str_match(str);
+				if (!op->str.match) {
+					show_error(error_str, "Failed to allocate string filter");
+					return PEVENT_ERRNO__MEM_ALLOC_FAILED;
+				}
 				break;
 			default:
 				show_error(error_str,
@@ -560,21 +825,26 @@ add_right(struct filter_arg *op, struct filter_arg *arg, char *error_str)
 			op->type = FILTER_ARG_STR;
 			op->str.type = op_type;
 			op->str.field = left->field.field;
+			op->str.access = left->field.access;
 			op->str.val = strdup(str);
 			if (!op->str.val) {
 				show_error(error_str, "Failed to allocate string filter");
 				return PEVENT_ERRNO__MEM_ALLOC_FAILED;
 			}
 			/*
-			 * Need a buffer to copy data for tests
+			 * Need a buffer to copy data for tests. The length
+			 * of a dynamic string is 16 bits of its __data_loc.
 			 */
-			op->str.buffer = malloc(op->str.field->size + 1);
+			size = op->str.field->size;
+			if (op->str.field->flags & FIELD_IS_DYNAMIC)
+				size = 0xffff;
+			op->str.buffer = malloc(size + 1);
 			if (!op->str.buffer) {
 				show_error(error_str, "Failed to allocate string filter");
 				return PEVENT_ERRNO__MEM_ALLOC_FAILED;
 			}
 			/* Null terminate this buffer */
-			op->str.buffer[op->str.field->size] = 0;
+			op->str.buffer[size] = 0;
 
 			/* We no longer have left or right args */
 			free_arg(arg);
@@ -1242,6 +1512,8 @@ filter_event(struct event_filter *filter, struct event_format *event,
 	if (filter_type->filter)
 		free_arg(filter_type->filter);
 	filter_type->filter = arg;
+	free_filter_prog(filter_type->prog);
+	filter_type->prog = NULL;
 
 	return 0;
 }
@@ -1363,6 +1635,7 @@ enum pevent_errno pevent_filter_add_filter_str(struct event_filter *filter,
 static void free_filter_type(struct filter_type *filter_type)
 {
 	free_arg(filter_type->filter);
+	free_filter_prog(filter_type->prog);
 }
 
 /**
@@ -1416,6 +1689,9 @@ int pevent_filter_remove_event(struct event_filter *filter,
 	if (!filter_type)
 		return 0;
 
+	if (event_id >= 0 && event_id < filter->nr_filter_ids)
+		filter->filter_ids[event_id] = 0;
+
 	free_filter_type(filter_type);
 
 	/* The filter_type points into the event_filters array */
@@ -1428,6 +1704,8 @@ int pevent_filter_remove_event(struct event_filter *filter,
 	memset(&filter->event_filters[filter->filters], 0,
 	       sizeof(*filter_type));
 
+	update_filter_ids(filter, filter_type - filter->event_filters);
+
 	return 1;
 }
 
@@ -1447,6 +1725,10 @@ void pevent_filter_reset(struct event_filter *filter)
 	free(filter->event_filters);
 	filter->filters = 0;
 	filter->event_filters = NULL;
+
+	free(filter->filter_ids);
+	filter->nr_filter_ids = 0;
+	filter->filter_ids = NULL;
 }
 
 void pevent_filter_free(struct event_filter *filter)
@@ -1498,6 +1780,8 @@ static int copy_filter_type(struct event_filter *filter,
 			return -1;
 
 		filter_type->filter = arg;
+		free_filter_prog(filter_type->prog);
+		filter_type->prog = NULL;
 
 		free(str);
 		return 0;
@@ -1700,40 +1984,23 @@ get_comm(struct event_format *event, struct pevent_record *record)
 	int pid;
 
 	pid = pevent_data_pid(event->pevent, record);
-	comm = pevent_data_comm_from_pid(event->pevent, pid);
+	comm = pevent_data_comm_from_pid_ts(event->pevent, pid, record->ts);
 	return comm;
 }
 
 static unsigned long long
 get_value(struct event_format *event,
-	  struct format_field *field, struct pevent_record *record)
+	  struct pevent_field_accessor *access, struct pevent_record *record)
 {
-	unsigned long long val;
-
 	/* Handle our dummy "comm" field */
-	if (field == &comm) {
+	if (access->field == &comm) {
 		const char *name;
 
 		name = get_comm(event, record);
 		return (unsigned long)name;
 	}
 
-	pevent_read_number_field(field, record->data, &val);
-
-	if (!(field->flags & FIELD_IS_SIGNED))
-		return val;
-
-	switch (field->size) {
-	case 1:
-		return (char)val;
-	case 2:
-		return (short)val;
-	case 4:
-		return (int)val;
-	case 8:
-		return (long long)val;
-	}
-	return val;
+	return pevent_field_read(access, record->data);
 }
 
 static unsigned long long
@@ -1801,7 +2068,7 @@ get_arg_value(struct event_format *event, struct filter_arg *arg,
 {
 	switch (arg->type) {
 	case FILTER_ARG_FIELD:
-		return get_value(event, arg->field.field, record);
+		return get_value(event, &arg->field.access, record);
 
 	case FILTER_ARG_VALUE:
 		if (arg->value.type != FILTER_NUMBER) {
@@ -1868,26 +2135,29 @@ static const char *get_field_str(struct filter_arg *arg, struct pevent_record *r
 	unsigned long long addr;
 	const char *val = NULL;
 	char hex[64];
+	int len;
 
 	/* If the field is not a string convert it */
 	if (arg->str.field->flags & FIELD_IS_STRING) {
-		val = record->data + arg->str.field->offset;
+		val = pevent_field_data(&arg->str.access, record->data, &len);
+		if (val + len > (char *)record->data + record->size)
+			len = 0;
 
 		/*
 		 * We need to copy the data since we can't be sure the field
 		 * is null terminated.
 		 */
-		if (*(val + arg->str.field->size - 1)) {
+		if (!len || *(val + len - 1)) {
 			/* copy it */
-			memcpy(arg->str.buffer, val, arg->str.field->size);
-			/* the buffer is already NULL terminated */
+			memcpy(arg->str.buffer, val, len);
+			arg->str.buffer[len] = 0;
 			val = arg->str.buffer;
 		}
 
 	} else {
 		event = arg->str.field->event;
 		pevent = event->pevent;
-		addr = get_value(event, arg->str.field, record);
+		addr = get_value(event, &arg->str.access, record);
 
 		if (arg->str.field->flags & (FIELD_IS_POINTER | FIELD_IS_LONG))
 			/* convert to a kernel symbol */
@@ -1921,11 +2191,10 @@ static int test_str(struct event_format *event, struct filter_arg *arg,
 		return strcmp(val, arg->str.val) != 0;
 
 	case FILTER_CMP_REGEX:
-		/* Returns zero on match */
-		return !regexec(&arg->str.reg, val, 0, NULL, 0);
+		return test_regex(arg, val, arg->str.field == &comm);
 
 	case FILTER_CMP_NOT_REGEX:
-		return regexec(&arg->str.reg, val, 0, NULL, 0);
+		return !test_regex(arg, val, arg->str.field == &comm);
 
 	default:
 		if (!*err)
@@ -2016,6 +2285,555 @@ int pevent_event_filtered(struct event_filter *filter, int event_id)
 	return filter_type ? 1 : 0;
 }
 
+/*
+ * A filter is compiled into a flat program the first time it is
+ * matched. Each instruction is one test, which names the instruction
+ * to go to if it passes and if it fails, so AND, OR and NOT cost
+ * nothing when matching. The tests under an AND or an OR are kept in
+ * the order that is cheapest for the records seen so far.
+ */
+#define PROG_MATCH		-1
+#define PROG_MISS		-2
+
+/* Matches before the tests are first reordered, and the most between */
+#define PROG_TUNE_START		256
+#define PROG_TUNE_MAX		(1 << 20)
+
+#define NEVER_DECIDES		1e300
+
+enum filter_insn_type {
+	INSN_FIELD_CONST,	/* a field against a number */
+	INSN_NUM,		/* any two numbers */
+	INSN_STR,		/* a string */
+};
+
+enum filter_operand_type {
+	OPERAND_CONST,
+	OPERAND_FIELD,
+	OPERAND_ARG,		/* comm and expressions */
+};
+
+struct filter_operand {
+	enum filter_operand_type	type;
+	pevent_field_read_func		read;
+	int				offset;
+	unsigned long long		val;
+	struct filter_arg		*arg;
+};
+
+/* The filter with the operands of each AND and OR in one list */
+struct filter_node {
+	enum filter_op_type	op;		/* 0 for a test or a constant */
+	int			neg;
+	int			nr;
+	struct filter_node	**children;
+	struct filter_arg	*arg;
+	double			cost;
+	double			pass;
+	double			key;
+	unsigned long long	evals;
+	unsigned long long	passes;
+};
+
+struct filter_insn {
+	enum filter_insn_type	type;
+	enum filter_cmp_type	cmp;
+	int			jt;
+	int			jf;
+	struct filter_operand	left;
+	struct filter_operand	right;
+	struct filter_arg	*arg;
+	struct filter_node	*node;
+	unsigned long long	evals;
+	unsigned long long	passes;
+};
+
+struct filter_prog {
+	struct filter_node	*root;
+	struct filter_insn	*insns;
+	int			nr_insns;
+	int			start;
+	int			tree;		/* not compiled, walk the tree */
+	unsigned long long	runs;
+	unsigned long long	next_tune;
+};
+
+static int operand_compiles(struct filter_arg *arg)
+{
+	switch (arg->type) {
+	case FILTER_ARG_FIELD:
+		return 1;
+	case FILTER_ARG_VALUE:
+		return arg->value.type == FILTER_NUMBER;
+	case FILTER_ARG_EXP:
+		if (arg->exp.type < FILTER_EXP_ADD ||
+		    arg->exp.type > FILTER_EXP_XOR ||
+		    !arg->exp.left || !arg->exp.right)
+			return 0;
+		return operand_compiles(arg->exp.left) &&
+			operand_compiles(arg->exp.right);
+	default:
+		return 0;
+	}
+}
+
+/* Anything that could fail while matching is left to the tree walk */
+static int test_compiles(struct filter_arg *arg)
+{
+	switch (arg->type) {
+	case FILTER_ARG_NUM:
+		if (arg->num.type < FILTER_CMP_EQ || arg->num.type > FILTER_CMP_LE ||
+		    !arg->num.left || !arg->num.right)
+			return 0;
+		return operand_compiles(arg->num.left) &&
+			operand_compiles(arg->num.right);
+	case FILTER_ARG_STR:
+		return arg->str.type >= FILTER_CMP_MATCH &&
+			arg->str.type <= FILTER_CMP_NOT_REGEX;
+	case FILTER_ARG_EXP:
+	case FILTER_ARG_VALUE:
+	case FILTER_ARG_FIELD:
+		return operand_compiles(arg);
+	default:
+		return 0;
+	}
+}
+
+/* A rough cost of a test, a field read being 1 */
+static double operand_cost(struct filter_arg *arg)
+{
+	switch (arg->type) {
+	case FILTER_ARG_FIELD:
+		return arg->field.field == &comm ? 8 : 1;
+	case FILTER_ARG_EXP:
+		return 1 + operand_cost(arg->exp.left) +
+			operand_cost(arg->exp.right);
+	default:
+		return 0;
+	}
+}
+
+static double test_cost(struct filter_arg *arg)
+{
+	double cost;
+
+	switch (arg->type) {
+	case FILTER_ARG_NUM:
+		return 1 + operand_cost(arg->num.left) +
+			operand_cost(arg->num.right);
+	case FILTER_ARG_STR:
+		cost = arg->str.field == &comm ? 8 : 4;
+		if (arg->str.type == FILTER_CMP_REGEX ||
+		    arg->str.type == FILTER_CMP_NOT_REGEX)
+			cost += 16;
+		return cost;
+	default:
+		return 1 + operand_cost(arg);
+	}
+}
+
+static void free_filter_node(struct filter_node *node)
+{
+	int i;
+
+	if (!node)
+		return;
+
+	for (i = 0; i < node->nr; i++)
+		free_filter_node(node->children[i]);
+	free(node->children);
+	free(node);
+}
+
+static struct filter_node *build_filter_node(struct filter_arg *arg, int *tests);
+
+/* Operands of the same operation are merged into its list */
+static int add_filter_child(struct filter_node *node, struct filter_arg *arg,
+			    int *tests)
+{
+	struct filter_node **children;
+	struct filter_node *child;
+	int merge;
+	int nr;
+
+	child = build_filter_node(arg, tests);
+	if (!child)
+		return -1;
+
+	merge = child->op == node->op && !child->neg;
+	nr = merge ? child->nr : 1;
+
+	children = realloc(node->children,
+			   sizeof(*children) * (node->nr + nr));
+	if (!children) {
+		free_filter_node(child);
+		return -1;
+	}
+	node->children = children;
+
+	if (merge) {
+		memcpy(children + node->nr, child->children,
+		       sizeof(*children) * nr);
+		free(child->children);
+		free(child);
+	} else
+		children[node->nr] = child;
+	node->nr += nr;
+
+	return 0;
+}
+
+static struct filter_node *build_filter_node(struct filter_arg *arg, int *tests)
+{
+	struct filter_node *node;
+
+	if (arg->type == FILTER_ARG_OP && arg->op.type == FILTER_OP_NOT) {
+		if (!arg->op.right)
+			return NULL;
+		node = build_filter_node(arg->op.right, tests);
+		if (node)
+			node->neg = !node->neg;
+		return node;
+	}
+
+	if (arg->type == FILTER_ARG_OP) {
+		if ((arg->op.type != FILTER_OP_AND &&
+		     arg->op.type != FILTER_OP_OR) ||
+		    !arg->op.left || !arg->op.right)
+			return NULL;
+	} else if (arg->type != FILTER_ARG_BOOLEAN && !test_compiles(arg))
+		return NULL;
+
+	node = calloc(1, sizeof(*node));
+	if (!node)
+		return NULL;
+
+	if (arg->type != FILTER_ARG_OP) {
+		node->arg = arg;
+		if (arg->type != FILTER_ARG_BOOLEAN) {
+			node->cost = test_cost(arg);
+			(*tests)++;
+		}
+		return node;
+	}
+
+	node->op = arg->op.type;
+	if (add_filter_child(node, arg->op.left, tests) ||
+	    add_filter_child(node, arg->op.right, tests)) {
+		free_filter_node(node);
+		return NULL;
+	}
+
+	return node;
+}
+
+static void init_operand(struct filter_operand *op, struct filter_arg *arg)
+{
+	memset(op, 0, sizeof(*op));
+	op->arg = arg;
+
+	if (arg->type == FILTER_ARG_VALUE) {
+		op->type = OPERAND_CONST;
+		op->val = arg->value.val;
+	} else if (arg->type == FILTER_ARG_FIELD && arg->field.field != &comm) {
+		op->type = OPERAND_FIELD;
+		op->read = arg->field.access.read;
+		op->offset = arg->field.access.offset;
+	} else
+		op->type = OPERAND_ARG;
+}
+
+static enum filter_cmp_type swap_cmp(enum filter_cmp_type cmp)
+{
+	switch (cmp) {
+	case FILTER_CMP_GT:
+		return FILTER_CMP_LT;
+	case FILTER_CMP_LT:
+		return FILTER_CMP_GT;
+	case FILTER_CMP_GE:
+		return FILTER_CMP_LE;
+	case FILTER_CMP_LE:
+		return FILTER_CMP_GE;
+	default:
+		return cmp;
+	}
+}
+
+static int emit_test(struct filter_prog *prog, struct filter_node *node,
+		     int pc, int jt, int jf)
+{
+	struct filter_insn *insn = &prog->insns[pc];
+	struct filter_arg *arg = node->arg;
+	struct filter_operand tmp;
+
+	memset(insn, 0, sizeof(*insn));
+	insn->arg = arg;
+	insn->node = node;
+	insn->jt = jt;
+	insn->jf = jf;
+
+	switch (arg->type) {
+	case FILTER_ARG_STR:
+		insn->type = INSN_STR;
+		return pc;
+	case FILTER_ARG_NUM:
+		insn->cmp = arg->num.type;
+		init_operand(&insn->left, arg->num.left);
+		init_operand(&insn->right, arg->num.right);
+		break;
+	default:
+		/* A number by itself is true if it is not zero */
+		insn->cmp = FILTER_CMP_NE;
+		init_operand(&insn->left, arg);
+		insn->right.type = OPERAND_CONST;
+		break;
+	}
+
+	/* Keep the field on the left */
+	if (insn->left.type == OPERAND_CONST) {
+		tmp = insn->left;
+		insn->left = insn->right;
+		insn->right = tmp;
+		insn->cmp = swap_cmp(insn->cmp);
+	}
+
+	if (insn->left.type == OPERAND_FIELD && insn->right.type == OPERAND_CONST)
+		insn->type = INSN_FIELD_CONST;
+	else
+		insn->type = INSN_NUM;
+
+	return pc;
+}
+
+/*
+ * Returns the first instruction of @node. The instructions are laid
+ * out from the end, as each operand of an AND or an OR goes on to
+ * the one after it.
+ */
+static int compile_filter_node(struct filter_prog *prog, struct filter_node *node,
+			       int *pos, int jt, int jf)
+{
+	int tmp;
+	int i;
+
+	if (node->neg) {
+		tmp = jt;
+		jt = jf;
+		jf = tmp;
+	}
+
+	if (!node->op) {
+		if (node->arg->type == FILTER_ARG_BOOLEAN)
+			return node->arg->boolean.value ? jt : jf;
+		return emit_test(prog, node, --(*pos), jt, jf);
+	}
+
+	for (i = node->nr - 1; i >= 0; i--) {
+		if (node->op == FILTER_OP_AND)
+			jt = compile_filter_node(prog, node->children[i], pos, jt, jf);
+		else
+			jf = compile_filter_node(prog, node->children[i], pos, jt, jf);
+	}
+
+	return node->op == FILTER_OP_AND ? jt : jf;
+}
+
+static void compile_filter_prog(struct filter_prog *prog)
+{
+	int pos = prog->nr_insns;
+
+	prog->start = compile_filter_node(prog, prog->root, &pos,
+					  PROG_MATCH, PROG_MISS);
+}
+
+static struct filter_prog *alloc_filter_prog(struct filter_arg *arg)
+{
+	struct filter_prog *prog;
+	int tests = 0;
+
+	prog = calloc(1, sizeof(*prog));
+	if (!prog)
+		return NULL;
+
+	prog->root = build_filter_node(arg, &tests);
+	if (!prog->root) {
+		prog->tree = 1;
+		return prog;
+	}
+
+	if (tests) {
+		prog->insns = calloc(tests, sizeof(*prog->insns));
+		if (!prog->insns) {
+			free_filter_node(prog->root);
+			free(prog);
+			return NULL;
+		}
+	}
+	prog->nr_insns = tests;
+	prog->next_tune = PROG_TUNE_START;
+
+	compile_filter_prog(prog);
+
+	return prog;
+}
+
+static void free_filter_prog(struct filter_prog *prog)
+{
+	if (!prog)
+		return;
+
+	free_filter_node(prog->root);
+	free(prog->insns);
+	free(prog);
+}
+
+/*
+ * Works out the cost and the chance to pass of @node, with the
+ * operands of each AND and OR sorted so that the ones most likely
+ * to decide it cheaply come first.
+ */
+static void tune_filter_node(struct filter_node *node)
+{
+	struct filter_node *child;
+	double reach = 1;
+	double decide;
+	int i, j;
+
+	if (!node->op) {
+		if (node->arg->type == FILTER_ARG_BOOLEAN)
+			node->pass = node->arg->boolean.value ? 1 : 0;
+		else
+			node->pass = (node->passes + 1.0) / (node->evals + 2.0);
+		if (node->neg)
+			node->pass = 1 - node->pass;
+		return;
+	}
+
+	for (i = 0; i < node->nr; i++) {
+		child = node->children[i];
+		tune_filter_node(child);
+
+		/* An AND is decided by a failure, an OR by a pass */
+		decide = node->op == FILTER_OP_AND ? 1 - child->pass : child->pass;
+		child->key = decide > 0 ? child->cost / decide : NEVER_DECIDES;
+	}
+
+	/* Few operands, and equal ones must keep their order */
+	for (i = 1; i < node->nr; i++) {
+		child = node->children[i];
+		for (j = i; j > 0 && node->children[j - 1]->key > child->key; j--)
+			node->children[j] = node->children[j - 1];
+		node->children[j] = child;
+	}
+
+	node->cost = 0;
+	for (i = 0; i < node->nr; i++) {
+		child = node->children[i];
+		node->cost += reach * child->cost;
+		if (node->op == FILTER_OP_AND)
+			reach *= child->pass;
+		else
+			reach *= 1 - child->pass;
+	}
+
+	node->pass = node->op == FILTER_OP_AND ? reach : 1 - reach;
+	if (node->neg)
+		node->pass = 1 - node->pass;
+}
+
+static void tune_filter_prog(struct filter_prog *prog)
+{
+	struct filter_insn *insn;
+	int i;
+
+	for (i = 0; i < prog->nr_insns; i++) {
+		insn = &prog->insns[i];
+		insn->node->evals += insn->evals;
+		insn->node->passes += insn->passes;
+	}
+
+	tune_filter_node(prog->root);
+	compile_filter_prog(prog);
+
+	if (prog->next_tune < PROG_TUNE_MAX)
+		prog->next_tune *= 4;
+	else
+		prog->next_tune += PROG_TUNE_MAX;
+}
+
+static int cmp_num(enum filter_cmp_type cmp, unsigned long long lval,
+		   unsigned long long rval)
+{
+	switch (cmp) {
+	case FILTER_CMP_EQ:
+		return lval == rval;
+	case FILTER_CMP_NE:
+		return lval != rval;
+	case FILTER_CMP_GT:
+		return lval > rval;
+	case FILTER_CMP_LT:
+		return lval < rval;
+	case FILTER_CMP_GE:
+		return lval >= rval;
+	default:
+		return lval <= rval;
+	}
+}
+
+static unsigned long long
+operand_value(struct filter_operand *op, struct event_format *event,
+	      struct pevent_record *record)
+{
+	enum pevent_errno err = 0;
+
+	switch (op->type) {
+	case OPERAND_CONST:
+		return op->val;
+	case OPERAND_FIELD:
+		return op->read(record->data + op->offset);
+	default:
+		return get_arg_value(event, op->arg, record, &err);
+	}
+}
+
+static int run_filter_prog(struct filter_prog *prog, struct event_format *event,
+			   struct pevent_record *record)
+{
+	enum pevent_errno err = 0;
+	struct filter_insn *insn;
+	int pc = prog->start;
+	int pass;
+
+	while (pc >= 0) {
+		insn = &prog->insns[pc];
+
+		switch (insn->type) {
+		case INSN_FIELD_CONST:
+			pass = cmp_num(insn->cmp,
+				       insn->left.read(record->data + insn->left.offset),
+				       insn->right.val);
+			break;
+		case INSN_NUM:
+			pass = cmp_num(insn->cmp,
+				       operand_value(&insn->left, event, record),
+				       operand_value(&insn->right, event, record));
+			break;
+		default:
+			pass = test_str(event, insn->arg, record, &err);
+			break;
+		}
+
+		insn->evals++;
+		if (pass) {
+			insn->passes++;
+			pc = insn->jt;
+		} else
+			pc = insn->jf;
+	}
+
+	return pc == PROG_MATCH;
+}
+
 /**
  * pevent_filter_match - test if a record matches a filter
  * @filter: filter struct with filter information
@@ -2033,6 +2851,7 @@ enum pevent_errno pevent_filter_match(struct event_filter *filter,
 {
 	struct pevent *pevent = filter->pevent;
 	struct filter_type *filter_type;
+	struct filter_prog *prog;
 	int event_id;
 	int ret;
 	enum pevent_errno err = 0;
@@ -2048,9 +2867,20 @@ enum pevent_errno pevent_filter_match(struct event_filter *filter,
 	if (!filter_type)
 		return PEVENT_ERRNO__FILTER_NOT_FOUND;
 
-	ret = test_filter(filter_type->event, filter_type->filter, record, &err);
-	if (err)
-		return err;
+	if (!filter_type->prog)
+		filter_type->prog = alloc_filter_prog(filter_type->filter);
+
+	prog = filter_type->prog;
+	if (prog && !prog->tree) {
+		if (++prog->runs == prog->next_tune)
+			tune_filter_prog(prog);
+		ret = run_filter_prog(prog, filter_type->event, record);
+	} else {
+		ret = test_filter(filter_type->event, filter_type->filter,
+				  record, &err);
+		if (err)
+			return err;
+	}
 
 	return ret ? PEVENT_ERRNO__FILTER_MATCH : PEVENT_ERRNO__FILTER_MISS;
 }
@@ -20,15 +20,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "trace-cmd.h"
 
-static struct func_stack {
+struct func_stack {
 	int size;
 	char **stack;
-} *fstack;
+};
+
+/*
+ * A cpu's stack is only used by one thread at a time, but the cpus
+ * may be printed by different threads (trace-cmd report -j). The
+ * array is replaced when it grows, not reallocated under the other
+ * threads, and the old ones are kept until the plugin is unloaded.
+ */
+static struct func_stacks {
+	struct func_stacks	*old;
+	struct func_stack	*added;
+	int			cpus;
+	struct func_stack	*stack[];
+} *fstacks;
 
-static int cpus = -1;
+static pthread_mutex_t fstacks_lock = PTHREAD_MUTEX_INITIALIZER;
 
 #define STK_BLK 10
 
@@ -84,46 +98,91 @@ static void add_child(struct func_stack *stack, const char *child, int pos)
 	stack->stack[pos] = strdup(child);
 }
 
+static struct func_stack *get_stack(int cpu)
+{
+	struct func_stacks *stacks;
+	struct func_stacks *new;
+	int first;
+	int i;
+
+	stacks = __atomic_load_n(&fstacks, __ATOMIC_ACQUIRE);
+	if (stacks && cpu < stacks->cpus)
+		return stacks->stack[cpu];
+
+	pthread_mutex_lock(&fstacks_lock);
+	stacks = fstacks;
+	if (stacks && cpu < stacks->cpus)
+		goto out;
+
+	new = malloc(sizeof(*new) + sizeof(new->stack[0]) * (cpu + 1));
+	if (!new)
+		goto fail;
+
+	/* Account for holes in the cpu count */
+	first = stacks ? stacks->cpus : 0;
+	new->added = calloc(cpu + 1 - first, sizeof(*new->added));
+	if (!new->added) {
+		free(new);
+		goto fail;
+	}
+	for (i = 0; i < first; i++)
+		new->stack[i] = stacks->stack[i];
+	for (; i <= cpu; i++)
+		new->stack[i] = &new->added[i - first];
+	new->cpus = cpu + 1;
+	new->old = stacks;
+
+	__atomic_store_n(&fstacks, new, __ATOMIC_RELEASE);
+	stacks = new;
+ out:
+	pthread_mutex_unlock(&fstacks_lock);
+	return stacks->stack[cpu];
+
+ fail:
+	pthread_mutex_unlock(&fstacks_lock);
+	warning("could not allocate plugin memory\n");
+	return NULL;
+}
+
 static int add_and_get_index(const char *parent, const char *child, int cpu)
 {
+	struct func_stack *stack;
 	int i;
 
 	if (cpu < 0)
 		return 0;
 
-	if (cpu > cpus) {
-		struct func_stack *ptr;
-
-		ptr = realloc(fstack, sizeof(*fstack) * (cpu + 1));
-		if (!ptr) {
-			warning("could not allocate plugin memory\n");
-			return 0;
-		}
-
-		fstack = ptr;
-
-		/* Account for holes in the cpu count */
-		for (i = cpus + 1; i <= cpu; i++)
-			memset(&fstack[i], 0, sizeof(fstack[i]));
-		cpus = cpu;
-	}
+	stack = get_stack(cpu);
+	if (!stack)
+		return 0;
 
-	for (i = 0; i < fstack[cpu].size && fstack[cpu].stack[i]; i++) {
-		if (strcmp(parent, fstack[cpu].stack[i]) == 0) {
-			add_child(&fstack[cpu], child, i+1);
+	for (i = 0; i < stack->size && stack->stack[i]; i++) {
+		if (strcmp(parent, stack->stack[i]) == 0) {
+			add_child(stack, child, i+1);
 			return i;
 		}
 	}
 
 	/* Not found */
-	add_child(&fstack[cpu], parent, 0);
-	add_child(&fstack[cpu], child, 1);
+	add_child(stack, parent, 0);
+	add_child(stack, child, 1);
 	return 0;
 }
 
+/*
+ * Plugins are loaded before the formats are read, so the fields are
+ * found by each thread on the first record it prints.
+ */
+static __thread struct function_fields {
+	struct event_format		*event;
+	struct pevent_field_accessor	ip;
+	struct pevent_field_accessor	parent_ip;
+} function_fields;
+
 static int function_handler(struct trace_seq *s, struct pevent_record *record,
 			    struct event_format *event, void *context)
 {
+	struct function_fields *f = &function_fields;
 	struct pevent *pevent = event->pevent;
 	unsigned long long function;
 	unsigned long long pfunction;
@@ -131,12 +190,19 @@ static int function_handler(struct trace_seq *s, struct pevent_record *record,
 	const char *parent;
 	int index = 0;
 
-	if (pevent_get_field_val(s, event, "ip", record, &function, 1))
+	if (f->event != event) {
+		pevent_field_accessor_find(&f->ip, event, "ip", 0);
+		pevent_field_accessor_find(&f->parent_ip, event, "parent_ip", 0);
+		f->event = event;
+	}
+
+	if (pevent_get_accessor_val(s, &f->ip, "ip", record, &function, 1))
 		return trace_seq_putc(s, '!');
 
 	func = pevent_find_function(pevent, function);
 
-	if (pevent_get_field_val(s, event, "parent_ip", record, &pfunction, 1))
+	if (pevent_get_accessor_val(s, &f->parent_ip, "parent_ip",
+				    record, &pfunction, 1))
 		return trace_seq_putc(s, '!');
 
 	parent = pevent_find_function(pevent, pfunction);
@@ -174,20 +240,28 @@ int PEVENT_PLUGIN_LOADER(struct pevent *pevent)
 
 void PEVENT_PLUGIN_UNLOADER(struct pevent *pevent)
 {
+	struct func_stacks *stacks;
+	struct func_stack *stack;
 	int i, x;
 
 	pevent_unregister_event_handler(pevent, -1, "ftrace", "function",
 					function_handler, NULL);
 
-	for (i = 0; i <= cpus; i++) {
-		for (x = 0; x < fstack[i].size && fstack[i].stack[x]; x++)
-			free(fstack[i].stack[x]);
-		free(fstack[i].stack);
+	for (i = 0; fstacks && i < fstacks->cpus; i++) {
+		stack = fstacks->stack[i];
+		for (x = 0; x < stack->size && stack->stack[x]; x++)
+			free(stack->stack[x]);
+		free(stack->stack);
 	}
 
 	trace_util_remove_options(plugin_options);
 
-	free(fstack);
-	fstack = NULL;
-	cpus = -1;
+	memset(&function_fields, 0, sizeof(function_fields));
+
+	while (fstacks) {
+		stacks = fstacks;
+		fstacks = stacks->old;
+		free(stacks->added);
+		free(stacks);
+	}
 }
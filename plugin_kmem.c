@@ -23,19 +23,41 @@
 
 #include "trace-cmd.h"
 
+static const char *call_site_events[] = {
+	"kfree",
+	"kmalloc",
+	"kmalloc_node",
+	"kmem_cache_alloc",
+	"kmem_cache_alloc_node",
+	"kmem_cache_free",
+};
+
+#define NR_CALL_SITE_EVENTS \
+	(sizeof(call_site_events) / sizeof(call_site_events[0]))
+
+/*
+ * The call_site field of each event, found on the first record of
+ * the event. The handler's context is the index of the event.
+ */
+static __thread struct call_site_field {
+	struct event_format		*event;
+	struct pevent_field_accessor	call_site;
+} call_site_fields[NR_CALL_SITE_EVENTS];
+
 static int call_site_handler(struct trace_seq *s, struct pevent_record *record,
 			     struct event_format *event, void *context)
 {
-	struct format_field *field;
+	struct call_site_field *f = &call_site_fields[(long)context];
 	unsigned long long val, addr;
-	void *data = record->data;
 	const char *func;
 
-	field = pevent_find_field(event, "call_site");
-	if (!field)
-		return 1;
+	if (f->event != event) {
+		pevent_field_accessor_find(&f->call_site, event, "call_site", 0);
+		f->event = event;
+	}
 
-	if (pevent_read_number_field(field, data, &val))
+	if (pevent_get_accessor_val(NULL, &f->call_site, "call_site",
+				    record, &val, 0))
 		return 1;
 
 	func = pevent_find_function(event->pevent, val);
@@ -50,45 +72,24 @@ static int call_site_handler(struct trace_seq *s, struct pevent_record *record,
 
 int PEVENT_PLUGIN_LOADER(struct pevent *pevent)
 {
-	pevent_register_event_handler(pevent, -1, "kmem", "kfree",
-				      call_site_handler, NULL);
-
-	pevent_register_event_handler(pevent, -1, "kmem", "kmalloc",
-				      call_site_handler, NULL);
+	long i;
 
-	pevent_register_event_handler(pevent, -1, "kmem", "kmalloc_node",
-				      call_site_handler, NULL);
-
-	pevent_register_event_handler(pevent, -1, "kmem", "kmem_cache_alloc",
-				      call_site_handler, NULL);
-
-	pevent_register_event_handler(pevent, -1, "kmem", "kmem_cache_alloc_node",
-				      call_site_handler, NULL);
-
-	pevent_register_event_handler(pevent, -1, "kmem", "kmem_cache_free",
-				      call_site_handler, NULL);
+	for (i = 0; i < NR_CALL_SITE_EVENTS; i++)
+		pevent_register_event_handler(pevent, -1, "kmem",
+					      call_site_events[i],
+					      call_site_handler, (void *)i);
 
 	return 0;
 }
 
 void PEVENT_PLUGIN_UNLOADER(struct pevent *pevent)
 {
-	pevent_unregister_event_handler(pevent, -1, "kmem", "kfree",
-					call_site_handler, NULL);
-
-	pevent_unregister_event_handler(pevent, -1, "kmem", "kmalloc",
-					call_site_handler, NULL);
-
-	pevent_unregister_event_handler(pevent, -1, "kmem", "kmalloc_node",
-					call_site_handler, NULL);
-
-	pevent_unregister_event_handler(pevent, -1, "kmem", "kmem_cache_alloc",
-					call_site_handler, NULL);
+	long i;
 
-	pevent_unregister_event_handler(pevent, -1, "kmem",
-					"kmem_cache_alloc_node",
-					call_site_handler, NULL);
+	for (i = 0; i < NR_CALL_SITE_EVENTS; i++)
+		pevent_unregister_event_handler(pevent, -1, "kmem",
+						call_site_events[i],
+						call_site_handler, (void *)i);
 
-	pevent_unregister_event_handler(pevent, -1, "kmem", "kmem_cache_free",
-					call_site_handler, NULL);
+	memset(call_site_fields, 0, sizeof(call_site_fields));
 }
@@ -60,33 +60,71 @@ static void write_and_save_comm(struct format_field *field,
 	trace_seq_terminate(s);
 	comm = &s->buffer[len];
 
-	/* Help out the comm to ids. This will handle dups */
-	pevent_register_comm(field->event->pevent, comm, pid);
+	/* Help out the comm to ids. This will handle dups and renames */
+	pevent_register_comm_ts(field->event->pevent, comm, pid, record->ts);
 }
 
+/*
+ * Plugins are loaded before the formats are read, so the fields are
+ * found on the first record of the event. sched_wakeup and
+ * sched_wakeup_new share a handler, its context picks their fields.
+ */
+static __thread struct wakeup_fields {
+	struct event_format		*event;
+	struct pevent_field_accessor	pid;
+	struct pevent_field_accessor	comm;
+	struct pevent_field_accessor	prio;
+	struct pevent_field_accessor	success;
+	struct pevent_field_accessor	target_cpu;
+} wakeup_fields[2];
+
+static __thread struct switch_fields {
+	struct event_format		*event;
+	struct pevent_field_accessor	prev_pid;
+	struct pevent_field_accessor	prev_comm;
+	struct pevent_field_accessor	prev_prio;
+	struct pevent_field_accessor	prev_state;
+	struct pevent_field_accessor	next_pid;
+	struct pevent_field_accessor	next_comm;
+	struct pevent_field_accessor	next_prio;
+} switch_fields;
+
+#define find_field(f, event, name) \
+	pevent_field_accessor_find(&(f)->name, event, #name, 0)
+
 static int sched_wakeup_handler(struct trace_seq *s, struct pevent_record *record,
 				struct event_format *event, void *context)
 {
-	struct format_field *field;
+	struct wakeup_fields *f = &wakeup_fields[(long)context];
 	unsigned long long val;
 
-	if (pevent_get_field_val(s, event, "pid", record, &val, 1))
+	if (f->event != event) {
+		find_field(f, event, pid);
+		find_field(f, event, comm);
+		find_field(f, event, prio);
+		find_field(f, event, success);
+		find_field(f, event, target_cpu);
+		f->event = event;
+	}
+
+	if (pevent_get_accessor_val(s, &f->pid, "pid", record, &val, 1))
 		return trace_seq_putc(s, '!');
 
-	field = pevent_find_any_field(event, "comm");
-	if (field) {
-		write_and_save_comm(field, record, s, val);
+	if (f->comm.field) {
+		write_and_save_comm(f->comm.field, record, s, val);
 		trace_seq_putc(s, ':');
 	}
 	trace_seq_printf(s, "%lld", val);
 
-	if (pevent_get_field_val(s, event, "prio", record, &val, 0) == 0)
+	if (pevent_get_accessor_val(s, &f->prio, "prio", record, &val, 0) == 0)
 		trace_seq_printf(s, " [%lld]", val);
 
-	if (pevent_get_field_val(s, event, "success", record, &val, 1) == 0)
+	if (pevent_get_accessor_val(s, &f->success, "success",
+				    record, &val, 1) == 0)
 		trace_seq_printf(s, " success=%lld", val);
 
-	if (pevent_get_field_val(s, event, "target_cpu", record, &val, 0) == 0)
+	if (pevent_get_accessor_val(s, &f->target_cpu, "target_cpu",
+				    record, &val, 0) == 0)
 		trace_seq_printf(s, " CPU:%03llu", val);
 
 	return 0;
@@ -95,38 +133,52 @@ static int sched_wakeup_handler(struct trace_seq *s, struct pevent_record *recor
 static int sched_switch_handler(struct trace_seq *s, struct pevent_record *record,
 				struct event_format *event, void *context)
 {
-	struct format_field *field;
+	struct switch_fields *f = &switch_fields;
 	unsigned long long val;
 
-	if (pevent_get_field_val(s, event, "prev_pid", record, &val, 1))
+	if (f->event != event) {
+		find_field(f, event, prev_pid);
+		find_field(f, event, prev_comm);
+		find_field(f, event, prev_prio);
+		find_field(f, event, prev_state);
+		find_field(f, event, next_pid);
+		find_field(f, event, next_comm);
+		find_field(f, event, next_prio);
+		f->event = event;
+	}
+
+	if (pevent_get_accessor_val(s, &f->prev_pid, "prev_pid",
+				    record, &val, 1))
 		return trace_seq_putc(s, '!');
 
-	field = pevent_find_any_field(event, "prev_comm");
-	if (field) {
-		write_and_save_comm(field, record, s, val);
+	if (f->prev_comm.field) {
+		write_and_save_comm(f->prev_comm.field, record, s, val);
 		trace_seq_putc(s, ':');
 	}
 	trace_seq_printf(s, "%lld ", val);
 
-	if (pevent_get_field_val(s, event, "prev_prio", record, &val, 0) == 0)
+	if (pevent_get_accessor_val(s, &f->prev_prio, "prev_prio",
+				    record, &val, 0) == 0)
 		trace_seq_printf(s, "[%lld] ", val);
 
-	if (pevent_get_field_val(s,  event, "prev_state", record, &val, 0) == 0)
+	if (pevent_get_accessor_val(s, &f->prev_state, "prev_state",
+				    record, &val, 0) == 0)
 		write_state(s, val);
 
 	trace_seq_puts(s, " ==> ");
 
-	if (pevent_get_field_val(s, event, "next_pid", record, &val, 1))
+	if (pevent_get_accessor_val(s, &f->next_pid, "next_pid",
+				    record, &val, 1))
 		return trace_seq_putc(s, '!');
 
-	field = pevent_find_any_field(event, "next_comm");
-	if (field) {
-		write_and_save_comm(field, record, s, val);
+	if (f->next_comm.field) {
+		write_and_save_comm(f->next_comm.field, record, s, val);
 		trace_seq_putc(s, ':');
 	}
 	trace_seq_printf(s, "%lld", val);
 
-	if (pevent_get_field_val(s, event, "next_prio", record, &val, 0) == 0)
+	if (pevent_get_accessor_val(s, &f->next_prio, "next_prio",
+				    record, &val, 0) == 0)
 		trace_seq_printf(s, " [%lld]", val);
 
 	return 0;
@@ -138,10 +190,10 @@ int PEVENT_PLUGIN_LOADER(struct pevent *pevent)
 				      sched_switch_handler, NULL);
 
 	pevent_register_event_handler(pevent, -1, "sched", "sched_wakeup",
-				      sched_wakeup_handler, NULL);
+				      sched_wakeup_handler, (void *)0);
 
 	pevent_register_event_handler(pevent, -1, "sched", "sched_wakeup_new",
-				      sched_wakeup_handler, NULL);
+				      sched_wakeup_handler, (void *)1);
 
 	return 0;
 }
@@ -152,8 +204,11 @@ void PEVENT_PLUGIN_UNLOADER(struct pevent *pevent)
 					sched_switch_handler, NULL);
 
 	pevent_unregister_event_handler(pevent, -1, "sched", "sched_wakeup",
-					sched_wakeup_handler, NULL);
+					sched_wakeup_handler, (void *)0);
 
 	pevent_unregister_event_handler(pevent, -1, "sched", "sched_wakeup_new",
-					sched_wakeup_handler, NULL);
+					sched_wakeup_handler, (void *)1);
+
+	memset(wakeup_fields, 0, sizeof(wakeup_fields));
+	memset(&switch_fields, 0, sizeof(switch_fields));
 }
@@ -0,0 +1,352 @@
+/*
+ * trace-cache.c : keep the parsed kallsyms of a kernel on disk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License (not later!)
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not,  see <http://www.gnu.org/licenses>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * Parsing and sorting the kallsyms of a kernel takes most of the time
+ * of opening a trace.dat file. The sorted function map is saved under
+ * the cache directory, keyed by a hash of the kallsyms text, and the
+ * next file recorded on the same kernel maps it back in.
+ *
+ * The cache is only used if the directory exists:
+ *
+ *   $XDG_CACHE_HOME/trace-cmd  (default ~/.cache/trace-cmd)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace-cmd.h"
+
+#define CACHE_DIR		"trace-cmd"
+#define KALLSYMS_MAGIC		"tcksyms"
+#define KALLSYMS_VERSION	1
+#define KALLSYMS_NO_MOD		((unsigned int)-1)
+
+struct kallsyms_header {
+	char			magic[8];
+	unsigned int		version;
+	unsigned int		count;
+	unsigned long long	hash;
+	unsigned long long	size;
+	unsigned long long	strings;
+};
+
+/* Followed by the string table of the func and mod offsets */
+struct kallsyms_entry {
+	unsigned long long	addr;
+	unsigned int		func;
+	unsigned int		mod;
+};
+
+struct kallsyms_cache {
+	void			*map;
+	size_t			size;
+	struct func_map		*funcs;
+};
+
+static char *cache_dir(void)
+{
+	struct stat st;
+	char *path;
+	char *home;
+	int ret;
+
+	home = getenv("XDG_CACHE_HOME");
+	if (home && *home)
+		ret = asprintf(&path, "%s/%s", home, CACHE_DIR);
+	else {
+		home = getenv("HOME");
+		if (!home)
+			return NULL;
+		ret = asprintf(&path, "%s/.cache/%s", home, CACHE_DIR);
+	}
+	if (ret < 0)
+		return NULL;
+
+	if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		free(path);
+		return NULL;
+	}
+
+	return path;
+}
+
+static unsigned long long cache_hash(const char *buf, unsigned int size)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	unsigned long long word;
+	unsigned int i;
+
+	for (i = 0; i + sizeof(word) <= size; i += sizeof(word)) {
+		memcpy(&word, buf + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+	for (; i < size; i++)
+		hash = (hash ^ (unsigned char)buf[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+static void free_kallsyms_cache(void *data)
+{
+	struct kallsyms_cache *cache = data;
+
+	munmap(cache->map, cache->size);
+	free(cache->funcs);
+	free(cache);
+}
+
+static int load_kallsyms_cache(struct pevent *pevent, const char *file,
+			       unsigned long long hash, unsigned int size)
+{
+	struct kallsyms_header *header;
+	struct kallsyms_entry *entries;
+	struct kallsyms_cache *cache;
+	struct func_map *funcs = NULL;
+	unsigned long long left;
+	struct stat st;
+	char *strings;
+	void *map;
+	unsigned int i;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*header)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	header = map;
+	if (memcmp(header->magic, KALLSYMS_MAGIC, sizeof(header->magic)) ||
+	    header->version != KALLSYMS_VERSION ||
+	    header->hash != hash || header->size != size || !header->strings)
+		goto fail;
+
+	/* Check each part against what is left, so the sum can not wrap */
+	left = st.st_size - sizeof(*header);
+	if (header->strings > left ||
+	    header->count > (left - header->strings) / sizeof(*entries) ||
+	    left != header->strings + sizeof(*entries) * header->count)
+		goto fail;
+
+	entries = (struct kallsyms_entry *)(header + 1);
+	strings = (char *)(entries + header->count);
+
+	/* Every offset must land in the table, which ends with a '\0' */
+	if (strings[header->strings - 1])
+		goto fail;
+
+	funcs = malloc(sizeof(*funcs) * (header->count + 1));
+	if (!funcs)
+		goto fail;
+
+	for (i = 0; i < header->count; i++) {
+		if (entries[i].func >= header->strings ||
+		    (entries[i].mod != KALLSYMS_NO_MOD &&
+		     entries[i].mod >= header->strings) ||
+		    (i && entries[i].addr < entries[i - 1].addr))
+			goto fail;
+		funcs[i].addr = entries[i].addr;
+		funcs[i].func = strings + entries[i].func;
+		if (entries[i].mod == KALLSYMS_NO_MOD)
+			funcs[i].mod = NULL;
+		else
+			funcs[i].mod = strings + entries[i].mod;
+	}
+	memset(&funcs[i], 0, sizeof(funcs[i]));
+
+	cache = malloc(sizeof(*cache));
+	if (!cache)
+		goto fail;
+	cache->map = map;
+	cache->size = st.st_size;
+	cache->funcs = funcs;
+
+	if (pevent_set_func_map(pevent, funcs, header->count,
+				free_kallsyms_cache, cache)) {
+		free(cache);
+		goto fail;
+	}
+
+	return 0;
+
+ fail:
+	free(funcs);
+	munmap(map, st.st_size);
+	return -1;
+}
+
+/* The sorted functions of a module sit together, and share its name */
+static int new_mod(struct func_map *funcs, int i)
+{
+	return funcs[i].mod &&
+		(!i || !funcs[i - 1].mod ||
+		 strcmp(funcs[i].mod, funcs[i - 1].mod) != 0);
+}
+
+static int write_kallsyms_cache(FILE *fp, struct func_map *funcs, int count,
+				unsigned long long hash, unsigned int size)
+{
+	struct kallsyms_header header;
+	struct kallsyms_entry entry;
+	unsigned long long strings = 0;
+	unsigned long long mod = 0;
+	int i;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, KALLSYMS_MAGIC, sizeof(header.magic));
+	header.version = KALLSYMS_VERSION;
+	header.count = count;
+	header.hash = hash;
+	header.size = size;
+
+	for (i = 0; i < count; i++) {
+		strings += strlen(funcs[i].func) + 1;
+		if (new_mod(funcs, i))
+			strings += strlen(funcs[i].mod) + 1;
+	}
+	if (strings >= KALLSYMS_NO_MOD)
+		return -1;
+	header.strings = strings;
+
+	if (fwrite(&header, sizeof(header), 1, fp) != 1)
+		return -1;
+
+	strings = 0;
+	for (i = 0; i < count; i++) {
+		memset(&entry, 0, sizeof(entry));
+		entry.addr = funcs[i].addr;
+		entry.func = strings;
+		strings += strlen(funcs[i].func) + 1;
+		entry.mod = KALLSYMS_NO_MOD;
+		if (new_mod(funcs, i)) {
+			mod = strings;
+			strings += strlen(funcs[i].mod) + 1;
+		}
+		if (funcs[i].mod)
+			entry.mod = mod;
+		if (fwrite(&entry, sizeof(entry), 1, fp) != 1)
+			return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (fputs(funcs[i].func, fp) == EOF || fputc(0, fp) == EOF)
+			return -1;
+		if (new_mod(funcs, i) &&
+		    (fputs(funcs[i].mod, fp) == EOF || fputc(0, fp) == EOF))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void save_kallsyms_cache(struct pevent *pevent, const char *file,
+				unsigned long long hash, unsigned int size)
+{
+	struct func_map *funcs;
+	char *tmp;
+	FILE *fp;
+	int count;
+	int ret;
+	int fd;
+
+	count = pevent_get_func_map(pevent, &funcs);
+	if (count <= 0)
+		return;
+
+	/* Other readers only ever see a complete file */
+	if (asprintf(&tmp, "%s.XXXXXX", file) < 0)
+		return;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto out_free;
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		goto out_unlink;
+	}
+
+	ret = write_kallsyms_cache(fp, funcs, count, hash, size);
+	if (fclose(fp) || ret < 0)
+		goto out_unlink;
+
+	if (rename(tmp, file) == 0)
+		goto out_free;
+
+ out_unlink:
+	unlink(tmp);
+ out_free:
+	free(tmp);
+}
+
+/**
+ * tracecmd_parse_proc_kallsyms - parse kallsyms through the cache
+ * @pevent: the handle to register the functions with
+ * @file: the kallsyms text
+ * @size: the size of @file
+ *
+ * Does what parse_proc_kallsyms() does. If the cache directory exists,
+ * the function map that was saved for the same kallsyms is used
+ * instead, or the map is saved there after parsing. Like
+ * parse_proc_kallsyms(), this modifies @file.
+ */
+void tracecmd_parse_proc_kallsyms(struct pevent *pevent, char *file,
+				  unsigned int size)
+{
+	unsigned long long hash = 0;
+	char *path = NULL;
+	char *dir;
+	int ret;
+
+	/* The cache holds the whole map, it can not be merged into one */
+	dir = pevent->func_count ? NULL : cache_dir();
+	if (dir) {
+		hash = cache_hash(file, size);
+		ret = asprintf(&path, "%s/kallsyms-%x-%016llx", dir, size, hash);
+		free(dir);
+		if (ret < 0)
+			path = NULL;
+	}
+
+	if (path && load_kallsyms_cache(pevent, path, hash, size) == 0) {
+		free(path);
+		return;
+	}
+
+	parse_proc_kallsyms(pevent, file, size);
+
+	if (path) {
+		save_kallsyms_cache(pevent, path, hash, size);
+		free(path);
+	}
+}
@@ -33,6 +33,8 @@ void parse_cmdlines(struct pevent *pevent, char *file, int size);
 void parse_trace_clock(struct pevent *pevent, char *file, int size);
 void parse_proc_kallsyms(struct pevent *pevent, char *file, unsigned int size);
 void parse_ftrace_printk(struct pevent *pevent, char *file, unsigned int size);
+void tracecmd_parse_proc_kallsyms(struct pevent *pevent, char *file,
+				  unsigned int size);
 
 extern int tracecmd_disable_sys_plugins;
 extern int tracecmd_disable_plugins;
@@ -103,6 +105,15 @@ struct tracecmd_ftrace {
 	struct event_format *fgraph_ret_event;
 	int fgraph_ret_id;
 	int long_size;
+	/* Fields of the function graph events, resolved with the ret event */
+	struct pevent_field_accessor	common_type;
+	struct pevent_field_accessor	common_pid;
+	struct pevent_field_accessor	ent_func;
+	struct pevent_field_accessor	ent_depth;
+	struct pevent_field_accessor	ret_func;
+	struct pevent_field_accessor	ret_depth;
+	struct pevent_field_accessor	ret_calltime;
+	struct pevent_field_accessor	ret_rettime;
 };
 
 struct tracecmd_input *tracecmd_alloc(const char *file);
@@ -187,7 +198,16 @@ int tracecmd_set_cursor(struct tracecmd_input *handle,
 unsigned long long
 tracecmd_get_cursor(struct tracecmd_input *handle, int cpu);
 
+int tracecmd_load_page_index(struct tracecmd_input *handle, const char *file,
+			     int build);
+int tracecmd_set_page_filter(struct tracecmd_input *handle,
+			     const int *ids, int nr_ids,
+			     const int *pids, int nr_pids);
+
 int tracecmd_ftrace_overrides(struct tracecmd_input *handle, struct tracecmd_ftrace *finfo);
+struct pevent_record *
+tracecmd_ftrace_read_ahead(struct tracecmd_input *handle,
+			   struct pevent_record *record);
 struct pevent *tracecmd_get_pevent(struct tracecmd_input *handle);
 bool tracecmd_get_use_trace_clock(struct tracecmd_input *handle);
 
@@ -203,6 +223,13 @@ unsigned int tracecmd_record_ts_delta(struct tracecmd_input *handle,
 #ifndef SWIG
 /* hack for function graph work around */
 extern __thread struct tracecmd_input *tracecmd_curr_thread_handle;
+
+/* The leaf return read ahead for entry, see tracecmd_ftrace_read_ahead() */
+struct tracecmd_ftrace_leaf {
+	struct pevent_record		*entry;
+	struct pevent_record		*ret;
+};
+extern __thread struct tracecmd_ftrace_leaf tracecmd_curr_leaf;
 #endif
 
 
@@ -251,6 +278,14 @@ int tracecmd_append_buffer_cpu_data(struct tracecmd_output *handle,
 				    int cpus, char * const *cpu_data_files);
 int tracecmd_attach_cpu_data(char *file, int cpus, char * const *cpu_data_files);
 int tracecmd_attach_cpu_data_fd(int fd, int cpus, char * const *cpu_data_files);
+int tracecmd_attach_buffers_fd(int fd, int cpus, char * const *cpu_data_files,
+			       int nr_buffers, char * const *buffer_names);
+struct tracecmd_output *tracecmd_get_output_handle_fd(int fd);
+off64_t tracecmd_buffers_table_size(struct tracecmd_output *handle, int cpus,
+				    int nr_buffers, char * const *buffer_names);
+int tracecmd_write_buffers_table(struct tracecmd_output *handle, int cpus,
+				 int nr_buffers, char * const *buffer_names,
+				 off64_t *offsets, unsigned long long *sizes);
 
 /* --- Reading the Fly Recorder Trace --- */
 
@@ -279,11 +314,26 @@ int tracecmd_msg_send_init_data(int fd);
 int tracecmd_msg_metadata_send(int fd, const char *buf, int size);
 int tracecmd_msg_finish_sending_metadata(int fd);
 void tracecmd_msg_send_close_msg(void);
+int tracecmd_msg_send_data_streams(int fd, int cpus, int nr_fds, int *fds);
+int tracecmd_msg_send_udp_streams(int fd, int nr_fds, int *fds, int *socks);
+int tracecmd_msg_add_buffer(const char *name);
+int tracecmd_msg_set_compression(int level);
+void tracecmd_msg_set_bulk_metadata(void);
+void tracecmd_msg_set_udp_credits(void);
 
 /* for server */
 int tracecmd_msg_initial_setting(int fd, int *cpus, int *pagesize);
 int tracecmd_msg_send_port_array(int fd, int total_cpus, int *ports);
+typedef long long (*tracecmd_msg_reserve_func)(int fd, int stream, unsigned int *size);
 int tracecmd_msg_collect_metadata(int ifd, int ofd);
+int tracecmd_msg_read_metadata(int ifd, int ofd);
+int tracecmd_msg_wait_close(int ifd);
+typedef unsigned int (*tracecmd_msg_credit_func)(int stream);
+int tracecmd_msg_wait_close_credits(int ifd, int nr_streams, int wake_fd,
+				    tracecmd_msg_credit_func credit);
+int tracecmd_msg_collect_data(int ifd, int ofd, int cpus, int nr_streams,
+			      tracecmd_msg_reserve_func reserve);
+char * const *tracecmd_msg_get_buffers(int *nr_buffers);
 
 /* msg debugging */
 void tracecmd_msg_set_debug(int debug);
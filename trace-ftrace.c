@@ -45,6 +45,8 @@ struct pevent_plugin_option trace_ftrace_options[] = {
 static struct pevent_plugin_option *fgraph_tail = &trace_ftrace_options[0];
 static struct pevent_plugin_option *fgraph_depth = &trace_ftrace_options[1];
 
+__thread struct tracecmd_ftrace_leaf tracecmd_curr_leaf;
+
 static void find_long_size(struct tracecmd_ftrace *finfo)
 {
 	finfo->long_size = tracecmd_long_size(finfo->handle);
@@ -65,8 +67,19 @@ static int find_ret_event(struct tracecmd_ftrace *finfo, struct pevent *pevent)
 	if (!event)
 		return -1;
 
+	pevent_field_accessor_find(&finfo->common_type, event, "common_type", 0);
+	pevent_field_accessor_find(&finfo->common_pid, event, "common_pid", 0);
+	pevent_field_accessor_find(&finfo->ret_func, event, "func", 0);
+	pevent_field_accessor_find(&finfo->ret_depth, event, "depth", 0);
+	pevent_field_accessor_find(&finfo->ret_calltime, event, "calltime", 0);
+	pevent_field_accessor_find(&finfo->ret_rettime, event, "rettime", 0);
+
 	finfo->fgraph_ret_id = event->id;
 	finfo->fgraph_ret_event = event;
+
+	event = pevent_find_event_by_name(pevent, "ftrace", "funcgraph_entry");
+	pevent_field_accessor_find(&finfo->ent_func, event, "func", 0);
+	pevent_field_accessor_find(&finfo->ent_depth, event, "depth", 0);
 	return 0;
 }
 
@@ -76,14 +89,32 @@ static int find_ret_event(struct tracecmd_ftrace *finfo, struct pevent *pevent)
 			return -1;					\
 	} while (0)
 
+/*
+ * The handler is registered before the formats are read, so the fields
+ * are found on the first record. With report -j the function events
+ * are printed on several threads, each thread keeps its own.
+ */
+static __thread struct function_fields {
+	struct event_format		*event;
+	struct pevent_field_accessor	ip;
+	struct pevent_field_accessor	parent_ip;
+} function_fields;
+
 static int function_handler(struct trace_seq *s, struct pevent_record *record,
 			    struct event_format *event, void *context)
 {
+	struct function_fields *f = &function_fields;
 	struct pevent *pevent = event->pevent;
 	unsigned long long function;
 	const char *func;
 
-	if (pevent_get_field_val(s, event, "ip", record, &function, 1))
+	if (f->event != event) {
+		pevent_field_accessor_find(&f->ip, event, "ip", 0);
+		pevent_field_accessor_find(&f->parent_ip, event, "parent_ip", 0);
+		f->event = event;
+	}
+
+	if (pevent_get_accessor_val(s, &f->ip, "ip", record, &function, 1))
 		return trace_seq_putc(s, '!');
 
 	func = pevent_find_function(pevent, function);
@@ -92,7 +123,8 @@ static int function_handler(struct trace_seq *s, struct pevent_record *record,
 	else
 		trace_seq_printf(s, "0x%llx", function);
 
-	if (pevent_get_field_val(s, event, "parent_ip", record, &function, 1))
+	if (pevent_get_accessor_val(s, &f->parent_ip, "parent_ip",
+				    record, &function, 1))
 		return trace_seq_putc(s, '!');
 
 	func = pevent_find_function(pevent, function);
@@ -107,36 +139,38 @@ static int function_handler(struct trace_seq *s, struct pevent_record *record,
 #define TRACE_GRAPH_INDENT		2
 
 static struct pevent_record *
-get_return_for_leaf(struct trace_seq *s, int cpu, int cur_pid,
-		    unsigned long long cur_func, struct pevent_record *next,
-		    struct tracecmd_ftrace *finfo)
+get_return_for_leaf(struct trace_seq *s, struct tracecmd_input *handle,
+		    int cpu, int cur_pid, unsigned long long cur_func,
+		    struct pevent_record *next, struct tracecmd_ftrace *finfo)
 {
 	unsigned long long val;
 	unsigned long long type;
 	unsigned long long pid;
 
 	/* Searching a common field, can use any event */
-	if (pevent_get_common_field_val(s, finfo->fgraph_ret_event, "common_type", next, &type, 1))
+	if (pevent_get_accessor_val(s, &finfo->common_type, "common_type",
+				    next, &type, 1))
 		return NULL;
 
 	if (type != finfo->fgraph_ret_id)
 		return NULL;
 
-	if (pevent_get_common_field_val(s, finfo->fgraph_ret_event, "common_pid", next, &pid, 1))
+	if (pevent_get_accessor_val(s, &finfo->common_pid, "common_pid",
+				    next, &pid, 1))
 		return NULL;
 
 	if (cur_pid != pid)
 		return NULL;
 
 	/* We aleady know this is a funcgraph_ret_event */
-	if (pevent_get_field_val(s, finfo->fgraph_ret_event, "func", next, &val, 1))
+	if (pevent_get_accessor_val(s, &finfo->ret_func, "func", next, &val, 1))
 		return NULL;
 
 	if (cur_func != val)
 		return NULL;
 
 	/* this is a leaf, now advance the iterator */
-	return tracecmd_read_data(tracecmd_curr_thread_handle, cpu);
+	return tracecmd_read_data(handle, cpu);
 }
 
 /* Signal a overhead of time execution to the output */
@@ -214,10 +248,12 @@ print_graph_entry_leaf(struct trace_seq *s,
 	int ret;
 	int i;
 
-	if (pevent_get_field_val(s, finfo->fgraph_ret_event, "rettime", ret_rec, &rettime, 1))
+	if (pevent_get_accessor_val(s, &finfo->ret_rettime, "rettime",
+				    ret_rec, &rettime, 1))
 		return trace_seq_putc(s, '!');
 
-	if (pevent_get_field_val(s, finfo->fgraph_ret_event, "calltime", ret_rec, &calltime, 1))
+	if (pevent_get_accessor_val(s, &finfo->ret_calltime, "calltime",
+				    ret_rec, &calltime, 1))
 		return trace_seq_putc(s, '!');
 
 	duration = rettime - calltime;
@@ -228,14 +264,16 @@ print_graph_entry_leaf(struct trace_seq *s,
 	/* Duration */
 	print_graph_duration(s, duration);
 
-	if (pevent_get_field_val(s, event, "depth", record, &depth, 1))
+	if (pevent_get_accessor_val(s, &finfo->ent_depth, "depth",
+				    record, &depth, 1))
 		return trace_seq_putc(s, '!');
 
 	/* Function */
 	for (i = 0; i < (int)(depth * TRACE_GRAPH_INDENT); i++)
 		trace_seq_putc(s, ' ');
 
-	if (pevent_get_field_val(s, event, "func", record, &val, 1))
+	if (pevent_get_accessor_val(s, &finfo->ent_func, "func",
+				    record, &val, 1))
 		return trace_seq_putc(s, '!');
 	func = pevent_find_function(pevent, val);
 
@@ -252,7 +290,8 @@ print_graph_entry_leaf(struct trace_seq *s,
 
 static int print_graph_nested(struct trace_seq *s,
 			      struct event_format *event,
-			      struct pevent_record *record)
+			      struct pevent_record *record,
+			      struct tracecmd_ftrace *finfo)
 {
 	struct pevent *pevent = event->pevent;
 	unsigned long long depth;
@@ -267,14 +306,16 @@ static int print_graph_nested(struct trace_seq *s,
 	/* No time */
 	trace_seq_puts(s, "           |  ");
 
-	if (pevent_get_field_val(s, event, "depth", record, &depth, 1))
+	if (pevent_get_accessor_val(s, &finfo->ent_depth, "depth",
+				    record, &depth, 1))
 		return trace_seq_putc(s, '!');
 
 	/* Function */
 	for (i = 0; i < (int)(depth * TRACE_GRAPH_INDENT); i++)
 		trace_seq_putc(s, ' ');
 
-	if (pevent_get_field_val(s, event, "func", record, &val, 1))
+	if (pevent_get_accessor_val(s, &finfo->ent_func, "func",
+				    record, &val, 1))
 		return trace_seq_putc(s, '!');
 
 	func = pevent_find_function(pevent, val);
@@ -295,21 +336,31 @@ fgraph_ent_handler(struct trace_seq *s, struct pevent_record *record,
 		   struct event_format *event, void *context)
 {
 	struct tracecmd_ftrace *finfo = context;
+	struct tracecmd_input *handle = tracecmd_curr_thread_handle;
 	struct pevent_record *rec;
 	unsigned long long val, pid;
 	int cpu = record->cpu;
+	int read_ahead;
 
 	ret_event_check(finfo, event->pevent);
 
-	if (pevent_get_common_field_val(s, event, "common_pid", record, &pid, 1))
+	if (pevent_get_accessor_val(s, &finfo->common_pid, "common_pid",
+				    record, &pid, 1))
 		return trace_seq_putc(s, '!');
 
-	if (pevent_get_field_val(s, event, "func", record, &val, 1))
+	if (pevent_get_accessor_val(s, &finfo->ent_func, "func",
+				    record, &val, 1))
 		return trace_seq_putc(s, '!');
 
-	rec = tracecmd_peek_data(tracecmd_curr_thread_handle, cpu);
-	if (rec)
-		rec = get_return_for_leaf(s, cpu, pid, val, rec, finfo);
+	read_ahead = tracecmd_curr_leaf.entry == record;
+	if (read_ahead)
+		rec = tracecmd_curr_leaf.ret;
+	else {
+		rec = tracecmd_peek_data(handle, cpu);
+		if (rec)
+			rec = get_return_for_leaf(s, handle, cpu, pid, val,
+						  rec, finfo);
+	}
 
 	if (rec) {
 		/*
@@ -317,9 +368,10 @@ fgraph_ent_handler(struct trace_seq *s, struct pevent_record *record,
 		 * returns the return of the function
 		 */
 		print_graph_entry_leaf(s, event, record, rec, finfo);
-		free_record(rec);
+		if (!read_ahead)
+			free_record(rec);
 	} else
-		print_graph_nested(s, event, record);
+		print_graph_nested(s, event, record, finfo);
 
 	return 0;
 }
@@ -337,10 +389,12 @@ fgraph_ret_handler(struct trace_seq *s, struct pevent_record *record,
 
 	ret_event_check(finfo, event->pevent);
 
-	if (pevent_get_field_val(s, event, "rettime", record, &rettime, 1))
+	if (pevent_get_accessor_val(s, &finfo->ret_rettime, "rettime",
+				    record, &rettime, 1))
 		return trace_seq_putc(s, '!');
 
-	if (pevent_get_field_val(s, event, "calltime", record, &calltime, 1))
+	if (pevent_get_accessor_val(s, &finfo->ret_calltime, "calltime",
+				    record, &calltime, 1))
 		return trace_seq_putc(s, '!');
 
 	duration = rettime - calltime;
@@ -351,7 +405,8 @@ fgraph_ret_handler(struct trace_seq *s, struct pevent_record *record,
 	/* Duration */
 	print_graph_duration(s, duration);
 
-	if (pevent_get_field_val(s, event, "depth", record, &depth, 1))
+	if (pevent_get_accessor_val(s, &finfo->ret_depth, "depth",
+				    record, &depth, 1))
 		return trace_seq_putc(s, '!');
 
 	/* Function */
@@ -361,7 +416,8 @@ fgraph_ret_handler(struct trace_seq *s, struct pevent_record *record,
 	trace_seq_putc(s, '}');
 
 	if (fgraph_tail->set) {
-		if (pevent_get_field_val(s, event, "func", record, &val, 0))
+		if (pevent_get_accessor_val(s, &finfo->ret_func, "func",
+					    record, &val, 0))
 			return 0;
 		func = pevent_find_function(event->pevent, val);
 		if (!func)
@@ -429,7 +485,6 @@ int tracecmd_ftrace_overrides(struct tracecmd_input *handle,
 	struct tracecmd_ftrace *finfo)
 {
 	struct pevent *pevent;
-	struct event_format *event;
 
 	finfo->handle = handle;
 
@@ -449,15 +504,71 @@ int tracecmd_ftrace_overrides(struct tracecmd_input *handle,
 
 	trace_util_add_options("ftrace", trace_ftrace_options);
 
-	/* Store the func ret id and event for later use */
-	event = pevent_find_event_by_name(pevent, "ftrace", "funcgraph_exit");
-	if (!event)
+	/* Store the func ret id, event and fields for later use */
+	if (find_ret_event(finfo, pevent) < 0)
 		return 0;
 
 	finfo->long_size = tracecmd_long_size(handle);
 
-	finfo->fgraph_ret_id = event->id;
-	finfo->fgraph_ret_event = event;
-
 	return 0;
 }
+
+/**
+ * tracecmd_ftrace_read_ahead - read what printing a record reads ahead
+ * @handle: the handle that @record was read from
+ * @record: the record that is next to print
+ *
+ * Printing a function graph entry peeks at the next record of its cpu,
+ * and consumes it if it is the return of a leaf function. That only
+ * works when the record is printed as soon as it is read. Call this
+ * instead when @record is next in order, and set tracecmd_curr_leaf to
+ * @record and the returned record on the thread that prints @record
+ * later. This also resolves what the ftrace handlers look up on their
+ * first use, so that they can be run on several threads.
+ *
+ * Returns the return of the leaf function, which must be freed with
+ * free_record() once @record is printed, or NULL.
+ */
+struct pevent_record *
+tracecmd_ftrace_read_ahead(struct tracecmd_input *handle,
+			   struct pevent_record *record)
+{
+	struct tracecmd_ftrace *finfo;
+	struct event_format *event;
+	struct pevent_record *next;
+	unsigned long long val, pid;
+
+	event = pevent_find_event_by_record(tracecmd_get_pevent(handle), record);
+	if (!event)
+		return NULL;
+
+	if (event->handler == trace_stack_handler) {
+		finfo = event->context;
+		long_size_check(finfo);
+		return NULL;
+	}
+
+	if (event->handler != fgraph_ent_handler &&
+	    event->handler != fgraph_ret_handler)
+		return NULL;
+
+	finfo = event->context;
+	if (!finfo->fgraph_ret_event && find_ret_event(finfo, event->pevent) < 0)
+		return NULL;
+
+	if (event->handler != fgraph_ent_handler)
+		return NULL;
+
+	if (pevent_get_accessor_val(NULL, &finfo->common_pid, "common_pid",
+				    record, &pid, 0) ||
+	    pevent_get_accessor_val(NULL, &finfo->ent_func, "func",
+				    record, &val, 0))
+		return NULL;
+
+	next = tracecmd_peek_data(handle, record->cpu);
+	if (!next)
+		return NULL;
+
+	return get_return_for_leaf(NULL, handle, record->cpu, pid, val,
+				   next, finfo);
+}
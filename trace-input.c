@@ -29,6 +29,7 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/param.h>
 #include <pthread.h>
 #include <regex.h>
 #include <fcntl.h>
@@ -73,6 +74,9 @@ struct cpu_data {
 	struct kbuffer		*kbuf;
 	int			cpu;
 	int			pipe_fd;
+	/* See tracecmd_load_page_index() and tracecmd_set_page_filter() */
+	struct page_index_region *index;
+	unsigned long long	*page_filter;
 };
 
 struct input_buffer_instance {
@@ -104,6 +108,8 @@ struct tracecmd_input {
 	struct tracecmd_ftrace	finfo;
 
 	struct hook_list	*hooks;
+	/* The page index that cpu_data points into */
+	void			*page_index;
 	/* file information */
 	size_t			header_files_start;
 	size_t			ftrace_files_start;
@@ -391,11 +397,80 @@ static int regex_event_buf(const char *file, int size, regex_t *epreg)
 	return ret;
 }
 
+/*
+ * The event formats are read from the file first, and then parsed
+ * together by pevent_parse_events(), which spreads the parsing over
+ * a pool of threads.
+ */
+struct format_list {
+	struct pevent_format_buf	*formats;
+	int				nr_formats;
+	char				**systems;
+	int				nr_systems;
+};
+
+static int add_format(struct format_list *list, const char *system,
+		      char *buf, unsigned long long size)
+{
+	struct pevent_format_buf *formats;
+
+	formats = realloc(list->formats,
+			  sizeof(*formats) * (list->nr_formats + 1));
+	if (!formats)
+		return -1;
+	list->formats = formats;
+
+	formats += list->nr_formats++;
+	memset(formats, 0, sizeof(*formats));
+	formats->sys = system;
+	formats->buf = buf;
+	formats->size = size;
+
+	return 0;
+}
+
+static int add_format_system(struct format_list *list, char *system)
+{
+	char **systems;
+
+	systems = realloc(list->systems,
+			  sizeof(*systems) * (list->nr_systems + 1));
+	if (!systems)
+		return -1;
+	list->systems = systems;
+	systems[list->nr_systems++] = system;
+
+	return 0;
+}
+
+static void free_format_list(struct format_list *list)
+{
+	int i;
+
+	for (i = 0; i < list->nr_formats; i++)
+		free(list->formats[i].buf);
+	free(list->formats);
+
+	for (i = 0; i < list->nr_systems; i++)
+		free(list->systems[i]);
+	free(list->systems);
+}
+
+static void parse_format_list(struct tracecmd_input *handle,
+			      struct format_list *list)
+{
+	struct pevent *pevent = handle->pevent;
+
+	if (pevent_parse_events(pevent, list->formats, list->nr_formats,
+				0, NULL, NULL))
+		pevent->parsing_failures = 1;
+}
+
 static int read_ftrace_file(struct tracecmd_input *handle,
 			    unsigned long long size,
-			    int print, regex_t *epreg)
+			    int print, regex_t *epreg,
+			    struct format_list *list)
 {
-	struct pevent *pevent = handle->pevent;
 	char *buf;
 
 	buf = malloc(size);
@@ -409,11 +484,15 @@ static int read_ftrace_file(struct tracecmd_input *handle,
 	if (epreg) {
 		if (print || regex_event_buf(buf, size, epreg))
 			printf("%.*s\n", (int)size, buf);
-	} else {
-		if (pevent_parse_event(pevent, buf, size, "ftrace"))
-			pevent->parsing_failures = 1;
+		free(buf);
+		return 0;
+	}
+
+	/* The list owns the buffer now, it is parsed with the others */
+	if (add_format(list, "ftrace", buf, size) < 0) {
+		free(buf);
+		return -1;
 	}
-	free(buf);
 
 	return 0;
 }
@@ -421,9 +500,8 @@ static int read_ftrace_file(struct tracecmd_input *handle,
 static int read_event_file(struct tracecmd_input *handle,
 			   char *system, unsigned long long size,
 			   int print, int *sys_printed,
-			   regex_t *epreg)
+			   regex_t *epreg, struct format_list *list)
 {
-	struct pevent *pevent = handle->pevent;
 	char *buf;
 
 	buf = malloc(size);
@@ -443,11 +521,15 @@ static int read_event_file(struct tracecmd_input *handle,
 			}
 			printf("%.*s\n", (int)size, buf);
 		}
-	} else {
-		if (pevent_parse_event(pevent, buf, size, system))
-			pevent->parsing_failures = 1;
+		free(buf);
+		return 0;
+	}
+
+	/* The list owns the buffer now, it is parsed with the others */
+	if (add_format(list, system, buf, size) < 0) {
+		free(buf);
+		return -1;
 	}
-	free(buf);
 
 	return 0;
 }
@@ -497,6 +579,7 @@ static int make_preg_files(const char *regex, regex_t *system,
 
 static int read_ftrace_files(struct tracecmd_input *handle, const char *regex)
 {
+	struct format_list list;
 	unsigned long long size;
 	regex_t spreg;
 	regex_t epreg;
@@ -539,28 +622,44 @@ static int read_ftrace_files(struct tracecmd_input *handle, const char *regex)
 	if (count < 0)
 		return -1;
 
+	memset(&list, 0, sizeof(list));
+
 	for (i = 0; i < count; i++) {
 		size = read8(handle);
 		if (size < 0)
-			return -1;
-		ret = read_ftrace_file(handle, size, print_all, ereg);
+			goto failed;
+		ret = read_ftrace_file(handle, size, print_all, ereg, &list);
 		if (ret < 0)
-			return -1;
+			goto failed;
 	}
 
 	handle->event_files_start =
 		lseek64(handle->fd, 0, SEEK_CUR);
 
+	parse_format_list(handle, &list);
+	free_format_list(&list);
+
 	if (sreg) {
 		regfree(sreg);
 		regfree(ereg);
 	}
 
 	return 0;
+
+ failed:
+	free_format_list(&list);
+
+	if (sreg) {
+		regfree(sreg);
+		regfree(ereg);
+	}
+
+	return -1;
 }
 
 static int read_event_files(struct tracecmd_input *handle, const char *regex)
 {
+	struct format_list list;
 	unsigned long long size;
 	char *system;
 	regex_t spreg;
@@ -588,10 +687,18 @@ static int read_event_files(struct tracecmd_input *handle, const char *regex)
 	if (systems < 0)
 		return -1;
 
+	memset(&list, 0, sizeof(list));
+
 	for (i = 0; i < systems; i++) {
 		system = read_string(handle);
 		if (!system)
-			return -1;
+			goto failed;
+
+		/* The formats of this system refer to it until parsed */
+		if (add_format_system(&list, system) < 0) {
+			free(system);
+			goto failed;
+		}
 
 		sys_printed = 0;
 		print_all = 0;
@@ -629,13 +736,15 @@ static int read_event_files(struct tracecmd_input *handle, const char *regex)
 
 			ret = read_event_file(handle, system, size,
 					      print_all, &sys_printed,
-					      reg);
+					      reg, &list);
 			if (ret < 0)
 				goto failed;
 		}
-		free(system);
 	}
 
+	parse_format_list(handle, &list);
+	free_format_list(&list);
+
 	if (sreg) {
 		regfree(sreg);
 		regfree(ereg);
@@ -644,12 +753,13 @@ static int read_event_files(struct tracecmd_input *handle, const char *regex)
 	return 0;
 
  failed:
+	free_format_list(&list);
+
 	if (sreg) {
 		regfree(sreg);
 		regfree(ereg);
 	}
 
-	free(system);
 	return -1;
 }
 
@@ -675,7 +785,7 @@ static int read_proc_kallsyms(struct tracecmd_input *handle)
 	}
 	buf[size] = 0;
 
-	parse_proc_kallsyms(pevent, buf, size);
+	tracecmd_parse_proc_kallsyms(pevent, buf, size);
 
 	free(buf);
 	return 0;
@@ -1010,6 +1120,97 @@ static int get_page(struct tracecmd_input *handle, int cpu,
 	return 0;
 }
 
+/*
+ * The page index (trace.dat.idx) has, for each page of a cpu buffer,
+ * the set of the events on the page and a summary of their pids.
+ * It is native endian, as it is only used where it was made, and
+ * everything in it is aligned to 8 bytes.
+ */
+#define PAGE_INDEX_MAGIC	"tcpgidx"
+#define PAGE_INDEX_VERSION	1
+/* The start of the file is hashed, it holds the headers and formats */
+#define PAGE_INDEX_HASH_SIZE	(64 * 1024)
+
+struct page_index_header {
+	char			magic[8];
+	unsigned int		version;
+	unsigned int		page_size;
+	unsigned long long	file_size;
+	unsigned long long	hash;
+	unsigned int		nr_regions;
+	unsigned int		reserved;
+};
+
+/*
+ * The pages of one cpu buffer. Followed by the event ids of the bits
+ * of its bitmaps, then by the bitmap of the events of each page along
+ * with one word where the pid of each event sets pid_bit(pid).
+ */
+struct page_index_region {
+	unsigned long long	offset;
+	unsigned long long	size;
+	/* The time stamp of the first page, to see if the file changed */
+	unsigned long long	first_ts;
+	unsigned int		nr_ids;
+	unsigned int		nr_pages;
+};
+
+static inline int region_words(struct page_index_region *region)
+{
+	/* The bitmap, and the pids */
+	return (region->nr_ids + 63) / 64 + 1;
+}
+
+static inline unsigned int *region_ids(struct page_index_region *region)
+{
+	return (unsigned int *)(region + 1);
+}
+
+static inline unsigned long long *
+region_pages(struct page_index_region *region)
+{
+	return (unsigned long long *)(region + 1) + (region->nr_ids + 1) / 2;
+}
+
+static inline size_t region_size(struct page_index_region *region)
+{
+	return sizeof(*region) + (region->nr_ids + 1) / 2 * 8 +
+		(size_t)region->nr_pages * region_words(region) * 8;
+}
+
+static inline unsigned long long pid_bit(int pid)
+{
+	return 1ULL << (((unsigned int)pid * 0x9e3779b1U) >> 26);
+}
+
+/* Returns the first page from @offset on that may pass the page filter */
+static off64_t skip_filtered_pages(struct tracecmd_input *handle, int cpu,
+				   off64_t offset)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	struct page_index_region *region = cpu_data->index;
+	unsigned long long *filter = cpu_data->page_filter;
+	unsigned long long end = cpu_data->file_offset + cpu_data->file_size;
+	unsigned long long *entry;
+	int words;
+	int i;
+
+	if (!filter)
+		return offset;
+
+	words = region_words(region);
+	for (; offset < end; offset += handle->page_size) {
+		entry = region_pages(region) +
+			(offset - cpu_data->file_offset) / handle->page_size * words;
+		for (i = 0; i < words; i++) {
+			if (entry[i] & filter[i])
+				return offset;
+		}
+	}
+
+	return offset;
+}
+
 static int get_next_page(struct tracecmd_input *handle, int cpu)
 {
 	off64_t offset;
@@ -1026,6 +1227,13 @@ static int get_next_page(struct tracecmd_input *handle, int cpu)
 
 	offset = handle->cpu_data[cpu].offset + handle->page_size;
 
+	offset = skip_filtered_pages(handle, cpu, offset);
+	if (offset >= handle->cpu_data[cpu].file_offset +
+	    handle->cpu_data[cpu].file_size) {
+		handle->cpu_data[cpu].offset = 0;
+		return 0;
+	}
+
 	return get_page(handle, cpu, offset);
 }
 
@@ -1478,6 +1686,570 @@ tracecmd_get_cursor(struct tracecmd_input *handle, int cpu)
 	return cpu_data->offset + kbuffer_curr_offset(kbuf);
 }
 
+static struct kbuffer *alloc_kbuf(struct tracecmd_input *handle)
+{
+	enum kbuffer_long_size long_size;
+	enum kbuffer_endian endian;
+	struct kbuffer *kbuf;
+
+	if (handle->long_size == 8)
+		long_size = KBUFFER_LSIZE_8;
+	else
+		long_size = KBUFFER_LSIZE_4;
+
+	if (handle->pevent->file_bigendian)
+		endian = KBUFFER_ENDIAN_BIG;
+	else
+		endian = KBUFFER_ENDIAN_LITTLE;
+
+	kbuf = kbuffer_alloc(long_size, endian);
+	if (kbuf && handle->pevent->old_format)
+		kbuffer_set_old_format(kbuf);
+
+	return kbuf;
+}
+
+/* The size and a hash of the start of the trace.dat file */
+static int page_index_file_id(struct tracecmd_input *handle,
+			      unsigned long long *size,
+			      unsigned long long *hash)
+{
+	unsigned long long len;
+	unsigned char *buf;
+	struct stat st;
+	unsigned int i;
+
+	if (fstat(handle->fd, &st) < 0)
+		return -1;
+
+	*size = st.st_size;
+	len = MIN(*size, PAGE_INDEX_HASH_SIZE);
+	buf = malloc(len);
+	if (!buf)
+		return -1;
+
+	if (pread64(handle->fd, buf, len, 0) != (ssize_t)len) {
+		free(buf);
+		return -1;
+	}
+
+	*hash = 0xcbf29ce484222325ULL;
+	for (i = 0; i < len; i++)
+		*hash = (*hash ^ buf[i]) * 0x100000001b3ULL;
+
+	free(buf);
+	return 0;
+}
+
+static int region_first_ts(struct tracecmd_input *handle,
+			   struct cpu_data *cpu_data, unsigned long long *ts)
+{
+	if (pread64(handle->fd, ts, sizeof(*ts),
+		    cpu_data->file_offset) != sizeof(*ts))
+		return -1;
+	return 0;
+}
+
+/* Reads @file, or returns NULL if it is not an index of this trace.dat */
+static struct page_index_header *
+read_page_index(struct tracecmd_input *handle, const char *file,
+		unsigned long long file_size, unsigned long long hash,
+		size_t *index_size)
+{
+	struct page_index_header *header;
+	struct page_index_region *region;
+	struct stat st;
+	size_t pos;
+	unsigned int i;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*header)) {
+		close(fd);
+		return NULL;
+	}
+
+	header = malloc(st.st_size);
+	if (!header) {
+		close(fd);
+		return NULL;
+	}
+
+	if (read(fd, header, st.st_size) != st.st_size)
+		goto fail;
+	close(fd);
+	fd = -1;
+
+	if (memcmp(header->magic, PAGE_INDEX_MAGIC, sizeof(header->magic)) ||
+	    header->version != PAGE_INDEX_VERSION ||
+	    header->page_size != handle->page_size ||
+	    header->file_size != file_size || header->hash != hash)
+		goto fail;
+
+	/* Every region must fit in the file */
+	pos = sizeof(*header);
+	for (i = 0; i < header->nr_regions; i++) {
+		if (pos + sizeof(*region) > (size_t)st.st_size)
+			goto fail;
+		region = (void *)header + pos;
+		if (region->nr_pages != (region->size + handle->page_size - 1) /
+		    handle->page_size)
+			goto fail;
+		pos += region_size(region);
+		if (pos > (size_t)st.st_size)
+			goto fail;
+	}
+
+	*index_size = pos;
+	return header;
+
+ fail:
+	if (fd >= 0)
+		close(fd);
+	free(header);
+	return NULL;
+}
+
+static struct page_index_region *
+find_region(struct tracecmd_input *handle, struct page_index_header *header,
+	    struct cpu_data *cpu_data)
+{
+	struct page_index_region *region;
+	unsigned long long ts;
+	void *pos = header + 1;
+	unsigned int i;
+
+	for (i = 0; i < header->nr_regions; i++) {
+		region = pos;
+		pos += region_size(region);
+		if (region->offset != cpu_data->file_offset ||
+		    region->size != cpu_data->file_size)
+			continue;
+		if (region_first_ts(handle, cpu_data, &ts) < 0)
+			return NULL;
+		if (ts == region->first_ts)
+			return region;
+	}
+
+	return NULL;
+}
+
+/* Reads the pages of @cpu_data to make its region of the index */
+static struct page_index_region *
+build_region(struct tracecmd_input *handle, struct cpu_data *cpu_data)
+{
+	struct page_index_region *region = NULL;
+	struct pevent_record record;
+	unsigned long long end = cpu_data->file_offset + cpu_data->file_size;
+	unsigned long long offset;
+	unsigned long long *pages;
+	unsigned long long *entry;
+	unsigned long long *new;
+	unsigned int nr_pages;
+	unsigned int nr_ids = 0;
+	unsigned int *ids = NULL;
+	int *dense = NULL;
+	int nr_dense = 0;
+	struct kbuffer *kbuf;
+	void *page = NULL;
+	void *data;
+	size_t len;
+	int words = 2;
+	int id, p, i;
+
+	nr_pages = (cpu_data->file_size + handle->page_size - 1) /
+		handle->page_size;
+
+	kbuf = alloc_kbuf(handle);
+	page = malloc(handle->page_size);
+	pages = calloc((size_t)nr_pages * words, sizeof(*pages));
+	if (!kbuf || !page || !pages)
+		goto out;
+
+	memset(&record, 0, sizeof(record));
+
+	for (p = 0; p < nr_pages; p++) {
+		offset = cpu_data->file_offset + (unsigned long long)p * handle->page_size;
+		len = MIN(handle->page_size, end - offset);
+		memset(page + len, 0, handle->page_size - len);
+		if (pread64(handle->fd, page, len, offset) != (ssize_t)len)
+			goto out;
+
+		kbuffer_load_subbuffer(kbuf, page);
+		if (kbuffer_subbuffer_size(kbuf) > handle->page_size)
+			goto out;
+
+		while ((data = kbuffer_read_event(kbuf, NULL))) {
+			record.data = data;
+			record.size = kbuffer_event_size(kbuf);
+			id = pevent_data_type(handle->pevent, &record);
+			if (id < 0)
+				id = 0;
+
+			if (id >= nr_dense) {
+				i = nr_dense;
+				nr_dense = id + 64;
+				dense = realloc(dense, sizeof(*dense) * nr_dense);
+				if (!dense)
+					goto out;
+				for (; i < nr_dense; i++)
+					dense[i] = -1;
+			}
+
+			if (dense[id] < 0) {
+				if (nr_ids == (words - 1) * 64) {
+					/* Double the bitmap of every page */
+					new = calloc((size_t)nr_pages * (words * 2 - 1),
+						     sizeof(*new));
+					if (!new)
+						goto out;
+					for (i = 0; i < nr_pages; i++) {
+						memcpy(&new[i * (words * 2 - 1)],
+						       &pages[i * words],
+						       sizeof(*new) * (words - 1));
+						new[(i + 1) * (words * 2 - 1) - 1] =
+							pages[(i + 1) * words - 1];
+					}
+					free(pages);
+					pages = new;
+					words = words * 2 - 1;
+				}
+				ids = realloc(ids, sizeof(*ids) * (nr_ids + 1));
+				if (!ids)
+					goto out;
+				ids[nr_ids] = id;
+				dense[id] = nr_ids++;
+			}
+
+			entry = &pages[p * words];
+			entry[dense[id] / 64] |= 1ULL << (dense[id] % 64);
+			entry[words - 1] |= pid_bit(pevent_data_pid(handle->pevent,
+								    &record));
+
+			kbuffer_next_event(kbuf, NULL);
+		}
+	}
+
+	region = calloc(1, sizeof(*region) + (nr_ids + 1) / 2 * 8 +
+			(size_t)nr_pages * ((nr_ids + 63) / 64 + 1) * 8);
+	if (!region)
+		goto out;
+
+	region->offset = cpu_data->file_offset;
+	region->size = cpu_data->file_size;
+	region->nr_ids = nr_ids;
+	region->nr_pages = nr_pages;
+	if (region_first_ts(handle, cpu_data, &region->first_ts) < 0) {
+		free(region);
+		region = NULL;
+		goto out;
+	}
+
+	if (nr_ids)
+		memcpy(region_ids(region), ids, sizeof(*ids) * nr_ids);
+
+	entry = region_pages(region);
+	for (p = 0; p < nr_pages; p++) {
+		memcpy(entry, &pages[p * words],
+		       sizeof(*entry) * (region_words(region) - 1));
+		entry += region_words(region);
+		entry[-1] = pages[(p + 1) * words - 1];
+	}
+
+ out:
+	if (kbuf)
+		kbuffer_free(kbuf);
+	free(page);
+	free(pages);
+	free(ids);
+	free(dense);
+	return region;
+}
+
+static int in_page_index(struct page_index_header *header, size_t size,
+			 struct page_index_region *region)
+{
+	return header && (void *)region > (void *)header &&
+		(void *)region < (void *)header + size;
+}
+
+/* Regions of this handle are only kept if they are still good */
+static int keep_region(struct tracecmd_input *handle,
+		       struct page_index_region **regions,
+		       struct page_index_region *region)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		if (regions[cpu] == region)
+			return 1;
+		if (handle->cpu_data[cpu].file_offset == region->offset)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void save_page_index(struct page_index_header *header, size_t size,
+			    const char *file)
+{
+	char *tmp;
+	int ret;
+	int fd;
+
+	/* Other readers only ever see a complete file */
+	if (asprintf(&tmp, "%s.XXXXXX", file) < 0)
+		return;
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		warning("could not write page index %s", file);
+		free(tmp);
+		return;
+	}
+
+	/* Readable by whoever can read the trace.dat file */
+	ret = fchmod(fd, 0644);
+	if (ret == 0)
+		ret = __do_write_check(fd, header, size);
+	if (close(fd) < 0)
+		ret = -1;
+
+	if (ret < 0 || rename(tmp, file) < 0) {
+		warning("could not write page index %s", file);
+		unlink(tmp);
+	}
+
+	free(tmp);
+}
+
+/**
+ * tracecmd_load_page_index - use a page index of the trace.dat file
+ * @handle: input handle for the trace.dat file
+ * @file: the page index file, usually the trace.dat name with ".idx"
+ * @build: if set, index what @file does not cover and save it there
+ *
+ * The page index has the events and the pids of each page of the cpu
+ * buffers. It is only used with tracecmd_set_page_filter(), to skip
+ * the pages that hold nothing of interest.
+ *
+ * The index is checked against the trace.dat file, and the parts of
+ * it that do not match are ignored. With @build, the cpus that are
+ * not covered are indexed by reading their pages, which is about as
+ * fast as reading their records once, and @file is updated. The
+ * buffer instances of a file can all keep their index in one @file.
+ *
+ * This clears the page filter.
+ *
+ * Returns 0 if every cpu of @handle is indexed, -1 otherwise.
+ */
+int tracecmd_load_page_index(struct tracecmd_input *handle, const char *file,
+			     int build)
+{
+	struct page_index_header *header;
+	struct page_index_header *new;
+	struct page_index_region *region;
+	struct page_index_region **regions;
+	unsigned long long file_size;
+	unsigned long long hash;
+	size_t index_size = 0;
+	size_t size;
+	void *pos;
+	int missing = 0;
+	int cpu;
+
+	if (!handle->cpu_data || handle->use_pipe)
+		return -1;
+
+	tracecmd_set_page_filter(handle, NULL, 0, NULL, 0);
+	for (cpu = 0; cpu < handle->cpus; cpu++)
+		handle->cpu_data[cpu].index = NULL;
+	free(handle->page_index);
+	handle->page_index = NULL;
+
+	if (page_index_file_id(handle, &file_size, &hash) < 0)
+		return -1;
+
+	header = read_page_index(handle, file, file_size, hash, &index_size);
+
+	regions = calloc(handle->cpus, sizeof(*regions));
+	if (!regions) {
+		free(header);
+		return -1;
+	}
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		if (!handle->cpu_data[cpu].file_size)
+			continue;
+		if (header)
+			regions[cpu] = find_region(handle, header,
+						   &handle->cpu_data[cpu]);
+		if (!regions[cpu])
+			missing++;
+	}
+
+	if (!missing || !build)
+		goto out;
+
+	/* Keep the regions of other buffers and the ones that still match */
+	size = sizeof(*new);
+	for (pos = header + 1; header && pos < (void *)header + index_size;
+	     pos += region_size(pos)) {
+		if (keep_region(handle, regions, pos))
+			size += region_size(pos);
+	}
+
+	new = NULL;
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		if (!handle->cpu_data[cpu].file_size || regions[cpu])
+			continue;
+		regions[cpu] = build_region(handle, &handle->cpu_data[cpu]);
+		if (!regions[cpu])
+			goto out_free;
+		size += region_size(regions[cpu]);
+	}
+
+	new = malloc(size);
+	if (!new)
+		goto out_free;
+
+	memset(new, 0, sizeof(*new));
+	memcpy(new->magic, PAGE_INDEX_MAGIC, sizeof(new->magic));
+	new->version = PAGE_INDEX_VERSION;
+	new->page_size = handle->page_size;
+	new->file_size = file_size;
+	new->hash = hash;
+
+	pos = new + 1;
+	for (region = (void *)(header + 1);
+	     header && (void *)region < (void *)header + index_size;
+	     region = (void *)region + region_size(region)) {
+		if (!keep_region(handle, regions, region))
+			continue;
+		memcpy(pos, region, region_size(region));
+		pos += region_size(region);
+		new->nr_regions++;
+	}
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		region = regions[cpu];
+		if (!region || in_page_index(header, index_size, region))
+			continue;
+		memcpy(pos, region, region_size(region));
+		pos += region_size(region);
+		new->nr_regions++;
+	}
+
+	save_page_index(new, size, file);
+
+ out_free:
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		region = regions[cpu];
+		if (region && !in_page_index(header, index_size, region))
+			free(region);
+		regions[cpu] = NULL;
+	}
+	free(header);
+	header = new;
+
+	/* Point into the new index */
+	missing = 0;
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		if (!handle->cpu_data[cpu].file_size)
+			continue;
+		if (header)
+			regions[cpu] = find_region(handle, header,
+						   &handle->cpu_data[cpu]);
+		if (!regions[cpu])
+			missing++;
+	}
+
+ out:
+	handle->page_index = header;
+	for (cpu = 0; cpu < handle->cpus; cpu++)
+		handle->cpu_data[cpu].index = regions[cpu];
+	free(regions);
+	return missing ? -1 : 0;
+}
+
+/**
+ * tracecmd_set_page_filter - skip the pages without given events or pids
+ * @handle: input handle for the trace.dat file
+ * @ids: the ids of the events to keep
+ * @nr_ids: the number of @ids
+ * @pids: the pids whose events to keep
+ * @nr_pids: the number of @pids
+ *
+ * With a page index loaded by tracecmd_load_page_index(), the reads
+ * of each cpu skip the pages that hold neither any of the events of
+ * @ids nor any event of the @pids. A skipped page may hold other
+ * events, and a page that is read may hold none of them: this is only
+ * to save reading the pages that can not match, the records that are
+ * read still need to be filtered. The page that a cpu is on, and the
+ * pages that are read directly (tracecmd_read_at() and such), are
+ * not skipped.
+ *
+ * If both @ids and @pids are NULL, the filter is removed.
+ *
+ * Returns 0 if every cpu of @handle is filtered, -1 if some of them
+ * have no index and will read all their pages.
+ */
+int tracecmd_set_page_filter(struct tracecmd_input *handle,
+			     const int *ids, int nr_ids,
+			     const int *pids, int nr_pids)
+{
+	struct page_index_region *region;
+	struct cpu_data *cpu_data;
+	unsigned long long *filter;
+	unsigned int *region_id;
+	int ret = 0;
+	int words;
+	int cpu;
+	int i, x;
+
+	if (!handle->cpu_data)
+		return -1;
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		cpu_data = &handle->cpu_data[cpu];
+		free(cpu_data->page_filter);
+		cpu_data->page_filter = NULL;
+
+		if (!ids && !pids)
+			continue;
+
+		region = cpu_data->index;
+		if (!region) {
+			if (cpu_data->file_size)
+				ret = -1;
+			continue;
+		}
+
+		words = region_words(region);
+		filter = calloc(words, sizeof(*filter));
+		if (!filter) {
+			ret = -1;
+			continue;
+		}
+
+		region_id = region_ids(region);
+		for (i = 0; i < nr_ids; i++) {
+			for (x = 0; x < region->nr_ids; x++) {
+				if (region_id[x] == (unsigned int)ids[i])
+					filter[x / 64] |= 1ULL << (x % 64);
+			}
+		}
+		for (i = 0; i < nr_pids; i++)
+			filter[words - 1] |= pid_bit(pids[i]);
+
+		cpu_data->page_filter = filter;
+	}
+
+	return ret;
+}
+
 /**
  * tracecmd_translate_data - create a record from raw data
  * @handle: input handle for the trace.dat file
@@ -2065,9 +2837,6 @@ static int handle_options(struct tracecmd_input *handle)
 
 static int read_cpu_data(struct tracecmd_input *handle)
 {
-	struct pevent *pevent = handle->pevent;
-	enum kbuffer_long_size long_size;
-	enum kbuffer_endian endian;
 	unsigned long long size;
 	char buf[10];
 	int cpu;
@@ -2103,26 +2872,14 @@ static int read_cpu_data(struct tracecmd_input *handle)
 	if (force_read)
 		handle->read_page = true;
 
-	if (handle->long_size == 8)
-		long_size = KBUFFER_LSIZE_8;
-	else
-		long_size = KBUFFER_LSIZE_4;
-
-	if (handle->pevent->file_bigendian)
-		endian = KBUFFER_ENDIAN_BIG;
-	else
-		endian = KBUFFER_ENDIAN_LITTLE;
-
 	for (cpu = 0; cpu < handle->cpus; cpu++) {
 		unsigned long long offset;
 
 		handle->cpu_data[cpu].cpu = cpu;
 
-		handle->cpu_data[cpu].kbuf = kbuffer_alloc(long_size, endian);
+		handle->cpu_data[cpu].kbuf = alloc_kbuf(handle);
 		if (!handle->cpu_data[cpu].kbuf)
 			goto out_free;
-		if (pevent->old_format)
-			kbuffer_set_old_format(handle->cpu_data[cpu].kbuf);
 
 		offset = read8(handle);
 		size = read8(handle);
@@ -2594,8 +3351,12 @@ void tracecmd_close(struct tracecmd_input *handle)
 		}
 	}
 
+	for (cpu = 0; handle->cpu_data && cpu < handle->cpus; cpu++)
+		free(handle->cpu_data[cpu].page_filter);
+
 	free(handle->cpustats);
 	free(handle->cpu_data);
+	free(handle->page_index);
 	free(handle->uname);
 	close(handle->fd);
 
@@ -2960,6 +3721,7 @@ tracecmd_buffer_instance_handle(struct tracecmd_input *handle, int indx)
 	new_handle->parent = handle;
 	new_handle->cpustats = NULL;
 	new_handle->hooks = NULL;
+	new_handle->page_index = NULL;
 	if (handle->uname)
 		/* Ignore if fails to malloc, no biggy */
 		new_handle->uname = strdup(handle->uname);
@@ -25,12 +25,16 @@
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
 #include <sys/wait.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <poll.h>
 
 #include "trace-local.h"
 #include "trace-msg.h"
@@ -127,6 +131,20 @@ static void finish(int sig)
 	done = true;
 }
 
+/*
+ * Set in a reader when the client is done, to take what is left of
+ * its stream and exit.
+ */
+static bool drain;
+
+/* The signals of a reader while it waits for its socket */
+static sigset_t reader_mask;
+
+static void finish_reading(int sig)
+{
+	drain = true;
+}
+
 #define LOG_BUF_SIZE 1024
 static void __plog(const char *prefix, const char *fmt, va_list ap,
 		   FILE *fp)
@@ -200,31 +218,944 @@ void pdie(const char *fmt, ...)
 	exit(-1);
 }
 
-static int process_udp_child(int sfd, const char *host, const char *port,
-			     int cpu, int page_size)
+/* Number of pages moved per splice() call from a TCP stream */
+#define TCP_SPLICE_PAGES	64
+
+/* Number of datagrams received per recvmmsg() call */
+#define UDP_BATCH		32
+
+/* The first run of the output file a stream gets, they double from there */
+#define STREAM_RUN_MIN		(256 << 10)
+#define STREAM_RUN_MAX		(16 << 20)
+
+/* The runs that all the streams of a client can have */
+#define STREAM_MAX_RUNS		(1 << 20)
+
+/* Room for the datagrams that come in while a reader is writing */
+#define UDP_RCVBUF		(8 << 20)
+
+/* How far out of order a numbered page may come before the gap is lost */
+#define UDP_REORDER		64
+
+/* How long a draining UDP reader waits for pages still on their way */
+#define UDP_DRAIN_MS		20
+
+/* The missed events flag of the commit field of a page, bit 31 */
+#define PAGE_MISSED_EVENTS	0x80
+
+struct stream_run {
+	off64_t			offset;
+	off64_t			size;
+	int			next;	/* the next run of the stream */
+};
+
+struct stream_extent {
+	int			first;	/* runs of the stream, if nr_runs */
+	int			last;
+	int			nr_runs;
+	off64_t			room;	/* left in the last run */
+	off64_t			size;	/* data written by the stream */
+	unsigned int		seen;	/* past the last UDP page number */
+	unsigned int		window;	/* UDP pages the socket holds */
+};
+
+/*
+ * With the v2 and v3 protocols, the streams are written straight into
+ * the output file instead of temp files. The metadata comes first,
+ * then room for the CPU data tables, and then each stream gets runs
+ * of the file as it needs them. A run is twice as big as the one
+ * before it, up to STREAM_RUN_MAX, and is made of whole pages. When
+ * the client is done, the runs of each stream are put together, so the
+ * file is laid out like any other trace.dat.
+ *
+ * This is shared with the readers, each of which owns the extent of
+ * its stream. The runs are handed out with atomic adds on @end and
+ * @nr_runs.
+ */
+struct client_extents {
+	off64_t			meta_end;	/* where the tables go */
+	off64_t			data_start;	/* set once the metadata is in */
+	off64_t			end;		/* end of the runs handed out */
+	int			page_size;	/* that the runs are made of */
+	int			start_fd;	/* eventfd, set with @data_start */
+	int			credit_fd;	/* eventfd, set as @seen moves */
+	int			missed_byte;	/* of a page, to flag lost pages */
+	int			nr_runs;
+	struct stream_run	*runs;		/* STREAM_MAX_RUNS of them */
+	int			streams;
+	struct stream_extent	extent[];
+};
+
+static struct client_extents *extents;
+
+/* Write at @offset, or where the file is at when @offset is negative */
+static void write_or_die(int fd, const void *buf, size_t size, off64_t offset)
 {
-	struct sockaddr_storage peer_addr;
-	socklen_t peer_addr_len;
-	char buf[page_size];
-	char *tempfile;
-	int cfd;
-	int fd;
+	ssize_t r;
+
+	while (size) {
+		if (offset < 0)
+			r = write(fd, buf, size);
+		else
+			r = pwrite64(fd, buf, size, offset);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			pdie("writing to file");
+		}
+		buf += r;
+		size -= r;
+		if (offset >= 0)
+			offset += r;
+	}
+}
+
+static int alloc_extents(int streams, int page_size)
+{
+	size_t size = sizeof(*extents) + sizeof(extents->extent[0]) * streams;
+	struct stream_run *runs;
+
+	/* Only the runs that are handed out take memory */
+	runs = mmap(NULL, sizeof(*runs) * STREAM_MAX_RUNS,
+		    PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (runs == MAP_FAILED)
+		return -ENOMEM;
+
+	extents = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (extents == MAP_FAILED) {
+		munmap(runs, sizeof(*runs) * STREAM_MAX_RUNS);
+		extents = NULL;
+		return -ENOMEM;
+	}
+	extents->start_fd = eventfd(0, EFD_CLOEXEC);
+	extents->credit_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (extents->start_fd < 0 || extents->credit_fd < 0) {
+		if (extents->start_fd >= 0)
+			close(extents->start_fd);
+		if (extents->credit_fd >= 0)
+			close(extents->credit_fd);
+		munmap(runs, sizeof(*runs) * STREAM_MAX_RUNS);
+		munmap(extents, size);
+		extents = NULL;
+		return -ENOMEM;
+	}
+	extents->runs = runs;
+	extents->streams = streams;
+	extents->missed_byte = -1;
+
+	/* Both are powers of two, the runs must be whole pages of each */
+	extents->page_size = getpagesize();
+	if (page_size > extents->page_size)
+		extents->page_size = page_size;
+
+	return 0;
+}
+
+static void free_extents(void)
+{
+	close(extents->start_fd);
+	close(extents->credit_fd);
+	munmap(extents->runs, sizeof(*extents->runs) * STREAM_MAX_RUNS);
+	munmap(extents, sizeof(*extents) +
+	       sizeof(extents->extent[0]) * extents->streams);
+	extents = NULL;
+}
+
+static off64_t round_to_page(off64_t size)
+{
+	return (size + extents->page_size - 1) & ~(off64_t)(extents->page_size - 1);
+}
+
+/*
+ * Let the readers go, either the data start is set or they are to quit.
+ * The counter is never read back, so it wakes up every one of them.
+ */
+static void release_readers(void)
+{
+	eventfd_write(extents->start_fd, 1);
+}
+
+/*
+ * The readers can not write before we know where the data starts.
+ * Returns 0 if they are to quit before that.
+ */
+static int wait_for_data_start(void)
+{
+	struct pollfd pfd = { .fd = extents->start_fd, .events = POLLIN };
+	int ret;
+
+	while (!done && !*(volatile off64_t *)&extents->data_start) {
+		ret = poll(&pfd, 1, -1);
+		if (ret < 0 && errno != EINTR)
+			pdie("waiting for the data start");
+		/* Released without a start */
+		if (ret > 0)
+			break;
+	}
+	return *(volatile off64_t *)&extents->data_start != 0;
+}
+
+/*
+ * Wait for the socket of a reader to have something to read. SIGUSR1
+ * is blocked outside of this wait, so a reader that is told to drain
+ * can not miss it. Once draining, waits no more than @drain_ms.
+ *
+ * Returns 1 if there is something to read, 0 if the reader is to stop.
+ */
+static int reader_wait(int sfd, int drain_ms)
+{
+	struct pollfd pfd = { .fd = sfd, .events = POLLIN };
+	struct timespec ts;
+	int ret;
+
+	ts.tv_sec = drain_ms / 1000;
+	ts.tv_nsec = (drain_ms % 1000) * 1000000;
+
+	while (!done) {
+		ret = ppoll(&pfd, 1, drain ? &ts : NULL, &reader_mask);
+		if (ret >= 0)
+			return ret > 0;
+		if (errno != EINTR)
+			pdie("waiting for client");
+	}
+	return 0;
+}
+
+/*
+ * Returns where the next bytes of @stream go in the output file, and
+ * lowers @size to how many of them fit there, or returns -1 when the
+ * streams go to temp files.
+ */
+static long long reserve_stream(int fd, int stream, unsigned int *size)
+{
+	struct stream_extent *extent;
+	struct stream_run *run;
+	off64_t offset;
+	off64_t len;
+	int r;
+
+	if (!extents)
+		return -1;
+
+	extent = &extents->extent[stream];
+
+	if (!extent->room) {
+		/* Most streams of a big machine stay small, start small */
+		len = STREAM_RUN_MIN;
+		if (extent->nr_runs)
+			len = extents->runs[extent->last].size * 2;
+		if (len > STREAM_RUN_MAX)
+			len = STREAM_RUN_MAX;
+		len = round_to_page(len);
+
+		r = __sync_fetch_and_add(&extents->nr_runs, 1);
+		if (r >= STREAM_MAX_RUNS)
+			die("too many runs of stream data");
+		offset = __sync_fetch_and_add(&extents->end, len);
+
+		/* Keep the run in one piece on disk, if we can */
+		if (fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len) < 0 &&
+		    errno != EOPNOTSUPP && errno != ENOSYS)
+			pdie("reserving room for stream data");
+
+		run = &extents->runs[r];
+		run->offset = offset;
+		run->size = len;
+		if (extent->nr_runs)
+			extents->runs[extent->last].next = r;
+		else
+			extent->first = r;
+		extent->last = r;
+		extent->nr_runs++;
+		extent->room = len;
+	}
+
+	run = &extents->runs[extent->last];
+	offset = run->offset + run->size - extent->room;
+	if (*size > extent->room)
+		*size = extent->room;
+	extent->room -= *size;
+	extent->size += *size;
+
+	return offset;
+}
+
+/* Write to @stream, going on to its next run when one is full */
+static void write_stream(int fd, int stream, const void *buf, unsigned int size)
+{
+	unsigned int len;
+	off64_t offset;
+
+	while (size) {
+		len = size;
+		offset = reserve_stream(fd, stream, &len);
+		write_or_die(fd, buf, len, offset);
+		buf += len;
+		size -= len;
+	}
+}
+
+static void writev_stream(int fd, int stream, struct iovec *iov,
+			  unsigned int size)
+{
+	unsigned int len;
+	off64_t offset;
+	void *base;
+	size_t rest;
 	int n;
+
+	while (size) {
+		len = size;
+		offset = reserve_stream(fd, stream, &len);
+		size -= len;
+
+		/* The iovs that make up the len bytes, the last one maybe not all */
+		for (n = 0; len > iov[n].iov_len; n++)
+			len -= iov[n].iov_len;
+		base = iov[n].iov_base;
+		rest = iov[n].iov_len - len;
+		iov[n].iov_len = len;
+
+		if (tracecmd_msg_writev(fd, iov, n + 1, offset) < 0)
+			pdie("writing to file");
+
+		iov[n].iov_base = base + len;
+		iov[n].iov_len = rest;
+		iov += n;
+		if (!rest)
+			iov++;
+	}
+}
+
+/*
+ * Find the byte of the commit field of a page that holds the missed
+ * events flag, for the endianess and size of the client's pages.
+ */
+static int find_missed_byte(int ofd)
+{
+	struct tracecmd_input *ihandle;
+	struct pevent *pevent;
+	int ret = -1;
+	int ifd;
+
+	ifd = dup(ofd);
+	if (ifd < 0)
+		return -1;
+	if (lseek(ifd, 0, SEEK_SET) == (off_t)-1) {
+		close(ifd);
+		return -1;
+	}
+
+	ihandle = tracecmd_alloc_fd(ifd);
+	if (!ihandle) {
+		close(ifd);
+		return -1;
+	}
+
+	if (tracecmd_read_headers(ihandle) < 0)
+		goto out;
+
+	pevent = tracecmd_get_pevent(ihandle);
+	if (pevent->header_page_size_size < 4)
+		goto out;
+
+	ret = pevent->header_page_size_offset;
+	if (pevent_is_file_bigendian(pevent))
+		ret += pevent->header_page_size_size - 4;
+	else
+		ret += 3;
+ out:
+	tracecmd_close(ihandle);
+	return ret;
+}
+
+/*
+ * The metadata is in. Leave room for the CPU data tables after it, and
+ * let the streams start writing after that.
+ */
+static struct tracecmd_output *start_stream_data(int ofd, int cpus)
+{
+	struct tracecmd_output *handle;
+	char * const *buffers;
+	off64_t data_start;
+	off64_t size;
+	int nr_buffers;
+
+	if (use_udp_seq)
+		extents->missed_byte = find_missed_byte(ofd);
+
+	handle = tracecmd_get_output_handle_fd(ofd);
+	if (!handle)
+		return NULL;
+
+	buffers = tracecmd_msg_get_buffers(&nr_buffers);
+	size = tracecmd_buffers_table_size(handle, cpus, nr_buffers, buffers);
+	if (size < 0) {
+		tracecmd_output_close(handle);
+		return NULL;
+	}
+
+	extents->meta_end = lseek64(ofd, 0, SEEK_CUR);
+	data_start = round_to_page(extents->meta_end + size);
+
+	extents->end = data_start;
+	__sync_synchronize();
+	extents->data_start = data_start;
+	release_readers();
+
+	return handle;
+}
+
+/* Copy @size bytes of the output file from @from to @to, they do not overlap */
+static void move_stream_data(int fd, off64_t from, off64_t to, off64_t size)
+{
+	char buf[BUFSIZ];
+	ssize_t n;
+
+	while (size) {
+		n = copy_file_range(fd, &from, fd, &to, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		size -= n;
+	}
+
+	/* Not supported by the file system, copy it ourselves */
+	while (size) {
+		n = pread64(fd, buf, size > BUFSIZ ? BUFSIZ : size, from);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			pdie("reading back stream data");
+		write_or_die(fd, buf, n, to);
+		from += n;
+		to += n;
+		size -= n;
+	}
+}
+
+/* The bytes of run @r of @extent that hold data */
+static off64_t run_used(struct stream_extent *extent, int r)
+{
+	if (r == extent->last)
+		return extents->runs[r].size - extent->room;
+	return extents->runs[r].size;
+}
+
+/*
+ * Put the runs of each stream together, one stream after the other
+ * from the data start and each on a page, the way trace.dat has the
+ * CPU data. The runs of the later streams that are in the way of a
+ * stream are first moved past the end of all the runs, so no byte is
+ * moved more than twice. Returns the end of the data.
+ */
+static off64_t compact_streams(int fd, off64_t *offsets)
+{
+	struct stream_extent *extent;
+	struct stream_run *run;
+	off64_t tail = extents->end;
+	off64_t start = extents->data_start;
+	off64_t data_end = start;
+	off64_t used;
+	off64_t end;
+	off64_t to;
+	int i, j, n, r;
+
+	for (i = 0; i < extents->streams; i++) {
+		extent = &extents->extent[i];
+		offsets[i] = start;
+		if (!extent->nr_runs)
+			continue;
+		end = start + extent->size;
+
+		for (j = i; j < extents->streams; j++) {
+			to = start;
+			for (n = 0, r = extents->extent[j].first;
+			     n < extents->extent[j].nr_runs; n++, r = run->next) {
+				run = &extents->runs[r];
+				used = run_used(&extents->extent[j], r);
+				/* A run of this stream can already be in place */
+				if (j == i && run->offset == to) {
+					to += used;
+					continue;
+				}
+				to += used;
+				if (run->offset >= end || run->offset + used <= start)
+					continue;
+				move_stream_data(fd, run->offset, tail, used);
+				run->offset = tail;
+				tail += round_to_page(used);
+			}
+		}
+
+		/* Nothing else is left between start and end */
+		to = start;
+		for (n = 0, r = extent->first; n < extent->nr_runs;
+		     n++, r = run->next) {
+			run = &extents->runs[r];
+			used = run_used(extent, r);
+			if (run->offset != to)
+				move_stream_data(fd, run->offset, to, used);
+			to += used;
+		}
+
+		data_end = end;
+		start = round_to_page(end);
+	}
+
+	return data_end;
+}
+
+/*
+ * All the streams are in their runs. Put each of them in one piece,
+ * write where they are and cut the file after the data.
+ */
+static int finish_stream_data(struct tracecmd_output *handle, int ofd, int cpus)
+{
+	unsigned long long *sizes;
+	char * const *buffers;
+	off64_t *offsets;
+	off64_t data_end;
+	int nr_buffers;
+	int ret = -ENOMEM;
+	int i;
+
+	buffers = tracecmd_msg_get_buffers(&nr_buffers);
+
+	offsets = malloc(sizeof(*offsets) * extents->streams);
+	sizes = malloc(sizeof(*sizes) * extents->streams);
+	if (!offsets || !sizes)
+		goto out;
+
+	for (i = 0; i < extents->streams; i++)
+		sizes[i] = extents->extent[i].size;
+
+	data_end = compact_streams(ofd, offsets);
+
+	ret = -EIO;
+	if (lseek64(ofd, extents->meta_end, SEEK_SET) == (off64_t)-1)
+		goto out;
+
+	if (tracecmd_write_buffers_table(handle, cpus, nr_buffers, buffers,
+					 offsets, sizes) < 0)
+		goto out;
+
+	if (ftruncate(ofd, data_end) < 0)
+		goto out;
+
+	ret = 0;
+ out:
+	free(offsets);
+	free(sizes);
+	tracecmd_output_close(handle);
+	return ret;
+}
+
+/*
+ * Copy a stream that can not be spliced (or when splice is not
+ * supported on this socket) through a user space buffer.
+ */
+static void read_stream_data(int sfd, int fd, int stream, int page_size)
+{
+	int size = page_size * TCP_SPLICE_PAGES;
+	char *buf;
+	int n;
+
+	buf = malloc(size);
+	if (!buf)
+		pdie("allocating read buffer");
+
+	do {
+		n = read(sfd, buf, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pdie("reading client");
+		}
+		if (!n)
+			break;
+		write_stream(fd, stream, buf, n);
+	} while (!done);
+
+	free(buf);
+}
+
+/*
+ * Move the TCP stream into the file with splice(), through a pipe
+ * big enough to hold TCP_SPLICE_PAGES pages. The data never has
+ * to be copied into user space.
+ *
+ * Returns -1 if splice is not supported, and nothing was read.
+ */
+static int splice_stream_data(int sfd, int fd, int stream, int page_size)
+{
+	int size = page_size * TCP_SPLICE_PAGES;
+	unsigned int len;
+	loff_t offset;
+	int brass[2];
+	int first = 1;
+	ssize_t n, s;
+
+	if (pipe(brass) < 0)
+		return -1;
+
+	/* If the pipe can not grow, we just move less at a time */
+	fcntl(brass[1], F_SETPIPE_SZ, size);
+
+	do {
+		n = splice(sfd, NULL, brass[1], NULL, size,
+			   SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (first && errno == EINVAL) {
+				close(brass[0]);
+				close(brass[1]);
+				return -1;
+			}
+			pdie("reading client");
+		}
+		first = 0;
+		if (!n)
+			break;
+
+		/* Anything in the pipe must make it to the file */
+		while (n) {
+			len = n;
+			offset = reserve_stream(fd, stream, &len);
+			n -= len;
+			while (len) {
+				s = splice(brass[0], NULL, fd,
+					   offset < 0 ? NULL : &offset,
+					   len, SPLICE_F_MOVE);
+				if (s < 0) {
+					if (errno == EINTR)
+						continue;
+					pdie("writing to file");
+				}
+				len -= s;
+			}
+		}
+	} while (!done);
+
+	close(brass[0]);
+	close(brass[1]);
+
+	return 0;
+}
+
+/*
+ * Each UDP packet holds a page. Receive them in batches directly
+ * into page aligned buffers, and write the batch out with a single
+ * writev().
+ */
+static void recv_udp_data(int sfd, int fd, int stream, int page_size)
+{
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	struct iovec out[UDP_BATCH];
+	unsigned int size;
+	void *pages;
 	int once = 0;
+	int n, i;
 
-	signal_setup(SIGUSR1, finish);
+	if (posix_memalign(&pages, page_size, page_size * UDP_BATCH))
+		pdie("allocating udp pages");
 
-	tempfile = get_temp_file(host, port, cpu);
-	if (!tempfile)
-		return -ENOMEM;
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < UDP_BATCH; i++) {
+		iovs[i].iov_base = pages + page_size * i;
+		iovs[i].iov_len = page_size;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (!done) {
+		n = recvmmsg(sfd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				if (reader_wait(sfd, UDP_DRAIN_MS))
+					continue;
+				break;
+			}
+			pdie("reading client");
+		}
+		if (!n)
+			break;
+
+		size = 0;
+		for (i = 0; i < n; i++) {
+			/* UDP requires that we get the full size in one go */
+			if (msgs[i].msg_len < page_size && !once) {
+				once = 1;
+				warning("read %d bytes, expected %d",
+					msgs[i].msg_len, page_size);
+			}
+			out[i].iov_base = iovs[i].iov_base;
+			out[i].iov_len = msgs[i].msg_len;
+			size += msgs[i].msg_len;
+		}
+		writev_stream(fd, stream, out, size);
+	}
+
+	free(pages);
+}
+
+/* A UDP stream of numbered pages (v3) */
+struct udp_seq_stream {
+	int			fd;
+	int			stream;
+	int			page_size;
+	unsigned int		next;		/* number of the next page to write */
+	unsigned int		seen;		/* past the highest page number */
+	int			missed;		/* pages lost before the next one */
+	int			stashed;
+	unsigned int		stash_len[UDP_REORDER];
+	char			*stash;		/* pages that came early */
+	struct iovec		out[UDP_BATCH + UDP_REORDER];
+	int			nr_out;
+	unsigned int		out_size;
+	unsigned long long	received;
+	unsigned long long	lost;
+	unsigned long long	reordered;
+	unsigned long long	late;
+};
+
+static void udp_seq_write(struct udp_seq_stream *s)
+{
+	if (!s->nr_out)
+		return;
+	writev_stream(s->fd, s->stream, s->out, s->out_size);
+	s->nr_out = 0;
+	s->out_size = 0;
+}
+
+static void udp_seq_emit(struct udp_seq_stream *s, char *page, unsigned int len)
+{
+	/* Let the reader of the file know that pages are missing here */
+	if (s->missed && extents && extents->missed_byte >= 0 &&
+	    len > extents->missed_byte)
+		page[extents->missed_byte] |= PAGE_MISSED_EVENTS;
+	s->missed = 0;
+
+	s->out[s->nr_out].iov_base = page;
+	s->out[s->nr_out].iov_len = len;
+	s->nr_out++;
+	s->out_size += len;
+	s->next++;
+}
+
+/* Write the next page if it came early, or give up on it */
+static void udp_seq_advance(struct udp_seq_stream *s)
+{
+	int slot = s->next % UDP_REORDER;
+
+	if (s->stash_len[slot]) {
+		udp_seq_emit(s, s->stash + s->page_size * slot,
+			     s->stash_len[slot]);
+		s->stash_len[slot] = 0;
+		s->stashed--;
+		return;
+	}
+	s->lost++;
+	s->missed++;
+	s->next++;
+}
+
+static void udp_seq_page(struct udp_seq_stream *s, unsigned int seq,
+			 char *page, unsigned int len)
+{
+	int slot;
+
+	if ((int)(seq + 1 - s->seen) > 0)
+		s->seen = seq + 1;
+
+	if ((int)(seq - s->next) < 0) {
+		/* Already written, or given up on */
+		s->late++;
+		return;
+	}
+
+	/*
+	 * Far past the window, write out what is stashed and give up on
+	 * the rest of the gap at once, rather than a page at a time.
+	 */
+	if (seq - s->next >= 2 * UDP_REORDER) {
+		while (s->stashed)
+			udp_seq_advance(s);
+		s->lost += seq - UDP_REORDER + 1 - s->next;
+		s->missed = 1;
+		s->next = seq - UDP_REORDER + 1;
+	}
+
+	while (seq - s->next >= UDP_REORDER)
+		udp_seq_advance(s);
+
+	if (seq == s->next) {
+		udp_seq_emit(s, page, len);
+		while (s->stashed && s->stash_len[s->next % UDP_REORDER])
+			udp_seq_advance(s);
+		return;
+	}
+
+	slot = seq % UDP_REORDER;
+	if (s->stash_len[slot]) {
+		s->late++;
+		return;
+	}
+
+	/* The slot may still be waiting to be written */
+	udp_seq_write(s);
+
+	memcpy(s->stash + s->page_size * slot, page, len);
+	s->stash_len[slot] = len;
+	s->stashed++;
+	s->reordered++;
+}
+
+static void udp_seq_stats(struct udp_seq_stream *s)
+{
+	char * const *buffers;
+	const char *name = "";
+	int nr_buffers;
+	int cpus;
+
+	buffers = tracecmd_msg_get_buffers(&nr_buffers);
+	cpus = extents->streams / (nr_buffers + 1);
+	if (s->stream >= cpus)
+		name = buffers[s->stream / cpus - 1];
+
+	plog("%s%sCPU%d: received %llu pages, lost %llu, reordered %llu, late %llu\n",
+	     name, *name ? " " : "", s->stream % cpus,
+	     s->received, s->lost, s->reordered, s->late);
+}
+
+/*
+ * Each UDP packet holds a page after its sequence number. Pages that
+ * come early wait in a small window for the ones before them. A page
+ * that does not show up before the window moves past it is lost, and
+ * the page written after the gap gets its missed events flag set.
+ */
+static void recv_udp_seq_data(int sfd, int fd, int stream, int page_size)
+{
+	struct stream_extent *extent = &extents->extent[stream];
+	struct udp_seq_stream s;
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH][2];
+	unsigned int seqs[UDP_BATCH];
+	unsigned int len;
+	void *pages;
+	int once = 0;
+	int n, i;
+
+	memset(&s, 0, sizeof(s));
+	s.fd = fd;
+	s.stream = stream;
+	s.page_size = page_size;
+
+	if (posix_memalign(&pages, page_size, page_size * UDP_BATCH))
+		pdie("allocating udp pages");
+	if (posix_memalign((void **)&s.stash, page_size, page_size * UDP_REORDER))
+		pdie("allocating udp pages");
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < UDP_BATCH; i++) {
+		iovs[i][0].iov_base = &seqs[i];
+		iovs[i][0].iov_len = UDP_SEQ_HDR_LEN;
+		iovs[i][1].iov_base = pages + page_size * i;
+		iovs[i][1].iov_len = page_size;
+		msgs[i].msg_hdr.msg_iov = iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	while (!done) {
+		n = recvmmsg(sfd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				if (reader_wait(sfd, UDP_DRAIN_MS))
+					continue;
+				break;
+			}
+			pdie("reading client");
+		}
+		if (!n)
+			break;
+
+		for (i = 0; i < n; i++) {
+			if (msgs[i].msg_len <= UDP_SEQ_HDR_LEN)
+				continue;
+			len = msgs[i].msg_len - UDP_SEQ_HDR_LEN;
+			if (len < page_size && !once) {
+				once = 1;
+				warning("read %d bytes, expected %d",
+					len, page_size);
+			}
+			s.received++;
+			udp_seq_page(&s, ntohl(seqs[i]), iovs[i][1].iov_base, len);
+		}
+		udp_seq_write(&s);
 
-	fd = open(tempfile, O_WRONLY | O_TRUNC | O_CREAT, 0644);
-	if (fd < 0)
-		pdie("creating %s", tempfile);
+		/* What was sent before the pages seen is off the socket */
+		if (s.seen != extent->seen) {
+			extent->seen = s.seen;
+			eventfd_write(extents->credit_fd, 1);
+		}
+	}
+
+	/* Nothing more is coming, write what is left in the window */
+	while (s.stashed)
+		udp_seq_advance(&s);
+	udp_seq_write(&s);
+
+	udp_seq_stats(&s);
+
+	free(s.stash);
+	free(pages);
+}
+
+static int process_udp_child(int sfd, const char *host, const char *port,
+			     int cpu, int page_size, int ofd)
+{
+	struct sockaddr_storage peer_addr;
+	socklen_t peer_addr_len;
+	char *tempfile = NULL;
+	sigset_t mask;
+	int cfd;
+	int fd = ofd;
+
+	/*
+	 * SIGUSR1 tells the reader that the client is done. A TCP reader
+	 * goes on to the end of its stream, a UDP one until its socket
+	 * stays empty.
+	 */
+	signal_setup(SIGUSR1, finish_reading);
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, &reader_mask);
+
+	if (!extents) {
+		tempfile = get_temp_file(host, port, cpu);
+		if (!tempfile)
+			return -ENOMEM;
+
+		fd = open(tempfile, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+		if (fd < 0)
+			pdie("creating %s", tempfile);
+	}
 
 	if (use_tcp) {
 		if (listen(sfd, backlog) < 0)
 			pdie("listen");
+		/* The client may be done without ever connecting */
+		if (!reader_wait(sfd, 0))
+			goto done;
 		peer_addr_len = sizeof(peer_addr);
 		cfd = accept(sfd, (struct sockaddr *)&peer_addr, &peer_addr_len);
 		if (cfd < 0 && errno == EINTR)
@@ -235,23 +1166,16 @@ static int process_udp_child(int sfd, const char *host, const char *port,
 		sfd = cfd;
 	}
 
-	do {
-		/* TODO, make this copyless! */
-		n = read(sfd, buf, page_size);
-		if (n < 0) {
-			if (errno == EINTR)
-				continue;
-			pdie("reading client");
-		}
-		if (!n)
-			break;
-		/* UDP requires that we get the full size in one go */
-		if (!use_tcp && n < page_size && !once) {
-			once = 1;
-			warning("read %d bytes, expected %d", n, page_size);
-		}
-		write(fd, buf, n);
-	} while (!done);
+	if (extents && !wait_for_data_start())
+		goto done;
+
+	if (use_tcp) {
+		if (splice_stream_data(sfd, fd, cpu, page_size) < 0)
+			read_stream_data(sfd, fd, cpu, page_size);
+	} else if (use_udp_seq)
+		recv_udp_seq_data(sfd, fd, cpu, page_size);
+	else
+		recv_udp_data(sfd, fd, cpu, page_size);
 
  done:
 	put_temp_file(tempfile);
@@ -305,8 +1229,27 @@ static int udp_bind_a_port(int start_port, int *sfd)
 	return num_port;
 }
 
+/*
+ * Try to get past rmem_max first, as the readers can fall behind.
+ * Returns how many pages the socket holds, as the kernel counts more
+ * than twice the size of a datagram of a page against the buffer.
+ */
+static unsigned int set_udp_rcvbuf(int sfd, int pagesize)
+{
+	int size = UDP_RCVBUF;
+	socklen_t len = sizeof(size);
+
+	if (setsockopt(sfd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+		setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	if (getsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &size, &len) < 0 ||
+	    size < pagesize * 3)
+		return 1;
+	return size / (pagesize * 3);
+}
+
 static void fork_udp_reader(int sfd, const char *node, const char *port,
-			    int *pid, int cpu, int pagesize)
+			    int *pid, int cpu, int pagesize, int ofd)
 {
 	int ret;
 
@@ -316,7 +1259,7 @@ static void fork_udp_reader(int sfd, const char *node, const char *port,
 		pdie("creating udp reader");
 
 	if (!*pid) {
-		ret = process_udp_child(sfd, node, port, cpu, pagesize);
+		ret = process_udp_child(sfd, node, port, cpu, pagesize, ofd);
 		if (ret < 0)
 			pdie("Problem with udp reader %d", ret);
 	}
@@ -325,8 +1268,9 @@ static void fork_udp_reader(int sfd, const char *node, const char *port,
 }
 
 static int open_udp(const char *node, const char *port, int *pid,
-		    int cpu, int pagesize, int start_port)
+		    int cpu, int pagesize, int start_port, int ofd)
 {
+	unsigned int window;
 	int sfd;
 	int num_port;
 
@@ -338,7 +1282,13 @@ static int open_udp(const char *node, const char *port, int *pid,
 	if (num_port < 0)
 		return num_port;
 
-	fork_udp_reader(sfd, node, port, pid, cpu, pagesize);
+	if (!use_tcp) {
+		window = set_udp_rcvbuf(sfd, pagesize);
+		if (extents)
+			extents->extent[cpu].window = window;
+	}
+
+	fork_udp_reader(sfd, node, port, pid, cpu, pagesize, ofd);
 
 	return num_port;
 }
@@ -367,7 +1317,11 @@ static int communicate_with_client(int fd, int *cpus, int *pagesize)
 
 	/* Is the client using the new protocol? */
 	if (*cpus == -1) {
-		if (memcmp(buf, V2_CPU, n) != 0) {
+		if (memcmp(buf, V3_CPU, n) == 0)
+			proto_ver = V3_PROTOCOL;
+		else if (memcmp(buf, V2_CPU, n) == 0)
+			proto_ver = V2_PROTOCOL;
+		else {
 			/* If it did not send a version, then bail */
 			if (memcmp(buf, "-1V", 3)) {
 				plog("Unknown string %s\n", buf);
@@ -388,12 +1342,12 @@ static int communicate_with_client(int fd, int *cpus, int *pagesize)
 				last_proto[n] = 0;
 			}
 			/* Return the highest protocol we can use */
-			write(fd, "V2", 3);
+			write(fd, "V3", 3);
 			goto try_again;
 		}
 
-		/* Let the client know we use v2 protocol */
-		write(fd, "V2", 3);
+		/* Let the client know which protocol we use */
+		write(fd, proto_ver == V3_PROTOCOL ? "V3" : "V2", 3);
 
 		/* read the rest of dummy data */
 		n = read(fd, buf, sizeof(V2_MAGIC));
@@ -403,13 +1357,12 @@ static int communicate_with_client(int fd, int *cpus, int *pagesize)
 		/* We're off! */
 		write(fd, "OK", 2);
 
-		proto_ver = V2_PROTOCOL;
-
 		/* read the CPU count, the page size, and options */
 		if (tracecmd_msg_initial_setting(fd, cpus, pagesize) < 0)
 			goto out;
 	} else {
 		/* The client is using the v1 protocol */
+		proto_ver = V1_PROTOCOL;
 
 		plog("cpus=%d\n", *cpus);
 		if (*cpus < 0)
@@ -503,14 +1456,14 @@ static void destroy_all_readers(int cpus, int *pid_array, const char *node,
 		if (pid_array[cpu] > 0) {
 			kill(pid_array[cpu], SIGKILL);
 			waitpid(pid_array[cpu], NULL, 0);
-			delete_temp_file(node, port, cpu);
 			pid_array[cpu] = 0;
 		}
+		delete_temp_file(node, port, cpu);
 	}
 }
 
 static int *create_all_readers(int cpus, const char *node, const char *port,
-			       int pagesize, int fd)
+			       int pagesize, int fd, int ofd)
 {
 	char buf[BUFSIZ];
 	int *port_array;
@@ -537,7 +1490,7 @@ static int *create_all_readers(int cpus, const char *node, const char *port,
 	/* Now create a UDP port for each CPU */
 	for (cpu = 0; cpu < cpus; cpu++) {
 		udp_port = open_udp(node, port, &pid, cpu,
-				    pagesize, start_port);
+				    pagesize, start_port, ofd);
 		if (udp_port < 0)
 			goto out_free;
 		port_array[cpu] = udp_port;
@@ -549,7 +1502,7 @@ static int *create_all_readers(int cpus, const char *node, const char *port,
 		start_port = udp_port + 1;
 	}
 
-	if (proto_ver == V2_PROTOCOL) {
+	if (proto_ver >= V2_PROTOCOL) {
 		/* send set of port numbers to the client */
 		if (tracecmd_msg_send_port_array(fd, cpus, port_array) < 0)
 			goto out_free;
@@ -598,6 +1551,10 @@ static void collect_metadata_from_client(int ifd, int ofd)
 	} while (n > 0 && !done);
 }
 
+/*
+ * The client is done, and has closed its streams. Let the readers take
+ * what is left of them, and wait for them to exit.
+ */
 static void stop_all_readers(int cpus, int *pid_array)
 {
 	int cpu;
@@ -606,26 +1563,57 @@ static void stop_all_readers(int cpus, int *pid_array)
 		if (pid_array[cpu] > 0)
 			kill(pid_array[cpu], SIGUSR1);
 	}
+
+	/* Also the ones still waiting for the data start */
+	if (extents)
+		release_readers();
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		if (pid_array[cpu] <= 0)
+			continue;
+		/* The exit of another reader interrupts the wait */
+		while (waitpid(pid_array[cpu], NULL, 0) < 0 && errno == EINTR)
+			;
+		pid_array[cpu] = 0;
+	}
 }
 
+/* The client may send a UDP stream as far as its socket holds */
+static unsigned int stream_credit(int stream)
+{
+	struct stream_extent *extent = &extents->extent[stream];
+
+	return *(volatile unsigned int *)&extent->seen + extent->window;
+}
+
+/*
+ * The streams of the buffer instances follow the ones of the top
+ * instance, @cpus streams for each buffer.
+ */
 static int put_together_file(int cpus, int ofd, const char *node,
 			      const char *port)
 {
+	char * const *buffers;
 	char **temp_files;
+	int nr_buffers;
+	int streams;
 	int cpu;
 
+	buffers = tracecmd_msg_get_buffers(&nr_buffers);
+	streams = cpus * (nr_buffers + 1);
+
 	/* Now put together the file */
-	temp_files = malloc(sizeof(*temp_files) * cpus);
+	temp_files = malloc(sizeof(*temp_files) * streams);
 	if (!temp_files)
 		return -ENOMEM;
 
-	for (cpu = 0; cpu < cpus; cpu++) {
+	for (cpu = 0; cpu < streams; cpu++) {
 		temp_files[cpu] = get_temp_file(node, port, cpu);
 		if (!temp_files[cpu])
 			goto fail;
 	}
 
-	tracecmd_attach_cpu_data_fd(ofd, cpus, temp_files);
+	tracecmd_attach_buffers_fd(ofd, cpus, temp_files, nr_buffers, buffers);
 	free(temp_files);
 	return 0;
 
@@ -637,10 +1625,35 @@ static int put_together_file(int cpus, int ofd, const char *node,
 	return -ENOMEM;
 }
 
-static int process_client(const char *node, const char *port, int fd)
+static int process_client_v1(const char *node, const char *port, int fd,
+			     int cpus, int pagesize, int ofd)
 {
 	int *pid_array;
+	int ret;
+
+	pid_array = create_all_readers(cpus, node, port, pagesize, fd, ofd);
+	if (!pid_array)
+		return -ENOMEM;
+
+	/* Now we are ready to start reading data from the client */
+	collect_metadata_from_client(fd, ofd);
+
+	stop_all_readers(cpus, pid_array);
+
+	ret = put_together_file(cpus, ofd, node, port);
+
+	destroy_all_readers(cpus, pid_array, node, port);
+
+	return ret;
+}
+
+static int process_client(const char *node, const char *port, int fd)
+{
+	struct tracecmd_output *handle = NULL;
+	int *pid_array = NULL;
+	int nr_buffers;
 	int pagesize;
+	int streams;
 	int cpus;
 	int ofd;
 	int ret;
@@ -649,31 +1662,61 @@ static int process_client(const char *node, const char *port, int fd)
 	if (ret < 0)
 		return ret;
 
+	/* Every buffer instance of the client has a stream per CPU */
+	tracecmd_msg_get_buffers(&nr_buffers);
+	streams = cpus * (nr_buffers + 1);
+
 	ofd = create_client_file(node, port);
 
-	pid_array = create_all_readers(cpus, node, port, pagesize, fd);
-	if (!pid_array)
-		return -ENOMEM;
+	/* The v1 metadata only ends when the client is done */
+	if (proto_ver == V1_PROTOCOL)
+		return process_client_v1(node, port, fd, cpus, pagesize, ofd);
 
-	/* Now we are ready to start reading data from the client */
-	if (proto_ver == V2_PROTOCOL)
-		tracecmd_msg_collect_metadata(fd, ofd);
-	else
-		collect_metadata_from_client(fd, ofd);
-
-	/* wait a little to let our readers finish reading */
-	sleep(1);
+	if (alloc_extents(streams, pagesize) < 0)
+		return -ENOMEM;
 
-	/* stop our readers */
-	stop_all_readers(cpus, pid_array);
+	if (proto_ver == V3_PROTOCOL && use_tcp) {
+		/*
+		 * No ports tells the client to send everything on this
+		 * connection.
+		 */
+		ret = tracecmd_msg_send_port_array(fd, 0, NULL);
+	} else {
+		pid_array = create_all_readers(streams, node, port, pagesize,
+					       fd, ofd);
+		if (!pid_array)
+			ret = -ENOMEM;
+	}
+	if (ret < 0)
+		goto out;
 
-	/* wait a little to have the readers clean up */
-	sleep(1);
+	/* Now we are ready to start reading data from the client */
+	ret = tracecmd_msg_read_metadata(fd, ofd);
+	if (ret >= 0) {
+		handle = start_stream_data(ofd, cpus);
+		if (!handle)
+			ret = -EINVAL;
+	}
 
-	ret = put_together_file(cpus, ofd, node, port);
+	if (ret >= 0) {
+		if (pid_array)
+			ret = tracecmd_msg_wait_close_credits(fd, streams,
+							      extents->credit_fd,
+							      stream_credit);
+		else
+			ret = tracecmd_msg_collect_data(fd, ofd, cpus, streams,
+							reserve_stream);
+	}
 
-	destroy_all_readers(cpus, pid_array, node, port);
+	if (pid_array) {
+		stop_all_readers(streams, pid_array);
+		destroy_all_readers(streams, pid_array, node, port);
+	}
 
+	if (handle)
+		ret = finish_stream_data(handle, ofd, cpus);
+ out:
+	free_extents();
 	return ret;
 }
 
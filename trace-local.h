@@ -82,15 +82,18 @@ void trace_init_profile(struct tracecmd_input *handle, struct hook_list *hooks,
 			int global);
 int trace_profile(void);
 void trace_profile_set_merge_like_comms(void);
+void trace_profile_snapshot(void);
 
 struct tracecmd_input *
 trace_stream_init(struct buffer_instance *instance, int cpu, int fd, int cpus,
 		  int profile, struct hook_list *hooks, int global);
 int trace_stream_read(struct pid_record_data *pids, int nr_pids, struct timeval *tv,
 		      int profile);
+void trace_stream_set_profile_interval(int msecs);
 
 void trace_show_data(struct tracecmd_input *handle, struct pevent_record *record,
 		     int profile);
+void trace_show_flush(void);
 
 /* --- event interation --- */
 
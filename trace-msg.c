@@ -31,7 +31,12 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/types.h>
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
 
 #include "trace-cmd-local.h"
 #include "trace-msg.h"
@@ -52,6 +57,19 @@ typedef __be32 be32;
 #define TRACECMD_MSG_META_MAX_LEN	\
 ((TRACECMD_MSG_MAX_LEN) - (TRACECMD_MSG_META_MIN_LEN) - TRACECMD_MSG_HDR_LEN)
 
+					/* + cpu + instance of the stream */
+#define TRACECMD_MSG_DATA_HDR_LEN	\
+		((TRACECMD_MSG_HDR_LEN) + (sizeof(be32)) + (sizeof(be32)))
+
+					/* pages forwarded per data frame */
+#define TRACECMD_MSG_DATA_PAGES		16
+
+					/* largest data frame we accept */
+#define TRACECMD_MSG_DATA_MAX_LEN	(1 << 20)
+
+					/* metadata sent per bulk message */
+#define TRACECMD_MSG_META_BULK_LEN	(4 << 20)
+
 					/* size + opt_cmd + size of str */
 #define TRACECMD_OPT_MIN_LEN		\
 			((sizeof(be32)) + (sizeof(be32)) + (sizeof(be32)))
@@ -61,6 +79,7 @@ typedef __be32 be32;
 
 /* for both client and server */
 bool use_tcp;
+bool use_udp_seq;
 int cpu_count;
 
 /* for client */
@@ -73,6 +92,34 @@ bool send_metadata;
 static int *port_array;
 bool done;
 
+/* buffer instances that are recorded over the network (v3) */
+static char **msg_buffers;
+static int nr_msg_buffers;
+
+/*
+ * zlib level of the data frames (v3). For the server, only tells
+ * that the client may send compressed frames.
+ */
+static int msg_compress;
+
+/*
+ * Metadata goes in large messages (v3). The client collects it in
+ * @meta_buf, up to TRACECMD_MSG_META_BULK_LEN bytes per message.
+ */
+static bool msg_bulk_meta;
+static char *meta_buf;
+static char *meta_zbuf;
+static u32 meta_len;
+static unsigned long long meta_raw;
+static unsigned long long meta_sent;
+static int meta_msgs;
+
+/*
+ * The server paces the numbered UDP pages with MSG_CREDIT (v3). It
+ * tells the client up to what page number each stream may send.
+ */
+static bool msg_credits;
+
 struct tracecmd_msg_str {
 	be32 size;
 	char *buf;
@@ -100,6 +147,11 @@ struct tracecmd_msg_meta {
 	struct tracecmd_msg_str str;
 };
 
+struct tracecmd_msg_data {
+	be32 cpu;
+	be32 instance;
+} __attribute__((packed));
+
 struct tracecmd_msg_error {
 	be32 size;
 	be32 cmd;
@@ -116,6 +168,10 @@ enum tracecmd_msg_cmd {
 	MSG_RINIT	= 5,
 	MSG_SENDMETA	= 6,
 	MSG_FINMETA	= 7,
+	MSG_DATA	= 8,
+	MSG_ZDATA	= 9,
+	MSG_ZMETA	= 10,
+	MSG_CREDIT	= 11,
 };
 
 struct tracecmd_msg {
@@ -125,10 +181,40 @@ struct tracecmd_msg {
 		struct tracecmd_msg_tinit tinit;
 		struct tracecmd_msg_rinit rinit;
 		struct tracecmd_msg_meta meta;
+		struct tracecmd_msg_data data;
 		struct tracecmd_msg_error err;
 	} data;
 } __attribute__((packed));
 
+/* A bulk MSG_SENDMETA or MSG_ZMETA, the (compressed) metadata follows */
+struct tracecmd_msg_meta_hdr {
+	be32 size;
+	be32 cmd;
+	be32 len;	/* of the metadata, once uncompressed */
+} __attribute__((packed));
+
+/* A MSG_DATA frame, the stream data follows this header */
+struct tracecmd_msg_data_hdr {
+	be32 size;
+	be32 cmd;
+	struct tracecmd_msg_data data;
+} __attribute__((packed));
+
+/* A MSG_CREDIT frame, the (be32) limits of @nr streams from @first follow */
+struct tracecmd_msg_credit_hdr {
+	be32 size;
+	be32 cmd;
+	be32 first;
+	be32 nr;
+} __attribute__((packed));
+
+/* The most streams a MSG_CREDIT frame holds */
+#define TRACECMD_MSG_CREDIT_MAX		\
+	((TRACECMD_MSG_MAX_LEN - sizeof(struct tracecmd_msg_credit_hdr)) / sizeof(be32))
+
+/* Without credits for this long, the pages in flight are taken as lost */
+#define TRACECMD_MSG_CREDIT_WAIT_MSEC	1000
+
 struct tracecmd_msg *errmsg;
 
 static ssize_t msg_do_write_check(int fd, struct tracecmd_msg *msg)
@@ -176,8 +262,15 @@ static int optcpy(struct tracecmd_msg_opt *opt, u32 offset,
 
 enum msg_opt_command {
 	MSGOPT_USETCP = 1,
+	MSGOPT_BUFFER = 2,
+	MSGOPT_COMPRESS = 3,
+	MSGOPT_UDPSEQ = 4,
+	MSGOPT_BULKMETA = 5,
+	MSGOPT_CREDITS = 6,
 };
 
+#define MSG_COMPRESS_ZLIB	"zlib"
+
 static int add_option_to_tinit(u32 cmd, const char *buf,
 			       struct tracecmd_msg *msg, int offset)
 {
@@ -212,11 +305,49 @@ static int add_options_to_tinit(struct tracecmd_msg *msg)
 {
 	int offset = offsetof(struct tracecmd_msg, data.tinit.opt);
 	int ret;
+	int i;
 
 	if (use_tcp) {
 		ret = add_option_to_tinit(MSGOPT_USETCP, NULL, msg, offset);
 		if (ret < 0)
 			return ret;
+		offset += ret;
+	}
+
+	for (i = 0; i < nr_msg_buffers; i++) {
+		ret = add_option_to_tinit(MSGOPT_BUFFER, msg_buffers[i],
+					  msg, offset);
+		if (ret < 0)
+			return ret;
+		offset += ret;
+	}
+
+	if (msg_compress) {
+		ret = add_option_to_tinit(MSGOPT_COMPRESS, MSG_COMPRESS_ZLIB,
+					  msg, offset);
+		if (ret < 0)
+			return ret;
+		offset += ret;
+	}
+
+	if (use_udp_seq) {
+		ret = add_option_to_tinit(MSGOPT_UDPSEQ, NULL, msg, offset);
+		if (ret < 0)
+			return ret;
+		offset += ret;
+	}
+
+	if (msg_bulk_meta) {
+		ret = add_option_to_tinit(MSGOPT_BULKMETA, NULL, msg, offset);
+		if (ret < 0)
+			return ret;
+		offset += ret;
+	}
+
+	if (msg_credits) {
+		ret = add_option_to_tinit(MSGOPT_CREDITS, NULL, msg, offset);
+		if (ret < 0)
+			return ret;
 	}
 
 	return 0;
@@ -230,6 +361,20 @@ static int make_tinit(struct tracecmd_msg *msg)
 	if (use_tcp)
 		opt_num++;
 
+	opt_num += nr_msg_buffers;
+
+	if (msg_compress)
+		opt_num++;
+
+	if (use_udp_seq)
+		opt_num++;
+
+	if (msg_bulk_meta)
+		opt_num++;
+
+	if (msg_credits)
+		opt_num++;
+
 	if (opt_num) {
 		ret = add_options_to_tinit(msg);
 		if (ret < 0)
@@ -265,6 +410,7 @@ static u32 tracecmd_msg_get_body_length(u32 cmd)
 {
 	struct tracecmd_msg *msg;
 	u32 len = 0;
+	int i;
 
 	switch (cmd) {
 	case MSG_TINIT:
@@ -278,12 +424,30 @@ static u32 tracecmd_msg_get_body_length(u32 cmd)
 		 */
 
 		/* TODO, test for ipv4 */
-		if (page_size >= UDP_MAX_PACKET) {
+		if (page_size + (use_udp_seq ? UDP_SEQ_HDR_LEN : 0) >= UDP_MAX_PACKET) {
 			warning("page size too big for UDP using TCP in live read");
 			use_tcp = true;
 		}
 
-		if (use_tcp)
+		if (use_tcp) {
+			use_udp_seq = false;
+			msg_credits = false;
+			len += TRACECMD_OPT_MIN_LEN;
+		}
+
+		for (i = 0; i < nr_msg_buffers; i++)
+			len += TRACECMD_OPT_MIN_LEN + strlen(msg_buffers[i]);
+
+		if (msg_compress)
+			len += TRACECMD_OPT_MIN_LEN + strlen(MSG_COMPRESS_ZLIB);
+
+		if (use_udp_seq)
+			len += TRACECMD_OPT_MIN_LEN;
+
+		if (msg_bulk_meta)
+			len += TRACECMD_OPT_MIN_LEN;
+
+		if (msg_credits)
 			len += TRACECMD_OPT_MIN_LEN;
 
 		return len;
@@ -379,18 +543,11 @@ static int tracecmd_msg_read_extra(int fd, void *buf, u32 size, int *n)
 	return 0;
 }
 
-/*
- * Read header information of msg first, then read all data
- */
-static int tracecmd_msg_recv(int fd, struct tracecmd_msg *msg)
+/* Read the rest of a message whose header is already in @msg */
+static int tracecmd_msg_recv_body(int fd, struct tracecmd_msg *msg)
 {
 	u32 size = 0;
-	int n = 0;
-	int ret;
-
-	ret = tracecmd_msg_read_extra(fd, msg, TRACECMD_MSG_HDR_LEN, &n);
-	if (ret < 0)
-		return ret;
+	int n = TRACECMD_MSG_HDR_LEN;
 
 	size = ntohl(msg->size);
 	if (size > TRACECMD_MSG_MAX_LEN)
@@ -410,6 +567,21 @@ error:
 	return -ENOMSG;
 }
 
+/*
+ * Read header information of msg first, then read all data
+ */
+static int tracecmd_msg_recv(int fd, struct tracecmd_msg *msg)
+{
+	int n = 0;
+	int ret;
+
+	ret = tracecmd_msg_read_extra(fd, msg, TRACECMD_MSG_HDR_LEN, &n);
+	if (ret < 0)
+		return ret;
+
+	return tracecmd_msg_recv_body(fd, msg);
+}
+
 #define MSG_WAIT_MSEC	5000
 static int msg_wait_to = MSG_WAIT_MSEC;
 
@@ -421,22 +593,34 @@ void tracecmd_msg_set_debug(int debug)
 		msg_wait_to = MSG_WAIT_MSEC;
 }
 
-/*
- * A return value of 0 indicates time-out
- */
-static int tracecmd_msg_recv_wait(int fd, struct tracecmd_msg *msg)
+/* Wait for a message, returns -ETIMEDOUT on time-out */
+static int msg_poll_wait(int fd)
 {
 	struct pollfd pfd;
 	int ret;
 
 	pfd.fd = fd;
 	pfd.events = POLLIN;
-	ret = poll(&pfd, 1, msg_wait_to);
+	/* Our readers exiting (SIGCHLD) must not cut off the metadata */
+	do {
+		ret = poll(&pfd, 1, msg_wait_to);
+	} while (ret < 0 && errno == EINTR && !done);
 	if (ret < 0)
 		return -errno;
 	else if (ret == 0)
 		return -ETIMEDOUT;
 
+	return 0;
+}
+
+static int tracecmd_msg_recv_wait(int fd, struct tracecmd_msg *msg)
+{
+	int ret;
+
+	ret = msg_poll_wait(fd);
+	if (ret < 0)
+		return ret;
+
 	return tracecmd_msg_recv(fd, msg);
 }
 
@@ -491,10 +675,16 @@ int tracecmd_msg_send_init_data(int fd)
 	if (ret < 0)
 		return ret;
 
+	/*
+	 * A server that hands out no ports wants all the streams to be
+	 * multiplexed over this connection (v3).
+	 */
 	cpus = ntohl(msg->data.rinit.cpus);
-	client_ports = malloc_or_die(sizeof(int) * cpus);
-	for (i = 0; i < cpus; i++)
-		client_ports[i] = ntohl(msg->data.rinit.port_array[i]);
+	if (cpus) {
+		client_ports = malloc_or_die(sizeof(int) * cpus);
+		for (i = 0; i < cpus; i++)
+			client_ports[i] = ntohl(msg->data.rinit.port_array[i]);
+	}
 
 	/* Next, send meta data */
 	send_metadata = true;
@@ -502,12 +692,142 @@ int tracecmd_msg_send_init_data(int fd)
 	return 0;
 }
 
+/**
+ * tracecmd_msg_add_buffer - record a buffer instance over the network
+ * @name: the name of the buffer instance
+ *
+ * The buffer instances are sent to the server with MSG_TINIT, and
+ * their streams follow the top instance, in the order they were added.
+ * Only a v3 server understands them.
+ */
+int tracecmd_msg_add_buffer(const char *name)
+{
+	char **buffers;
+	char *buf;
+
+	buf = strdup(name);
+	if (!buf)
+		return -ENOMEM;
+
+	buffers = realloc(msg_buffers, sizeof(*buffers) * (nr_msg_buffers + 1));
+	if (!buffers) {
+		free(buf);
+		return -ENOMEM;
+	}
+	buffers[nr_msg_buffers++] = buf;
+	msg_buffers = buffers;
+
+	return 0;
+}
+
+/**
+ * tracecmd_msg_get_buffers - the buffer instances of the client
+ * @nr_buffers: returns the number of buffer instances
+ *
+ * Returns the names of the buffer instances the client records
+ * along with the top instance.
+ */
+char * const *tracecmd_msg_get_buffers(int *nr_buffers)
+{
+	*nr_buffers = nr_msg_buffers;
+	return msg_buffers;
+}
+
+/**
+ * tracecmd_msg_set_compression - compress the data frames (v3)
+ * @level: the zlib compression level (1-9)
+ *
+ * Asks the server in MSG_TINIT to accept compressed data frames.
+ * Each batch of pages read from a stream is compressed on its own.
+ * Returns -ENOTSUP if trace-cmd was built without zlib.
+ */
+int tracecmd_msg_set_compression(int level)
+{
+#ifdef NO_ZLIB
+	return -ENOTSUP;
+#else
+	if (level < Z_BEST_SPEED || level > Z_BEST_COMPRESSION)
+		return -EINVAL;
+	msg_compress = level;
+	return 0;
+#endif
+}
+
+/**
+ * tracecmd_msg_set_bulk_metadata - send the metadata in large messages (v3)
+ *
+ * Instead of a message per write of the metadata, the metadata is
+ * collected and sent in messages of up to a few MB, compressed when
+ * compression is used.
+ */
+void tracecmd_msg_set_bulk_metadata(void)
+{
+	msg_bulk_meta = true;
+}
+
+/**
+ * tracecmd_msg_set_udp_credits - let the server pace the UDP pages (v3)
+ *
+ * The numbered UDP pages of a stream only go out as far as the server
+ * allows with MSG_CREDIT, which follows what its readers took off
+ * their sockets. Until then they wait in the pipes of the recorders.
+ */
+void tracecmd_msg_set_udp_credits(void)
+{
+	msg_credits = true;
+}
+
 static bool process_option(struct tracecmd_msg_opt *opt)
 {
-	/* currently the only option we have is to us TCP */
-	if (ntohl(opt->opt_cmd) == MSGOPT_USETCP) {
+	u32 size;
+	char *buf;
+
+	switch (ntohl(opt->opt_cmd)) {
+	case MSGOPT_USETCP:
 		use_tcp = true;
 		return true;
+	case MSGOPT_BUFFER:
+		size = ntohl(opt->str.size);
+		if (!size || size > ntohl(opt->size) - TRACECMD_OPT_MIN_LEN)
+			return false;
+		buf = malloc(size + 1);
+		if (!buf)
+			return false;
+		memcpy(buf, (void *)opt + TRACECMD_OPT_MIN_LEN, size);
+		buf[size] = 0;
+		if (tracecmd_msg_add_buffer(buf) < 0) {
+			free(buf);
+			return false;
+		}
+		plog("buffer=%s\n", buf);
+		free(buf);
+		return true;
+	case MSGOPT_COMPRESS:
+#ifndef NO_ZLIB
+		size = ntohl(opt->str.size);
+		if (size != strlen(MSG_COMPRESS_ZLIB) ||
+		    size > ntohl(opt->size) - TRACECMD_OPT_MIN_LEN ||
+		    memcmp((void *)opt + TRACECMD_OPT_MIN_LEN,
+			   MSG_COMPRESS_ZLIB, size) != 0)
+			return false;
+		plog("compress=%s\n", MSG_COMPRESS_ZLIB);
+		msg_compress = 1;
+		return true;
+#else
+		plog("Not built with zlib, can not decompress\n");
+		return false;
+#endif
+	case MSGOPT_UDPSEQ:
+		use_udp_seq = true;
+		return true;
+	case MSGOPT_BULKMETA:
+		msg_bulk_meta = true;
+		return true;
+	case MSGOPT_CREDITS:
+		if (!use_udp_seq)
+			return false;
+		msg_credits = true;
+		return true;
 	}
 	return false;
 }
@@ -594,6 +914,11 @@ int tracecmd_msg_send_port_array(int fd, int total_cpus, int *ports)
 {
 	int ret;
 
+	if (total_cpus > CPU_MAX) {
+		plog("Can not hand out ports for more than %d cpus\n", CPU_MAX);
+		return -EINVAL;
+	}
+
 	cpu_count = total_cpus;
 	port_array = ports;
 
@@ -609,6 +934,48 @@ void tracecmd_msg_send_close_msg(void)
 	tracecmd_msg_send(psfd, MSG_CLOSE);
 }
 
+/**
+ * tracecmd_msg_writev - write all of a set of iovecs
+ * @fd: the file or socket to write to
+ * @iov: the buffers to write, updated as they are written
+ * @cnt: the number of entries in @iov
+ * @offset: the file offset to write at, or -1 for the current one
+ *
+ * Retries short and interrupted writes until everything is written.
+ *
+ * Returns 0 on success, or -errno on error.
+ */
+int tracecmd_msg_writev(int fd, struct iovec *iov, int cnt, off64_t offset)
+{
+	ssize_t r;
+
+	while (cnt) {
+		if (offset < 0)
+			r = writev(fd, iov, cnt);
+		else
+			r = pwritev64(fd, iov, cnt, offset);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (offset >= 0)
+			offset += r;
+		/* Skip what was written, a short write leaves a partial iov */
+		while (cnt && r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base += r;
+			iov->iov_len -= r;
+		}
+	}
+
+	return 0;
+}
+
 static void make_meta(const char *buf, int buflen, struct tracecmd_msg *msg)
 {
 	int offset = offsetof(struct tracecmd_msg, data.meta.str.buf);
@@ -617,6 +984,82 @@ static void make_meta(const char *buf, int buflen, struct tracecmd_msg *msg)
 	msgcpy(msg, offset, buf, buflen);
 }
 
+/* Send what was collected of the metadata as one message */
+static int msg_flush_metadata(int fd)
+{
+	struct tracecmd_msg_meta_hdr hdr;
+	struct iovec iov[2];
+	u32 cmd = MSG_SENDMETA;
+	u32 len = meta_len;
+	char *buf = meta_buf;
+
+	if (!meta_len)
+		return 0;
+
+#ifndef NO_ZLIB
+	if (msg_compress) {
+		uLongf zlen = compressBound(TRACECMD_MSG_META_BULK_LEN);
+
+		if (!meta_zbuf)
+			meta_zbuf = malloc(zlen);
+		/* Only send it compressed if that helps */
+		if (meta_zbuf &&
+		    compress2((Bytef *)meta_zbuf, &zlen, (Bytef *)meta_buf,
+			      meta_len, msg_compress) == Z_OK && zlen < meta_len) {
+			cmd = MSG_ZMETA;
+			buf = meta_zbuf;
+			len = zlen;
+		}
+	}
+#endif
+
+	hdr.size = htonl(TRACECMD_MSG_META_MIN_LEN + len);
+	hdr.cmd = htonl(cmd);
+	hdr.len = htonl(meta_len);
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = TRACECMD_MSG_META_MIN_LEN;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+
+	meta_raw += meta_len;
+	meta_sent += TRACECMD_MSG_META_MIN_LEN + len;
+	meta_msgs++;
+	meta_len = 0;
+
+	return tracecmd_msg_writev(fd, iov, 2, -1);
+}
+
+/* Collect the metadata, and send it whenever there is enough of it */
+static int msg_bulk_metadata_send(int fd, const char *buf, int size)
+{
+	u32 n;
+	int ret;
+
+	if (!meta_buf) {
+		meta_buf = malloc(TRACECMD_MSG_META_BULK_LEN);
+		if (!meta_buf)
+			return -ENOMEM;
+	}
+
+	while (size) {
+		n = TRACECMD_MSG_META_BULK_LEN - meta_len;
+		if (n > size)
+			n = size;
+		memcpy(meta_buf + meta_len, buf, n);
+		meta_len += n;
+		buf += n;
+		size -= n;
+
+		if (meta_len == TRACECMD_MSG_META_BULK_LEN) {
+			ret = msg_flush_metadata(fd);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
 int tracecmd_msg_metadata_send(int fd, const char *buf, int size)
 {
 	struct tracecmd_msg *msg;
@@ -624,6 +1067,9 @@ int tracecmd_msg_metadata_send(int fd, const char *buf, int size)
 	int ret;
 	int count = 0;
 
+	if (msg_bulk_meta)
+		return msg_bulk_metadata_send(fd, buf, size);
+
 	ret = tracecmd_msg_create(MSG_SENDMETA, &msg);
 	if (ret < 0)
 		return ret;
@@ -658,6 +1104,17 @@ int tracecmd_msg_finish_sending_metadata(int fd)
 {
 	int ret;
 
+	if (msg_bulk_meta) {
+		ret = msg_flush_metadata(fd);
+		free(meta_buf);
+		free(meta_zbuf);
+		meta_buf = meta_zbuf = NULL;
+		if (ret < 0)
+			return ret;
+		plog("Sent %llu bytes of metadata in %d messages (%llu bytes)\n",
+		     meta_raw, meta_msgs, meta_sent);
+	}
+
 	ret = tracecmd_msg_send(fd, MSG_FINMETA);
 	if (ret < 0)
 		return ret;
@@ -667,27 +1124,109 @@ int tracecmd_msg_finish_sending_metadata(int fd)
 	return 0;
 }
 
-int tracecmd_msg_collect_metadata(int ifd, int ofd)
+/*
+ * Read a bulk metadata message (v3) into @buf, and write it out.
+ * The header of the message is already read.
+ */
+static int msg_read_bulk_metadata(int ifd, int ofd, u32 cmd, u32 size,
+				  char **buf, char **zbuf)
 {
-	struct tracecmd_msg *msg;
-	char buf[TRACECMD_MSG_MAX_LEN];
+	char *data;
+	u32 payload;
+	u32 len;
+	be32 val;
+	int n = 0;
+	int ret;
+
+	if (size < TRACECMD_MSG_META_MIN_LEN)
+		return -EINVAL;
+
+	ret = tracecmd_msg_read_extra(ifd, &val, sizeof(val), &n);
+	if (ret < 0)
+		return ret;
+
+	len = ntohl(val);
+	payload = size - TRACECMD_MSG_META_MIN_LEN;
+	if (len > TRACECMD_MSG_META_BULK_LEN || payload > TRACECMD_MSG_META_BULK_LEN)
+		return -EINVAL;
+	if (cmd == MSG_SENDMETA && payload != len)
+		return -EINVAL;
+	if (cmd == MSG_ZMETA && !msg_compress)
+		return -EINVAL;
+
+	if (!*buf) {
+		*buf = malloc(TRACECMD_MSG_META_BULK_LEN);
+		if (!*buf)
+			return -ENOMEM;
+	}
+	if (cmd == MSG_ZMETA && !*zbuf) {
+		*zbuf = malloc(TRACECMD_MSG_META_BULK_LEN);
+		if (!*zbuf)
+			return -ENOMEM;
+	}
+
+	data = cmd == MSG_ZMETA ? *zbuf : *buf;
+	n = 0;
+	ret = tracecmd_msg_read_extra(ifd, data, payload, &n);
+	if (ret < 0)
+		return ret;
+
+	if (cmd == MSG_ZMETA) {
+#ifndef NO_ZLIB
+		uLongf ulen = len;
+
+		if (uncompress((Bytef *)*buf, &ulen, (Bytef *)*zbuf,
+			       payload) != Z_OK || ulen != len)
+			return -EINVAL;
+#else
+		return -EINVAL;
+#endif
+	}
+
+	return __do_write_check(ofd, *buf, len);
+}
+
+static int msg_read_metadata(int ifd, int ofd, struct tracecmd_msg *msg)
+{
+	char *buf = (char *)msg;
+	char *bulk_buf = NULL;
+	char *bulk_zbuf = NULL;
+	unsigned long long total = 0;
 	u32 s, t, n, cmd;
 	int offset = TRACECMD_MSG_META_MIN_LEN;
+	int msgs = 0;
+	int hdr;
 	int ret;
 
-	msg = (struct tracecmd_msg *)buf;
-
 	do {
-		ret = tracecmd_msg_recv_wait(ifd, msg);
+		ret = msg_poll_wait(ifd);
+		if (!ret) {
+			hdr = 0;
+			ret = tracecmd_msg_read_extra(ifd, msg, TRACECMD_MSG_HDR_LEN,
+						      &hdr);
+		}
+		cmd = ntohl(msg->cmd);
+		if (!ret && msg_bulk_meta &&
+		    (cmd == MSG_SENDMETA || cmd == MSG_ZMETA)) {
+			ret = msg_read_bulk_metadata(ifd, ofd, cmd,
+						     ntohl(msg->size),
+						     &bulk_buf, &bulk_zbuf);
+			if (ret == -EINVAL)
+				goto error;
+			total += ntohl(msg->size);
+			msgs++;
+			if (!ret)
+				continue;
+		} else if (!ret)
+			ret = tracecmd_msg_recv_body(ifd, msg);
 		if (ret < 0) {
 			if (ret == -ETIMEDOUT)
 				warning("Connection timed out\n");
 			else
 				warning("reading client");
-			return ret;
+			goto out;
 		}
 
-		cmd = ntohl(msg->cmd);
 		if (cmd == MSG_FINMETA) {
 			/* Finish receiving meta data */
 			break;
@@ -703,12 +1242,55 @@ int tracecmd_msg_collect_metadata(int ifd, int ofd)
 				if (errno == EINTR)
 					continue;
 				warning("writing to file");
-				return -errno;
+				ret = -errno;
+				goto out;
 			}
 			t -= s;
 			s = n - t;
 		} while (t);
-	} while (cmd == MSG_SENDMETA);
+	} while (cmd == MSG_SENDMETA || cmd == MSG_ZMETA);
+
+	if (msgs)
+		plog("Received %llu bytes of metadata in %d messages\n",
+		     total, msgs);
+	ret = 0;
+ out:
+	free(bulk_buf);
+	free(bulk_zbuf);
+	return ret;
+
+error:
+	error_operation_for_server(msg);
+	ret = -EINVAL;
+	goto out;
+}
+
+/**
+ * tracecmd_msg_read_metadata - receive the metadata
+ * @ifd: the connection to the client
+ * @ofd: the file to write the metadata to
+ *
+ * Returns once the client has sent all its metadata (MSG_FINMETA).
+ */
+int tracecmd_msg_read_metadata(int ifd, int ofd)
+{
+	char buf[TRACECMD_MSG_MAX_LEN];
+
+	return msg_read_metadata(ifd, ofd, (struct tracecmd_msg *)buf);
+}
+
+/**
+ * tracecmd_msg_wait_close - wait for the client to finish
+ * @ifd: the connection to the client
+ */
+int tracecmd_msg_wait_close(int ifd)
+{
+	struct tracecmd_msg *msg;
+	char buf[TRACECMD_MSG_MAX_LEN];
+	u32 cmd;
+	int ret;
+
+	msg = (struct tracecmd_msg *)buf;
 
 	/* check the finish message of the client */
 	while (!done) {
@@ -736,3 +1318,742 @@ error:
 	error_operation_for_server(msg);
 	return ret;
 }
+
+/* Send the limits of all the streams, if any of them moved */
+static int msg_send_credits(int fd, int nr_streams,
+			    tracecmd_msg_credit_func credit, u32 *limits,
+			    bool all)
+{
+	struct tracecmd_msg_credit_hdr hdr;
+	be32 buf[TRACECMD_MSG_CREDIT_MAX];
+	struct iovec iov[2];
+	bool moved = all;
+	u32 limit;
+	int first, nr, i;
+	int ret;
+
+	for (i = 0; i < nr_streams; i++) {
+		limit = credit(i);
+		if (limit != limits[i])
+			moved = true;
+		limits[i] = limit;
+	}
+	if (!moved)
+		return 0;
+
+	for (first = 0; first < nr_streams; first += nr) {
+		nr = nr_streams - first;
+		if (nr > TRACECMD_MSG_CREDIT_MAX)
+			nr = TRACECMD_MSG_CREDIT_MAX;
+		for (i = 0; i < nr; i++)
+			buf[i] = htonl(limits[first + i]);
+
+		hdr.size = htonl(sizeof(hdr) + sizeof(be32) * nr);
+		hdr.cmd = htonl(MSG_CREDIT);
+		hdr.first = htonl(first);
+		hdr.nr = htonl(nr);
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = buf;
+		iov[1].iov_len = sizeof(be32) * nr;
+		ret = tracecmd_msg_writev(fd, iov, 2, -1);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * tracecmd_msg_wait_close_credits - wait for the client, pacing its UDP pages
+ * @ifd: the connection to the client
+ * @nr_streams: the number of streams
+ * @wake_fd: an eventfd that is written to when the credits may have moved
+ * @credit: returns up to what page number a stream may be sent
+ *
+ * If the client asked for credits, sends it the limits of the streams
+ * with MSG_CREDIT, first when called and then whenever they move, until
+ * the client closes the connection. Otherwise the same as
+ * tracecmd_msg_wait_close().
+ */
+int tracecmd_msg_wait_close_credits(int ifd, int nr_streams, int wake_fd,
+				    tracecmd_msg_credit_func credit)
+{
+	struct tracecmd_msg *msg;
+	char buf[TRACECMD_MSG_MAX_LEN];
+	struct pollfd pfds[2];
+	unsigned long long cnt;
+	u32 *limits;
+	u32 cmd;
+	int ret;
+
+	if (!msg_credits)
+		return tracecmd_msg_wait_close(ifd);
+
+	limits = calloc(nr_streams, sizeof(*limits));
+	if (!limits)
+		return -ENOMEM;
+
+	msg = (struct tracecmd_msg *)buf;
+
+	pfds[0].fd = ifd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = wake_fd;
+	pfds[1].events = POLLIN;
+
+	ret = msg_send_credits(ifd, nr_streams, credit, limits, true);
+
+	while (!done && ret >= 0) {
+		ret = poll(pfds, 2, -1);
+		if (ret < 0) {
+			if (errno != EINTR)
+				ret = -errno;
+			else
+				ret = 0;
+			continue;
+		}
+
+		if (pfds[1].revents) {
+			if (read(wake_fd, &cnt, sizeof(cnt)) < 0 &&
+			    errno != EINTR && errno != EAGAIN) {
+				ret = -errno;
+				break;
+			}
+			ret = msg_send_credits(ifd, nr_streams, credit,
+					       limits, false);
+			if (ret < 0)
+				break;
+		}
+
+		if (!pfds[0].revents)
+			continue;
+
+		ret = tracecmd_msg_recv(ifd, msg);
+		if (ret < 0) {
+			warning("reading client");
+			break;
+		}
+
+		cmd = ntohl(msg->cmd);
+		if (cmd == MSG_CLOSE)
+			/* Finish this connection */
+			break;
+
+		warning("Not accept the message %d", cmd);
+		error_operation_for_server(msg);
+		ret = -EINVAL;
+	}
+
+	free(limits);
+	return ret < 0 ? ret : 0;
+}
+
+int tracecmd_msg_collect_metadata(int ifd, int ofd)
+{
+	int ret;
+
+	ret = tracecmd_msg_read_metadata(ifd, ofd);
+	if (ret < 0)
+		return ret;
+
+	return tracecmd_msg_wait_close(ifd);
+}
+
+/**
+ * tracecmd_msg_send_data_streams - multiplex the CPU streams (v3)
+ * @fd: the connection to the server
+ * @cpus: the number of CPUs per buffer instance
+ * @nr_fds: the number of streams
+ * @fds: the streams, indexed by instance * @cpus + cpu
+ *
+ * Reads whatever is available from the streams and sends it as
+ * MSG_DATA frames tagged with the CPU and instance it came from.
+ * All the frames ready at one time go out with a single writev().
+ * With compression, a batch that shrinks goes out as MSG_ZDATA.
+ * Returns when every stream has been closed, or on error.
+ */
+int tracecmd_msg_send_data_streams(int fd, int cpus, int nr_fds, int *fds)
+{
+	struct tracecmd_msg_data_hdr *hdrs = NULL;
+	struct pollfd *pfds = NULL;
+	struct iovec *iov = NULL;
+	char *bufs = NULL;
+	char *zbufs = NULL;
+	int batch = page_size * TRACECMD_MSG_DATA_PAGES;
+	unsigned long long raw = 0, sent = 0;
+#ifndef NO_ZLIB
+	unsigned long zbatch = 0;
+#endif
+	int open_fds = nr_fds;
+	int ret = -ENOMEM;
+	int cnt, n, i;
+
+	pfds = calloc(nr_fds, sizeof(*pfds));
+	hdrs = calloc(nr_fds, sizeof(*hdrs));
+	iov = calloc(nr_fds * 2, sizeof(*iov));
+	bufs = malloc((size_t)batch * nr_fds);
+	if (!pfds || !hdrs || !iov || !bufs)
+		goto out;
+
+#ifndef NO_ZLIB
+	if (msg_compress) {
+		zbatch = compressBound(batch);
+		zbufs = malloc(zbatch * nr_fds);
+		if (!zbufs)
+			goto out;
+	}
+#endif
+
+	for (i = 0; i < nr_fds; i++) {
+		pfds[i].fd = fds[i];
+		pfds[i].events = POLLIN;
+		hdrs[i].cmd = htonl(MSG_DATA);
+		hdrs[i].data.cpu = htonl(i % cpus);
+		hdrs[i].data.instance = htonl(i / cpus);
+	}
+
+	while (open_fds) {
+		ret = poll(pfds, nr_fds, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			goto out;
+		}
+
+		cnt = 0;
+		for (i = 0; i < nr_fds; i++) {
+			if (pfds[i].fd < 0 || !pfds[i].revents)
+				continue;
+			n = read(pfds[i].fd, bufs + (size_t)batch * i, batch);
+			if (n < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				ret = -errno;
+				goto out;
+			}
+			if (!n) {
+				/* The recorder of this stream is done */
+				pfds[i].fd = -1;
+				open_fds--;
+				continue;
+			}
+			raw += n;
+			hdrs[i].cmd = htonl(MSG_DATA);
+			iov[cnt + 1].iov_base = bufs + (size_t)batch * i;
+			iov[cnt + 1].iov_len = n;
+#ifndef NO_ZLIB
+			if (zbufs) {
+				char *zbuf = zbufs + zbatch * i;
+				uLongf zlen = zbatch;
+
+				/* Only send the compressed batch if it helps */
+				if (compress2((Bytef *)zbuf, &zlen,
+					      iov[cnt + 1].iov_base, n,
+					      msg_compress) == Z_OK && zlen < n) {
+					hdrs[i].cmd = htonl(MSG_ZDATA);
+					iov[cnt + 1].iov_base = zbuf;
+					iov[cnt + 1].iov_len = zlen;
+				}
+			}
+#endif
+			sent += iov[cnt + 1].iov_len;
+			hdrs[i].size = htonl(TRACECMD_MSG_DATA_HDR_LEN +
+					     iov[cnt + 1].iov_len);
+			iov[cnt].iov_base = &hdrs[i];
+			iov[cnt].iov_len = TRACECMD_MSG_DATA_HDR_LEN;
+			cnt += 2;
+		}
+
+		if (cnt) {
+			ret = tracecmd_msg_writev(fd, iov, cnt, -1);
+			if (ret < 0)
+				goto out;
+		}
+	}
+
+	if (zbufs && raw)
+		plog("Compressed %llu bytes of data to %llu (%.1f%%)\n",
+		     raw, sent, sent * 100.0 / raw);
+
+	ret = 0;
+ out:
+	free(pfds);
+	free(hdrs);
+	free(iov);
+	free(bufs);
+	free(zbufs);
+	return ret;
+}
+
+/* Send @size bytes of @buf, a datagram per page (the last may be partial) */
+static int msg_send_udp_pages(int sock, u32 *seq, char *buf, int size)
+{
+	struct mmsghdr msgs[TRACECMD_MSG_DATA_PAGES];
+	struct iovec iov[TRACECMD_MSG_DATA_PAGES][2];
+	be32 seqs[TRACECMD_MSG_DATA_PAGES];
+	int pages = (size + page_size - 1) / page_size;
+	int sent = 0;
+	int ret;
+	int i;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < pages; i++) {
+		seqs[i] = htonl((*seq)++);
+		iov[i][0].iov_base = &seqs[i];
+		iov[i][0].iov_len = UDP_SEQ_HDR_LEN;
+		iov[i][1].iov_base = buf + (size_t)page_size * i;
+		iov[i][1].iov_len = size < page_size ? size : page_size;
+		size -= iov[i][1].iov_len;
+		msgs[i].msg_hdr.msg_iov = iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	while (sent < pages) {
+		ret = sendmmsg(sock, msgs + sent, pages - sent, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		sent += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Send what the buffer of a stream holds, as far as its credits go.
+ * A partial page only goes out once the stream is closed.
+ */
+static int msg_send_udp_buf(int sock, u32 *seq, u32 limit, char *buf,
+			    int *fill, bool closed)
+{
+	int size = *fill;
+	int pages;
+	int ret;
+
+	if (!closed)
+		size -= size % page_size;
+
+	if (msg_credits) {
+		pages = (int)(limit - *seq);
+		if (pages <= 0)
+			return 0;
+		if (size > pages * page_size)
+			size = pages * page_size;
+	}
+	if (!size)
+		return 0;
+
+	ret = msg_send_udp_pages(sock, seq, buf, size);
+	if (ret < 0)
+		return ret;
+
+	*fill -= size;
+	memmove(buf, buf + size, *fill);
+	return 0;
+}
+
+/* Read a MSG_CREDIT frame, a limit never goes back */
+static int msg_recv_credits(int fd, int nr_streams, u32 *limits)
+{
+	struct tracecmd_msg_credit_hdr hdr;
+	be32 buf[TRACECMD_MSG_CREDIT_MAX];
+	u32 first, nr, limit;
+	int n = 0;
+	int ret;
+	u32 i;
+
+	ret = tracecmd_msg_read_extra(fd, &hdr, sizeof(hdr), &n);
+	if (ret < 0)
+		return ret;
+
+	first = ntohl(hdr.first);
+	nr = ntohl(hdr.nr);
+	if (ntohl(hdr.cmd) != MSG_CREDIT || nr > TRACECMD_MSG_CREDIT_MAX ||
+	    ntohl(hdr.size) != sizeof(hdr) + sizeof(be32) * nr ||
+	    nr > nr_streams || first > nr_streams - nr) {
+		warning("Not accept the message %d", ntohl(hdr.cmd));
+		return -EINVAL;
+	}
+
+	n = 0;
+	ret = tracecmd_msg_read_extra(fd, buf, sizeof(be32) * nr, &n);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < nr; i++) {
+		limit = ntohl(buf[i]);
+		if ((int)(limit - limits[first + i]) > 0)
+			limits[first + i] = limit;
+	}
+
+	return 0;
+}
+
+/**
+ * tracecmd_msg_send_udp_streams - send the CPU streams as datagrams (v3)
+ * @fd: the connection to the server
+ * @nr_fds: the number of streams
+ * @fds: the streams, indexed by instance * cpus + cpu
+ * @socks: the connected UDP sockets of the streams
+ *
+ * Each page read from a stream goes out as one datagram, after the
+ * sequence number of the page within its stream. That lets the server
+ * put pages that arrive out of order back in place, and tell which
+ * pages were lost. A partial page is only sent when its stream closes.
+ *
+ * With credits, the pages of a stream only go out up to the limit the
+ * server sent on @fd. A stream that has a full batch waiting is not
+ * read from, so the rest stays in its pipe and the recorder blocks.
+ * Returns when every stream has been closed and sent, or on error.
+ */
+int tracecmd_msg_send_udp_streams(int fd, int nr_fds, int *fds, int *socks)
+{
+	struct pollfd *pfds = NULL;
+	int batch = page_size * TRACECMD_MSG_DATA_PAGES;
+	bool *closed = NULL;
+	int *fill = NULL;
+	u32 *seq = NULL;
+	u32 *limits = NULL;
+	char *bufs = NULL;
+	char *buf;
+	int open_fds = nr_fds;
+	int waiting = 0;
+	int ret = -ENOMEM;
+	int n, i;
+
+	pfds = calloc(nr_fds + 1, sizeof(*pfds));
+	closed = calloc(nr_fds, sizeof(*closed));
+	fill = calloc(nr_fds, sizeof(*fill));
+	seq = calloc(nr_fds, sizeof(*seq));
+	limits = calloc(nr_fds, sizeof(*limits));
+	bufs = malloc((size_t)batch * nr_fds);
+	if (!pfds || !closed || !fill || !seq || !limits || !bufs)
+		goto out;
+
+	for (i = 0; i < nr_fds; i++)
+		pfds[i].events = POLLIN;
+
+	pfds[nr_fds].fd = msg_credits ? fd : -1;
+	pfds[nr_fds].events = POLLIN;
+
+	while (open_fds || waiting) {
+		/* A closed pipe would wake us up even if not read from */
+		for (i = 0; i < nr_fds; i++)
+			pfds[i].fd = !closed[i] && fill[i] < batch ? fds[i] : -1;
+
+		ret = poll(pfds, nr_fds + 1,
+			   waiting ? TRACECMD_MSG_CREDIT_WAIT_MSEC : -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			goto out;
+		}
+
+		if (!ret) {
+			/* Give up on what is in flight, rather than stall */
+			for (i = 0; i < nr_fds; i++) {
+				if (fill[i])
+					limits[i] = seq[i] + TRACECMD_MSG_DATA_PAGES;
+			}
+		}
+
+		if (pfds[nr_fds].revents) {
+			ret = msg_recv_credits(fd, nr_fds, limits);
+			if (ret < 0)
+				goto out;
+		}
+
+		for (i = 0; i < nr_fds; i++) {
+			if (pfds[i].fd < 0 || !pfds[i].revents)
+				continue;
+			buf = bufs + (size_t)batch * i;
+			n = read(pfds[i].fd, buf + fill[i], batch - fill[i]);
+			if (n < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				ret = -errno;
+				goto out;
+			}
+			if (!n) {
+				/* The recorder of this stream is done */
+				closed[i] = true;
+				open_fds--;
+				continue;
+			}
+			fill[i] += n;
+		}
+
+		waiting = 0;
+		for (i = 0; i < nr_fds; i++) {
+			if (!fill[i])
+				continue;
+			buf = bufs + (size_t)batch * i;
+			ret = msg_send_udp_buf(socks[i], &seq[i], limits[i],
+					       buf, &fill[i], closed[i]);
+			if (ret < 0)
+				goto out;
+			/* Left over for the lack of credits */
+			if (fill[i] >= (closed[i] ? 1 : page_size))
+				waiting++;
+		}
+	}
+
+	ret = 0;
+ out:
+	free(pfds);
+	free(closed);
+	free(fill);
+	free(seq);
+	free(limits);
+	free(bufs);
+	return ret;
+}
+
+static int msg_pwrite_check(int fd, const char *buf, size_t size, off64_t offset)
+{
+	ssize_t r;
+
+	while (size) {
+		r = pwrite64(fd, buf, size, offset);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += r;
+		offset += r;
+		size -= r;
+	}
+
+	return 0;
+}
+
+/*
+ * Move @size bytes of a data frame from the connection into the
+ * file at @offset. Use splice() when we can, so that the data does
+ * not need to be copied into user space.
+ */
+static int msg_copy_data(int ifd, int ofd, u32 size, off64_t offset, int *brass)
+{
+	char buf[BUFSIZ];
+	ssize_t n, s;
+	int r;
+	u32 t;
+
+	while (brass[0] >= 0 && size) {
+		n = splice(ifd, NULL, brass[1], NULL, size,
+			   SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EINVAL)
+				return -errno;
+			/* Not supported, fall back to copying */
+			close(brass[0]);
+			close(brass[1]);
+			brass[0] = brass[1] = -1;
+			break;
+		}
+		if (!n)
+			return -ENOTCONN;
+		size -= n;
+		while (n) {
+			s = splice(brass[0], NULL, ofd, &offset, n, SPLICE_F_MOVE);
+			if (s < 0) {
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+			n -= s;
+		}
+	}
+
+	while (size) {
+		t = size > BUFSIZ ? BUFSIZ : size;
+		r = 0;
+		s = tracecmd_msg_read_extra(ifd, buf, t, &r);
+		if (s < 0)
+			return s;
+		s = msg_pwrite_check(ofd, buf, t, offset);
+		if (s < 0)
+			return s;
+		offset += t;
+		size -= t;
+	}
+
+	return 0;
+}
+
+#ifndef NO_ZLIB
+/*
+ * Read a compressed batch of pages of @size bytes from the connection
+ * and write it out uncompressed where @reserve says the stream goes.
+ * Returns the uncompressed size.
+ */
+static int msg_inflate_data(int ifd, int ofd, int stream, u32 size,
+			    tracecmd_msg_reserve_func reserve,
+			    char **zbuf, char **buf)
+{
+	off64_t offset;
+	uLongf len = TRACECMD_MSG_DATA_MAX_LEN;
+	unsigned int piece;
+	uLongf pos;
+	int n = 0;
+	int ret;
+
+	if (!*zbuf) {
+		*zbuf = malloc(TRACECMD_MSG_DATA_MAX_LEN);
+		*buf = malloc(TRACECMD_MSG_DATA_MAX_LEN);
+		if (!*zbuf || !*buf)
+			return -ENOMEM;
+	}
+
+	ret = tracecmd_msg_read_extra(ifd, *zbuf, size, &n);
+	if (ret < 0)
+		return ret;
+
+	if (uncompress((Bytef *)*buf, &len, (Bytef *)*zbuf, size) != Z_OK)
+		return -EINVAL;
+
+	/* The stream may go on somewhere else in @ofd */
+	for (pos = 0; pos < len; pos += piece) {
+		piece = len - pos;
+		offset = reserve(ofd, stream, &piece);
+		if (offset < 0)
+			return offset;
+
+		ret = msg_pwrite_check(ofd, *buf + pos, piece, offset);
+		if (ret < 0)
+			return ret;
+	}
+
+	return len;
+}
+#endif
+
+/**
+ * tracecmd_msg_collect_data - receive the multiplexed streams (v3)
+ * @ifd: the connection to the client
+ * @ofd: the file to write the stream data to
+ * @cpus: the number of CPUs per buffer instance
+ * @nr_streams: the number of streams
+ * @reserve: returns where in @ofd the next bytes of a stream go, and
+ *           how many of them fit there
+ *
+ * Called after the metadata was read. Demultiplexes the MSG_DATA
+ * frames into @ofd until the client closes the connection. The
+ * streams are numbered instance * @cpus + cpu.
+ */
+int tracecmd_msg_collect_data(int ifd, int ofd, int cpus, int nr_streams,
+			      tracecmd_msg_reserve_func reserve)
+{
+	struct tracecmd_msg *msg;
+	char buf[TRACECMD_MSG_MAX_LEN];
+	int brass[2] = { -1, -1 };
+	unsigned long long raw = 0, received = 0;
+	char *zbuf = NULL, *dbuf = NULL;
+	u32 size, cmd, cpu, instance;
+	unsigned int len;
+	u32 stream;
+	int n;
+	int ret;
+
+	off64_t offset;
+
+	if (cpus <= 0)
+		return -EINVAL;
+
+	msg = (struct tracecmd_msg *)buf;
+
+	if (pipe(brass) == 0)
+		fcntl(brass[1], F_SETPIPE_SZ, TRACECMD_MSG_DATA_MAX_LEN);
+
+	while (!done) {
+		n = 0;
+		ret = tracecmd_msg_read_extra(ifd, msg, TRACECMD_MSG_HDR_LEN, &n);
+		if (ret < 0) {
+			warning("reading client");
+			goto out;
+		}
+
+		size = ntohl(msg->size);
+		cmd = ntohl(msg->cmd);
+		if (cmd == MSG_CLOSE)
+			/* Finish this connection */
+			break;
+
+		ret = -EINVAL;
+		if ((cmd != MSG_DATA && !(cmd == MSG_ZDATA && msg_compress)) ||
+		    size < TRACECMD_MSG_DATA_HDR_LEN ||
+		    size > TRACECMD_MSG_DATA_MAX_LEN + TRACECMD_MSG_DATA_HDR_LEN) {
+			warning("Not accept the message %d", cmd);
+			goto error;
+		}
+
+		ret = tracecmd_msg_read_extra(ifd, msg, TRACECMD_MSG_DATA_HDR_LEN -
+					      TRACECMD_MSG_HDR_LEN, &n);
+		if (ret < 0) {
+			warning("reading client");
+			goto out;
+		}
+
+		cpu = ntohl(msg->data.data.cpu);
+		instance = ntohl(msg->data.data.instance);
+		/* Both come from the client, check them before multiplying */
+		if (cpu >= (u32)cpus || instance >= (u32)(nr_streams / cpus)) {
+			plog("Data for unknown stream cpu=%u instance=%u\n",
+			     cpu, instance);
+			ret = -EINVAL;
+			goto error;
+		}
+		stream = instance * cpus + cpu;
+
+		size -= TRACECMD_MSG_DATA_HDR_LEN;
+		received += size;
+#ifndef NO_ZLIB
+		if (cmd == MSG_ZDATA) {
+			ret = msg_inflate_data(ifd, ofd, stream, size, reserve,
+					       &zbuf, &dbuf);
+			if (ret >= 0)
+				raw += ret;
+		} else
+#endif
+		{
+			raw += size;
+			for (ret = 0; size && ret >= 0; size -= len) {
+				len = size;
+				offset = reserve(ofd, stream, &len);
+				ret = offset;
+				if (offset >= 0)
+					ret = msg_copy_data(ifd, ofd, len, offset,
+							    brass);
+			}
+		}
+		if (ret < 0) {
+			warning("writing stream data");
+			goto out;
+		}
+	}
+
+	if (msg_compress && raw)
+		plog("Received %llu bytes of data compressed to %llu (%.1f%%)\n",
+		     raw, received, received * 100.0 / raw);
+
+	ret = 0;
+	goto out;
+
+error:
+	error_operation_for_server(msg);
+out:
+	if (brass[0] >= 0) {
+		close(brass[0]);
+		close(brass[1]);
+	}
+	free(zbuf);
+	free(dbuf);
+	return ret;
+}
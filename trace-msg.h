@@ -2,16 +2,24 @@
 #define _TRACE_MSG_H_
 
 #include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define UDP_MAX_PACKET	(65536 - 20)
 #define V2_MAGIC	"677768\0"
 #define V2_CPU		"-1V2"
+#define V3_CPU		"-1V3"
 
 #define V1_PROTOCOL	1
 #define V2_PROTOCOL	2
+#define V3_PROTOCOL	3
+
+/* v3 UDP datagrams start with the (be32) sequence number of their page */
+#define UDP_SEQ_HDR_LEN	4
 
 /* for both client and server */
 extern bool use_tcp;
+extern bool use_udp_seq;
 extern int cpu_count;
 
 /* for client */
@@ -25,4 +33,6 @@ extern bool done;
 void plog(const char *fmt, ...);
 void pdie(const char *fmt, ...);
 
+int tracecmd_msg_writev(int fd, struct iovec *iov, int cnt, off64_t offset);
+
 #endif /* _TRACE_MSG_H_ */
@@ -0,0 +1,928 @@
+/*
+ * trace-net-bench.c : benchmark recording to a listener over loopback
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of the License
+ * (not later!)
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not,  see <http://www.gnu.org/licenses>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * Replays the CPU data of a trace.dat file through the client side of
+ * the network protocols into a "trace-cmd listen" started on loopback,
+ * and reports how fast it went and what it cost on both ends. No
+ * tracefs is needed: the metadata and pages come from the file.
+ */
+#define _LARGEFILE64_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <limits.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "trace-cmd.h"
+#include "trace-msg.h"
+
+#define DEFAULT_PORT	19000
+
+/* How long the listener gets to bind its port */
+#define LISTEN_WAIT_MSEC	5000
+
+struct bench_mode {
+	const char		*name;
+	int			proto;
+	int			tcp;
+	int			compress;
+};
+
+static struct bench_mode modes[] = {
+	{ "v1-udp",	V1_PROTOCOL,	0,	0 },
+	{ "v1-tcp",	V1_PROTOCOL,	1,	0 },
+	{ "v2-udp",	V2_PROTOCOL,	0,	0 },
+	{ "v2-tcp",	V2_PROTOCOL,	1,	0 },
+	{ "v3-udp",	V3_PROTOCOL,	0,	0 },
+	{ "v3-tcp",	V3_PROTOCOL,	1,	0 },
+	{ "v3-zlib",	V3_PROTOCOL,	1,	1 },
+	{ NULL }
+};
+
+/* Where the data of a CPU is in a trace.dat file */
+struct cpu_data {
+	off64_t			offset;
+	off64_t			size;
+};
+
+struct trace_file {
+	int			fd;
+	int			page_size;
+	int			cpus;
+	off64_t			meta_size;
+	struct cpu_data		*data;
+};
+
+/* What one end of the connection cost */
+struct bench_usage {
+	double			cpu;		/* user + system seconds */
+	unsigned long long	syscalls;	/* read and write like calls */
+};
+
+struct bench_result {
+	struct bench_usage	usage;
+	unsigned long long	bytes;		/* CPU data sent */
+	double			setup;		/* seconds to connect and send the metadata */
+	double			send;		/* seconds to send the data */
+	double			finish;		/* seconds for the listener to be done */
+	int			error;
+};
+
+static const char *listener = NULL;
+static int repeat = 1;
+static int keep;
+
+/* Neither the protocol log nor the status of reading files matter here */
+void plog(const char *fmt, ...)
+{
+}
+
+void pr_stat(const char *fmt, ...)
+{
+}
+
+void vpr_stat(const char *fmt, va_list ap)
+{
+}
+
+void pdie(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(-1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static int read_all(int fd, void *buf, size_t size, off64_t offset)
+{
+	ssize_t r;
+
+	while (size) {
+		r = pread64(fd, buf, size, offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf += r;
+		size -= r;
+		offset += r;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+	ssize_t r;
+
+	while (size) {
+		r = write(fd, buf, size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf += r;
+		size -= r;
+	}
+	return 0;
+}
+
+/*
+ * The metadata is what a client sends before the CPU data, that is
+ * everything up to the CPU count. The CPU data of the top instance is
+ * found from the flyrecord section that follows the options.
+ */
+static int open_trace_file(const char *file, struct trace_file *tf)
+{
+	struct tracecmd_input *handle;
+	struct pevent *pevent;
+	unsigned long long val8;
+	unsigned short option;
+	unsigned int val4;
+	char buf[10];
+	off64_t pos;
+	int ret = -1;
+	int ifd;
+	int cpu;
+
+	memset(tf, 0, sizeof(*tf));
+
+	tf->fd = open(file, O_RDONLY);
+	if (tf->fd < 0)
+		return -1;
+
+	/* The handle reads through a shared file offset */
+	ifd = dup(tf->fd);
+	if (ifd < 0)
+		return -1;
+	handle = tracecmd_alloc_fd(ifd);
+	if (!handle) {
+		close(ifd);
+		return -1;
+	}
+	if (tracecmd_read_headers(handle) < 0)
+		goto out;
+
+	pevent = tracecmd_get_pevent(handle);
+	tf->page_size = tracecmd_page_size(handle);
+	tf->meta_size = lseek64(tf->fd, 0, SEEK_CUR);
+	pos = tf->meta_size;
+
+	if (read_all(tf->fd, &val4, 4, pos) < 0)
+		goto out;
+	tf->cpus = __data2host4(pevent, val4);
+	pos += 4;
+
+	if (read_all(tf->fd, buf, 10, pos) < 0)
+		goto out;
+	pos += 10;
+
+	if (strncmp(buf, "options", 7) == 0) {
+		for (;;) {
+			if (read_all(tf->fd, &option, 2, pos) < 0)
+				goto out;
+			pos += 2;
+			if (!__data2host2(pevent, option))
+				break;
+			if (read_all(tf->fd, &val4, 4, pos) < 0)
+				goto out;
+			pos += 4 + __data2host4(pevent, val4);
+		}
+		if (read_all(tf->fd, buf, 10, pos) < 0)
+			goto out;
+		pos += 10;
+	}
+
+	if (strncmp(buf, "flyrecord", 9) != 0) {
+		warning("%s: no flyrecord data", file);
+		goto out;
+	}
+
+	tf->data = calloc(tf->cpus, sizeof(*tf->data));
+	if (!tf->data)
+		goto out;
+
+	for (cpu = 0; cpu < tf->cpus; cpu++) {
+		if (read_all(tf->fd, &val8, 8, pos) < 0)
+			goto out;
+		tf->data[cpu].offset = __data2host8(pevent, val8);
+		if (read_all(tf->fd, &val8, 8, pos + 8) < 0)
+			goto out;
+		tf->data[cpu].size = __data2host8(pevent, val8);
+		pos += 16;
+	}
+
+	ret = 0;
+ out:
+	tracecmd_close(handle);
+	return ret;
+}
+
+static unsigned long long trace_file_data_size(struct trace_file *tf)
+{
+	unsigned long long size = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < tf->cpus; cpu++)
+		size += tf->data[cpu].size;
+	return size;
+}
+
+static void get_usage(struct bench_usage *usage)
+{
+	struct rusage self, children;
+	unsigned long long val;
+	char line[128];
+	FILE *fp;
+
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+	usage->cpu = self.ru_utime.tv_sec + self.ru_utime.tv_usec / 1000000.0 +
+		self.ru_stime.tv_sec + self.ru_stime.tv_usec / 1000000.0 +
+		children.ru_utime.tv_sec + children.ru_utime.tv_usec / 1000000.0 +
+		children.ru_stime.tv_sec + children.ru_stime.tv_usec / 1000000.0;
+
+	/* Includes the children that were waited for */
+	usage->syscalls = 0;
+	fp = fopen("/proc/self/io", "r");
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "syscr: %llu", &val) == 1 ||
+		    sscanf(line, "syscw: %llu", &val) == 1)
+			usage->syscalls += val;
+	}
+	fclose(fp);
+}
+
+static int connect_to(int port, int type)
+{
+	struct addrinfo hints;
+	struct addrinfo *results, *rp;
+	char buf[BUFSIZ];
+	int sfd = -1;
+
+	snprintf(buf, BUFSIZ, "%d", port);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = type;
+
+	if (getaddrinfo("localhost", buf, &hints, &results) != 0)
+		return -1;
+
+	for (rp = results; rp != NULL; rp = rp->ai_next) {
+		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (sfd < 0)
+			continue;
+		if (connect(sfd, rp->ai_addr, rp->ai_addrlen) == 0)
+			break;
+		close(sfd);
+		sfd = -1;
+	}
+	freeaddrinfo(results);
+
+	return sfd;
+}
+
+/*
+ * Send the CPU data of @cpu to @fd, @repeat times. Like a recorder,
+ * pages are spliced through a pipe, unless each page must go out as
+ * its own datagram.
+ */
+static void feed_cpu(struct trace_file *tf, int cpu, int fd, int udp)
+{
+	struct cpu_data *data = &tf->data[cpu];
+	off64_t offset;
+	off64_t end;
+	char *page;
+	int brass[2];
+	ssize_t r;
+	int size;
+	int i;
+
+	page = malloc(tf->page_size);
+	if (!page || pipe(brass) < 0)
+		pdie("feeder of cpu %d", cpu);
+
+	for (i = 0; i < repeat; i++) {
+		offset = data->offset;
+		end = data->offset + data->size;
+		while (offset < end) {
+			size = end - offset > tf->page_size ?
+				tf->page_size : end - offset;
+			if (udp) {
+				if (read_all(tf->fd, page, size, offset) < 0)
+					pdie("reading cpu %d", cpu);
+				/* A full receive buffer only loses the page */
+				send(fd, page, size, 0);
+				offset += size;
+				continue;
+			}
+			r = splice(tf->fd, &offset, brass[1], NULL, size, SPLICE_F_MOVE);
+			if (r <= 0)
+				pdie("splicing cpu %d", cpu);
+			while (r > 0) {
+				ssize_t s = splice(brass[0], NULL, fd, NULL, r,
+						   SPLICE_F_MOVE);
+				if (s <= 0)
+					pdie("sending cpu %d", cpu);
+				r -= s;
+			}
+		}
+	}
+	exit(0);
+}
+
+static int start_feeders(struct trace_file *tf, int *fds, int udp, int *pids)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < tf->cpus; cpu++) {
+		pids[cpu] = fork();
+		if (pids[cpu] < 0)
+			return -1;
+		if (!pids[cpu])
+			feed_cpu(tf, cpu, fds[cpu], udp);
+	}
+	return 0;
+}
+
+static void wait_feeders(int cpus, int *pids)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < cpus; cpu++)
+		if (pids[cpu] > 0)
+			waitpid(pids[cpu], NULL, 0);
+}
+
+/* The start of the v1 protocol, returns the ports of the CPUs */
+static int *client_v1(int fd, struct trace_file *tf, int tcp)
+{
+	char buf[BUFSIZ];
+	int *ports;
+	int cpu, i;
+
+	snprintf(buf, BUFSIZ, "%d", tf->cpus);
+	write_all(fd, buf, strlen(buf) + 1);
+	snprintf(buf, BUFSIZ, "%d", tf->page_size);
+	write_all(fd, buf, strlen(buf) + 1);
+	if (tcp)
+		write_all(fd, "1\0" "4\0" "TCP", 8);
+	else
+		write_all(fd, "0", 2);
+
+	ports = malloc(sizeof(*ports) * tf->cpus);
+	if (!ports)
+		return NULL;
+
+	for (cpu = 0; cpu < tf->cpus; cpu++) {
+		for (i = 0; i < BUFSIZ; i++) {
+			if (read(fd, buf + i, 1) != 1) {
+				free(ports);
+				return NULL;
+			}
+			if (!buf[i] || buf[i] == ',')
+				break;
+		}
+		if (i == BUFSIZ) {
+			free(ports);
+			return NULL;
+		}
+		buf[i] = 0;
+		ports[cpu] = atoi(buf);
+	}
+
+	return ports;
+}
+
+/* The handshake of the v2 and v3 protocols, as trace-cmd record does it */
+static int client_handshake(int fd, int proto)
+{
+	const char *cpu_str = proto == V3_PROTOCOL ? V3_CPU : V2_CPU;
+	char buf[BUFSIZ];
+	int n;
+
+	n = read(fd, buf, 8);
+	if (n != 8 || memcmp(buf, "tracecmd", 8) != 0)
+		return -1;
+
+	write_all(fd, cpu_str, strlen(cpu_str) + 1);
+	n = read(fd, buf, BUFSIZ);
+	if (n < 2 || memcmp(buf, cpu_str + 2, 2) != 0)
+		return -1;
+
+	write_all(fd, V2_MAGIC, sizeof(V2_MAGIC));
+	n = read(fd, buf, BUFSIZ);
+	if (n != 2 || memcmp(buf, "OK", 2) != 0)
+		return -1;
+
+	return 0;
+}
+
+static int send_trace_metadata(int fd, struct trace_file *tf, int proto)
+{
+	char *buf;
+	int ret;
+
+	buf = malloc(tf->meta_size);
+	if (!buf)
+		return -1;
+	ret = read_all(tf->fd, buf, tf->meta_size, 0);
+	if (ret < 0)
+		goto out;
+
+	if (proto == V1_PROTOCOL) {
+		ret = write_all(fd, buf, tf->meta_size);
+		goto out;
+	}
+
+	ret = tracecmd_msg_metadata_send(fd, buf, tf->meta_size);
+	if (ret < 0)
+		goto out;
+	ret = tracecmd_msg_finish_sending_metadata(fd);
+ out:
+	free(buf);
+	return ret;
+}
+
+/* Send the streams over the connection (TCP) or as numbered pages (UDP) */
+static int client_mux(int fd, struct trace_file *tf, int *socks, int *pids)
+{
+	int *read_fds;
+	int *write_fds;
+	int brass[2];
+	int cpu;
+	int ret = -1;
+
+	read_fds = malloc(sizeof(*read_fds) * tf->cpus);
+	write_fds = malloc(sizeof(*write_fds) * tf->cpus);
+	if (!read_fds || !write_fds)
+		goto out;
+
+	for (cpu = 0; cpu < tf->cpus; cpu++) {
+		if (pipe(brass) < 0)
+			goto out;
+		fcntl(brass[1], F_SETPIPE_SZ, tf->page_size * 64);
+		read_fds[cpu] = brass[0];
+		write_fds[cpu] = brass[1];
+	}
+
+	if (start_feeders(tf, write_fds, 0, pids) < 0)
+		goto out;
+	for (cpu = 0; cpu < tf->cpus; cpu++)
+		close(write_fds[cpu]);
+
+	if (socks)
+		ret = tracecmd_msg_send_udp_streams(fd, tf->cpus, read_fds,
+						    socks);
+	else
+		ret = tracecmd_msg_send_data_streams(fd, tf->cpus, tf->cpus,
+						     read_fds);
+	for (cpu = 0; cpu < tf->cpus; cpu++)
+		close(read_fds[cpu]);
+ out:
+	free(read_fds);
+	free(write_fds);
+	return ret;
+}
+
+/*
+ * The client end of a run. Reports through @result once the listener
+ * closed the connection, which it does when the file is complete.
+ */
+static void run_client(struct bench_mode *mode, struct trace_file *tf,
+		       int port, int result_fd)
+{
+	struct bench_result result;
+	int *ports = NULL;
+	int *socks;
+	int *pids;
+	double connected;
+	double start;
+	double sent;
+	char buf[BUFSIZ];
+	int fd;
+	int cpu;
+	int ret = -1;
+
+	memset(&result, 0, sizeof(result));
+
+	socks = calloc(tf->cpus, sizeof(*socks));
+	pids = calloc(tf->cpus, sizeof(*pids));
+	if (!socks || !pids)
+		goto out;
+
+	connected = now();
+	fd = connect_to(port, SOCK_STREAM);
+	if (fd < 0)
+		goto out;
+
+	cpu_count = tf->cpus;
+	page_size = tf->page_size;
+	use_tcp = mode->tcp;
+
+	if (mode->proto == V1_PROTOCOL) {
+		if (read(fd, buf, 8) != 8 || memcmp(buf, "tracecmd", 8) != 0)
+			goto out;
+		ports = client_v1(fd, tf, mode->tcp);
+	} else {
+		if (client_handshake(fd, mode->proto) < 0)
+			goto out;
+		if (mode->proto == V3_PROTOCOL) {
+			if (!mode->tcp) {
+				use_udp_seq = true;
+				tracecmd_msg_set_udp_credits();
+			}
+			tracecmd_msg_set_bulk_metadata();
+		}
+		if (mode->compress &&
+		    tracecmd_msg_set_compression(mode->compress) < 0)
+			goto out;
+		if (tracecmd_msg_send_init_data(fd) < 0)
+			goto out;
+		ports = client_ports;
+	}
+
+	if (send_trace_metadata(fd, tf, mode->proto) < 0)
+		goto out;
+
+	if (ports) {
+		for (cpu = 0; cpu < tf->cpus; cpu++) {
+			socks[cpu] = connect_to(ports[cpu], mode->tcp ?
+						SOCK_STREAM : SOCK_DGRAM);
+			if (socks[cpu] < 0)
+				goto out;
+		}
+	}
+
+	start = now();
+	if (mode->proto == V3_PROTOCOL)
+		ret = client_mux(fd, tf, ports ? socks : NULL, pids);
+	else
+		ret = start_feeders(tf, socks, !mode->tcp, pids);
+	wait_feeders(tf->cpus, pids);
+	sent = now();
+	if (ret < 0)
+		goto out;
+
+	/* Like the recorders exiting before the client hangs up */
+	for (cpu = 0; ports && cpu < tf->cpus; cpu++)
+		close(socks[cpu]);
+	if (mode->proto != V1_PROTOCOL)
+		tracecmd_msg_send_close_msg();
+	shutdown(fd, SHUT_WR);
+
+	/* The listener hangs up once it wrote the file */
+	while (read(fd, buf, BUFSIZ) > 0)
+		;
+
+	result.bytes = trace_file_data_size(tf) * repeat;
+	result.setup = start - connected;
+	result.send = sent - start;
+	result.finish = now() - sent;
+	ret = 0;
+ out:
+	result.error = ret < 0;
+	get_usage(&result.usage);
+	write_all(result_fd, &result, sizeof(result));
+	exit(0);
+}
+
+/*
+ * Starts the listener, and reports what it cost once told to stop
+ * through @stop_fd. Being the parent of the listener, the usage of
+ * its children is all of the listener.
+ */
+static void run_listener(const char *dir, int port, int stop_fd, int result_fd)
+{
+	struct bench_usage usage;
+	char log[PATH_MAX];
+	char portstr[32];
+	char c;
+	int pid;
+	int fd;
+
+	snprintf(log, PATH_MAX, "%s/listen.log", dir);
+	snprintf(portstr, sizeof(portstr), "%d", port);
+
+	pid = fork();
+	if (pid < 0)
+		pdie("forking the listener");
+	if (!pid) {
+		close(stop_fd);
+		close(result_fd);
+		/* Keep what the listener prints out of the results */
+		fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+		execl(listener, listener, "listen", "-p", portstr,
+		      "-d", dir, "-l", log, NULL);
+		pdie("running %s", listener);
+	}
+
+	while (read(stop_fd, &c, 1) < 0 && errno == EINTR)
+		;
+
+	kill(pid, SIGINT);
+	waitpid(pid, NULL, 0);
+
+	get_usage(&usage);
+	write_all(result_fd, &usage, sizeof(usage));
+	exit(0);
+}
+
+static int wait_for_port(int port)
+{
+	int msec;
+	int fd;
+
+	for (msec = 0; msec < LISTEN_WAIT_MSEC; msec += 10) {
+		fd = connect_to(port, SOCK_STREAM);
+		if (fd >= 0)
+			return fd;
+		usleep(10000);
+	}
+	return -1;
+}
+
+/* How much CPU data the listener wrote */
+static unsigned long long received_bytes(const char *dir)
+{
+	unsigned long long size = 0;
+	struct trace_file tf;
+	struct dirent *dent;
+	char file[PATH_MAX];
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return 0;
+
+	while ((dent = readdir(d))) {
+		if (strncmp(dent->d_name, "trace.", 6) != 0)
+			continue;
+		snprintf(file, PATH_MAX, "%s/%s", dir, dent->d_name);
+		if (open_trace_file(file, &tf) == 0)
+			size += trace_file_data_size(&tf);
+		free(tf.data);
+		if (tf.fd >= 0)
+			close(tf.fd);
+	}
+	closedir(d);
+
+	return size;
+}
+
+static void remove_dir(const char *dir)
+{
+	struct dirent *dent;
+	char file[PATH_MAX];
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+	while ((dent = readdir(d))) {
+		if (dent->d_name[0] == '.')
+			continue;
+		snprintf(file, PATH_MAX, "%s/%s", dir, dent->d_name);
+		unlink(file);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+static void run_mode(struct bench_mode *mode, struct trace_file *tf, int port)
+{
+	struct bench_result result;
+	struct bench_usage server;
+	char dir[] = "/tmp/trace-net-bench.XXXXXX";
+	unsigned long long received;
+	int cresult[2], sresult[2], stop[2];
+	int cpid, spid;
+	double mb;
+	int fd;
+
+	if (!mkdtemp(dir))
+		pdie("creating a directory for the listener");
+
+	if (pipe(cresult) < 0 || pipe(sresult) < 0 || pipe(stop) < 0)
+		pdie("pipe");
+
+	spid = fork();
+	if (spid < 0)
+		pdie("fork");
+	if (!spid) {
+		close(stop[1]);
+		close(sresult[0]);
+		run_listener(dir, port, stop[0], sresult[1]);
+	}
+	close(stop[0]);
+	close(sresult[1]);
+
+	/* Only here to know the listener is up */
+	fd = wait_for_port(port);
+	if (fd < 0) {
+		warning("%s: the listener did not come up on port %d",
+			mode->name, port);
+		goto out;
+	}
+	close(fd);
+
+	cpid = fork();
+	if (cpid < 0)
+		pdie("fork");
+	if (!cpid) {
+		close(cresult[0]);
+		run_client(mode, tf, port, cresult[1]);
+	}
+	close(cresult[1]);
+
+	if (read(cresult[0], &result, sizeof(result)) != sizeof(result))
+		result.error = 1;
+	waitpid(cpid, NULL, 0);
+
+	write_all(stop[1], "", 1);
+	if (read(sresult[0], &server, sizeof(server)) != sizeof(server))
+		memset(&server, 0, sizeof(server));
+	waitpid(spid, NULL, 0);
+
+	if (result.error) {
+		warning("%s: the run failed, see %s/listen.log", mode->name, dir);
+		keep = 1;
+		goto out;
+	}
+
+	received = received_bytes(dir);
+	mb = result.bytes / (1024.0 * 1024.0);
+	printf("%-8s %8.1f %8.1f %9.1f %8.1f%% %9.2f %9.2f %10.0f %10.0f %9.1f\n",
+	       mode->name, mb, result.setup * 1000, mb / result.send,
+	       result.bytes ? received * 100.0 / result.bytes : 0,
+	       result.usage.cpu * 1000 / mb, server.cpu * 1000 / mb,
+	       result.usage.syscalls / mb, server.syscalls / mb,
+	       result.finish * 1000);
+	fflush(stdout);
+ out:
+	close(stop[1]);
+	close(cresult[0]);
+	close(sresult[0]);
+	if (keep) {
+		printf("%s: listener output kept in %s\n", mode->name, dir);
+		fflush(stdout);
+	}
+	else
+		remove_dir(dir);
+}
+
+static void usage(char **argv)
+{
+	struct bench_mode *mode;
+	char *p = basename(argv[0]);
+
+	printf("\n"
+	       "usage: %s [-i file][-r repeat][-p port][-c trace-cmd][-k][mode ...]\n"
+	       "  Replays the CPU data of a trace.dat file into \"trace-cmd listen\"\n"
+	       "  over loopback, for each protocol mode given (default all).\n"
+	       "    -i input file (default trace.dat)\n"
+	       "    -r send the CPU data that many times\n"
+	       "    -p first port for the listeners (default %d)\n"
+	       "    -c the trace-cmd to run the listener with\n"
+	       "       (default the one next to this program)\n"
+	       "    -k keep the files the listener wrote\n"
+	       "  modes:", p, DEFAULT_PORT);
+	for (mode = modes; mode->name; mode++)
+		printf(" %s", mode->name);
+	printf("\n\n");
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_mode *mode;
+	struct trace_file tf;
+	const char *input = "trace.dat";
+	char path[PATH_MAX];
+	int port = DEFAULT_PORT;
+	ssize_t n;
+	int all;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "hi:r:p:c:k")) >= 0) {
+		switch (c) {
+		case 'i':
+			input = optarg;
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			if (repeat < 1)
+				usage(argv);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'c':
+			listener = optarg;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			usage(argv);
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		for (mode = modes; mode->name; mode++)
+			if (strcmp(argv[i], mode->name) == 0)
+				break;
+		if (!mode->name)
+			usage(argv);
+	}
+
+	if (!listener) {
+		n = readlink("/proc/self/exe", path, PATH_MAX - 1);
+		if (n < 0)
+			pdie("finding trace-cmd, use -c");
+		path[n] = 0;
+		strcat(dirname(path), "/trace-cmd");
+		listener = strdup(path);
+	}
+
+	if (open_trace_file(input, &tf) < 0)
+		pdie("reading %s", input);
+
+	/* A listener that hangs up fails the run, it does not kill it */
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%s: %d cpus, %.1f MB of CPU data, sent %d time%s\n\n",
+	       input, tf.cpus, trace_file_data_size(&tf) / (1024.0 * 1024.0),
+	       repeat, repeat > 1 ? "s" : "");
+	printf("%-8s %8s %8s %9s %9s %9s %9s %10s %10s %9s\n",
+	       "mode", "MB", "setup ms", "MB/s", "received", "cl ms/MB", "srv ms/MB",
+	       "cl sys/MB", "srv sys/MB", "finish ms");
+
+	fflush(stdout);
+
+	all = optind == argc;
+	for (mode = modes; mode->name; mode++, port++) {
+		if (!all) {
+			for (i = optind; i < argc; i++)
+				if (strcmp(argv[i], mode->name) == 0)
+					break;
+			if (i == argc)
+				continue;
+		}
+#ifdef NO_ZLIB
+		if (mode->compress)
+			continue;
+#endif
+		run_mode(mode, &tf, port);
+	}
+
+	return 0;
+}
@@ -1071,22 +1071,80 @@ out_free:
 	return NULL;
 }
 
+/* The size of the tracing file as it will be saved in the data file */
+static off64_t tracing_file_size(struct tracecmd_output *handle,
+				 const char *filename)
+{
+	struct stat st;
+	off64_t size = 0;
+	char *file;
+
+	file = get_tracing_file(handle, filename);
+	if (!file)
+		return -1;
+
+	if (stat(file, &st) >= 0)
+		size = get_size(file);
+
+	put_tracing_file(file);
+
+	return size;
+}
+
+/* The size of the "flyrecord" section before the CPU data */
+static off64_t cpu_data_table_size(struct tracecmd_output *handle, int cpus)
+{
+	off64_t size;
+
+	/*
+	 * Unfortunately, the trace_clock data was placed after the
+	 * cpu data, and wasn't accounted for with the offsets.
+	 * We need to save room for the trace_clock file. This means
+	 * we need to find the size of it before we define the final
+	 * offsets.
+	 */
+	size = tracing_file_size(handle, "trace_clock");
+	if (size < 0)
+		return -1;
+
+	/* "flyrecord", the offset and size of each cpu, the trace_clock size */
+	return 10 + cpus * 16 + 8 + size;
+}
+
+static int write_cpu_data_table(struct tracecmd_output *handle, int cpus,
+				off64_t *offsets, unsigned long long *sizes)
+{
+	unsigned long long endian8;
+	int i;
+
+	if (do_write_check(handle, "flyrecord", 10))
+		return -1;
+
+	for (i = 0; i < cpus; i++) {
+		endian8 = convert_endian_8(handle, offsets[i]);
+		if (do_write_check(handle, &endian8, 8))
+			return -1;
+		endian8 = convert_endian_8(handle, sizes[i]);
+		if (do_write_check(handle, &endian8, 8))
+			return -1;
+	}
+
+	return save_tracing_file_data(handle, "trace_clock");
+}
+
 static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 				      int cpus, char * const *cpu_data_files)
 {
 	off64_t *offsets = NULL;
 	unsigned long long *sizes = NULL;
 	off64_t offset;
-	unsigned long long endian8;
+	off64_t table_size;
 	off64_t check_size;
 	char *file;
 	struct stat st;
 	int ret;
 	int i;
 
-	if (do_write_check(handle, "flyrecord", 10))
-		goto out_free;
-
 	offsets = malloc(sizeof(*offsets) * cpus);
 	if (!offsets)
 		goto out_free;
@@ -1094,30 +1152,11 @@ static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 	if (!sizes)
 		goto out_free;
 
-	offset = lseek64(handle->fd, 0, SEEK_CUR);
-
-	/* hold any extra data for data */
-	offset += cpus * (16);
-
-	/*
-	 * Unfortunately, the trace_clock data was placed after the
-	 * cpu data, and wasn't accounted for with the offsets.
-	 * We need to save room for the trace_clock file. This means
-	 * we need to find the size of it before we define the final
-	 * offsets.
-	 */
-	file = get_tracing_file(handle, "trace_clock");
-	if (!file)
+	table_size = cpu_data_table_size(handle, cpus);
+	if (table_size < 0)
 		goto out_free;
 
-	/* Save room for storing the size */
-	offset += 8;
-
-	ret = stat(file, &st);
-	if (ret >= 0)
-		offset += get_size(file);
-
-	put_tracing_file(file);
+	offset = lseek64(handle->fd, 0, SEEK_CUR) + table_size;
 
 	/* Page align offset */
 	offset = (offset + (handle->page_size - 1)) & ~(handle->page_size - 1);
@@ -1133,16 +1172,9 @@ static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 		sizes[i] = st.st_size;
 		offset += st.st_size;
 		offset = (offset + (handle->page_size - 1)) & ~(handle->page_size - 1);
-
-		endian8 = convert_endian_8(handle, offsets[i]);
-		if (do_write_check(handle, &endian8, 8))
-			goto out_free;
-		endian8 = convert_endian_8(handle, sizes[i]);
-		if (do_write_check(handle, &endian8, 8))
-			goto out_free;
 	}
 
-	if (save_tracing_file_data(handle, "trace_clock") < 0)
+	if (write_cpu_data_table(handle, cpus, offsets, sizes) < 0)
 		goto out_free;
 
 	for (i = 0; i < cpus; i++) {
@@ -1218,21 +1250,33 @@ int tracecmd_append_buffer_cpu_data(struct tracecmd_output *handle,
 	return __tracecmd_append_cpu_data(handle, cpus, cpu_data_files);
 }
 
-int tracecmd_attach_cpu_data_fd(int fd, int cpus, char * const *cpu_data_files)
+/**
+ * tracecmd_get_output_handle_fd - get an output handle for a data file
+ * @fd: the file that already holds the meta data
+ *
+ * Reads the endianess and page size of the meta data, so that the
+ * CPU data can be written after it. The file position is left at
+ * the end of the file.
+ */
+struct tracecmd_output *tracecmd_get_output_handle_fd(int fd)
 {
 	struct tracecmd_input *ihandle;
-	struct tracecmd_output *handle;
-	struct pevent *pevent;
-	int ret = -1;
+	struct tracecmd_output *handle = NULL;
+	int ifd;
 
 	/* Move the file descriptor to the beginning */
 	if (lseek(fd, 0, SEEK_SET) == (off_t)-1)
-		return -1;
+		return NULL;
 
-	/* get a input handle from this */
-	ihandle = tracecmd_alloc_fd(fd);
-	if (!ihandle)
-		return -1;
+	/* get a input handle from this, closing it must not close @fd */
+	ifd = dup(fd);
+	if (ifd < 0)
+		return NULL;
+	ihandle = tracecmd_alloc_fd(ifd);
+	if (!ihandle) {
+		close(ifd);
+		return NULL;
+	}
 
 	/* move the file descriptor to the end */
 	if (lseek(fd, 0, SEEK_END) == (off_t)-1)
@@ -1248,22 +1292,164 @@ int tracecmd_attach_cpu_data_fd(int fd, int cpus, char * const *cpu_data_files)
 	handle->fd = fd;
 
 	/* get endian and page size */
-	pevent = tracecmd_get_pevent(ihandle);
 	/* Use the pevent of the ihandle for later writes */
 	handle->pevent = tracecmd_get_pevent(ihandle);
-	pevent_ref(pevent);
+	pevent_ref(handle->pevent);
 	handle->page_size = tracecmd_page_size(ihandle);
 	list_head_init(&handle->options);
 
-	if (tracecmd_append_cpu_data(handle, cpus, cpu_data_files) >= 0)
-		ret = 0;
-
-	tracecmd_output_close(handle);
  out_free:
 	tracecmd_close(ihandle);
+	return handle;
+}
+
+/**
+ * tracecmd_buffers_table_size - room needed before the CPU data
+ * @handle: the output handle from tracecmd_get_output_handle_fd()
+ * @cpus: the number of CPUs of each buffer
+ * @nr_buffers: the number of buffer instances
+ * @buffer_names: the names of the buffer instances
+ *
+ * Returns the number of bytes tracecmd_write_buffers_table() writes
+ * after the meta data, or -1 on error.
+ */
+off64_t tracecmd_buffers_table_size(struct tracecmd_output *handle, int cpus,
+				    int nr_buffers, char * const *buffer_names)
+{
+	off64_t table_size;
+	off64_t size;
+	int i;
+
+	table_size = cpu_data_table_size(handle, cpus);
+	if (table_size < 0)
+		return -1;
+
+	/* cpus, the options and the table of each buffer */
+	size = 4 + 10 + 2 + table_size * (nr_buffers + 1);
+	for (i = 0; i < nr_buffers; i++)
+		size += 2 + 4 + 8 + strlen(buffer_names[i]) + 1;
+
+	return size;
+}
+
+/**
+ * tracecmd_write_buffers_table - write where the CPU data of each buffer is
+ * @handle: the output handle from tracecmd_get_output_handle_fd()
+ * @cpus: the number of CPUs of each buffer
+ * @nr_buffers: the number of buffer instances
+ * @buffer_names: the names of the buffer instances
+ * @offsets: the offset of the data of each CPU, the top buffer first
+ * @sizes: the size of the data of each CPU, the top buffer first
+ *
+ * For when the CPU data was already written in place. Writes the
+ * options and the CPU data tables at the current file position,
+ * which must leave tracecmd_buffers_table_size() bytes before the
+ * data.
+ */
+int tracecmd_write_buffers_table(struct tracecmd_output *handle, int cpus,
+				 int nr_buffers, char * const *buffer_names,
+				 off64_t *offsets, unsigned long long *sizes)
+{
+	struct tracecmd_option **buffer_options = NULL;
+	unsigned long long endian8;
+	off64_t offset;
+	int endian4;
+	int ret = -1;
+	int i;
+
+	if (nr_buffers) {
+		buffer_options = malloc(sizeof(*buffer_options) * nr_buffers);
+		if (!buffer_options)
+			return -1;
+		for (i = 0; i < nr_buffers; i++) {
+			buffer_options[i] = tracecmd_add_buffer_option(handle,
+								       buffer_names[i]);
+			if (!buffer_options[i])
+				goto out_free;
+		}
+	}
+
+	endian4 = convert_endian_4(handle, cpus);
+	if (do_write_check(handle, &endian4, 4))
+		goto out_free;
+
+	if (add_options(handle) < 0)
+		goto out_free;
+
+	for (i = 0; i <= nr_buffers; i++) {
+		if (i) {
+			/* Point the buffer option to its table */
+			offset = lseek64(handle->fd, 0, SEEK_CUR);
+			endian8 = convert_endian_8(handle, offset);
+			if (tracecmd_update_option(handle, buffer_options[i - 1],
+						   8, &endian8) < 0)
+				goto out_free;
+		}
+		if (write_cpu_data_table(handle, cpus, offsets + i * cpus,
+					 sizes + i * cpus) < 0)
+			goto out_free;
+	}
+
+	ret = 0;
+ out_free:
+	free(buffer_options);
 	return ret;
 }
 
+/**
+ * tracecmd_attach_buffers_fd - attach the data of several buffers to a file
+ * @fd: the file that holds the meta data
+ * @cpus: the number of CPUs of each buffer
+ * @cpu_data_files: the CPU data files of the top buffer, followed by
+ *                  the ones of each buffer instance (@cpus each)
+ * @nr_buffers: the number of buffer instances
+ * @buffer_names: the names of the buffer instances
+ */
+int tracecmd_attach_buffers_fd(int fd, int cpus, char * const *cpu_data_files,
+			       int nr_buffers, char * const *buffer_names)
+{
+	struct tracecmd_option **buffer_options = NULL;
+	struct tracecmd_output *handle;
+	int ret = -1;
+	int i;
+
+	handle = tracecmd_get_output_handle_fd(fd);
+	if (!handle)
+		return -1;
+
+	if (nr_buffers) {
+		buffer_options = malloc(sizeof(*buffer_options) * nr_buffers);
+		if (!buffer_options)
+			goto out_close;
+		for (i = 0; i < nr_buffers; i++) {
+			buffer_options[i] = tracecmd_add_buffer_option(handle,
+								       buffer_names[i]);
+			if (!buffer_options[i])
+				goto out_close;
+		}
+	}
+
+	if (tracecmd_append_cpu_data(handle, cpus, cpu_data_files) < 0)
+		goto out_close;
+
+	for (i = 0; i < nr_buffers; i++) {
+		if (tracecmd_append_buffer_cpu_data(handle, buffer_options[i], cpus,
+						    cpu_data_files + (i + 1) * cpus) < 0)
+			goto out_close;
+	}
+
+	ret = 0;
+ out_close:
+	free(buffer_options);
+	tracecmd_output_close(handle);
+	return ret;
+}
+
+int tracecmd_attach_cpu_data_fd(int fd, int cpus, char * const *cpu_data_files)
+{
+	return tracecmd_attach_buffers_fd(fd, cpus, cpu_data_files, 0, NULL);
+}
+
 int tracecmd_attach_cpu_data(char *file, int cpus, char * const *cpu_data_files)
 {
 	int fd;
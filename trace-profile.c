@@ -212,8 +212,13 @@ struct handle_data {
 
 static struct handle_data *handles;
 static struct event_data *stacktrace_event;
+static struct task_data *last_task;
 static bool merge_like_comms = false;
 
+/* Trace time covered by the records profiled since the last snapshot */
+static unsigned long long window_start;
+static unsigned long long window_end;
+
 void trace_profile_set_merge_like_comms(void)
 {
 	merge_like_comms = true;
@@ -516,7 +521,6 @@ find_task(struct handle_data *h, int pid)
 {
 	unsigned long long key = trace_hash(pid);
 	struct trace_hash_item *item;
-	static struct task_data *last_task;
 	void *data = (unsigned long *)&pid;
 
 	if (last_task && last_task->pid == pid)
@@ -770,6 +774,10 @@ int trace_profile_record(struct tracecmd_input *handle,
 	if (record->missed_events)
 		handle_missed_events(h, cpu);
 
+	if (!window_start)
+		window_start = record->ts;
+	window_end = record->ts;
+
 	pevent = h->pevent;
 
 	id = pevent_data_type(pevent, record);
@@ -2463,3 +2471,120 @@ int trace_profile(void)
 
 	return 0;
 }
+
+static void reset_task_events(struct task_data *task)
+{
+	struct trace_hash_item **bucket;
+	struct trace_hash_item *item;
+
+	trace_hash_for_each_bucket(bucket, &task->event_hash) {
+		trace_hash_while_item(item, bucket) {
+			trace_hash_del(item);
+			free_event_hash(event_from_item(item));
+		}
+	}
+	task->last_event = NULL;
+	task->proxy = NULL;
+	task->group = NULL;
+}
+
+/*
+ * Output the tasks that had events since the last snapshot, and start
+ * a new window for all of them. Tasks that are not sleeping, waiting on
+ * an end event or holding a stack trace are freed, as they will be
+ * allocated again if they show up later.
+ */
+static void snapshot_tasks(struct handle_data *h)
+{
+	struct trace_hash_item **bucket;
+	struct trace_hash_item *item;
+	struct trace_hash_item *n;
+	struct task_data **tasks;
+	struct task_data *task;
+	int nr_tasks = 0;
+	int i;
+
+	trace_hash_for_each_bucket(bucket, &h->task_hash) {
+		trace_hash_for_each_item(item, bucket) {
+			nr_tasks++;
+		}
+	}
+
+	tasks = malloc(sizeof(*tasks) * nr_tasks);
+	if (!tasks) {
+		warning("Could not allocate tasks");
+		return;
+	}
+
+	nr_tasks = 0;
+
+	trace_hash_for_each_bucket(bucket, &h->task_hash) {
+		trace_hash_for_each_item(item, bucket) {
+			task = task_from_item(item);
+			if (!trace_hash_empty(&task->event_hash))
+				tasks[nr_tasks++] = task;
+		}
+	}
+
+	qsort(tasks, nr_tasks, sizeof(*tasks), compare_tasks);
+
+	for (i = 0; i < nr_tasks; i++)
+		output_task(h, tasks[i]);
+
+	free(tasks);
+
+	trace_hash_for_each_bucket(bucket, &h->task_hash) {
+		trace_hash_for_each_item_safe(item, n, bucket) {
+			task = task_from_item(item);
+			reset_task_events(task);
+			if (!trace_hash_empty(&task->start_hash) ||
+			    task->sleeping || task->last_stack)
+				continue;
+			trace_hash_del(&task->hash);
+			free_task(task);
+		}
+	}
+}
+
+/**
+ * trace_profile_snapshot - output the profile gathered so far and reset it
+ *
+ * Used by stream --profile-interval to show what happened since the
+ * last snapshot while the tracing is still going on. The counters and
+ * timings start over after each snapshot, so that only the tasks that
+ * are still running take up memory.
+ */
+void trace_profile_snapshot(void)
+{
+	struct handle_data *h;
+	int i;
+
+	if (!window_start)
+		return;
+
+	printf("\n==== profile %lld.%06lld to %lld.%06lld ====\n",
+	       nsecs_per_sec(window_start), mod_to_usec(window_start),
+	       nsecs_per_sec(window_end), mod_to_usec(window_end));
+
+	/* Tasks may be freed, do not let find_task() return them */
+	last_task = NULL;
+
+	for (h = handles; h; h = h->next) {
+		if (merge_like_comms)
+			merge_tasks(h);
+
+		show_global_task(h, h->global_task);
+		reset_task_events(h->global_task);
+		for (i = 0; i < h->cpus; i++) {
+			show_global_task(h, &h->global_percpu_tasks[i]);
+			reset_task_events(&h->global_percpu_tasks[i]);
+		}
+
+		output_groups(h);
+		snapshot_tasks(h);
+	}
+
+	fflush(stdout);
+
+	window_start = 0;
+}
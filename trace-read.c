@@ -44,12 +44,15 @@ static struct filter_str {
 	struct filter_str	*next;
 	char			*filter;
 	int			neg;
+	int			pids;
 } *filter_strings;
 static struct filter_str **filter_next = &filter_strings;
 
 struct filter {
 	struct filter		*next;
 	struct event_filter	*filter;
+	/* Made by make_pid_filter() */
+	int			pids;
 };
 
 struct event_str {
@@ -61,14 +64,25 @@ struct handle_list {
 	struct list_head	list;
 	struct tracecmd_input	*handle;
 	const char		*file;
+	const char		*path;
 	int			cpus;
 	int			done;
 	struct pevent_record	*record;
 	struct filter		*event_filters;
 	struct filter		*event_filter_out;
+	/* Indexed by event id, set if the event data is printed in order */
+	char			*in_order;
+	int			nr_in_order;
 };
 static struct list_head handle_list;
 
+/*
+ * The output of the events is collected here and written out
+ * in large chunks, instead of going through stdio for each one.
+ */
+static struct trace_seq show_seq;
+#define SHOW_FLUSH_SIZE		(64 * 1024)
+
 struct input_files {
 	struct list_head	list;
 	const char		*file;
@@ -98,6 +112,12 @@ static int instances;
 static int *filter_cpus;
 static int nr_filter_cpus;
 
+/* The pids of --pid and --comm */
+static int *filter_pids;
+static int nr_filter_pids;
+
+static int build_index;
+
 static int show_wakeup;
 static int wakeup_id;
 static int wakeup_new_id;
@@ -113,6 +133,7 @@ static int no_irqs;
 static int no_softirqs;
 
 static int tsdiff;
+static int report_threads;
 
 static struct format_field *wakeup_task;
 static struct format_field *wakeup_success;
@@ -300,7 +321,8 @@ static void add_input(const char *file)
 	last_input_file = item;
 }
 
-static void add_handle(struct tracecmd_input *handle, const char *file)
+static void add_handle(struct tracecmd_input *handle, const char *file,
+		       const char *path)
 {
 	struct handle_list *item;
 
@@ -309,6 +331,7 @@ static void add_handle(struct tracecmd_input *handle, const char *file)
 		die("Failed ot allocate for %s", file);
 	memset(item, 0, sizeof(*item));
 	item->handle = handle;
+	item->path = path;
 	if (file) {
 		item->file = file + strlen(file);
 		/* we want just the base name */
@@ -339,11 +362,12 @@ static void free_handles(void)
 	while (!list_empty(&handle_list)) {
 		item = container_of(handle_list.next, struct handle_list, list);
 		list_del(&item->list);
+		free(item->in_order);
 		free(item);
 	}
 }
 
-static void add_filter(const char *filter, int neg)
+static struct filter_str *add_filter(const char *filter, int neg)
 {
 	struct filter_str *ftr;
 
@@ -355,10 +379,13 @@ static void add_filter(const char *filter, int neg)
 		die("malloc");
 	ftr->next = NULL;
 	ftr->neg = neg;
+	ftr->pids = 0;
 
 	/* must maintain order of command line */
 	*filter_next = ftr;
 	filter_next = &ftr->next;
+
+	return ftr;
 }
 
 static void __add_filter(struct pid_list **head, const char *arg)
@@ -480,9 +507,14 @@ static void make_pid_filter(struct tracecmd_input *handle)
 	/* First do all common pids */
 	for (list = pid_list; list; list = list->next) {
 		str = append_pid_filter(str, list->pid);
+		filter_pids = realloc(filter_pids, sizeof(*filter_pids) *
+				      (nr_filter_pids + 1));
+		if (!filter_pids)
+			die("Failed to allocate pids");
+		filter_pids[nr_filter_pids++] = atoi(list->pid);
 	}
 
-	add_filter(str, 0);
+	add_filter(str, 0)->pids = 1;
 	free(str);
 
 	while (pid_list) {
@@ -516,6 +548,7 @@ static void process_filters(struct handle_list *handles)
 		if (!event_filter)
 			die("Failed to allocate for event filter");
 		event_filter->next = NULL;
+		event_filter->pids = filter->pids;
 		event_filter->filter = pevent_filter_alloc(pevent);
 		if (!event_filter->filter)
 			die("malloc");
@@ -625,7 +658,8 @@ static unsigned long long max_rt_time;
 static unsigned long long min_rt_lat = -1;
 static unsigned long long min_rt_time;
 
-static void add_sched(unsigned int val, unsigned long long end, int rt)
+static void add_sched(struct trace_seq *s, unsigned int val,
+		      unsigned long long end, int rt)
 {
 	struct trace_hash_item *item;
 	unsigned int key = trace_hash(val);
@@ -660,7 +694,8 @@ static void add_sched(unsigned int val, unsigned long long end, int rt)
 		}
 	}
 
-	printf(" Latency: %llu.%03llu usecs", cal / 1000, cal % 1000);
+	trace_seq_printf(s, " Latency: %llu.%03llu usecs",
+			 cal / 1000, cal % 1000);
 
 	total_wakeup_lat += cal;
 	wakeup_lat_count++;
@@ -674,7 +709,8 @@ static void add_sched(unsigned int val, unsigned long long end, int rt)
 	free(info);
 }
 
-static void process_wakeup(struct pevent *pevent, struct pevent_record *record)
+static void process_wakeup(struct pevent *pevent, struct pevent_record *record,
+			   struct trace_seq *s)
 {
 	unsigned long long val;
 	int id;
@@ -707,7 +743,7 @@ static void process_wakeup(struct pevent *pevent, struct pevent_record *record)
 			rt = 0;
 		if (pevent_read_number_field(sched_task, record->data, &val))
 			return;
-		add_sched(val, record->ts, rt);
+		add_sched(s, val, record->ts, rt);
 	}
 }
 
@@ -762,72 +798,89 @@ static void finish_wakeup(void)
 	trace_hash_free(&wakeup_hash);
 }
 
-void trace_show_data(struct tracecmd_input *handle, struct pevent_record *record,
-		     int profile)
+static struct trace_seq *get_show_seq(void)
 {
-	struct pevent *pevent;
-	struct trace_seq s;
-	int cpu = record->cpu;
-	bool use_trace_clock;
-	static unsigned long long last_ts;
-	unsigned long long diff_ts;
-	char buf[50];
-
-	pevent = tracecmd_get_pevent(handle);
-
-	test_save(record, cpu);
-
-	if (profile) {
-		trace_profile_record(handle, record, cpu);
-		return;
+	if (!show_seq.buffer) {
+		trace_seq_init(&show_seq);
+		atexit(trace_show_flush);
 	}
+	return &show_seq;
+}
+
+/* What is printed before the event: dropped events and buffer starts */
+static void show_record_head(struct tracecmd_input *handle,
+			     struct pevent_record *record, struct trace_seq *s)
+{
+	int cpu = record->cpu;
 
-	trace_seq_init(&s);
 	if (record->missed_events > 0)
-		trace_seq_printf(&s, "CPU:%d [%lld EVENTS DROPPED]\n",
+		trace_seq_printf(s, "CPU:%d [%lld EVENTS DROPPED]\n",
 				 cpu, record->missed_events);
 	else if (record->missed_events < 0)
-		trace_seq_printf(&s, "CPU:%d [EVENTS DROPPED]\n", cpu);
+		trace_seq_printf(s, "CPU:%d [EVENTS DROPPED]\n", cpu);
 	if (buffer_breaks || debug) {
 		if (tracecmd_record_at_buffer_start(handle, record)) {
-			trace_seq_printf(&s, "CPU:%d [SUBBUFFER START]", cpu);
+			trace_seq_printf(s, "CPU:%d [SUBBUFFER START]", cpu);
 			if (debug)
-				trace_seq_printf(&s, " [%lld]",
+				trace_seq_printf(s, " [%lld]",
 						 tracecmd_page_ts(handle, record));
-			trace_seq_putc(&s, '\n');
+			trace_seq_putc(s, '\n');
 		}
 	}
+}
+
+/* The task and time of the event, which the event data follows */
+static void show_event_start(struct tracecmd_input *handle,
+			     struct pevent_record *record,
+			     struct event_format *event, struct trace_seq *s)
+{
+	struct pevent *pevent = event->pevent;
+	static unsigned long long last_ts;
+	unsigned long long rec_ts = record->ts;
+	unsigned long long diff_ts;
+	bool use_trace_clock;
+	char buf[50];
+
 	use_trace_clock = tracecmd_get_use_trace_clock(handle);
-	if (tsdiff) {
-		struct event_format *event;
-		unsigned long long rec_ts = record->ts;
-
-		event = pevent_find_event_by_record(pevent, record);
-		pevent_print_event_task(pevent, &s, event, record);
-		pevent_print_event_time(pevent, &s, event, record,
-					use_trace_clock);
-		buf[0] = 0;
-		if (use_trace_clock && !(pevent->flags & PEVENT_NSEC_OUTPUT))
-			rec_ts = (rec_ts + 500) / 1000;
-		if (last_ts) {
-			diff_ts = rec_ts - last_ts;
-			snprintf(buf, 50, "(+%lld)", diff_ts);
-			buf[49] = 0;
-		}
-		last_ts = rec_ts;
-		trace_seq_printf(&s, " %-8s", buf);
-		pevent_print_event_data(pevent, &s, event, record);
-	} else
-		pevent_print_event(pevent, &s, record, use_trace_clock);
-	if (s.len && *(s.buffer + s.len - 1) == '\n')
-		s.len--;
+	pevent_print_event_task(pevent, s, event, record);
+	pevent_print_event_time(pevent, s, event, record, use_trace_clock);
+	if (!tsdiff)
+		return;
+
+	buf[0] = 0;
+	if (use_trace_clock && !(pevent->flags & PEVENT_NSEC_OUTPUT))
+		rec_ts = (rec_ts + 500) / 1000;
+	if (last_ts) {
+		diff_ts = rec_ts - last_ts;
+		snprintf(buf, 50, "(+%lld)", diff_ts);
+		buf[49] = 0;
+	}
+	last_ts = rec_ts;
+	trace_seq_printf(s, " %-8s", buf);
+}
+
+/* The event data, without the new line that some events end with */
+static void show_event_data(struct event_format *event,
+			    struct pevent_record *record, struct trace_seq *s)
+{
+	unsigned int start = s->len;
+
+	pevent_print_event_data(event->pevent, s, event, record);
+	if (s->len > start && *(s->buffer + s->len - 1) == '\n')
+		s->len--;
+}
+
+/* What is printed after the event data, up to the end of the line */
+static void show_record_tail(struct tracecmd_input *handle,
+			     struct pevent_record *record, struct trace_seq *s)
+{
 	if (debug) {
 		struct kbuffer *kbuf;
 		struct kbuffer_raw_info info;
 		void *page;
 		void *offset;
 
-		trace_seq_printf(&s, " [%d]",
+		trace_seq_printf(s, " [%d]",
 				 tracecmd_record_ts_delta(handle, record));
 		kbuf = tracecmd_record_kbuf(handle, record);
 		page = tracecmd_record_page(handle, record);
@@ -844,30 +897,81 @@ void trace_show_data(struct tracecmd_input *handle, struct pevent_record *record
 					break;
 				switch (pi->type) {
 				case KBUFFER_TYPE_PADDING:
-					trace_seq_printf(&s, "\n PADDING: ");
+					trace_seq_printf(s, "\n PADDING: ");
 					break;
 				case KBUFFER_TYPE_TIME_EXTEND:
-					trace_seq_printf(&s, "\n TIME EXTEND: ");
+					trace_seq_printf(s, "\n TIME EXTEND: ");
 					break;
 				case KBUFFER_TYPE_TIME_STAMP:
-					trace_seq_printf(&s, "\n TIME STAMP?: ");
+					trace_seq_printf(s, "\n TIME STAMP?: ");
 					break;
 				}
-				trace_seq_printf(&s, "delta:%lld length:%d",
+				trace_seq_printf(s, "delta:%lld length:%d",
 						 pi->delta,
 						 pi->length);
 			}
 		}
 	}
 
-	trace_seq_do_printf(&s);
-	trace_seq_destroy(&s);
+	process_wakeup(tracecmd_get_pevent(handle), record, s);
 
-	process_wakeup(pevent, record);
+	trace_seq_putc(s, '\n');
+}
 
-	printf("\n");
+void trace_show_data(struct tracecmd_input *handle, struct pevent_record *record,
+		     int profile)
+{
+	struct event_format *event;
+	struct pevent *pevent;
+	struct trace_seq *s;
+	int cpu = record->cpu;
+
+	pevent = tracecmd_get_pevent(handle);
+
+	test_save(record, cpu);
+
+	if (profile) {
+		trace_profile_record(handle, record, cpu);
+		return;
+	}
+
+	s = get_show_seq();
+	show_record_head(handle, record, s);
+	event = pevent_find_event_by_record(pevent, record);
+	if (event) {
+		/* Read ahead in this handle, not the one last read from */
+		tracecmd_curr_leaf.entry = record;
+		tracecmd_curr_leaf.ret = tracecmd_ftrace_read_ahead(handle, record);
+		show_event_start(handle, record, event, s);
+		show_event_data(event, record, s);
+		if (tracecmd_curr_leaf.ret)
+			free_record(tracecmd_curr_leaf.ret);
+		tracecmd_curr_leaf.entry = NULL;
+	} else
+		/* Warns about the unknown event */
+		pevent_print_event(pevent, s, record,
+				   tracecmd_get_use_trace_clock(handle));
+	show_record_tail(handle, record, s);
+
+	if (s->len >= SHOW_FLUSH_SIZE)
+		trace_show_flush();
 }
 
+/**
+ * trace_show_flush - write out what trace_show_data() has collected
+ *
+ * Must be called before anything else is printed to stdout.
+ */
+void trace_show_flush(void)
+{
+	if (!show_seq.buffer || !show_seq.len)
+		return;
+
+	fflush(stdout);
+	trace_seq_flush(&show_seq, STDOUT_FILENO);
+}
+
+
 static void read_rest(void)
 {
 	char buf[BUFSIZ + 1];
@@ -1088,15 +1192,15 @@ static void free_handle_record(struct handle_list *handles)
 	handles->record = NULL;
 }
 
-static void print_handle_file(struct handle_list *handles)
+static void print_handle_file(struct handle_list *handles, struct trace_seq *s)
 {
 	/* Only print file names if more than one file is read */
 	if (!multi_inputs && !instances)
 		return;
 	if (handles->file)
-		printf("%*s: ", max_file_size, handles->file);
+		trace_seq_printf(s, "%*s: ", max_file_size, handles->file);
 	else
-		printf("%*s  ", max_file_size, "");
+		trace_seq_printf(s, "%*s  ", max_file_size, "");
 }
 
 static void free_filters(struct filter *event_filter)
@@ -1112,12 +1216,468 @@ static void free_filters(struct filter *event_filter)
 	}
 }
 
+static void print_func_cache_stats(void)
+{
+	struct handle_list *handles;
+	struct pevent *pevent;
+	unsigned long long lookups;
+	unsigned long long hits;
+
+	list_for_each_entry(handles, &handle_list, list) {
+		pevent = tracecmd_get_pevent(handles->handle);
+		pevent_func_cache_stats(pevent, &lookups, &hits);
+		if (!lookups)
+			continue;
+		pr_stat("%s%sfunction cache hit rate %.1f%% (%llu of %llu lookups)",
+			handles->file ? : "", handles->file ? ": " : "",
+			hits * 100.0 / lookups, hits, lookups);
+	}
+}
+
+/*
+ * With -j, the events are printed by several threads. The reading
+ * thread still does everything that depends on the events that came
+ * before: it reads, merges and filters the records, and prints what
+ * comes before and after the event data (the task and its comm, the
+ * time stamps, the wakeup latencies). The threads only print the event
+ * data, and each takes the events of its cpus (cpu modulo the number
+ * of threads) in the order they were read, for the plugins that keep
+ * state per cpu. The events are handed over in batches, and the
+ * reading thread puts the output of each batch back in order.
+ */
+#define SHOW_BATCH		1024
+#define SHOW_BATCHES		4
+
+struct show_event {
+	struct tracecmd_input	*handle;
+	struct pevent_record	*record;
+	/* The return of a leaf function, read ahead for a graph entry */
+	struct pevent_record	*leaf;
+	struct event_format	*event;
+	/* The thread that prints the data, -1 if it is in text already */
+	int			thread;
+	/* Where the data goes in text, and where the event ends */
+	unsigned int		head;
+	unsigned int		tail;
+	/* Where the data ends in the data of its thread */
+	unsigned int		data;
+	enum pevent_print_status status;
+};
+
+struct show_batch {
+	struct show_event	events[SHOW_BATCH];
+	int			nr_events;
+	int			busy;
+	struct trace_seq	text;
+	struct trace_seq	*data;
+};
+
+static int show_nr_threads;
+static pthread_t *show_threads;
+static struct show_batch *show_batches;
+static unsigned int *show_data_pos;
+static unsigned long show_queued;
+static unsigned long show_written;
+static int show_stopping;
+static pthread_mutex_t show_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t show_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t show_done = PTHREAD_COND_INITIALIZER;
+
+/*
+ * A plugin handler may depend on the events before it, like the
+ * sched_switch plugin that registers the comms it sees. The data of
+ * such events is printed by the reading thread. The ftrace handlers
+ * keep no state, or keep it per cpu, or read ahead with
+ * tracecmd_ftrace_read_ahead().
+ */
+static int event_in_order(struct event_format *event)
+{
+	static const char * const ftrace_events[] = {
+		"function", "funcgraph_entry", "funcgraph_exit",
+		"kernel_stack", NULL
+	};
+	int i;
+
+	if (!event->handler)
+		return 0;
+
+	if (strcmp(event->system, "ftrace") != 0)
+		return 1;
+
+	for (i = 0; ftrace_events[i]; i++) {
+		if (strcmp(event->name, ftrace_events[i]) == 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void init_in_order(struct handle_list *handles)
+{
+	struct event_format **events;
+	struct pevent *pevent;
+	int i;
+
+	pevent = tracecmd_get_pevent(handles->handle);
+	events = pevent_list_events(pevent, EVENT_SORT_ID);
+	if (!events)
+		die("Failed to list the events");
+
+	for (i = 0; events[i]; i++) {
+		if (events[i]->id >= handles->nr_in_order)
+			handles->nr_in_order = events[i]->id + 1;
+	}
+
+	handles->in_order = calloc(handles->nr_in_order ? : 1, 1);
+	if (!handles->in_order)
+		die("Failed to allocate event table");
+
+	for (i = 0; events[i]; i++)
+		handles->in_order[events[i]->id] = event_in_order(events[i]);
+}
+
+/*
+ * Print the data of an event, less its last new line, as the event
+ * goes on after it. Only the reading thread marks an event as failed,
+ * in the order of the records.
+ */
+static enum pevent_print_status
+show_thread_data(struct trace_seq *s, struct show_event *ev)
+{
+	enum pevent_print_status status;
+	unsigned int start = s->len;
+
+	tracecmd_curr_leaf.entry = ev->record;
+	tracecmd_curr_leaf.ret = ev->leaf;
+	status = pevent_try_print_event_data(ev->event->pevent, s, ev->event,
+					     ev->record);
+	tracecmd_curr_leaf.entry = NULL;
+	if (s->len > start && *(s->buffer + s->len - 1) == '\n')
+		s->len--;
+
+	return status;
+}
+
+static void *show_thread(void *data)
+{
+	int thread = (long)data;
+	struct show_batch *batch;
+	struct show_event *ev;
+	struct trace_seq *s;
+	unsigned long next;
+	int i;
+
+	for (next = 0; ; next++) {
+		pthread_mutex_lock(&show_lock);
+		while (next == show_queued && !show_stopping)
+			pthread_cond_wait(&show_ready, &show_lock);
+		if (next == show_queued) {
+			pthread_mutex_unlock(&show_lock);
+			break;
+		}
+		pthread_mutex_unlock(&show_lock);
+
+		batch = &show_batches[next % SHOW_BATCHES];
+		s = &batch->data[thread];
+		trace_seq_reset(s);
+
+		for (i = 0; i < batch->nr_events; i++) {
+			ev = &batch->events[i];
+			if (ev->thread != thread)
+				continue;
+
+			ev->status = show_thread_data(s, ev);
+			ev->data = s->len;
+		}
+
+		pthread_mutex_lock(&show_lock);
+		if (!--batch->busy)
+			pthread_cond_broadcast(&show_done);
+		pthread_mutex_unlock(&show_lock);
+	}
+
+	return NULL;
+}
+
+static void show_threads_start(int nr_threads)
+{
+	int i, x;
+
+	show_batches = calloc(SHOW_BATCHES, sizeof(*show_batches));
+	show_threads = malloc(sizeof(*show_threads) * nr_threads);
+	show_data_pos = malloc(sizeof(*show_data_pos) * nr_threads);
+	if (!show_batches || !show_threads || !show_data_pos)
+		die("Failed to allocate for %d threads", nr_threads);
+
+	for (i = 0; i < SHOW_BATCHES; i++) {
+		trace_seq_init(&show_batches[i].text);
+		show_batches[i].data = malloc(sizeof(struct trace_seq) * nr_threads);
+		if (!show_batches[i].data)
+			die("Failed to allocate for %d threads", nr_threads);
+		for (x = 0; x < nr_threads; x++)
+			trace_seq_init(&show_batches[i].data[x]);
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&show_threads[i], NULL, show_thread,
+				   (void *)(long)i))
+			die("Failed to create thread");
+	}
+
+	show_nr_threads = nr_threads;
+}
+
+static void show_write_batch(void)
+{
+	struct show_batch *batch = &show_batches[show_written % SHOW_BATCHES];
+	struct trace_seq *s = get_show_seq();
+	struct show_event *ev;
+	struct trace_seq *data;
+	unsigned int pos = 0;
+	int flags;
+	int i;
+
+	pthread_mutex_lock(&show_lock);
+	while (batch->busy)
+		pthread_cond_wait(&show_done, &show_lock);
+	pthread_mutex_unlock(&show_lock);
+
+	memset(show_data_pos, 0, sizeof(*show_data_pos) * show_nr_threads);
+
+	for (i = 0; i < batch->nr_events; i++) {
+		ev = &batch->events[i];
+
+		trace_seq_putmem(s, batch->text.buffer + pos, ev->head - pos);
+		if (ev->thread >= 0) {
+			data = &batch->data[ev->thread];
+			flags = __atomic_load_n(&ev->event->flags,
+						__ATOMIC_RELAXED);
+			/*
+			 * A record before it failed after the thread printed
+			 * it, print it again as the serial report does.
+			 */
+			if ((flags & EVENT_FL_FAILED) &&
+			    ev->status != PEVENT_PRINT_FIELDS)
+				show_thread_data(s, ev);
+			else
+				trace_seq_putmem(s, data->buffer + show_data_pos[ev->thread],
+						 ev->data - show_data_pos[ev->thread]);
+			show_data_pos[ev->thread] = ev->data;
+			if (ev->status == PEVENT_PRINT_FAILED)
+				__atomic_fetch_or(&ev->event->flags,
+						  EVENT_FL_FAILED,
+						  __ATOMIC_RELAXED);
+		}
+		trace_seq_putmem(s, batch->text.buffer + ev->head,
+				 ev->tail - ev->head);
+		pos = ev->tail;
+
+		free_record(ev->record);
+		if (ev->leaf)
+			free_record(ev->leaf);
+
+		if (s->len >= SHOW_FLUSH_SIZE)
+			trace_show_flush();
+	}
+
+	batch->nr_events = 0;
+	trace_seq_reset(&batch->text);
+	show_written++;
+}
+
+static void show_queue_batch(void)
+{
+	struct show_batch *batch = &show_batches[show_queued % SHOW_BATCHES];
+
+	pthread_mutex_lock(&show_lock);
+	batch->busy = show_nr_threads;
+	show_queued++;
+	pthread_cond_broadcast(&show_ready);
+	pthread_mutex_unlock(&show_lock);
+
+	/* Wait for the oldest batch, before its slot is needed */
+	if (show_queued - show_written == SHOW_BATCHES)
+		show_write_batch();
+}
+
+static void show_queue(struct handle_list *handles, struct pevent_record *record)
+{
+	struct show_batch *batch = &show_batches[show_queued % SHOW_BATCHES];
+	struct tracecmd_input *handle = handles->handle;
+	struct pevent *pevent = tracecmd_get_pevent(handle);
+	struct trace_seq *s = &batch->text;
+	struct show_event *ev;
+	int id;
+
+	test_save(record, record->cpu);
+
+	ev = &batch->events[batch->nr_events++];
+	ev->handle = handle;
+	ev->record = record;
+	ev->leaf = NULL;
+	ev->event = pevent_find_event_by_record(pevent, record);
+	ev->thread = -1;
+
+	print_handle_file(handles, s);
+	show_record_head(handle, record, s);
+	if (ev->event) {
+		show_event_start(handle, record, ev->event, s);
+		id = ev->event->id;
+		if (id < handles->nr_in_order && !handles->in_order[id]) {
+			ev->leaf = tracecmd_ftrace_read_ahead(handle, record);
+			ev->thread = record->cpu % show_nr_threads;
+		} else
+			show_event_data(ev->event, record, s);
+	} else
+		/* Warns about the unknown event */
+		pevent_print_event(pevent, s, record,
+				   tracecmd_get_use_trace_clock(handle));
+	ev->head = s->len;
+	show_record_tail(handle, record, s);
+	ev->tail = s->len;
+
+	if (batch->nr_events == SHOW_BATCH)
+		show_queue_batch();
+}
+
+static void show_threads_stop(void)
+{
+	struct show_batch *batch = &show_batches[show_queued % SHOW_BATCHES];
+	int i, x;
+
+	if (batch->nr_events)
+		show_queue_batch();
+	while (show_written < show_queued)
+		show_write_batch();
+
+	pthread_mutex_lock(&show_lock);
+	show_stopping = 1;
+	pthread_cond_broadcast(&show_ready);
+	pthread_mutex_unlock(&show_lock);
+
+	for (i = 0; i < show_nr_threads; i++)
+		pthread_join(show_threads[i], NULL);
+
+	for (i = 0; i < SHOW_BATCHES; i++) {
+		trace_seq_destroy(&show_batches[i].text);
+		for (x = 0; x < show_nr_threads; x++)
+			trace_seq_destroy(&show_batches[i].data[x]);
+		free(show_batches[i].data);
+	}
+	free(show_batches);
+	free(show_threads);
+	free(show_data_pos);
+	show_nr_threads = 0;
+}
+
 enum output_type {
 	OUTPUT_NORMAL,
 	OUTPUT_STAT_ONLY,
 	OUTPUT_UNAME_ONLY,
 };
 
+/* Events that a pid filter may match on other than by common_pid */
+static int has_pid_field(struct event_format *event)
+{
+	return pevent_find_field(event, "pid") ||
+		pevent_find_field(event, "next_pid");
+}
+
+/*
+ * The pages of the page index that have none of the events that the
+ * filters can pass are not read at all. Only the positive filters
+ * are looked at, a record that none of them knows is never shown.
+ */
+static void set_page_filter(struct handle_list *handles)
+{
+	struct tracecmd_input *handle = handles->handle;
+	struct event_format **events;
+	struct event_format *event;
+	struct filter *filter;
+	struct pevent *pevent;
+	char *index_file;
+	char *wanted = NULL;
+	int *ids = NULL;
+	int nr_ids = 0;
+	int pids = 0;
+	int skip = 1;
+	int ret;
+	int i;
+
+	if (!handles->path)
+		return;
+
+	if (!handles->event_filters || profile)
+		skip = 0;
+
+	pevent = tracecmd_get_pevent(handle);
+
+	/* A stack trace belongs to the record before it */
+	if (pevent_find_event_by_name(pevent, "ftrace", "kernel_stack"))
+		skip = 0;
+
+	if (!skip && !build_index)
+		return;
+
+	events = pevent_list_events(pevent, EVENT_SORT_ID);
+	if (!events)
+		skip = 0;
+
+	for (filter = handles->event_filters; skip && filter;
+	     filter = filter->next) {
+		/* Passes every event */
+		if (!filter->pids && !filter->filter->filters) {
+			skip = 0;
+			break;
+		}
+		if (filter->pids)
+			pids = 1;
+	}
+
+	if (skip) {
+		for (i = 0; events[i]; i++)
+			;
+		wanted = calloc(i, 1);
+		ids = malloc(sizeof(*ids) * i);
+		if (!wanted || !ids)
+			die("Failed to allocate event ids");
+	}
+
+	for (filter = handles->event_filters; skip && filter;
+	     filter = filter->next) {
+		for (i = 0; events[i]; i++) {
+			if (wanted[i])
+				continue;
+			if (filter->pids ? has_pid_field(events[i]) :
+			    pevent_event_filtered(filter->filter, events[i]->id)) {
+				wanted[i] = 1;
+				ids[nr_ids++] = events[i]->id;
+			}
+		}
+	}
+
+	/* The leaf of a function graph entry is read ahead unfiltered */
+	event = pevent_find_event_by_name(pevent, "ftrace", "funcgraph_entry");
+	for (i = 0; skip && event && i < nr_ids; i++) {
+		if (ids[i] == event->id)
+			skip = 0;
+	}
+
+	if (asprintf(&index_file, "%s.idx", handles->path) < 0)
+		die("Failed to allocate index file name");
+
+	ret = tracecmd_load_page_index(handle, index_file, build_index);
+	if (skip && ret == 0 &&
+	    tracecmd_set_page_filter(handle, ids, nr_ids,
+				     pids ? filter_pids : NULL,
+				     pids ? nr_filter_pids : 0) < 0)
+		warning("could not set the page filter");
+
+	free(index_file);
+	free(wanted);
+	free(ids);
+}
+
 static void read_data_info(struct list_head *handle_list, enum output_type otype,
 			   int global)
 {
@@ -1142,7 +1702,8 @@ static void read_data_info(struct list_head *handle_list, enum output_type otype
 
 		cpus = tracecmd_cpus(handles->handle);
 		handles->cpus = cpus;
-		print_handle_file(handles);
+		print_handle_file(handles, get_show_seq());
+		trace_show_flush();
 		printf("cpus=%d\n", cpus);
 
 		/* Latency trace is just all ASCII */
@@ -1198,7 +1759,7 @@ static void read_data_info(struct list_head *handle_list, enum output_type otype
 					warning("could not retreive handle %s", name);
 					continue;
 				}
-				add_handle(new_handle, name);
+				add_handle(new_handle, name, handles->path);
 			}
 		}
 	}
@@ -1206,6 +1767,15 @@ static void read_data_info(struct list_head *handle_list, enum output_type otype
 	if (otype != OUTPUT_NORMAL)
 		return;
 
+	list_for_each_entry(handles, handle_list, list)
+		set_page_filter(handles);
+
+	if (report_threads > 1 && !profile) {
+		list_for_each_entry(handles, handle_list, list)
+			init_in_order(handles);
+		show_threads_start(report_threads);
+	}
+
 	do {
 		last_handle = NULL;
 		last_record = NULL;
@@ -1218,13 +1788,21 @@ static void read_data_info(struct list_head *handle_list, enum output_type otype
 				last_handle = handles;
 			}
 		}
-		if (last_record) {
-			print_handle_file(last_handle);
+		if (last_record && show_nr_threads) {
+			/* The record is freed once it is printed */
+			show_queue(last_handle, last_record);
+			last_handle->record = NULL;
+		} else if (last_record) {
+			print_handle_file(last_handle, get_show_seq());
 			trace_show_data(last_handle->handle, last_record, profile);
 			free_handle_record(last_handle);
 		}
 	} while (last_record);
 
+	if (show_nr_threads)
+		show_threads_stop();
+	trace_show_flush();
+
 	if (profile)
 		trace_profile();
 
@@ -1389,6 +1967,7 @@ static void add_hook(const char *arg)
 }
 
 enum {
+	OPT_index	= 238,
 	OPT_tsdiff	= 239,
 	OPT_ts2secs	= 240,
 	OPT_tsoffset	= 241,
@@ -1476,11 +2055,12 @@ void trace_report (int argc, char **argv)
 			{"ts-offset", required_argument, NULL, OPT_tsoffset},
 			{"ts2secs", required_argument, NULL, OPT_ts2secs},
 			{"ts-diff", no_argument, NULL, OPT_tsdiff},
+			{"index", no_argument, NULL, OPT_index},
 			{"help", no_argument, NULL, '?'},
 			{NULL, 0, NULL, 0}
 		};
 
-		c = getopt_long (argc-1, argv+1, "+hSIi:H:feGpRr:tPNn:LlEwF:VvTqO:",
+		c = getopt_long (argc-1, argv+1, "+hSIi:H:feGpRr:tPNn:LlEwF:VvTqO:j:",
 			long_options, &option_index);
 		if (c == -1)
 			break;
@@ -1570,6 +2150,11 @@ void trace_report (int argc, char **argv)
 		case 'O':
 			process_plugin_option(optarg);
 			break;
+		case 'j':
+			report_threads = atoi(optarg);
+			if (report_threads < 1)
+				die("-j needs a number of threads");
+			break;
 		case 'v':
 			if (neg)
 				die("Only 1 -v can be used");
@@ -1639,6 +2224,9 @@ void trace_report (int argc, char **argv)
 			if (!input_file)
 				die("--ts-offset must come after -i");
 			break;
+		case OPT_index:
+			build_index = 1;
+			break;
 		case OPT_tsdiff:
 			tsdiff = 1;
 			break;
@@ -1669,7 +2257,8 @@ void trace_report (int argc, char **argv)
 			die("error reading header for %s", inputs->file);
 
 		/* If used with instances, top instance will have no tag */
-		add_handle(handle, multi_inputs ? inputs->file : NULL);
+		add_handle(handle, multi_inputs ? inputs->file : NULL,
+			   inputs->file);
 
 		if (no_date)
 			tracecmd_set_flag(handle, TRACECMD_FL_IGNORE_DATE);
@@ -1773,6 +2362,9 @@ void trace_report (int argc, char **argv)
 		otype = OUTPUT_UNAME_ONLY;
 	read_data_info(&handle_list, otype, global);
 
+	if (show_status)
+		print_func_cache_stats();
+
 	list_for_each_entry(handles, &handle_list, list) {
 		tracecmd_close(handles->handle);
 	}
@@ -85,6 +85,7 @@ static int buffers;
 static int clear_function_filters;
 
 static char *host;
+/* The connection to the listener */
 static int sfd;
 static struct tracecmd_output *network_handle;
 
@@ -106,7 +107,19 @@ static unsigned recorder_flags;
 /* Try a few times to get an accurate date */
 static int date2ts_tries = 5;
 
-static int proto_ver = V2_PROTOCOL;
+static int proto_ver = V3_PROTOCOL;
+
+/* v3: write ends of the per CPU pipes that feed the network mux */
+static int *mux_fds;
+static int nr_mux_fds;
+static int mux_pid;
+
+/* v3: the buffer instances are recorded over the network too */
+static int network_buffers;
+
+/* v3: zlib level to compress the network data with */
+#define DEFAULT_COMPRESS_LEVEL	1
+static int compress_level;
 static struct func_list *graph_funcs;
 
 static int func_stack;
@@ -2463,6 +2476,7 @@ static void connect_port(int cpu)
 {
 	struct addrinfo hints;
 	struct addrinfo *results, *rp;
+	int sfd;
 	int s;
 	char buf[BUFSIZ];
 
@@ -2555,6 +2569,42 @@ create_recorder_instance(struct buffer_instance *instance, const char *file, int
 	return record;
 }
 
+/*
+ * The streams of the buffer instances follow the ones of the top
+ * instance, in the order the buffers were sent to the server.
+ */
+static int network_stream(struct buffer_instance *instance, int cpu)
+{
+	struct buffer_instance *i;
+	int stream = 0;
+
+	if (instance->name) {
+		for_each_instance(i) {
+			stream++;
+			if (i == instance)
+				break;
+		}
+	}
+
+	return stream * cpu_count + cpu;
+}
+
+static struct tracecmd_recorder *
+create_network_recorder(struct buffer_instance *instance, int fd, int cpu)
+{
+	struct tracecmd_recorder *recorder;
+	char *path;
+
+	if (!instance->name)
+		return tracecmd_create_recorder_fd(fd, cpu, recorder_flags);
+
+	path = get_instance_dir(instance);
+	recorder = tracecmd_create_buffer_recorder_fd(fd, cpu, recorder_flags, path);
+	tracecmd_put_tracing_file(path);
+
+	return recorder;
+}
+
 /*
  * If extract is set, then this is going to set up the recorder,
  * connections and exit as the tracing is serialized by a single thread.
@@ -2564,10 +2614,11 @@ static int create_recorder(struct buffer_instance *instance, int cpu,
 {
 	long ret;
 	char *file;
+	int stream;
 	int pid;
 
-	/* network for buffer instances not supported yet */
-	if (client_ports && instance->name)
+	/* network for buffer instances needs the v3 protocol */
+	if ((client_ports || mux_fds) && instance->name && !network_buffers)
 		return 0;
 
 	if (type != TRACE_TYPE_EXTRACT) {
@@ -2587,9 +2638,13 @@ static int create_recorder(struct buffer_instance *instance, int cpu,
 		cpu_count = 0;
 	}
 
-	if (client_ports) {
-		connect_port(cpu);
-		recorder = tracecmd_create_recorder_fd(client_ports[cpu], cpu, recorder_flags);
+	if (mux_fds) {
+		stream = network_stream(instance, cpu);
+		recorder = create_network_recorder(instance, mux_fds[stream], cpu);
+	} else if (client_ports) {
+		stream = network_stream(instance, cpu);
+		connect_port(stream);
+		recorder = create_network_recorder(instance, client_ports[stream], cpu);
 	} else {
 		file = get_temp_file(instance, cpu);
 		recorder = create_recorder_instance(instance, file, cpu, brass);
@@ -2692,6 +2747,34 @@ static void communicate_with_listener_v1(int fd)
 
 static void communicate_with_listener_v2(int fd)
 {
+	struct buffer_instance *instance;
+
+	/* Only a v3 server knows how to store the buffer instances */
+	if (proto_ver == V3_PROTOCOL) {
+		for_each_instance(instance) {
+			if (tracecmd_msg_add_buffer(instance->name) < 0)
+				die("Failed to add buffer %s", instance->name);
+		}
+		network_buffers = buffers;
+
+		/*
+		 * Number the pages, so the server knows what UDP lost,
+		 * and let it tell how far ahead of it we may go.
+		 */
+		if (!use_tcp) {
+			use_udp_seq = true;
+			tracecmd_msg_set_udp_credits();
+		}
+
+		tracecmd_msg_set_bulk_metadata();
+
+		if (compress_level &&
+		    tracecmd_msg_set_compression(compress_level) < 0)
+			warning("Can not compress with level %d, sending uncompressed",
+				compress_level);
+	} else if (compress_level)
+		warning("The listener does not support compression, sending uncompressed");
+
 	if (tracecmd_msg_send_init_data(fd) < 0)
 		die("Cannot communicate with server");
 }
@@ -2715,19 +2798,30 @@ static void check_protocol_version(int fd)
 	 * So, we add the dummy number (the magic number and 0 option) to the
 	 * first client message.
 	 */
-	write(fd, V2_CPU, sizeof(V2_CPU));
+	write(fd, V3_CPU, sizeof(V3_CPU));
 
 	/* read a reply message */
 	n = read(fd, buf, BUFSIZ);
 
+	/*
+	 * A v2 server does not know v3, and answers with the highest
+	 * version it has. It then waits for us to ask again.
+	 */
+	if (n > 0 && memcmp(buf, "V2", n) == 0) {
+		proto_ver = V2_PROTOCOL;
+		plog("Use the v2 protocol\n");
+		write(fd, V2_CPU, sizeof(V2_CPU));
+		n = read(fd, buf, BUFSIZ);
+	}
+
 	if (n < 0 || !buf[0]) {
 		/* the server uses the v1 protocol, so we'll use it */
 		proto_ver = V1_PROTOCOL;
 		plog("Use the v1 protocol\n");
 	} else {
-		if (memcmp(buf, "V2", n) != 0)
+		if (memcmp(buf, proto_ver == V3_PROTOCOL ? "V3" : "V2", n) != 0)
 			die("Cannot handle the protocol %s", buf);
-		/* OK, let's use v2 protocol */
+		/* OK, let's use the new protocol */
 		write(fd, V2_MAGIC, sizeof(V2_MAGIC));
 
 		n = read(fd, buf, BUFSIZ - 1);
@@ -2740,11 +2834,85 @@ static void check_protocol_version(int fd)
 	}
 }
 
+/*
+ * With v3, the recorders write into pipes that a mux process reads.
+ * If the server did not hand out any ports, all the CPU streams go
+ * over the one connection, and the mux frames what they write. With
+ * UDP, the mux sends each page with its sequence number instead.
+ */
+static void start_network_mux(int fd)
+{
+	int *read_fds;
+	int brass[2];
+	int cpu;
+	int ret;
+
+	nr_mux_fds = cpu_count * (network_buffers + 1);
+	mux_fds = malloc(sizeof(*mux_fds) * nr_mux_fds);
+	read_fds = malloc(sizeof(*read_fds) * nr_mux_fds);
+	if (!mux_fds || !read_fds)
+		die("Failed to allocate pipes for %d cpus", cpu_count);
+
+	for (cpu = 0; cpu < nr_mux_fds; cpu++) {
+		if (pipe(brass) < 0)
+			die("pipe");
+		/* Give the mux room to batch pages */
+		fcntl(brass[1], F_SETPIPE_SZ, page_size * 64);
+		read_fds[cpu] = brass[0];
+		mux_fds[cpu] = brass[1];
+		if (client_ports)
+			connect_port(cpu);
+	}
+
+	mux_pid = fork();
+	if (mux_pid < 0)
+		die("fork");
+
+	if (!mux_pid) {
+		/* The recorders tell us when they are done by closing */
+		signal(SIGINT, SIG_IGN);
+		signal(SIGUSR1, SIG_IGN);
+		for (cpu = 0; cpu < nr_mux_fds; cpu++)
+			close(mux_fds[cpu]);
+		if (client_ports)
+			ret = tracecmd_msg_send_udp_streams(fd, nr_mux_fds,
+							    read_fds, client_ports);
+		else
+			ret = tracecmd_msg_send_data_streams(fd, cpu_count,
+							     nr_mux_fds, read_fds);
+		if (ret < 0)
+			die("Sending data to the server");
+		exit(0);
+	}
+
+	for (cpu = 0; cpu < nr_mux_fds; cpu++) {
+		close(read_fds[cpu]);
+		if (client_ports)
+			close(client_ports[cpu]);
+	}
+	free(read_fds);
+}
+
+/* Only the recorders may hold the mux pipes open */
+static void close_mux_fds(void)
+{
+	int cpu;
+
+	if (!mux_fds)
+		return;
+
+	for (cpu = 0; cpu < nr_mux_fds; cpu++) {
+		if (mux_fds[cpu] >= 0)
+			close(mux_fds[cpu]);
+		mux_fds[cpu] = -1;
+	}
+}
+
 static void setup_network(void)
 {
 	struct addrinfo hints;
 	struct addrinfo *result, *rp;
-	int sfd, s;
+	int s;
 	char *server;
 	char *port;
 	char *p;
@@ -2788,7 +2956,7 @@ again:
 
 	freeaddrinfo(result);
 
-	if (proto_ver == V2_PROTOCOL) {
+	if (proto_ver >= V2_PROTOCOL) {
 		check_protocol_version(sfd);
 		if (proto_ver == V1_PROTOCOL) {
 			/* reconnect to the server for using the v1 protocol */
@@ -2804,15 +2972,24 @@ again:
 	/* Now create the handle through this socket */
 	network_handle = tracecmd_create_init_fd_glob(sfd, listed_events);
 
-	if (proto_ver == V2_PROTOCOL)
+	if (proto_ver >= V2_PROTOCOL)
 		tracecmd_msg_finish_sending_metadata(sfd);
 
+	if (proto_ver == V3_PROTOCOL)
+		start_network_mux(sfd);
+
 	/* OK, we are all set, let'r rip! */
 }
 
 static void finish_network(void)
 {
-	if (proto_ver == V2_PROTOCOL)
+	if (mux_pid > 0) {
+		/* Let the mux send what the recorders left behind */
+		close_mux_fds();
+		waitpid(mux_pid, NULL, 0);
+		mux_pid = 0;
+	}
+	if (proto_ver >= V2_PROTOCOL)
 		tracecmd_msg_send_close_msg();
 	close(sfd);
 	free(host);
@@ -2864,6 +3041,8 @@ static void start_threads(enum trace_type type, int global)
 		}
 	}
 	recorder_threads = i;
+
+	close_mux_fds();
 }
 
 static void append_buffer(struct tracecmd_output *handle,
@@ -4103,7 +4282,9 @@ void update_first_instance(struct buffer_instance *instance, int topt)
 }
 
 enum {
+	OPT_profileint	= 246,
 	OPT_debug	= 247,
+	OPT_compress	= 248,
 	OPT_tsoffset	= 249,
 	OPT_bycomm	= 250,
 	OPT_stderr	= 251,
@@ -4144,6 +4325,7 @@ void trace_record (int argc, char **argv)
 	int do_child = 0;
 	int data_flags = 0;
 	int debug = 0;
+	int profile_interval = 0;
 
 	int c;
 
@@ -4308,10 +4490,12 @@ void trace_record (int argc, char **argv)
 			{"func-stack", no_argument, NULL, OPT_funcstack},
 			{"nosplice", no_argument, NULL, OPT_nosplice},
 			{"profile", no_argument, NULL, OPT_profile},
+			{"profile-interval", required_argument, NULL, OPT_profileint},
 			{"stderr", no_argument, NULL, OPT_stderr},
 			{"by-comm", no_argument, NULL, OPT_bycomm},
 			{"ts-offset", required_argument, NULL, OPT_tsoffset},
 			{"debug", no_argument, NULL, OPT_debug},
+			{"compress", optional_argument, NULL, OPT_compress},
 			{"help", no_argument, NULL, '?'},
 			{NULL, 0, NULL, 0}
 		};
@@ -4557,6 +4741,11 @@ void trace_record (int argc, char **argv)
 			instance->profile = 1;
 			events = 1;
 			break;
+		case OPT_profileint:
+			profile_interval = atoi(optarg);
+			if (profile_interval <= 0)
+				die("Bad profile interval %s", optarg);
+			break;
 		case OPT_stderr:
 			/* if -o was used (for profile), ignore this */
 			if (save_stdout >= 0)
@@ -4577,11 +4766,39 @@ void trace_record (int argc, char **argv)
 		case OPT_debug:
 			debug = 1;
 			break;
+		case OPT_compress:
+			compress_level = DEFAULT_COMPRESS_LEVEL;
+			if (optarg)
+				compress_level = atoi(optarg);
+			if (compress_level <= 0)
+				die("Bad compression level %s", optarg);
+			/* The data is compressed on the one TCP connection */
+			use_tcp = 1;
+			break;
 		default:
 			usage(argv);
 		}
 	}
 
+	if (compress_level && !host)
+		die("--compress can only be used with -N");
+
+	if (profile_interval) {
+		if (!stream && !profile)
+			die("--profile-interval can only be used with stream or profile");
+		/* Streaming profile snapshots is a profile run */
+		if (stream) {
+			struct buffer_instance *inst;
+
+			stream = 0;
+			profile = 1;
+			events = 1;
+			for_each_instance(inst)
+				inst->profile = 1;
+		}
+		trace_stream_set_profile_interval(profile_interval);
+	}
+
 	if (do_ptrace && !filter_task && (filter_pid < 0))
 		die(" -c can only be used with -F (or -P with event-fork support)");
 	if (do_child && !filter_task &&! filter_pid)
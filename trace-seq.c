@@ -21,6 +21,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "bug.h"
 #include "event-parse.h"
@@ -209,6 +211,30 @@ int trace_seq_puts(struct trace_seq *s, const char *str)
 	return len;
 }
 
+/**
+ * trace_seq_putmem - append a block of memory to a trace_seq
+ * @s: trace sequence descriptor
+ * @mem: the memory to append
+ * @len: the number of bytes of @mem to append
+ *
+ * Like trace_seq_puts(), but @mem does not need to be terminated, and
+ * may be the text of another trace_seq.
+ */
+int trace_seq_putmem(struct trace_seq *s, const void *mem, unsigned int len)
+{
+	TRACE_SEQ_CHECK_RET0(s);
+
+	while (len > ((s->buffer_size - 1) - s->len))
+		expand_buffer(s);
+
+	TRACE_SEQ_CHECK_RET0(s);
+
+	memcpy(s->buffer + s->len, mem, len);
+	s->len += len;
+
+	return len;
+}
+
 int trace_seq_putc(struct trace_seq *s, unsigned char c)
 {
 	TRACE_SEQ_CHECK_RET0(s);
@@ -237,7 +263,7 @@ int trace_seq_do_fprintf(struct trace_seq *s, FILE *fp)
 
 	switch (s->state) {
 	case TRACE_SEQ__GOOD:
-		return fprintf(fp, "%.*s", s->len, s->buffer);
+		return fwrite(s->buffer, 1, s->len, fp);
 	case TRACE_SEQ__BUFFER_POISONED:
 		fprintf(fp, "%s\n", "Usage of trace_seq after it was destroyed");
 		break;
@@ -252,3 +278,38 @@ int trace_seq_do_printf(struct trace_seq *s)
 {
 	return trace_seq_do_fprintf(s, stdout);
 }
+
+/**
+ * trace_seq_flush - write out a trace_seq and reset it
+ * @s: trace sequence descriptor
+ * @fd: the file descriptor to write to
+ *
+ * Writes the content of @s to @fd and empties it, keeping its
+ * buffer. This lets @s collect the output of many events and have
+ * it written with one write() instead of one per event.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int trace_seq_flush(struct trace_seq *s, int fd)
+{
+	unsigned int done = 0;
+	ssize_t ret = 0;
+
+	TRACE_SEQ_CHECK_RET_N(s, -1);
+
+	while (done < s->len) {
+		ret = write(fd, s->buffer + done, s->len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		done += ret;
+	}
+
+	/* What could not be written is dropped */
+	s->len = 0;
+	s->readpos = 0;
+
+	return ret < 0 ? -1 : 0;
+}
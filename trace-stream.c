@@ -18,10 +18,14 @@
  * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 
+#include <time.h>
+
+#include <sys/epoll.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
@@ -98,57 +102,250 @@ trace_stream_init(struct buffer_instance *instance, int cpu, int fd, int cpus,
 	return NULL;
 }
 
-int trace_stream_read(struct pid_record_data *pids, int nr_pids, struct timeval *tv,
-		      int profile)
+/*
+ * Records are printed in batches of at most STREAM_BATCH per call, so
+ * that the caller still gets to check on its children while a busy
+ * machine keeps the pipes full.
+ *
+ * While every CPU has a record queued, the oldest of them is the next
+ * one in time. But a CPU that has run dry may still deliver records older
+ * than what the other CPUs have already handed us. Records are then held
+ * back until they are STREAM_REORDER_WINDOW (in trace clock units,
+ * nanoseconds for the default clock) older than the newest record seen,
+ * giving the slow CPUs that long to catch up. When nothing new arrives
+ * before the timeout, whatever is held is printed.
+ */
+#define STREAM_BATCH		1024
+#define STREAM_REORDER_WINDOW	10000000ULL
+
+static struct stream_merge {
+	int			efd;
+	int			nr_open;
+	int			nr_heap;
+	struct pid_record_data	**heap;
+	unsigned long long	max_ts;
+} merge = {
+	.efd = -1,
+};
+
+/* Milliseconds between profile snapshots, zero for none */
+static int profile_interval;
+static unsigned long long next_snapshot;
+
+void trace_stream_set_profile_interval(int msecs)
 {
-	struct pevent_record *record;
-	struct pid_record_data *pid;
-	struct pid_record_data *last_pid;
-	fd_set rfds;
-	int top_rfd = 0;
-	int ret;
-	int i;
+	profile_interval = msecs;
+}
 
-	last_pid = NULL;
+static unsigned long long get_msecs(void)
+{
+	struct timespec ts;
 
- again:
-	for (i = 0; i < nr_pids; i++) {
-		pid = &pids[i];
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Output a profile snapshot if it is time for one, and return how long
+ * we may wait for data without missing the next one.
+ */
+static int profile_snapshot_check(int profile, int timeout)
+{
+	unsigned long long now;
+
+	if (!profile || !profile_interval)
+		return timeout;
 
-		if (!pid->record)
-			pid->record = tracecmd_read_data(pid->instance->handle, pid->cpu);
-		record = pid->record;
-		if (!record && errno == EINVAL)
+	now = get_msecs();
+	if (!next_snapshot)
+		next_snapshot = now + profile_interval;
+
+	if (now >= next_snapshot) {
+		trace_profile_snapshot();
+		next_snapshot = now + profile_interval;
+	}
+
+	if (timeout > next_snapshot - now)
+		timeout = next_snapshot - now;
+
+	return timeout;
+}
+
+static void heap_push(struct pid_record_data *pid)
+{
+	struct pid_record_data **heap = merge.heap;
+	unsigned long long ts = pid->record->ts;
+	int i = merge.nr_heap++;
+	int parent;
+
+	while (i) {
+		parent = (i - 1) / 2;
+		if (heap[parent]->record->ts <= ts)
+			break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = pid;
+}
+
+static void heap_pop(void)
+{
+	struct pid_record_data **heap = merge.heap;
+	struct pid_record_data *last;
+	unsigned long long ts;
+	int i = 0;
+	int child;
+
+	last = heap[--merge.nr_heap];
+	ts = last->record->ts;
+
+	while ((child = i * 2 + 1) < merge.nr_heap) {
+		if (child + 1 < merge.nr_heap &&
+		    heap[child + 1]->record->ts < heap[child]->record->ts)
+			child++;
+		if (ts <= heap[child]->record->ts)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+}
+
+/*
+ * Read the next record of a CPU and queue it. When the pipe is empty the
+ * CPU is left out of the heap until epoll tells us more data came in.
+ */
+static void stream_read_next(struct pid_record_data *pid)
+{
+	pid->record = tracecmd_read_data(pid->instance->handle, pid->cpu);
+	if (!pid->record) {
+		if (errno == EINVAL) {
 			/* pipe has closed */
 			pid->closed = 1;
-
-		if (record &&
-		    (!last_pid || record->ts < last_pid->record->ts))
-			last_pid = pid;
+			merge.nr_open--;
+			epoll_ctl(merge.efd, EPOLL_CTL_DEL, pid->brass[0], NULL);
+		}
+		return;
 	}
-	if (last_pid) {
-		trace_show_data(last_pid->instance->handle, last_pid->record, profile);
-		free_record(last_pid->record);
-		last_pid->record = NULL;
-		return 1;
+
+	if (pid->record->ts > merge.max_ts)
+		merge.max_ts = pid->record->ts;
+	heap_push(pid);
+}
+
+static int stream_merge_init(struct pid_record_data *pids, int nr_pids)
+{
+	struct epoll_event ev;
+	int i;
+
+	merge.heap = malloc(sizeof(*merge.heap) * nr_pids);
+	if (!merge.heap)
+		return -1;
+
+	merge.efd = epoll_create1(EPOLL_CLOEXEC);
+	if (merge.efd < 0) {
+		free(merge.heap);
+		merge.heap = NULL;
+		return -1;
 	}
 
-	FD_ZERO(&rfds);
+	for (i = 0; i < nr_pids; i++) {
+		if (pids[i].closed)
+			continue;
+		merge.nr_open++;
+		/*
+		 * Edge triggered: a CPU is only out of the heap after its
+		 * pipe was found empty, so the next write wakes us up.
+		 */
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = &pids[i];
+		if (epoll_ctl(merge.efd, EPOLL_CTL_ADD, pids[i].brass[0], &ev) < 0)
+			return -1;
+	}
 
 	for (i = 0; i < nr_pids; i++) {
-		/* Do not process closed pipes */
 		if (pids[i].closed)
 			continue;
-		if (pids[i].brass[0] > top_rfd)
-			top_rfd = pids[i].brass[0];
+		/* Records left over from before are queued as is */
+		if (pids[i].record)
+			heap_push(&pids[i]);
+		else
+			stream_read_next(&pids[i]);
+	}
+
+	return 0;
+}
+
+/*
+ * Print the queued records in time order, up to STREAM_BATCH of them.
+ * Unless @flush is set, stop at the first one still in the reorder
+ * window while some CPU has nothing queued.
+ */
+static int stream_print_batch(int profile, int flush)
+{
+	struct pid_record_data *pid;
+	int count = 0;
+
+	while (merge.nr_heap && count < STREAM_BATCH) {
+		pid = merge.heap[0];
+		if (!flush && merge.nr_heap < merge.nr_open &&
+		    pid->record->ts + STREAM_REORDER_WINDOW > merge.max_ts)
+			break;
 
-		FD_SET(pids[i].brass[0], &rfds);
+		heap_pop();
+		trace_show_data(pid->instance->handle, pid->record, profile);
+		free_record(pid->record);
+		pid->record = NULL;
+		count++;
+
+		stream_read_next(pid);
 	}
 
-	ret = select(top_rfd + 1, &rfds, NULL, NULL, tv);
+	trace_show_flush();
+
+	return count;
+}
+
+int trace_stream_read(struct pid_record_data *pids, int nr_pids, struct timeval *tv,
+		      int profile)
+{
+	struct epoll_event events[STREAM_BATCH];
+	struct pid_record_data *pid;
+	int timeout;
+	int wait;
+	int ret;
+	int i;
+
+	if (merge.efd < 0 && stream_merge_init(pids, nr_pids) < 0)
+		return -1;
+
+	timeout = tv->tv_sec * 1000 + tv->tv_usec / 1000;
+
+	for (;;) {
+		wait = profile_snapshot_check(profile, timeout);
+
+		ret = stream_print_batch(profile, 0);
+		if (ret > 0)
+			return ret;
+
+		ret = epoll_wait(merge.efd, events, STREAM_BATCH, wait);
+		if (ret < 0)
+			return ret;
 
-	if (ret > 0)
-		goto again;
+		/* Woken up for a profile snapshot, wait for the rest */
+		if (!ret && wait < timeout) {
+			timeout -= wait;
+			continue;
+		}
+
+		/* Nothing more is coming in, print what is held back */
+		if (!ret)
+			return stream_print_batch(profile, 1);
 
-	return ret;
+		for (i = 0; i < ret; i++) {
+			pid = events[i].data.ptr;
+			if (!pid->record && !pid->closed)
+				stream_read_next(pid);
+		}
+	}
 }
@@ -1053,28 +1053,97 @@ static int read_file(const char *file, char **buffer)
 	return len;
 }
 
-static int load_events(struct pevent *pevent, const char *system,
+/*
+ * The format files of all the events are collected first, and then
+ * read and parsed by pevent_parse_events() on a pool of threads.
+ */
+struct local_formats {
+	struct pevent_format_buf	*formats;
+	int				nr_formats;
+	char				**systems;
+	int				nr_systems;
+};
+
+static int add_local_format(struct local_formats *list, const char *system,
+			    char *format)
+{
+	struct pevent_format_buf *formats;
+
+	formats = realloc(list->formats,
+			  sizeof(*formats) * (list->nr_formats + 1));
+	if (!formats)
+		return -1;
+	list->formats = formats;
+
+	formats += list->nr_formats++;
+	memset(formats, 0, sizeof(*formats));
+	formats->sys = system;
+	formats->data = format;
+
+	return 0;
+}
+
+static void free_local_formats(struct local_formats *list)
+{
+	int i;
+
+	for (i = 0; i < list->nr_formats; i++) {
+		free(list->formats[i].data);
+		free(list->formats[i].buf);
+	}
+	free(list->formats);
+
+	for (i = 0; i < list->nr_systems; i++)
+		free(list->systems[i]);
+	free(list->systems);
+}
+
+static int load_local_format(struct pevent_format_buf *format,
+			     void *context)
+{
+	int len;
+
+	len = read_file(format->data, &format->buf);
+	if (len < 0)
+		return -1;
+	format->size = len;
+
+	return 0;
+}
+
+static int load_events(struct local_formats *list, const char *sys_name,
 			const char *sys_dir)
 {
 	struct dirent *dent;
 	struct stat st;
+	char **systems;
+	char *system;
 	DIR *dir;
-	int len = 0;
-	int ret = 0, failure = 0;
+	int ret, failure = 0;
 
 	ret = stat(sys_dir, &st);
 	if (ret < 0 || !S_ISDIR(st.st_mode))
 		return EINVAL;
 
+	systems = realloc(list->systems,
+			  sizeof(*systems) * (list->nr_systems + 1));
+	if (!systems)
+		return ENOMEM;
+	list->systems = systems;
+
+	system = strdup(sys_name);
+	if (!system)
+		return ENOMEM;
+	systems[list->nr_systems++] = system;
+
 	dir = opendir(sys_dir);
 	if (!dir)
 		return errno;
 
 	while ((dent = readdir(dir))) {
 		const char *name = dent->d_name;
-		char *event;
 		char *format;
-		char *buf;
+		char *event;
 
 		if (strcmp(name, ".") == 0 ||
 		    strcmp(name, "..") == 0)
@@ -1082,26 +1151,16 @@ static int load_events(struct pevent *pevent, const char *system,
 
 		event = append_file(sys_dir, name);
 		ret = stat(event, &st);
-		if (ret < 0 || !S_ISDIR(st.st_mode))
-			goto free_event;
-
-		format = append_file(event, "format");
-		ret = stat(format, &st);
 		if (ret < 0)
-			goto free_format;
-
-		len = read_file(format, &buf);
-		if (len < 0)
-			goto free_format;
-
-		ret = pevent_parse_event(pevent, buf, len, system);
-		free(buf);
- free_format:
-		free(format);
- free_event:
-		free(event);
-		if (ret)
 			failure = ret;
+		else if (S_ISDIR(st.st_mode)) {
+			format = append_file(event, "format");
+			if (add_local_format(list, system, format)) {
+				free(format);
+				failure = ENOMEM;
+			}
+		}
+		free(event);
 	}
 
 	closedir(dir);
@@ -1168,6 +1227,7 @@ struct pevent *tracecmd_local_events(const char *tracing_dir)
  */
 int tracecmd_fill_local_events(const char *tracing_dir, struct pevent *pevent)
 {
+	struct local_formats list;
 	struct dirent *dent;
 	char *events_dir;
 	struct stat st;
@@ -1177,6 +1237,8 @@ int tracecmd_fill_local_events(const char *tracing_dir, struct pevent *pevent)
 	if (!tracing_dir)
 		return -1;
 
+	memset(&list, 0, sizeof(list));
+
 	events_dir = append_file(tracing_dir, "events");
 	if (!events_dir)
 		return -1;
@@ -1214,7 +1276,7 @@ int tracecmd_fill_local_events(const char *tracing_dir, struct pevent *pevent)
 			continue;
 		}
 
-		ret = load_events(pevent, name, sys);
+		ret = load_events(&list, name, sys);
 
 		free(sys);
 
@@ -1223,11 +1285,17 @@ int tracecmd_fill_local_events(const char *tracing_dir, struct pevent *pevent)
 	}
 
 	closedir(dir);
+
+	if (pevent_parse_events(pevent, list.formats, list.nr_formats, 0,
+				load_local_format, NULL))
+		failure = 1;
+
 	/* always succeed because parsing failures are not critical */
 	ret = 0;
 
  out_free:
 	free(events_dir);
+	free_local_formats(&list);
 
 	pevent->parsing_failures = failure;
 